@@ -0,0 +1,178 @@
+/**
+ * @file flash_model.c
+ * @brief RAM model of the RP2040's QSPI flash for host builds.
+ *
+ * The model implements flash_range_erase() and flash_range_program() with the rules of NOR
+ * flash: erases work on whole sectors and set every bit, programs work on pages and can
+ * only clear bits. Misaligned or out-of-range commands abort, as they would corrupt the
+ * flash on the device.
+ *
+ * The model also stands in for the XIP window. By default it lives in anonymous memory
+ * and starts erased. If FLASH_MODEL_IMAGE names a file, the file is mapped instead, so the
+ * flash survives from one run to the next like the real one does across a reset. The tests
+ * expect freshly erased flash, as some of them count on contiguous free blocks, so start
+ * each test run from a new image.
+ *
+ * With timing on, every command adds the typical time of a W25Q16JV to the clock seen
+ * through time_us_64(), without actually waiting, so that benchmarks report the time the
+ * device would spend in the flash. FLASH_MODEL_TIMING sets whether it starts on (0 by
+ * default), and flash_model_set_timing() turns it on for benchmarks that compare paths
+ * bound by the flash.
+ *
+ * flash_model_cut_power() simulates a power loss: after a given number of erase and program
+ * commands the model drops the rest, so the flash stays as it was when the power went while
+ * the code runs on. Mounting again after restoring the power shows what a reboot would find.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "hardware/flash.h"
+
+#ifndef FLASH_MODEL_TIMING
+#define FLASH_MODEL_TIMING 0
+#endif
+// Typical command times of a W25Q16JV, in microseconds.
+#define FLASH_MODEL_SECTOR_ERASE_US 45000
+#define FLASH_MODEL_BLOCK_ERASE_US 150000
+#define FLASH_MODEL_PAGE_PROGRAM_US 400
+
+uint8_t *flash_model_xip;
+static uint64_t busy_us;
+static bool timing = FLASH_MODEL_TIMING;
+static uint32_t power_left = FLASH_MODEL_NO_POWER_CUT;   // Commands before the power is cut.
+static bool power_was_cut = false;
+
+
+/**
+ * Maps the model before main() runs, from the file named by FLASH_MODEL_IMAGE if set.
+ */
+__attribute__((constructor)) static void flash_model_init(void) {
+    const char *image = getenv("FLASH_MODEL_IMAGE");
+    void *memory = MAP_FAILED;
+    if (image != NULL && image[0] != '\0') {
+        int fd = open(image, O_RDWR | O_CREAT, 0644);
+        off_t length = (fd >= 0) ? lseek(fd, 0, SEEK_END) : -1;
+        if (fd >= 0 && length == 0) {
+            // A new image starts erased.
+            uint8_t erased[FLASH_SECTOR_SIZE];
+            memset(erased, 0xFF, sizeof(erased));
+            for (uint32_t offset = 0; offset < PICO_FLASH_SIZE_BYTES; offset += sizeof(erased)) {
+                if (write(fd, erased, sizeof(erased)) != (ssize_t)sizeof(erased)) {
+                    break;
+                }
+            }
+            length = lseek(fd, 0, SEEK_END);
+        }
+        if (length == PICO_FLASH_SIZE_BYTES) {
+            memory = mmap(NULL, PICO_FLASH_SIZE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        } else {
+            fprintf(stderr, "Flash image '%s' must be %u bytes.\n", image, (unsigned)PICO_FLASH_SIZE_BYTES);
+            exit(1);
+        }
+        close(fd);
+    } else {
+        memory = mmap(NULL, PICO_FLASH_SIZE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED) {
+            memset(memory, 0xFF, PICO_FLASH_SIZE_BYTES);
+        }
+    }
+    if (memory == MAP_FAILED) {
+        perror("flash model");
+        exit(1);
+    }
+    flash_model_xip = memory;
+}
+
+
+/**
+ * Time the model has spent in erase and program commands, in microseconds.
+ */
+uint64_t flash_model_busy_us(void) {
+    return __atomic_load_n(&busy_us, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Turns the command timings on or off, and returns whether they were on before.
+ */
+bool flash_model_set_timing(bool on) {
+    return __atomic_exchange_n(&timing, on, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Lets the next 'commands' erase and program commands through and drops every one after
+ * them; FLASH_MODEL_NO_POWER_CUT restores the power.
+ *
+ * @return Whether commands were dropped since the previous call.
+ */
+bool flash_model_cut_power(uint32_t commands) {
+    __atomic_store_n(&power_left, commands, __ATOMIC_RELAXED);
+    return __atomic_exchange_n(&power_was_cut, false, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Counts a command against the power cut.
+ *
+ * @return false if the power is off and the command must be dropped.
+ */
+static bool flash_model_powered(void) {
+    uint32_t left = __atomic_load_n(&power_left, __ATOMIC_RELAXED);
+    while (left != FLASH_MODEL_NO_POWER_CUT) {
+        if (left == 0) {
+            __atomic_store_n(&power_was_cut, true, __ATOMIC_RELAXED);
+            return false;
+        }
+        if (__atomic_compare_exchange_n(&power_left, &left, left - 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    return true;
+}
+
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+    assert(flash_offs % FLASH_SECTOR_SIZE == 0 && count % FLASH_SECTOR_SIZE == 0);
+    assert(flash_offs <= PICO_FLASH_SIZE_BYTES && count <= PICO_FLASH_SIZE_BYTES - flash_offs);
+    if (!flash_model_powered()) {
+        return;
+    }
+    memset(flash_model_xip + flash_offs, 0xFF, count);
+
+    if (__atomic_load_n(&timing, __ATOMIC_RELAXED)) {
+        // The SDK erases 64 KB blocks where the range allows, and sectors elsewhere.
+        uint64_t us = 0;
+        for (uint32_t offset = flash_offs; offset < flash_offs + count; ) {
+            bool block = offset % FLASH_BLOCK_SIZE == 0 && flash_offs + count - offset >= FLASH_BLOCK_SIZE;
+            us += block ? FLASH_MODEL_BLOCK_ERASE_US : FLASH_MODEL_SECTOR_ERASE_US;
+            offset += block ? FLASH_BLOCK_SIZE : FLASH_SECTOR_SIZE;
+        }
+        __atomic_fetch_add(&busy_us, us, __ATOMIC_RELAXED);
+    }
+}
+
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+    assert(flash_offs % FLASH_PAGE_SIZE == 0 && count % FLASH_PAGE_SIZE == 0);
+    assert(flash_offs <= PICO_FLASH_SIZE_BYTES && count <= PICO_FLASH_SIZE_BYTES - flash_offs);
+    if (!flash_model_powered()) {
+        return;
+    }
+    // Bytes sent as 0xFF leave the flash as it is, so they are not touched at all: a thread
+    // checking that they are still erased does not race with a program of the rest of the page.
+    for (size_t i = 0; i < count; i++) {
+        if (data[i] != 0xFF) {
+            flash_model_xip[flash_offs + i] &= data[i];
+        }
+    }
+
+    if (__atomic_load_n(&timing, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&busy_us, (uint64_t)(count / FLASH_PAGE_SIZE) * FLASH_MODEL_PAGE_PROGRAM_US, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,14 @@
+/**
+ * @file adc.h
+ * @brief Host stand-in for the Pico SDK's hardware/adc.h, returning a fixed reading.
+ */
+#ifndef HOST_HARDWARE_ADC_H
+#define HOST_HARDWARE_ADC_H
+
+#include <stdint.h>
+
+static inline void adc_init(void) {}
+static inline void adc_select_input(int input) { (void)input; }
+static inline uint16_t adc_read(void) { return 1234; }
+
+#endif // HOST_HARDWARE_ADC_H
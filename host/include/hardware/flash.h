@@ -0,0 +1,35 @@
+/**
+ * @file flash.h
+ * @brief Host stand-in for the Pico SDK's hardware/flash.h.
+ *
+ * The flash is modelled in RAM by host/flash_model.c, which also stands in for the XIP
+ * window: XIP_BASE is the address of the model, so reads through XIP_BASE + offset see
+ * the flash contents exactly as on the RP2040.
+ */
+#ifndef HOST_HARDWARE_FLASH_H
+#define HOST_HARDWARE_FLASH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "pico/stdlib.h"
+
+#define FLASH_PAGE_SIZE (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+#define FLASH_BLOCK_SIZE (1u << 16)
+
+extern uint8_t *flash_model_xip;
+#define XIP_BASE ((uintptr_t)flash_model_xip)
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count);
+
+// Host only: turns the model's erase and program timings on or off, returning the old setting.
+bool flash_model_set_timing(bool on);
+
+// Host only: drops every erase and program command after the next 'commands', as a power loss
+// would; returns whether the previous cut dropped any. FLASH_MODEL_NO_POWER_CUT restores power.
+#define FLASH_MODEL_NO_POWER_CUT UINT32_MAX
+bool flash_model_cut_power(uint32_t commands);
+
+#endif // HOST_HARDWARE_FLASH_H
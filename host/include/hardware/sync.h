@@ -0,0 +1,18 @@
+/**
+ * @file sync.h
+ * @brief Host stand-in for the Pico SDK's hardware/sync.h. Interrupts do not exist on the
+ * host, and the barriers become full memory fences.
+ */
+#ifndef HOST_HARDWARE_SYNC_H
+#define HOST_HARDWARE_SYNC_H
+
+#include <stdint.h>
+
+static inline uint32_t save_and_disable_interrupts(void) { return 0; }
+static inline void restore_interrupts(uint32_t status) { (void)status; }
+static inline void __dmb(void) { __sync_synchronize(); }
+static inline void __mem_fence_acquire(void) { __sync_synchronize(); }
+static inline void __mem_fence_release(void) { __sync_synchronize(); }
+static inline unsigned int get_core_num(void) { return 0; }
+
+#endif // HOST_HARDWARE_SYNC_H
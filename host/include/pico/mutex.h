@@ -0,0 +1,22 @@
+/**
+ * @file mutex.h
+ * @brief Host stand-in for the Pico SDK's pico/mutex.h, on pthread mutexes.
+ */
+#ifndef HOST_PICO_MUTEX_H
+#define HOST_PICO_MUTEX_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    pthread_mutex_t m;
+} mutex_t;
+
+static inline void mutex_init(mutex_t *mtx) { pthread_mutex_init(&mtx->m, NULL); }
+static inline void mutex_enter_blocking(mutex_t *mtx) { pthread_mutex_lock(&mtx->m); }
+static inline bool mutex_try_enter(mutex_t *mtx, uint32_t *owner) { (void)owner; return pthread_mutex_trylock(&mtx->m) == 0; }
+static inline void mutex_exit(mutex_t *mtx) { pthread_mutex_unlock(&mtx->m); }
+#define auto_init_mutex(name) static mutex_t name = { PTHREAD_MUTEX_INITIALIZER }
+
+#endif // HOST_PICO_MUTEX_H
@@ -0,0 +1,27 @@
+/**
+ * @file stdlib.h
+ * @brief Host stand-in for the Pico SDK's pico/stdlib.h.
+ */
+#ifndef HOST_PICO_STDLIB_H
+#define HOST_PICO_STDLIB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "pico/time.h"
+
+#ifndef PICO_FLASH_SIZE_BYTES
+#define PICO_FLASH_SIZE_BYTES (2 * 1024 * 1024)
+#endif
+#ifndef MIN
+#define MIN(a, b) ((b) > (a) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+static inline void stdio_init_all(void) {}
+static inline bool stdio_usb_connected(void) { return true; }
+
+#endif // HOST_PICO_STDLIB_H
@@ -0,0 +1,28 @@
+/**
+ * @file time.h
+ * @brief Host stand-in for the Pico SDK's pico/time.h.
+ *
+ * time_us_64() is the monotonic clock plus the time the flash model has spent erasing and
+ * programming (see flash_model_busy_us()), which is 0 unless the model's timings are turned
+ * on. Sleeps return at once, so the tests do not wait out the delays meant for a person
+ * watching the device.
+ */
+#ifndef HOST_PICO_TIME_H
+#define HOST_PICO_TIME_H
+
+#include <stdint.h>
+#include <time.h>
+
+uint64_t flash_model_busy_us(void);
+
+static inline uint64_t time_us_64(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000 + flash_model_busy_us();
+}
+static inline uint32_t time_us_32(void) { return (uint32_t)time_us_64(); }
+static inline void sleep_ms(uint32_t ms) { (void)ms; }
+static inline void sleep_us(uint64_t us) { (void)us; }
+static inline void tight_loop_contents(void) {}
+
+#endif // HOST_PICO_TIME_H
@@ -14,6 +14,7 @@
 #define FAT_ENTRY_INVALID 0xFFFFFFFA  // Signifies an invalid entry, used for error handling and validation.
 #define FAT_ENTRY_FULL 0xFFFFFFFD
 #define FAT_DIRECTORY_MARKER 0xFFFFFFFD
+#define FAT_ENTRY_RETIRED 0xFFFFFFF9  // A block no longer referred to, allocated until it has been erased.
 
 // Additional definitions for file attributes not directly related to the FAT but useful for managing file metadata.
 #define NO_TIMESTAMP 0xFFFFFFFF // Represents an undefined or invalid timestamp for file metadata.
@@ -38,9 +39,33 @@ uint32_t fat_allocate_block(void);
 // Frees a previously allocated block, returning it to the pool of available blocks.
 uint32_t fat_allocate_nearest_block(uint32_t hintBlock);
 
+// Allocates the first free block at or after 'startBlock', wrapping around to the start
+// of the data area. Used by the block log to sweep forward through the flash.
+uint32_t fat_allocate_block_from(uint32_t startBlock);
+
+// Allocates the most worn free block with at least 'minWear' erases, for static wear levelling.
+uint32_t fat_allocate_worn_block(uint32_t minWear);
+
+// Allocates 'count' physically consecutive free blocks, chosen best fit near 'hint', and links
+// them into a chain. Returns the first block, or FAT_NO_FREE_BLOCKS if no run is long enough.
+uint32_t fat_allocate_extent(uint32_t count, uint32_t hint);
+
+// Allocates a single block from the edge of a free run, so that no run is split, favouring
+// short runs among the least worn edges. Returns FAT_NO_FREE_BLOCKS if the FAT is full.
+uint32_t fat_allocate_edge_block(void);
+
 // Frees a previously allocated block, returning it to the pool of available blocks.
 void fat_free_block(uint32_t blockIndex);
 
+// Marks an allocated block as retired: it stays allocated, and its link to a next block is dropped.
+void fat_retire_block(uint32_t blockIndex);
+
+// Returns the first retired block at or after 'startBlock', or FAT_ENTRY_END if there is none.
+uint32_t fat_next_retired_block(uint32_t startBlock);
+
+// Returns the number of free blocks, kept up to date by every allocation and free.
+uint32_t fat_free_block_count(void);
+
 // Retrieves the next block in a file's chain, given the current block.
 // This supports sequential access to files stored across multiple blocks.
 int fat_get_next_block(uint32_t currentBlock, uint32_t* nextBlock);
@@ -49,8 +74,60 @@ int fat_get_next_block(uint32_t currentBlock, uint32_t* nextBlock);
 // This is crucial for supporting files that span multiple blocks.
 void fat_link_blocks(uint32_t prevBlock, uint32_t nextBlock);
 
+// Reference counts of blocks shared by copies of a file (see fs_cp()). A block referenced by
+// one predecessor or start block has no extra reference and is not shared.
+int fat_ref_block(uint32_t block);            // Adds a reference; -1 if it cannot.
+bool fat_unref_block(uint32_t block);         // Drops a reference; false if it was the only one.
+bool fat_block_shared(uint32_t block);        // Whether more than one reference remains.
+uint32_t fat_shared_block_count(void);        // Blocks that are shared, for a quick check.
+void fat_rebuild_refs(const uint32_t *heads, uint32_t count); // Recounts after a mount.
+
+
+// Changed entries since the last call, as (block, value) pairs, for the metadata journal.
+uint32_t fat_collect_dirty(uint32_t *pairs, uint32_t maxPairs);
+void fat_clear_dirty(void);
+
+// Sets one entry while replaying the metadata journal.
+void fat_set_entry(uint32_t block, uint32_t value);
+
+// FAT checkpoints. Which copy of each FAT sector belongs to a checkpoint, and the CRC of
+// that copy, are kept in the metadata journal's checkpoint record.
+typedef struct {
+    uint32_t copies;              // Bit s set: FAT sector s is in the second copy.
+    uint32_t crc[FAT_SECTORS];    // CRC-32 of each FAT sector as written.
+} fat_checkpoint;
+
+// Counters describing what FAT checkpoints wrote since the last reset.
+typedef struct {
+    uint32_t saves;               // fat_checkpoint_save() calls.
+    uint32_t sectors_written;     // FAT sectors erased and programmed.
+    uint32_t bytes_written;       // Bytes programmed for them.
+    uint32_t last_save_sectors;   // FAT sectors written by the most recent save.
+    uint32_t last_save_us;        // Duration of the most recent save.
+} fat_persist_stats;
+
+// Writes the FAT sectors changed since the last save and describes the result.
+int fat_checkpoint_save(fat_checkpoint *checkpoint);
+
+// Replaces the FAT with a saved checkpoint, verified sector by sector.
+int fat_checkpoint_load(const fat_checkpoint *checkpoint);
+
+void fat_get_persist_stats(fat_persist_stats *stats);
+void fat_reset_persist_stats(void);
+
+// Counters of one FAT region since fat_init().
+typedef struct {
+    uint32_t allocations;         // Blocks and extents allocated from the region.
+    uint32_t contended;           // Times its lock was found held by another core.
+} fat_region_stats;
+
+void fat_get_region_stats(uint32_t region, fat_region_stats *stats);
+
+// The core whose allocation cursor the caller uses; fat_bind_core() sets it for host threads.
+uint32_t fat_current_core(void);
+void fat_bind_core(uint32_t core);
 
-void saveFATEntriesToFileSystem();
-void loadFATEntriesFromFileSystem();
+// Block where a core's allocation cursor starts.
+uint32_t fat_core_start_block(uint32_t core);
 
 #endif // FAT_FS_H
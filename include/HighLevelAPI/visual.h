@@ -1,15 +1,21 @@
 #ifndef VISUAL_H
 #define VISUAL_H
 
-#include "../filesystem/filesystem.h" 
-#include "../config/flash_config.h" 
+#include "../filesystem/filesystem.h"
+#include "../config/flash_config.h"
+
+/**
+ * What fs_du() found below a directory.
+ */
+typedef struct {
+    uint32_t directories; // Subdirectories at any depth.
+    uint32_t files;       // Files in the directory and its subdirectories.
+    uint32_t bytes;       // Bytes in those files.
+} fs_usage;
 
  void print_indent(int level);
-// void print_directory(uint32_t dirId, int level);
 void print_filesystem_structure();
+int fs_du(const char* path, fs_usage* usage); // Totals below a directory, or -1.
 
 
-void print_directory(uint32_t parentDirId, int level, bool *visited);
-
-
-#endif // FILESYSTEM_HELPER_H
\ No newline at end of file
+#endif // FILESYSTEM_HELPER_H
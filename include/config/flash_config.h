@@ -47,13 +47,16 @@
     // the block size by the size of a single directory entry. This is used to optimize directory storage.
     #define ENTRIES_PER_BLOCK (FILESYSTEM_BLOCK_SIZE / sizeof(DirectoryEntry))
 
-    // The maximum number of files the filesystem can support. This is determined by the available
-    // space and how the filesystem is structured, ensuring a limit to prevent overallocation.
-    #define MAX_FILES 20
+    // File and directory entries live in paged tables on flash (see meta_table.h), so their
+    // number is limited by free blocks rather than by a fixed array. This is how many pages
+    // of those tables are kept in RAM at once; each page costs FILESYSTEM_BLOCK_SIZE bytes.
+    #ifndef META_CACHE_PAGES
+    #define META_CACHE_PAGES 4
+    #endif
 
-    // Calculates the maximum size of a file, aligning it to the block size. This ensures that
-    // file sizes are optimized for the block-based storage system, avoiding unnecessary fragmentation. 
-    #define MAX_FILE_SIZE ((FLASH_USABLE_SPACE / MAX_FILES) & ~(FILESYSTEM_BLOCK_SIZE - 1))
+    // Upper bound on cached pages, including extra pages held only while every page within
+    // META_CACHE_PAGES is pinned by an open file.
+    #define META_CACHE_MAX_LINES (META_CACHE_PAGES * 3)
 
 
     // A special value used in the FAT to indicate reserved entries. It can be set to an appropriate
@@ -61,9 +64,6 @@
     #define FAT_ENTRY_RESERVED 0xFFFFFFFC // You can choose an appropriate value
 
 
-    #define MAX_DIRECTORY_ENTRIES 20
-
-
 
     #define FAT_SUCCESS 0
     #define FAT_END_OF_CHAIN 1
@@ -79,4 +79,182 @@
 #define READ_ERROR_INCORRECT_MODE -3
 #define READ_SUCCESS_NO_DATA 0
 
+
+    // The number of 4 KB flash sectors the RAM write-back cache keeps resident.
+    // Each slot costs one sector of RAM, so the default of 4 uses 16 KB.
+    #define FLASH_CACHE_SECTORS 4
+
+    // Sector images the flush worker (flush_worker.h) can hold while they wait to be written.
+    // Each slot costs one sector of RAM.
+    #ifndef FLUSH_RING_SLOTS
+    #define FLUSH_RING_SLOTS 4
+    #endif
+
+    #define FLASH_CACHE_SUCCESS 0
+    #define FLASH_CACHE_INVALID_RANGE -1
+    #define FLASH_CACHE_NULL_POINTER -2
+
+    #define FLASH_PROGRAM_SUCCESS 0
+    #define FLASH_PROGRAM_INVALID_RANGE -1
+    #define FLASH_PROGRAM_NULL_POINTER -2
+    #define FLASH_PROGRAM_NO_MEMORY -3
+
+    // Every file data block ends with a small trailer describing its contents, so the
+    // payload that file data can use is slightly smaller than the block itself.
+    #define FS_BLOCK_TRAILER_SIZE 16
+    #define FS_BLOCK_PAYLOAD_SIZE (FILESYSTEM_BLOCK_SIZE - FS_BLOCK_TRAILER_SIZE)
+
+    // Writes covering at least this many whole blocks bypass the sector cache and are
+    // written as one contiguous run with batched erase and program operations.
+    #define FS_BULK_WRITE_MIN_BLOCKS 4
+
+    // Blocks fs_cp_deep() copies per step; the metadata tables are free between steps.
+    #ifndef FS_CP_DEEP_STEP_BLOCKS
+    #define FS_CP_DEEP_STEP_BLOCKS 16
+    #endif
+
+    // Requests fs_read_async() and fs_write_async() can hold queued until fs_poll() runs them.
+    #ifndef FS_ASYNC_QUEUE_DEPTH
+    #define FS_ASYNC_QUEUE_DEPTH 16
+    #endif
+
+    // Open files are locked through this many mutexes, picked by file id, so that operations
+    // on different files rarely wait for each other.
+    #ifndef FS_FILE_LOCKS
+    #define FS_FILE_LOCKS 8
+    #endif
+
+    // The FAT is split into this many regions of consecutive blocks, each with its own lock.
+    // Every core sweeps for free blocks with a cursor of its own that starts in a different
+    // region, so two cores allocating at the same time rarely contend.
+    #ifndef FAT_REGIONS
+    #define FAT_REGIONS 4
+    #endif
+    #define FAT_CORES 2
+
+    // Ring-log files (fs_log_open()): how many can be open at once, the most blocks one can
+    // span, the longest record, how many records wait in RAM before being packed, and how
+    // many full pages are programmed together with one flash command (1 to 16). A log costs
+    // about FS_LOG_QUEUE_DEPTH * (FS_LOG_MAX_RECORD + 8) + FS_LOG_BATCH_PAGES * 256 bytes of RAM.
+    #ifndef FS_LOG_MAX_OPEN
+    #define FS_LOG_MAX_OPEN 2
+    #endif
+    #ifndef FS_LOG_MAX_BLOCKS
+    #define FS_LOG_MAX_BLOCKS 64
+    #endif
+    #ifndef FS_LOG_MAX_RECORD
+    #define FS_LOG_MAX_RECORD 48
+    #endif
+    #ifndef FS_LOG_QUEUE_DEPTH
+    #define FS_LOG_QUEUE_DEPTH 128
+    #endif
+    #ifndef FS_LOG_BATCH_PAGES
+    #define FS_LOG_BATCH_PAGES 4
+    #endif
+
+    #define FS_LOG_SUCCESS 0
+    #define FS_LOG_INVALID_ARGUMENT -1
+    #define FS_LOG_FULL -2
+    #define FS_LOG_IO_ERROR -3
+
+    // Path lookups (dentry_cache.h) are cached in a table of DENTRY_CACHE_ENTRIES entries,
+    // keyed on the parent directory and the component's hash; a key may sit in any of the
+    // DENTRY_CACHE_PROBE entries after its home. Components longer than DENTRY_NAME_MAX
+    // bytes are not cached. An entry takes 48 bytes of RAM.
+    #ifndef DENTRY_CACHE_ENTRIES
+    #define DENTRY_CACHE_ENTRIES 128
+    #endif
+    #ifndef DENTRY_CACHE_PROBE
+    #define DENTRY_CACHE_PROBE 8
+    #endif
+    #ifndef DENTRY_NAME_MAX
+    #define DENTRY_NAME_MAX 24
+    #endif
+
+    // Deepest directory below the starting one that print_filesystem_structure() and fs_du()
+    // descend into; their walk keeps 4 bytes of stack per level.
+    #ifndef FS_TREE_MAX_DEPTH
+    #define FS_TREE_MAX_DEPTH 64
+    #endif
+
+    #define BLOCK_LOG_SUCCESS 0
+    #define BLOCK_LOG_INVALID_ARGUMENT -1
+    #define BLOCK_LOG_NO_SPACE -2
+    #define BLOCK_LOG_NO_MEMORY -3
+    #define BLOCK_LOG_IO_ERROR -4
+
+    // Metadata blocks right after the reserved space. The first five hold the legacy table
+    // saves and the superblock; after them come two copies of the FAT checkpoint.
+    //
+    // The FAT is checkpointed as 16-bit entries, FAT_SECTOR_ENTRIES to a sector, so parts of
+    // up to 256 MB fit. Each FAT sector has a copy in both areas: a checkpoint rewrites only
+    // the sectors whose entries changed, into the copy the previous checkpoint does not use,
+    // so a checkpoint torn by power loss leaves the previous one intact.
+    #define FAT_SECTOR_ENTRIES (FILESYSTEM_BLOCK_SIZE / 2)
+    #define FAT_SECTORS ((TOTAL_BLOCKS + FAT_SECTOR_ENTRIES - 1) / FAT_SECTOR_ENTRIES)
+    #define FAT_CHECKPOINT_BLOCKS FAT_SECTORS
+    #define FAT_CHECKPOINT_FIRST_BLOCK (NUMBER_OF_RESERVED_BLOCKS + 5)
+
+    // Erase counts of every block (see wear_table.h), saved with each checkpoint the same way
+    // as the FAT: two copies of each sector, only changed sectors rewritten.
+    #define WEAR_SECTOR_ENTRIES (FILESYSTEM_BLOCK_SIZE / 4)
+    #define WEAR_SECTORS ((TOTAL_BLOCKS + WEAR_SECTOR_ENTRIES - 1) / WEAR_SECTOR_ENTRIES)
+    #define WEAR_CHECKPOINT_FIRST_BLOCK (FAT_CHECKPOINT_FIRST_BLOCK + 2 * FAT_CHECKPOINT_BLOCKS)
+
+    // Free blocks the allocator compares, in sweep order, to pick the least worn one.
+    #ifndef WEAR_CANDIDATES
+    #define WEAR_CANDIDATES 8
+    #endif
+
+    // Metadata pages move to a fresh block on every write-back, taken from the edge of a
+    // free run (fat_allocate_edge_block()). Edges worn up to this many erases more than the
+    // least worn one compete on the length of their run, so holes are filled first.
+    #ifndef WEAR_EDGE_MARGIN
+    #define WEAR_EDGE_MARGIN 4
+    #endif
+
+    // Static wear levelling (fs_wear_level()): file data on a block at least this many erases
+    // behind the most worn data block is moved onto a worn free block, so that blocks holding
+    // files that never change take their share of the erases.
+    #ifndef WEAR_LEVEL_THRESHOLD
+    #define WEAR_LEVEL_THRESHOLD 100
+    #endif
+
+    // Time in microseconds that each fs_write() gives to static wear levelling; 0 turns it off.
+    #ifndef WEAR_LEVEL_SLICE_US
+    #define WEAR_LEVEL_SLICE_US 2000
+    #endif
+
+    // Blocks the wear levelling scan looks at in one step.
+    #define WEAR_LEVEL_SCAN_BLOCKS 32
+
+    // The metadata journal: a ring of sectors after the checkpoint slots that records every
+    // change to the metadata tables and the FAT between checkpoints.
+    #define JOURNAL_FIRST_BLOCK (WEAR_CHECKPOINT_FIRST_BLOCK + 2 * WEAR_SECTORS)
+    #define JOURNAL_SECTORS 4
+
+    // Blocks after the reserved space that fat_init() keeps for metadata.
+    #define METADATA_RESERVED_BLOCKS (5 + 2 * FAT_CHECKPOINT_BLOCKS + 2 * WEAR_SECTORS + JOURNAL_SECTORS)
+
+    // Journal records are collected in RAM and programmed together on commit.
+    #define JOURNAL_BUFFER_SIZE 1024
+
+    // Granularity at which changes to cached metadata pages are found and journaled.
+    #define META_JOURNAL_CHUNK 64
+
+    // The superblock identifies a formatted filesystem and the layout it was formatted with;
+    // fs_mount() refuses flash whose superblock does not match this build.
+    #define SUPERBLOCK_BLOCK (NUMBER_OF_RESERVED_BLOCKS + 1)
+    #define SUPERBLOCK_MAGIC 0x50494653   // "PIFS"
+    #define FS_FORMAT_VERSION 4
+
+    #define JOURNAL_SUCCESS 0
+    #define JOURNAL_NOT_FOUND -1
+    #define JOURNAL_IO_ERROR -2
+    #define JOURNAL_CORRUPTED -3
+
+    #define WEAR_SUCCESS 0
+    #define WEAR_IO_ERROR -1
+    #define WEAR_CORRUPTED -2
+
     #endif // FLASH_CONFIG_H
@@ -0,0 +1,51 @@
+/**
+ * @file dentry_cache.h
+ *
+ * Header file for path resolution. A path is walked one component at a time from the root
+ * directory: each component is looked up among the directories whose parentDirId is the
+ * directory reached so far, so "/root/a/x/f" and "/root/b/x/f" are different files.
+ *
+ * Lookups go through a small hash table in RAM keyed on (parentDirId, hash of the
+ * component). It remembers misses as well, so a path whose directories do not exist
+ * costs no scan of the directory table either. A cached directory is checked against its
+ * entry before it is used; creating a directory drops the cached miss of its name.
+ *
+ * A leading "/root" component names the root directory and may be left out: "/a/f",
+ * "a/f" and "/root/a/f" are the same file. Called with the metadata tables locked.
+ */
+
+#ifndef DENTRY_CACHE_H
+#define DENTRY_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../config/flash_config.h"
+#include "../directory/directories.h"
+
+#if DENTRY_CACHE_PROBE > DENTRY_CACHE_ENTRIES
+#error "DENTRY_CACHE_PROBE must not exceed DENTRY_CACHE_ENTRIES"
+#endif
+
+// The parent key under which the root directory itself is cached.
+#define DENTRY_ROOT_PARENT 0
+
+/**
+ * Counters of the cache since the filesystem was initialized or mounted.
+ */
+typedef struct {
+    uint32_t hits;           // Directories found in the cache.
+    uint32_t negative_hits;  // Missing directories known from the cache.
+    uint32_t misses;         // Lookups that scanned the directory table.
+    uint32_t stale;          // Cached directories whose entry had changed.
+    uint32_t evictions;      // Cache entries replaced by another name.
+} dentry_cache_stats;
+
+void dentry_cache_init(void); // Empties the cache.
+void dentry_cache_forget(uint32_t parentDirId, const char* name, size_t length); // Drops what is cached for a name.
+DirectoryEntry* dentry_lookup(uint32_t parentDirId, const char* name, size_t length); // A child directory, or NULL.
+DirectoryEntry* path_walk(const char* path); // The directory at a path, or NULL.
+DirectoryEntry* path_walk_parent(const char* path, char* leaf, size_t leaf_size); // The directory holding the last component.
+void dentry_cache_get_stats(dentry_cache_stats* stats);
+
+#endif // DENTRY_CACHE_H
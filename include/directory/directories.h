@@ -6,28 +6,61 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "../config/flash_config.h"    
+#include "../filesystem/name_pool.h"
 
 // note in order to remove a dir, you need to call fs_format() to remove all the files in the directory
 
 
 
 typedef struct {
-    char name[256];       // Name of the file or directory
+    name_ref name;        // Name of the directory in the name pool
     uint32_t parentDirId;    // ID of the parent directory
     uint32_t currentDirId; 
     bool is_directory;    // Flag to indicate if this is a directory
     uint32_t size;        // number of entries (for directories)
     uint32_t start_block; // Start block in flash memory
     bool in_use;  
+    // Lists of the directory's children and its neighbour in its parent's list of
+    // subdirectories, as table slot + 1; 0 for none. See fs_opendir().
+    uint32_t first_file;
+    uint32_t first_subdir;
+    uint32_t next_sibling;
 } DirectoryEntry;
 
 
+/**
+ * One child of a directory, filled in by fs_readdir().
+ */
+typedef struct {
+    char name[NAME_POOL_MAX_LENGTH + 1]; // Without a leading slash.
+    bool is_directory;
+    uint32_t size;       // Bytes in a file; 0 for a directory.
+} fs_dirent;
+
+/**
+ * A directory open for listing. Subdirectories are listed first, then files.
+ */
+typedef struct {
+    uint32_t dirId;          // currentDirId of the directory.
+    uint32_t next_subdir;    // Next subdirectory to return, as slot + 1; 0 when done.
+    uint32_t next_file;      // Next file to return, as slot + 1; 0 when done.
+    fs_dirent entry;         // The entry fs_readdir() returned last.
+} FS_DIR;
+
 
-extern DirectoryEntry dirEntries[MAX_DIRECTORY_ENTRIES];
 
 void init_directory_entries();
+DirectoryEntry* dir_entry_at(uint32_t slot); // Entry at a slot of the paged directory table, or NULL.
+const DirectoryEntry* dir_entry_peek(uint32_t slot); // Read-only entry, mapped from flash if not cached.
+uint32_t dir_entry_count(void); // Number of slots in the directory table.
+int dir_entry_slot(const DirectoryEntry* entry); // Slot of a resident entry, or -1.
+int dir_table_grow(void); // Adds a page of unused entries to the directory table.
 bool fs_create_directory(const char* directory);
 bool reset_root_directory(void);
+
+FS_DIR* fs_opendir(const char* path); // Opens a directory for listing its children.
+fs_dirent* fs_readdir(FS_DIR* dir); // The next child, or NULL after the last.
+void fs_closedir(FS_DIR* dir);
  
 
  
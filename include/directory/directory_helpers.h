@@ -19,11 +19,15 @@ typedef struct PathSegments {
 
 
  
-DirectoryEntry* createDirectoryEntry(const char* path);
+DirectoryEntry* createDirectoryEntry(const char* name, uint32_t parentDirId);
 uint32_t get_root_directory_id();
 bool is_directory_valid(const DirectoryEntry* directoryEntry);
 DirectoryEntry* DIR_find_directory_entry(const char* directoryName);
 DirectoryEntry* find_free_directory_entry(void);
+DirectoryEntry* dir_find_by_id(uint32_t dirId); // The directory with a currentDirId, or NULL.
+void dir_link_file(uint32_t fileSlot); // Adds a file to its parent directory's list.
+void dir_unlink_file(uint32_t fileSlot); // Takes a file out of its parent directory's list.
+void dir_link_directory(uint32_t dirSlot); // Adds a directory to its parent's list.
 void DIR_all_directory_entries(void);
 void saveDirectoriesEntriesToFileSystem();
 void loadDirectoriesEntriesFromFileSystem();
@@ -0,0 +1,31 @@
+/**
+ * @file file_index.h
+ *
+ * Header file for the in-RAM hash indexes over the file table. One index is keyed on
+ * (parentDirId, file name) and one on unique_file_id, so that open, rm, cp and mv find a
+ * file entry in O(1) instead of comparing the name of every slot. Both indexes use open
+ * addressing with linear probing and hold slot numbers of the file table. Only entries
+ * whose name hash matches are paged in from flash during a lookup.
+ */
+
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include <stdint.h>
+#include "../config/flash_config.h"
+#include "../filesystem/meta_journal.h"
+
+void file_index_rebuild(void); // Rebuilds both indexes from the in-use entries of the file table.
+int file_index_reserve(void); // Extends the indexes to every slot after the file table grows.
+void file_index_insert(int fileIndex); // Adds an in-use entry to both indexes.
+void file_index_remove(int fileIndex); // Removes an entry from both indexes before it changes or is freed.
+int file_index_find(const char* name, uint32_t parentDirId); // Slot of a file by name, or -1.
+int file_index_find_id(uint32_t unique_file_id); // Slot of a file by unique ID, or -1.
+int file_index_unused_slot(void); // Lowest slot of the file table holding no file, or -1.
+const char* file_index_key(const char* name); // The name as stored: without a leading slash.
+
+uint32_t file_index_snapshot_size(void); // Bytes file_index_snapshot_write() produces.
+void file_index_snapshot_write(meta_snapshot_sink sink, void *context); // Saves the indexes for the next mount.
+int file_index_snapshot_load(const uint8_t *data, uint32_t length); // Loads saved indexes instead of rebuilding.
+
+#endif // FILE_INDEX_H
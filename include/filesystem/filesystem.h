@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "../config/flash_config.h"    
+#include "../filesystem/name_pool.h"
 
  
 extern bool fs_initialized;
@@ -18,7 +19,7 @@ typedef enum {
 
 // File entry structure
 typedef struct {
-    char filename[256];     // Path of the file
+    name_ref filename;      // Name of the file in the name pool, without a leading slash
     uint32_t parentDirId;   // ID of the parent directory
     uint32_t size;      // Size of the file
     bool in_use;        // Indicates if this file entry is in use
@@ -26,6 +27,11 @@ typedef struct {
     bool is_directory;      // Flag to indicate if this entry is a
     // uint8_t buffer[256];
     uint32_t unique_file_id; 
+    uint32_t extent_blocks; // Leading blocks stored at start_block + i, so they are found without a FAT walk
+    uint32_t chain_version; // Bumped whenever a block already in the chain is replaced
+    // Neighbours in the parent directory's list of files, as file table slot + 1; 0 for none.
+    uint32_t next_sibling;
+    uint32_t prev_sibling;
 } FileEntry;
 
 // File handle structure
@@ -34,22 +40,88 @@ typedef struct {
     uint32_t position;  // Current position in the file
     // FileMode mode; 
     char mode;
+    // Last block looked up: its index in the file, its block number and the block before it
+    // (FAT_ENTRY_END if unknown). Sequential access moves the cursor without a FAT walk.
+    uint32_t cursor_index;
+    uint32_t cursor_block;
+    uint32_t cursor_prev;
+    // Block numbers of the file by index, built on the first random access outside the
+    // contiguous extent. NULL until then.
+    uint32_t *block_map;
+    uint32_t block_map_len;
+    uint32_t chain_version; // entry->chain_version the cursor and map were built against
 } FS_FILE;
 
-extern FileEntry fileSystem[MAX_FILES];
+/**
+ * Timings of the last fs_mount().
+ */
+typedef struct {
+    uint32_t total_us;
+    uint32_t block_log_us;      // Scanning block trailers for the log-structured writer.
+    uint32_t journal_us;        // Loading the checkpoint and replaying the journal.
+    uint32_t index_us;          // Loading or rebuilding the file index and name pool index.
+    uint32_t replayed_records;  // Journal records replayed.
+    bool used_snapshot;         // Whether the indexes came from an unmount snapshot.
+} fs_mount_stats;
+
+/**
+ * Counters of static wear levelling since the filesystem was initialized or mounted.
+ */
+typedef struct {
+    uint32_t migrations;    // Blocks of file data moved onto worn blocks.
+    uint32_t abandoned;     // Moves dropped because the file changed while its block was copied.
+    uint32_t slices;        // fs_wear_level() calls that did any work.
+    uint32_t max_slice_us;  // Longest time one fs_wear_level() call took.
+    uint32_t max_step_us;   // Longest single step (scan, erase, page copy or commit).
+} fs_wear_level_stats;
+
+/**
+ * A physical copy of a file in progress, started by fs_cp_deep_open() and advanced a few
+ * blocks at a time by fs_cp_deep_step().
+ */
+typedef struct {
+    FS_FILE *source;
+    FS_FILE *copy;
+    uint32_t source_id;      // unique_file_id of the source, to notice its removal.
+    uint32_t source_version; // Source's chain_version when the copy started.
+    uint32_t source_size;
+    uint32_t next_block;     // Next block of the source's chain to copy.
+    uint32_t first_block;    // First block of the copy's extent.
+    uint32_t blocks;         // Blocks to copy.
+    uint32_t copied;         // Blocks copied so far.
+    uint8_t image[FILESYSTEM_BLOCK_SIZE]; // Staging for one block; XIP is off while programming.
+} FS_COPY;
+
+FileEntry* file_entry_at(uint32_t slot); // Entry at a slot of the paged file table, or NULL.
+const FileEntry* file_entry_peek(uint32_t slot); // Read-only entry, mapped from flash if not cached.
+uint32_t file_entry_count(void); // Number of slots in the file table.
+int file_entry_slot(const FileEntry* entry); // Slot of a resident entry, or -1.
+int file_table_grow(void); // Adds a page of unused entries to the file table.
 
  void fs_init(void);
+int fs_mount(void); // Mounts the filesystem on flash; fs_init() formats instead.
+int fs_unmount(void); // Syncs and checkpoints so the next mount is fast.
+void fs_get_mount_stats(fs_mount_stats* stats);
 void shutdown();
  void init_file_entries() ;
 FS_FILE* fs_open(const char* path, const char* mode);
 void fs_close(FS_FILE* file);
 int fs_read(FS_FILE* file, void* buffer, int size);
+int fs_map(FS_FILE* file, uint32_t offset, uint32_t len, const void** ptr);
 int fs_write(FS_FILE* file, const void* buffer, int size);
 int fs_seek(FS_FILE* file, long offset, int whence);
+int fs_reserve(FS_FILE* file, uint32_t bytes);
+int fs_sync(void);
+int fs_wear_level(uint32_t budget_us); // Runs static wear levelling for about budget_us.
+void fs_get_wear_level_stats(fs_wear_level_stats* stats);
 int fs_mv(const char* old_path, const char* new_path);
 int fs_wipe(const char* path);
 int fs_format(const char* path);
 int fs_cp(const char* source_path, const char* dest_path);
+FS_COPY* fs_cp_deep_open(const char* source_path, const char* dest_path); // Starts a physical copy.
+int fs_cp_deep_step(FS_COPY* copy, uint32_t max_blocks); // Copies some blocks; blocks left, or -1.
+void fs_cp_deep_close(FS_COPY* copy);
+int fs_cp_deep(const char* source_path, const char* dest_path); // Copies the data at once.
 int fs_rm(const char* path);
 
 #endif // FILESYSTEM_H
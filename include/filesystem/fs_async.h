@@ -0,0 +1,65 @@
+/**
+ * @file fs_async.h
+ *
+ * Header file for non-blocking file reads and writes. fs_read_async() and fs_write_async()
+ * only queue a request and return a handle; the work is done later by fs_poll(), which a
+ * bare-metal main loop calls whenever it has time to spare, and each request's callback is
+ * invoked when it completes.
+ *
+ * Requests run in the order they were queued, each one at the file position left by the
+ * requests before it, exactly as the same sequence of fs_read() and fs_write() calls would.
+ * Consecutive requests of the same kind on the same file that fall within one block are
+ * merged into a single fs_read() or fs_write(), so a burst of small records costs one call.
+ *
+ * Buffers passed in must stay valid until the request's callback has run. Either core may
+ * queue requests and poll, but not interrupt handlers; callbacks run on the core that polls,
+ * and while one core polls, fs_poll() on the other returns at once. Drain the queue with
+ * fs_async_drain() before closing a file that still has requests queued, or before fs_sync()
+ * if those writes should be part of it.
+ */
+
+#ifndef FS_ASYNC_H
+#define FS_ASYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../config/flash_config.h"
+#include "../filesystem/filesystem.h"
+
+// Identifies a queued request; FS_ASYNC_INVALID is never a valid handle.
+typedef uint32_t fs_async_handle;
+#define FS_ASYNC_INVALID 0
+
+/**
+ * Invoked by fs_poll() when a request completes.
+ *
+ * @param handle The handle fs_read_async() or fs_write_async() returned.
+ * @param result What fs_read() or fs_write() would have returned for the request: the
+ *               number of bytes transferred, or a negative value on error.
+ * @param context The context pointer given with the request.
+ */
+typedef void (*fs_async_callback)(fs_async_handle handle, int result, void *context);
+
+/**
+ * Counters of asynchronous I/O since the last fs_async_init().
+ */
+typedef struct {
+    uint32_t submitted;   // Requests queued.
+    uint32_t completed;   // Requests whose callback has run.
+    uint32_t rejected;    // Requests refused because the queue was full or the arguments invalid.
+    uint32_t calls;       // fs_read() and fs_write() calls made to complete them.
+    uint32_t merged;      // Requests completed by a call made for an earlier request.
+    uint32_t max_queued;  // Most requests queued at once.
+} fs_async_stats;
+
+void fs_async_init(void); // Drops every queued request without running it.
+fs_async_handle fs_read_async(FS_FILE* file, void* buffer, int size, fs_async_callback callback, void* context);
+fs_async_handle fs_write_async(FS_FILE* file, const void* buffer, int size, fs_async_callback callback, void* context);
+int fs_poll(uint32_t budget_us); // Runs queued requests for about budget_us; returns how many completed.
+void fs_async_drain(void); // Runs every queued request.
+bool fs_async_pending(fs_async_handle handle); // True until the request's callback has run.
+uint32_t fs_async_queued(void); // Requests waiting to run.
+
+void fs_async_get_stats(fs_async_stats* stats);
+
+#endif // FS_ASYNC_H
@@ -0,0 +1,63 @@
+/**
+ * @file meta_journal.h
+ *
+ * Header file for the metadata journal. Instead of rewriting the file, directory and name
+ * tables and the FAT as a whole, every change to them is appended to a ring of journal
+ * sectors as a small delta: the changed chunks of table pages and the changed FAT entries.
+ * A commit costs a few page programs in proportion to the change, however large the tables
+ * have grown.
+ *
+ * Now and then, and whenever the ring is about to run out of sectors, a checkpoint writes
+ * every table page back and saves the FAT sectors that changed, after which the
+ * older journal sectors are no longer needed. At boot, meta_journal_recover() loads the
+ * latest checkpoint and replays the committed deltas that follow it.
+ *
+ * A checkpoint may also refer to a mount snapshot: the in-RAM indexes saved alongside it,
+ * so that a mount with nothing to replay can load them instead of rebuilding them.
+ */
+
+#ifndef META_JOURNAL_H
+#define META_JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../config/flash_config.h"
+
+/**
+ * Where a mount snapshot is stored: a run of consecutive blocks, allocated in the FAT.
+ */
+typedef struct {
+    uint32_t first_block;   // FAT_ENTRY_END if there is no snapshot.
+    uint32_t blocks;
+    uint32_t length;        // Bytes of snapshot data.
+    uint32_t checksum;      // Checksum of the data, checked before it is used.
+} meta_snapshot;
+
+/**
+ * Receives the bytes of a mount snapshot as it is written.
+ */
+typedef void (*meta_snapshot_sink)(const void *data, uint32_t length, void *context);
+
+/**
+ * Counters describing the journal's activity since the last reset.
+ */
+typedef struct {
+    uint32_t commits;            // Commits that wrote at least one change.
+    uint32_t records;            // Delta records appended.
+    uint32_t bytes_written;      // Journal bytes programmed, headers included.
+    uint32_t checkpoints;        // Checkpoints written.
+    uint32_t sectors_erased;     // Journal sectors erased to continue the ring.
+    uint32_t last_commit_bytes;  // Bytes programmed by the most recent commit.
+    uint32_t last_commit_us;     // Duration of the most recent commit.
+    uint32_t replayed_records;   // Records applied by the last meta_journal_recover().
+} meta_journal_stats;
+
+int meta_journal_format(void); // Starts an empty journal with a checkpoint of the current state.
+int meta_journal_commit(void); // Appends every pending metadata change and a commit marker.
+int meta_journal_checkpoint(const meta_snapshot *snapshot); // Writes all metadata back and restarts the journal.
+int meta_journal_recover(meta_snapshot *snapshot); // Loads the last checkpoint and replays committed changes.
+
+void meta_journal_get_stats(meta_journal_stats *stats);
+void meta_journal_reset_stats(void);
+
+#endif // META_JOURNAL_H
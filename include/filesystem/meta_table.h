@@ -0,0 +1,91 @@
+/**
+ * @file meta_table.h
+ *
+ * Header file for the paged metadata tables that hold file and directory entries. A table is
+ * an array of fixed-size records stored on flash in its own chain of blocks, one page per
+ * block, and grows a block at a time. Pages are brought into a small shared RAM cache on
+ * demand, so RAM use depends on the cache size rather than on the number of entries.
+ *
+ * A record pointer returned by meta_table_get() stays valid while its page is resident.
+ * The page most recently accessed is never the one evicted, so a pointer may be used until
+ * another page is touched; callers that hold a record longer (such as an open file) pin it.
+ *
+ * Changes to cached pages are found by meta_table_collect() for the metadata journal, a
+ * META_JOURNAL_CHUNK-byte chunk at a time, so callers never mark records dirty.
+ *
+ * None of the functions below lock anything themselves. Callers hold meta_table_lock() to
+ * change the tables or the page cache, or meta_table_lock_shared() to use records they
+ * already have pinned.
+ */
+
+#ifndef META_TABLE_H
+#define META_TABLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../config/flash_config.h"
+
+// Identifiers of the metadata tables, as recorded in the journal.
+#define META_TABLE_FILES 0
+#define META_TABLE_DIRECTORIES 1
+#define META_TABLE_NAMES 2
+#define META_TABLE_COUNT 3
+
+/**
+ * One metadata table. Records never straddle a page, so a page holds
+ * FILESYSTEM_BLOCK_SIZE / record_size of them.
+ */
+typedef struct {
+    uint32_t first_block;        // First block of the table's chain, or FAT_ENTRY_END while empty.
+    uint32_t blocks;             // Number of blocks (pages) in the chain.
+    uint16_t record_size;        // Size of one record in bytes.
+    uint16_t records_per_page;   // Records stored in each page.
+    uint8_t id;                  // One of the META_TABLE_* identifiers.
+    uint32_t hint_page;          // A page whose block is known, so chain walks can start there.
+    uint32_t hint_block;
+} meta_table;
+
+/**
+ * Receives one changed range of a page from meta_table_collect(). A NULL data pointer means
+ * the whole page was added to the table and starts out zeroed.
+ */
+typedef void (*meta_table_emit)(uint8_t id, uint32_t page, uint32_t offset, const uint8_t *data, uint32_t length);
+
+/**
+ * Counters describing how the page cache has been used since the last reset.
+ */
+typedef struct {
+    uint32_t hits;          // Record accesses served from a resident page.
+    uint32_t misses;        // Page loads from flash.
+    uint32_t writebacks;    // Pages programmed back to flash because they changed.
+    uint32_t resident;      // Pages held in RAM right now.
+    uint32_t peak_resident; // Most pages held in RAM at once.
+} meta_table_stats;
+
+void meta_table_init(meta_table *table, uint8_t id, uint16_t record_size); // Empties a table and drops its cached pages.
+void meta_table_attach(meta_table *table, uint32_t first_block, uint32_t blocks); // Points a table at a chain on flash.
+meta_table *meta_table_lookup(uint8_t id); // The table registered under an identifier, or NULL.
+uint32_t meta_table_capacity(const meta_table *table); // Number of record slots in the table.
+void *meta_table_get(meta_table *table, uint32_t slot); // Record at a slot, or NULL past the end.
+const void *meta_table_peek(meta_table *table, uint32_t slot); // Read-only record, mapped from flash if not cached.
+uint32_t meta_table_slot(const meta_table *table, const void *record); // Slot of a resident record.
+int meta_table_grow(meta_table *table); // Appends a page of zeroed records.
+void meta_table_pin(const void *record); // Keeps the page holding a record resident.
+void meta_table_unpin(const void *record); // Releases a pin taken by meta_table_pin().
+int meta_table_sync(void); // Writes every changed page back to flash.
+
+void meta_table_collect(meta_table_emit emit); // Reports ranges changed since the last collect.
+int meta_table_apply(uint8_t id, uint32_t page, uint32_t offset, const uint8_t *data, uint32_t length); // Replays a range.
+void meta_table_set_writeback_hook(void (*hook)(void)); // Called before any page is programmed.
+
+// Reader-writer lock over every table and the page cache.
+void meta_table_lock(void); // Exclusive; recursive for its holder.
+bool meta_table_try_lock(void); // Exclusive, only if free right now.
+void meta_table_unlock(void);
+void meta_table_lock_shared(void); // Shared with other readers; exclusive if the caller owns it.
+void meta_table_unlock_shared(void);
+
+void meta_table_get_stats(meta_table_stats *stats);
+void meta_table_reset_stats(void);
+
+#endif // META_TABLE_H
@@ -0,0 +1,66 @@
+/**
+ * @file name_pool.h
+ *
+ * Header file for the string pool that holds file and directory names. Entries of the file
+ * and directory tables store a fixed-size name_ref (offset, length and hash) instead of a
+ * 256-byte name buffer. The names themselves are packed into a pool kept on flash as a
+ * paged table (see meta_table.h), each one length-prefixed and stored once however many
+ * entries use it.
+ *
+ * Comparisons check the hash and length first, so the pool is only read for names that
+ * very likely match. Pointers returned by name_pool_str() point into the page cache and
+ * are only valid until a few other metadata pages have been touched.
+ */
+
+#ifndef NAME_POOL_H
+#define NAME_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../config/flash_config.h"
+#include "../filesystem/meta_journal.h"
+
+// Longest name the pool stores; longer names are truncated, as the old 256-byte buffers did.
+#define NAME_POOL_MAX_LENGTH 255
+
+/**
+ * A reference to a name in the pool, embedded in file and directory entries. A zeroed
+ * reference (length 0) holds no name.
+ */
+typedef struct {
+    uint32_t offset;   // Byte offset of the name's record in the pool.
+    uint32_t hash;     // name_pool_hash() of the name.
+    uint16_t length;   // Length of the name in bytes, without the terminator.
+    uint16_t reserved;
+} name_ref;
+
+/**
+ * Counters describing the contents of the pool.
+ */
+typedef struct {
+    uint32_t strings;      // Distinct names currently referenced.
+    uint32_t references;   // name_ref values pointing into the pool.
+    uint32_t bytes_used;   // Bytes of the pool taken by records, live or free.
+    uint32_t bytes_live;   // Bytes taken by records of referenced names.
+    uint32_t pages;        // Flash blocks holding the pool.
+    uint32_t shared;       // name_pool_set() calls that reused an existing name.
+} name_pool_stats;
+
+void name_pool_init(void); // Empties the pool.
+int name_pool_rebuild(void); // Rebuilds the RAM index after the pool table is restored.
+uint32_t name_pool_hash(const char* name, size_t length); // FNV-1a hash of a name.
+int name_pool_set(name_ref* ref, const char* name); // Points a reference at a name, interning it.
+void name_pool_clear(name_ref* ref); // Drops the name a reference holds.
+bool name_pool_matches(const name_ref* ref, const char* name, size_t length, uint32_t hash); // Hash-first compare.
+bool name_pool_equals(const name_ref* ref, const char* name); // name_pool_matches() for a C string.
+const char* name_pool_str(const name_ref* ref); // The name, NUL-terminated, in the page cache.
+const char* name_pool_peek(const name_ref* ref); // name_pool_str() read in place, without caching.
+
+uint32_t name_pool_snapshot_size(void); // Bytes name_pool_snapshot_write() produces.
+void name_pool_snapshot_write(meta_snapshot_sink sink, void *context); // Saves the index for the next mount.
+int name_pool_snapshot_load(const uint8_t *data, uint32_t length); // Loads a saved index instead of rebuilding.
+
+void name_pool_get_stats(name_pool_stats* stats);
+
+#endif // NAME_POOL_H
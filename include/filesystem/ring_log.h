@@ -0,0 +1,92 @@
+/**
+ * @file ring_log.h
+ *
+ * Header file for ring-log files, a file type for high-rate telemetry. A ring log is a file
+ * whose chain is a fixed ring of blocks allocated when it is created. Records are appended
+ * to it and, once the ring is full, the oldest block is erased and reused, so the log always
+ * holds the most recent records and never grows.
+ *
+ * fs_log_append() only copies a record into a RAM queue, taking a slot without a lock, so
+ * any number of threads or both cores may append at the same time. Queued records are
+ * packed into pages, and full pages are programmed FS_LOG_BATCH_PAGES at a time; whichever
+ * caller finds a page's worth of records queued and nobody else packing does the work.
+ * fs_log_flush() also programs a partly filled page, which ends it: later records start on
+ * the next page.
+ *
+ * Records survive a restart; fs_log_open() on an existing log finds the newest page again.
+ * A ring-log file must only be used through these functions, not fs_read() or fs_write().
+ * Records are appended from tasks or either core, not from interrupt handlers.
+ */
+
+#ifndef RING_LOG_H
+#define RING_LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hardware/flash.h"
+#include "../config/flash_config.h"
+#include "../filesystem/filesystem.h"
+
+#if (FS_LOG_QUEUE_DEPTH & (FS_LOG_QUEUE_DEPTH - 1)) != 0
+#error "FS_LOG_QUEUE_DEPTH must be a power of two"
+#endif
+
+/**
+ * A record waiting in the RAM queue. The slot is free for the producer of position n when
+ * its sequence is n, and holds that producer's record when it is n + 1.
+ */
+typedef struct {
+    uint32_t sequence;
+    uint16_t length;
+    uint8_t data[FS_LOG_MAX_RECORD];
+} fs_log_slot;
+
+/**
+ * Counters of a ring log since it was opened.
+ */
+typedef struct {
+    uint32_t appended;           // Records accepted by fs_log_append().
+    uint32_t dropped;            // Records refused because the queue was full.
+    uint32_t pages_programmed;   // Pages written to flash.
+    uint32_t blocks_overwritten; // Blocks erased to make room, dropping their oldest records.
+    uint32_t max_queued;         // Most records waiting in the queue at once.
+} fs_log_stats;
+
+/**
+ * An open ring log.
+ */
+typedef struct {
+    bool in_use;
+    FS_FILE *file;                       // Keeps the file's entry resident.
+    uint32_t blocks[FS_LOG_MAX_BLOCKS];  // The ring, in order.
+    uint32_t block_count;
+    uint32_t next_page;                  // Sequence number of the next page to program.
+
+    fs_log_slot queue[FS_LOG_QUEUE_DEPTH];
+    uint32_t queue_head;                 // Next position producers claim.
+    uint32_t queue_tail;                 // Next position the drain takes.
+    bool draining;                       // Held by whoever packs and programs pages.
+
+    uint8_t pages[FS_LOG_BATCH_PAGES][FLASH_PAGE_SIZE]; // Full pages, then the page being filled.
+    uint32_t pages_sealed;               // Full pages waiting to be programmed.
+    uint32_t page_used;                  // Bytes of records in the page being filled.
+    fs_log_stats stats;
+} fs_log;
+
+/**
+ * Receives the records of a log from fs_log_iterate(), oldest first. The data may point
+ * straight into the memory-mapped flash and is only valid during the call.
+ *
+ * @return true to continue with the next record, false to stop.
+ */
+typedef bool (*fs_log_visitor)(const void *record, uint16_t length, void *context);
+
+void fs_log_init(void); // Forgets every open log.
+fs_log *fs_log_open(const char *path, uint32_t capacity_blocks); // Opens or creates a ring log.
+int fs_log_append(fs_log *log, const void *record, uint16_t length); // Queues one record.
+int fs_log_flush(fs_log *log); // Programs every queued record, including a partial page.
+int fs_log_iterate(fs_log *log, fs_log_visitor visitor, void *context); // Visits every record.
+int fs_log_close(fs_log *log); // Flushes and closes.
+void fs_log_get_stats(const fs_log *log, fs_log_stats *stats);
+
+#endif // RING_LOG_H
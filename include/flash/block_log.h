@@ -0,0 +1,70 @@
+/**
+ * @file block_log.h
+ *
+ * Header file for the log-structured block writer used for file data. Each data block holds
+ * FS_BLOCK_PAYLOAD_SIZE bytes of file data followed by a fixed-size trailer. Overwrites never
+ * touch programmed bytes in place: the block is copied to a freshly erased block and the old
+ * one is retired until it is erased in the background.
+ */
+
+#ifndef BLOCK_LOG_H
+#define BLOCK_LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../config/flash_config.h"
+
+// Value of the trailer magic once a block has been sealed. An open block still has
+// an erased trailer, which reads as 0xFFFF.
+#define BLOCK_TRAILER_MAGIC 0xB10C
+
+/**
+ * The trailer stored in the last FS_BLOCK_TRAILER_SIZE bytes of every data block.
+ * It is programmed exactly once, when the payload becomes full.
+ */
+typedef struct {
+    uint32_t sequence;   // Log sequence number; later blocks have higher numbers.
+    uint32_t owner_id;   // unique_file_id of the file the block belongs to.
+    uint16_t length;     // Payload bytes in use.
+    uint16_t magic;      // BLOCK_TRAILER_MAGIC once sealed, 0xFFFF while the block is open.
+    uint32_t crc;        // CRC-32 of the payload bytes.
+} block_trailer;
+
+/**
+ * Counters describing the work done by the block log since the last reset.
+ */
+typedef struct {
+    uint32_t in_place_writes;  // Writes that landed in erased bytes of the same block.
+    uint32_t relocations;      // Writes that moved the block to a fresh erased block.
+    uint32_t sealed;           // Blocks whose trailer has been written.
+    uint32_t reclaimed;        // Retired blocks erased and returned to the FAT.
+    uint32_t bulk_blocks;      // Blocks written by block_log_write_run().
+    uint32_t clones;           // Shared blocks copied by block_log_clone().
+    uint32_t copied_blocks;    // Blocks written by block_log_copy_block().
+} block_log_stats;
+
+void block_log_init(void); // Resets the log and recovers the highest sequence number from flash.
+uint32_t block_log_allocate(void); // Returns a fresh, erased block for new data.
+uint32_t block_log_allocate_edge(void); // Returns an erased block from the edge of a free run, for moving pages.
+int block_log_write(uint32_t *block, uint32_t used, uint32_t pos, const uint8_t *data, size_t len, uint32_t owner_id);
+int block_log_clone(uint32_t block, uint32_t used, uint32_t pos, const uint8_t *data, size_t len,
+                    uint32_t owner_id, uint32_t *copy); // Copies a shared block, leaving it in place.
+int block_log_prepare_run(uint32_t first_block, uint32_t count); // Erases a run of blocks where needed.
+int block_log_write_run(uint32_t first_block, uint32_t count, const uint8_t *data, uint32_t owner_id); // Writes full blocks in bulk.
+int block_log_copy_block(uint32_t source, uint32_t used, uint32_t target, uint32_t owner_id,
+                         uint8_t *image); // Copies a block to an erased one, staged in image.
+void block_log_retire(uint32_t block); // Queues a block for erasure.
+void block_log_retire_flushed(uint32_t block); // Same, for a block whose replacement is on flash.
+int block_log_reclaim(void); // Erases retired blocks and frees them in the FAT.
+void block_log_commit_begin(void); // A journal commit starts.
+int block_log_commit_end(bool committed); // It ended; erases flushed blocks retired before it.
+int block_log_requeue_retired(void); // Queues the blocks the FAT marks retired, after a mount.
+bool block_log_read_trailer(uint32_t block, block_trailer *trailer); // Returns true if the block is sealed.
+bool block_log_verify(uint32_t block); // Checks the CRC of a sealed block.
+uint32_t block_log_crc32(uint32_t crc, const uint8_t *data, size_t len); // CRC-32 used by trailers and metadata.
+
+void block_log_get_stats(block_log_stats *stats);
+void block_log_reset_stats(void);
+
+#endif // BLOCK_LOG_H
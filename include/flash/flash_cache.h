@@ -0,0 +1,37 @@
+/**
+ * @file flash_cache.h
+ *
+ * Header file for the RAM write-back sector cache that sits between the filesystem and the
+ * raw flash erase/program routines. Small writes into the same sector are collected in RAM
+ * and reach the flash as a single erase and program when the sector is evicted or synced.
+ */
+
+#ifndef FLASH_CACHE_H
+#define FLASH_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Counters describing how the cache has been used since the last reset.
+ */
+typedef struct {
+    uint32_t hits;            // Accesses served from a sector already held in RAM.
+    uint32_t misses;          // Accesses that had to go to the flash itself.
+    uint32_t writebacks;      // Dirty sectors written back to flash.
+    uint32_t evictions;       // Sectors dropped to make room for another sector.
+    uint32_t erases_avoided;  // Writes merged into an already dirty sector instead of erasing again.
+} flash_cache_stats;
+
+void flash_cache_init(void); // Empties the cache and resets its counters.
+int flash_cache_read(uint32_t offset, uint8_t *buffer, size_t len); // Reads through the cache.
+int flash_cache_write(uint32_t offset, const uint8_t *data, size_t len); // Writes into the cache.
+int flash_cache_flush(uint32_t offset); // Writes back the sector holding offset, if dirty.
+int flash_cache_sync(void); // Writes back every dirty sector.
+void flash_cache_invalidate(uint32_t offset); // Drops the sector holding offset without writing it back.
+
+void flash_cache_get_stats(flash_cache_stats *stats);
+void flash_cache_reset_stats(void);
+
+#endif // FLASH_CACHE_H
@@ -25,10 +25,27 @@ typedef struct {
     uint8_t *data_ptr;      // Points to the actual data stored in flash.
 } flash_data;
 
+/**
+ * Counts of the physical flash operations issued, either for a single call or in total.
+ */
+typedef struct {
+    uint32_t erases;          // Number of 4 KB sector erases.
+    uint32_t pages_programmed; // Number of 256-byte pages programmed.
+    uint32_t block_erases;    // Number of 64 KB block erases.
+} flash_op_stats;
+
 // Functions for manipulating flash memory
 void flash_write_safe(uint32_t offset, const uint8_t *data, size_t data_len); // Writes data to flash safely.
 void flash_read_safe(uint32_t offset, uint8_t *buffer, size_t buffer_len); // Reads data from flash safely.
 void flash_erase_safe(uint32_t offset); // Erases a sector of flash memory safely.
+int flash_program_safe(uint32_t offset, const uint8_t *data, size_t data_len, flash_op_stats *stats); // Programs bytes, erasing only when unavoidable.
+int flash_erase_sector(uint32_t offset); // Erases one whole sector, leaving it blank.
+int flash_erase_range(uint32_t offset, size_t len); // Erases sectors, using 64 KB block erases where aligned.
+int flash_program_batch(uint32_t offset, const uint8_t *data, size_t len); // Programs whole pages in one interrupt window.
+
+// Running totals of erase and program operations, used to measure flash wear.
+void flash_get_op_stats(flash_op_stats *stats);
+void flash_reset_op_stats(void);
 
  
 #endif // FLASH_OPS_H
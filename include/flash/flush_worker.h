@@ -0,0 +1,46 @@
+/**
+ * @file flush_worker.h
+ *
+ * Header file for the optional background flush worker. Once started, the sector cache no
+ * longer programs evicted sectors itself: it copies each sector image into a lock-free ring
+ * that both cores may fill, and a worker on the second core (a thread on host builds) erases
+ * and programs it. Retired blocks are erased the same way. The core that writes files only pays
+ * for a copy, unless the ring is full.
+ *
+ * Images waiting in the ring are still part of the flash as far as the filesystem is
+ * concerned: reads through the cache see them, and any other erase or program of a sector
+ * waits until the worker is done with it.
+ */
+
+#ifndef FLUSH_WORKER_H
+#define FLUSH_WORKER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../config/flash_config.h"
+
+/**
+ * Counters describing the worker's activity since it was last started.
+ */
+typedef struct {
+    uint32_t submitted;     // Sector images queued, erases included.
+    uint32_t written;       // Images the worker erased or programmed.
+    uint32_t superseded;    // Images skipped because a newer one of the same sector followed.
+    uint32_t full_waits;    // Submissions that had to wait for a free slot.
+    uint32_t max_submit_us; // Longest time one submission took.
+} flush_worker_stats;
+
+int flush_worker_start(void); // Starts the worker; the cache then hands it every write-back.
+void flush_worker_stop(void); // Writes everything queued and stops the worker.
+bool flush_worker_running(void);
+
+void flush_worker_submit(uint32_t sector_offset, const uint8_t *data); // Queues a sector image.
+void flush_worker_submit_erase(uint32_t sector_offset); // Queues an erase of a sector.
+bool flush_worker_read(uint32_t offset, uint8_t *buffer, size_t len); // Reads from a queued image, if any.
+void flush_worker_barrier(uint32_t offset, size_t len); // Waits until nothing queued overlaps a range.
+void flush_worker_drain(void); // Waits until everything queued is on flash.
+
+void flush_worker_get_stats(flush_worker_stats *stats);
+
+#endif // FLUSH_WORKER_H
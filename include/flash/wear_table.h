@@ -0,0 +1,52 @@
+/**
+ * @file wear_table.h
+ *
+ * Header file for the wear table: an erase count for every block of the flash, kept in RAM
+ * and counted by the erase routines in flash_ops.c. The FAT allocator uses it to prefer the
+ * least worn of the free blocks it is about to hand out, so that erases are spread over the
+ * whole device rather than concentrated on the blocks the sweep reaches first.
+ *
+ * The table is saved with every metadata checkpoint and loaded back at mount. Erases since
+ * the last checkpoint are lost on power loss, which only makes the counts slightly low.
+ */
+
+#ifndef WEAR_TABLE_H
+#define WEAR_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../config/flash_config.h"
+
+/**
+ * Where the wear table of a checkpoint is: which copy of each wear sector, with its CRC.
+ * Kept in the metadata journal's checkpoint record.
+ */
+typedef struct {
+    uint8_t copy[(WEAR_SECTORS + 3) & ~3];   // Copy (0 or 1) of each sector.
+    uint32_t crc[WEAR_SECTORS];              // CRC-32 of each sector as written.
+} wear_checkpoint;
+
+/**
+ * Erase counts over the blocks the allocator hands out.
+ */
+typedef struct {
+    uint32_t blocks;    // Blocks counted.
+    uint32_t min;       // Fewest erases of any block.
+    uint32_t max;       // Most erases of any block.
+    uint32_t mean;      // Mean erases per block, rounded down.
+    uint32_t total;     // Erases of all blocks together.
+} wear_stats;
+
+void wear_table_init(void); // Starts every count at zero.
+void wear_table_note_erase(uint32_t offset, size_t len); // Counts an erase of a flash range.
+uint32_t wear_table_count(uint32_t block); // Erase count of a block.
+uint32_t wear_table_max(void); // Erase count of the most worn data block.
+
+int wear_table_save(wear_checkpoint *checkpoint); // Writes the sectors changed since the last save.
+int wear_table_load(const wear_checkpoint *checkpoint); // Loads the counts of a checkpoint.
+
+void wear_table_get_stats(wear_stats *stats);
+uint32_t wear_table_histogram(uint32_t *buckets, uint32_t bucket_count); // Returns the bucket width.
+
+#endif // WEAR_TABLE_H
@@ -0,0 +1,21 @@
+
+
+
+ 
+
+#ifndef BLOCK_LOG_TEST_H
+#define BLOCK_LOG_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_block_log();
+
+void test_block_log_append_fills_payload();
+void test_block_log_overwrite_relocates();
+void test_block_log_file_spans_blocks();
+void test_block_log_bulk_write_benchmark();
+void test_block_log_reserve_extent();
+
+#endif // BLOCK_LOG_TEST_H
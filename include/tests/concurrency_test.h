@@ -0,0 +1,14 @@
+#ifndef CONCURRENCY_TEST_H
+#define CONCURRENCY_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_concurrency();
+
+void test_concurrency_core_cursors();
+void test_concurrency_metadata_while_writing();
+void test_concurrency_two_writer_scaling();
+
+#endif // CONCURRENCY_TEST_H
@@ -0,0 +1,16 @@
+#ifndef COW_TEST_H
+#define COW_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_cow();
+
+void test_cow_copies_are_independent();
+void test_cow_blocks_freed_with_last_copy();
+void test_cow_copy_large_file();
+void test_cow_wipe_keeps_copy();
+void test_cow_copy_is_atomic();
+
+#endif // COW_TEST_H
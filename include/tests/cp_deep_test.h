@@ -0,0 +1,14 @@
+#ifndef CP_DEEP_TEST_H
+#define CP_DEEP_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_cp_deep();
+
+void test_cp_deep_copies_data();
+void test_cp_deep_source_changed();
+void test_cp_deep_benchmark();
+
+#endif // CP_DEEP_TEST_H
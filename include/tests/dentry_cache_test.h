@@ -0,0 +1,14 @@
+#ifndef DENTRY_CACHE_TEST_H
+#define DENTRY_CACHE_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_dentry_cache();
+
+void test_dentry_same_name_in_two_directories();
+void test_dentry_negative_entries();
+void test_dentry_deep_path_latency();
+
+#endif // DENTRY_CACHE_TEST_H
@@ -13,6 +13,9 @@ void run_all_tests_FAT();
 void test_fat_allocate_block();
 void test_fat_free_block();
 void test_fat_link_blocks();
+void test_fat_free_block_count();
+void test_fat_allocate_until_full();
+void test_fat_allocate_extent();
  
 
 #endif // FILESTYSTEM_HELPER_TEST_H
@@ -14,6 +14,9 @@ void test_extract_last_two_parts();
  void test_createFileEntry();
  void test_generateUniqueId();
  void test_save_and_load_FileEntries();
+ void test_file_lookup_benchmark();
+ void test_file_table_growth();
+ void test_name_pool_footprint();
 
 #endif // FILESTYSTEM_HELPER_TEST_H
 
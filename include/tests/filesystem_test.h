@@ -20,5 +20,9 @@ void test_fs_cp_function(void);
 
 void test_fs_rm(void);
 
+void test_fs_map_zero_copy(void);
+
+void test_fs_random_read_benchmark(void);
+
 #endif // FILESTYSTEM_TEST_H
 
@@ -0,0 +1,20 @@
+
+
+
+ 
+
+#ifndef FLASH_CACHE_TEST_H
+#define FLASH_CACHE_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_flash_cache();
+
+void test_flash_cache_read_back();
+void test_flash_cache_coalesces_small_writes();
+void test_flash_cache_lru_eviction();
+void test_flash_cache_sync();
+
+#endif // FLASH_CACHE_TEST_H
@@ -27,7 +27,7 @@
 
 
 // Declaration of function that orchestrates the execution of all defined tests.
-void run_all_tests();
+void run_all_tests_flash_ops();
 
 // Test function for verifying the full cycle of write, read, and erase operations.
 void test_full_cycle_operation();
@@ -54,6 +54,15 @@ void test_null_or_zero_data();
 //reading, and recovering a structured configuration from flash memory.
 void test_save_and_recover_struct();
 
+// Test function for programming into erased flash without an erase.
+void test_program_into_erased_skips_erase();
+
+// Test function for the erase fallback when programmed bits must return to 1.
+void test_program_overwrite_falls_back_to_erase();
+
+// Test function comparing erase counts of many small appends with and without erase skipping.
+void test_append_erase_counts();
+
 
 
 void serialize_device_config(const DeviceConfig *config, uint8_t *buffer);
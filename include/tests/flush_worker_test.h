@@ -0,0 +1,15 @@
+#ifndef FLUSH_WORKER_TEST_H
+#define FLUSH_WORKER_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_flush_worker();
+
+void test_flush_worker_reads_queued_sectors();
+void test_flush_worker_write_latency();
+void test_flush_worker_background_reclaim();
+void test_flush_worker_two_producers();
+
+#endif // FLUSH_WORKER_TEST_H
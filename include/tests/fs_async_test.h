@@ -0,0 +1,15 @@
+#ifndef FS_ASYNC_TEST_H
+#define FS_ASYNC_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_fs_async();
+
+void test_fs_async_completion_order();
+void test_fs_async_merges_requests();
+void test_fs_async_latency_histogram();
+void test_fs_async_two_cores();
+
+#endif // FS_ASYNC_TEST_H
@@ -0,0 +1,15 @@
+#ifndef META_JOURNAL_TEST_H
+#define META_JOURNAL_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_meta_journal();
+
+void test_meta_journal_commit_cost();
+void test_meta_journal_recovery();
+void test_meta_journal_ring_wrap();
+void test_meta_journal_fat_persistence();
+
+#endif // META_JOURNAL_TEST_H
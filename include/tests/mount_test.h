@@ -0,0 +1,15 @@
+#ifndef MOUNT_TEST_H
+#define MOUNT_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_mount();
+
+void test_mount_clean_snapshot();
+void test_mount_after_unclean_shutdown();
+void test_mount_time();
+void test_mount_rejects_bad_superblock();
+
+#endif // MOUNT_TEST_H
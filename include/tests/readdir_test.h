@@ -0,0 +1,14 @@
+#ifndef READDIR_TEST_H
+#define READDIR_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_readdir();
+
+void test_readdir_lists_children();
+void test_readdir_remove_while_listing();
+void test_readdir_benchmark();
+
+#endif // READDIR_TEST_H
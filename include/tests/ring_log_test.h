@@ -0,0 +1,14 @@
+#ifndef RING_LOG_TEST_H
+#define RING_LOG_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_ring_log();
+
+void test_ring_log_append_and_iterate();
+void test_ring_log_overwrites_oldest();
+void test_ring_log_throughput();
+
+#endif // RING_LOG_TEST_H
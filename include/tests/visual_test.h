@@ -0,0 +1,14 @@
+#ifndef VISUAL_TEST_H
+#define VISUAL_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_visual();
+
+void test_du_totals();
+void test_tree_walk_depth_limit();
+void test_tree_walk_large();
+
+#endif // VISUAL_TEST_H
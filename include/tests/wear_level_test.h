@@ -0,0 +1,14 @@
+#ifndef WEAR_LEVEL_TEST_H
+#define WEAR_LEVEL_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_wear_level();
+
+void test_wear_level_moves_cold_block();
+void test_wear_level_abandons_changed_block();
+void test_wear_level_write_latency();
+
+#endif // WEAR_LEVEL_TEST_H
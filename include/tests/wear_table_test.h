@@ -0,0 +1,14 @@
+#ifndef WEAR_TABLE_TEST_H
+#define WEAR_TABLE_TEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+void run_all_tests_wear_table();
+
+void test_wear_table_counts_erases();
+void test_wear_table_survives_mount();
+void test_wear_table_logging_simulation();
+
+#endif // WEAR_TABLE_TEST_H
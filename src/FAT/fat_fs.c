@@ -11,10 +11,15 @@
  * Architecture Highlights:
  * - FAT Array: Central to the filesystem, the FAT array maps data blocks to files, enabling
  *   the tracking of file data across non-contiguous storage blocks.
- * - Thread Safety: Implements mutex-based synchronization to ensure that FAT operations are
- *   safe in a multitasking environment, preventing data corruption during concurrent access.
+ * - Thread Safety: The FAT is split into FAT_REGIONS regions of consecutive blocks, each with
+ *   its own mutex, so that both cores can allocate and free blocks at the same time. Each core
+ *   sweeps for free blocks with its own cursor, and the cursors start in different regions.
+ *   Operations that span the whole FAT (extents, checkpoints, the journal) take every region
+ *   lock, in region order.
  * - Efficient Storage: Includes mechanisms for allocating, freeing, and linking blocks with
  *   minimal fragmentation, enhancing storage efficiency and access speed.
+ * - Free Bitmap: A packed bitmap of free blocks is kept alongside the FAT, so allocation scans
+ *   32 blocks per step from a rotating next-fit cursor and the free block count is always known.
  * - Dynamic Allocation: Features an allocation strategy that prioritizes proximity to hint blocks,
  *   reducing access times and further minimizing fragmentation.
  * - Robust Error Handling: Incorporates comprehensive validation and error handling to maintain
@@ -24,7 +29,8 @@
  * - Initialization (`fat_init`): Prepares the FAT for operation, marking all blocks as free and
  *   reserving system blocks as needed.
  * - Block Allocation (`fat_allocate_block`, `fat_allocate_nearest_block`): Allocates blocks for file storage,
- *   optionally near a hint block for optimized placement.
+ *   optionally near a hint block for optimized placement. Single-block allocations prefer the least
+ *   worn of the next few free blocks, using the erase counts of the wear table.
  * - Block Freeing (`fat_free_block`): Releases blocks back to the free pool when no longer needed.
  * - Block Linking (`fat_link_blocks`): Manages the chaining of blocks to accommodate file data that spans
  *   multiple blocks.
@@ -41,40 +47,355 @@
 #include "../FAT/fat_fs.h"            
 #include <stdio.h>
 #include "hardware/flash.h"   
+#include "hardware/sync.h"
 #include "pico/mutex.h"
 #include "pico/time.h"
 #include <stdlib.h>
 #include <string.h>
 #include "../flash/flash_ops.h"       
+#include "../flash/block_log.h"
+#include "../flash/wear_table.h"
 
 #include "../filesystem/filesystem.h"  
 #include "../config/flash_config.h"    
 
 
-#define ALLOCATE_BLOCK_MAX_RETRIES 3 // Max attempts to allocate a block before giving up
-#define ALLOCATE_BLOCK_RETRY_DELAY_MS 30 // Delay between allocation retries to allow for block freeing
+#define FREE_BITMAP_WORDS ((TOTAL_BLOCKS + 31) / 32)
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
 
 // The FAT table itself, storing the state of each block in the filesystem
 uint32_t FAT[TOTAL_BLOCKS]; 
-static mutex_t fat_mutex; // Mutex for thread-safe access to the FAT
+
+// Packed copy of which blocks are free (bit set = FAT_ENTRY_FREE), kept in step with FAT[]
+// so that a free block can be found 32 entries at a time instead of one by one.
+static uint32_t free_bitmap[FREE_BITMAP_WORDS];
+
+/**
+ * A range of the FAT with its own lock. Regions are made of whole bitmap words, so the
+ * entries, bitmap words and dirty bits of a block are all guarded by its region's mutex.
+ */
+typedef struct {
+    mutex_t mutex;
+    uint32_t first_word;      // First bitmap word of the region.
+    uint32_t end_word;        // One past its last bitmap word.
+    uint32_t free_count;      // Free blocks in the region.
+    bool extents_stale;       // A free bit of the region changed since the extent index was built.
+    fat_region_stats stats;
+} fat_region;
+
+static fat_region regions[FAT_REGIONS];
+static uint32_t core_cursor[FAT_CORES];   // Where fat_allocate_block() looks first, per core.
+
+#if !PICO_ON_DEVICE
+// Host builds run threads in place of cores; each says which core it stands for.
+static _Thread_local uint32_t bound_core = 0;
+#endif
+
+// Index of the runs of consecutive free blocks, used for best-fit extent allocation. It is
+// rebuilt from the bitmap only when needed: any change to the bitmap marks it stale, except
+// for extent allocations, which shrink the chosen run in place.
+typedef struct {
+    uint32_t start;   // First block of the free run.
+    uint32_t length;  // Number of free blocks in the run.
+} free_extent;
+
+#define MAX_FREE_EXTENTS (TOTAL_BLOCKS / 2 + 1) // Worst case: free and used blocks alternate.
+static free_extent free_extents[MAX_FREE_EXTENTS];
+static uint32_t free_extent_count = 0;
+
+// Blocks whose FAT entry changed since the metadata journal last collected them.
+static uint32_t dirty_bitmap[FREE_BITMAP_WORDS];
+
+// References to each block beyond the first. A block of a chain is normally referenced once,
+// by the block before it or by a file's start_block; fs_cp() lets copies of a file share its
+// chain, and the count tells when a block is still used elsewhere. Guarded by the block's
+// region lock, and derived from the FAT and the file table, so it is never saved.
+static uint16_t block_refs[TOTAL_BLOCKS];
+static uint32_t shared_blocks = 0;        // Blocks with a nonzero count.
+
+// Checkpoints store entries packed into 16 bits; packed values from here up stand for the
+// special values, so block numbers have to stay below it.
+#define FAT_PACKED_SPECIAL 0xFFF0
+#if TOTAL_BLOCKS > FAT_PACKED_SPECIAL
+#error "FAT checkpoints pack entries into 16 bits, which limits the flash to 0xFFF0 blocks."
+#endif
+
+// FAT sectors (bit per sector) whose entries changed since the last checkpoint save, and
+// which copy of each sector that save wrote. A sector spans regions, so bits are set atomically.
+static uint32_t dirty_sectors = 0;
+static fat_checkpoint saved_fat;
+static fat_persist_stats persist_stats;
+
+
+// Region holding a block. Regions start at word ceil(r * words / regions), which makes this
+// the inverse of that division.
+static inline fat_region *fat_region_of(uint32_t block) {
+    return &regions[(block / 32) * FAT_REGIONS / FREE_BITMAP_WORDS];
+}
+
+
+// Takes a region's lock, counting the times another core held it.
+static void fat_lock(fat_region *region) {
+    if (!mutex_try_enter(&region->mutex, NULL)) {
+        mutex_enter_blocking(&region->mutex);
+        region->stats.contended++;
+    }
+}
+
+
+static inline void fat_unlock(fat_region *region) {
+    mutex_exit(&region->mutex);
+}
+
+
+// Takes every region lock, in region order, for operations that span the whole FAT.
+static void fat_lock_all(void) {
+    for (uint32_t r = 0; r < FAT_REGIONS; r++) {
+        fat_lock(&regions[r]);
+    }
+}
+
+
+static void fat_unlock_all(void) {
+    for (uint32_t r = FAT_REGIONS; r > 0; r--) {
+        fat_unlock(&regions[r - 1]);
+    }
+}
+
+
+// First block of a region, or of the data area for the region that holds the reserved blocks.
+static uint32_t fat_region_start(const fat_region *region) {
+    uint32_t first = region->first_word * 32;
+    return MAX(first, NUMBER_OF_RESERVED_BLOCKS + METADATA_RESERVED_BLOCKS);
+}
+
+
+// One past the last block of a region.
+static uint32_t fat_region_end(const fat_region *region) {
+    return MIN(region->end_word * 32, TOTAL_BLOCKS);
+}
+
+
+// Records that a block's FAT entry changed. Must be called with the block's region locked.
+static inline void fat_mark_dirty(uint32_t block) {
+    dirty_bitmap[block / 32] |= 1u << (block % 32);
+    __atomic_fetch_or(&dirty_sectors, 1u << (block / FAT_SECTOR_ENTRIES), __ATOMIC_RELAXED);
+}
+
+
+// Records a block as free in the bitmap. Must be called with the block's region locked.
+static inline void fat_mark_free(uint32_t block) {
+    uint32_t mask = 1u << (block % 32);
+    fat_mark_dirty(block);
+    if (!(free_bitmap[block / 32] & mask)) {
+        fat_region *region = fat_region_of(block);
+        free_bitmap[block / 32] |= mask;
+        region->free_count++;
+        region->extents_stale = true;
+    }
+}
+
+
+// Records a block as in use in the bitmap. Must be called with the block's region locked.
+static inline void fat_mark_used(uint32_t block) {
+    uint32_t mask = 1u << (block % 32);
+    fat_mark_dirty(block);
+    if (free_bitmap[block / 32] & mask) {
+        fat_region *region = fat_region_of(block);
+        free_bitmap[block / 32] &= ~mask;
+        region->free_count--;
+        region->extents_stale = true;
+    }
+}
+
+
+/**
+ * Finds the first free block of a region at or after 'start', without wrapping around.
+ * Whole words of the bitmap are skipped when they have no free bit, and the lowest free bit
+ * of a word is found with a count-trailing-zeros instruction. Must be called with the
+ * region locked.
+ *
+ * @return The block number, or FAT_NO_FREE_BLOCKS if no block from 'start' on is free.
+ */
+static uint32_t fat_find_free(const fat_region *region, uint32_t start) {
+    uint32_t end = fat_region_end(region);
+    if (region->free_count == 0 || start >= end) {
+        return FAT_NO_FREE_BLOCKS;
+    }
+
+    uint32_t word = start / 32;
+    // Ignore the bits below 'start' in the first word.
+    uint32_t bits = free_bitmap[word] & (~0u << (start % 32));
+    while (word < region->end_word) {
+        if (bits != 0) {
+            uint32_t block = word * 32 + __builtin_ctz(bits);
+            return (block < end) ? block : FAT_NO_FREE_BLOCKS;
+        }
+        if (++word < region->end_word) {
+            bits = free_bitmap[word];
+        }
+    }
+    return FAT_NO_FREE_BLOCKS;
+}
+
+
+/**
+ * Finds the least worn of the next WEAR_CANDIDATES free blocks of a region at or after
+ * 'start', in the order fat_find_free() would return them. Ties go to the earliest, so with
+ * even wear the allocation order is the same as a plain sweep. Must be called with the
+ * region locked.
+ *
+ * @return The block number, or FAT_NO_FREE_BLOCKS if no block from 'start' on is free.
+ */
+static uint32_t fat_find_least_worn(const fat_region *region, uint32_t start) {
+    uint32_t best = fat_find_free(region, start);
+    if (best == FAT_NO_FREE_BLOCKS) {
+        return FAT_NO_FREE_BLOCKS;
+    }
+    uint32_t bestWear = wear_table_count(best);
+    uint32_t block = best;
+    for (uint32_t seen = 1; seen < WEAR_CANDIDATES; seen++) {
+        block = fat_find_free(region, block + 1);
+        if (block == FAT_NO_FREE_BLOCKS) {
+            break;
+        }
+        uint32_t wear = wear_table_count(block);
+        if (wear < bestWear) {
+            best = block;
+            bestWear = wear;
+        }
+    }
+    return best;
+}
+
+
+/**
+ * Sweeps forward from 'start' for the least worn of the next few free blocks: through the
+ * rest of the region holding 'start', then through the following regions, wrapping around to
+ * the first data block and back to the start, and allocates it as the end of a chain. Only
+ * one region is locked at a time.
+ *
+ * @param start Block to start from.
+ * @return The block number, or FAT_NO_FREE_BLOCKS if the FAT is full.
+ */
+static uint32_t fat_sweep(uint32_t start) {
+    if (start < NUMBER_OF_RESERVED_BLOCKS + METADATA_RESERVED_BLOCKS || start >= TOTAL_BLOCKS) {
+        start = NUMBER_OF_RESERVED_BLOCKS + METADATA_RESERVED_BLOCKS;
+    }
+    fat_region *first = fat_region_of(start);
+    uint32_t firstIndex = first - regions;
+
+    // The last step comes back to the first region, for the blocks before 'start'.
+    for (uint32_t step = 0; step <= FAT_REGIONS; step++) {
+        fat_region *region = &regions[(firstIndex + step) % FAT_REGIONS];
+        uint32_t from = (step == 0) ? start : fat_region_start(region);
+        fat_lock(region);
+        uint32_t block = fat_find_least_worn(region, from);
+        if (block != FAT_NO_FREE_BLOCKS && step == FAT_REGIONS && block >= start) {
+            block = FAT_NO_FREE_BLOCKS;
+        }
+        if (block != FAT_NO_FREE_BLOCKS) {
+            FAT[block] = FAT_ENTRY_END;
+            fat_mark_used(block);
+            region->stats.allocations++;
+            fat_unlock(region);
+            return block;
+        }
+        fat_unlock(region);
+    }
+    return FAT_NO_FREE_BLOCKS;
+}
+
+
+/**
+ * Returns the core the caller runs on, which selects its allocation cursor. On host builds
+ * it is whatever the calling thread was bound to with fat_bind_core().
+ */
+uint32_t fat_current_core(void) {
+#if PICO_ON_DEVICE
+    return get_core_num() % FAT_CORES;
+#else
+    return bound_core;
+#endif
+}
+
+
+/**
+ * Makes the calling thread allocate as if it ran on the given core. Only host builds, where
+ * threads stand in for the two cores, need this; on the RP2040 it does nothing.
+ */
+void fat_bind_core(uint32_t core) {
+#if PICO_ON_DEVICE
+    (void)core;
+#else
+    bound_core = core % FAT_CORES;
+#endif
+}
+
+
+/**
+ * Returns the block where a core's sweep starts after fat_init(): the data area for core 0
+ * and the start of an evenly spaced region for the others, so the cores begin apart.
+ */
+uint32_t fat_core_start_block(uint32_t core) {
+    return fat_region_start(&regions[(core % FAT_CORES) * FAT_REGIONS / FAT_CORES]);
+}
+
+
+/**
+ * Returns the number of free blocks without scanning the FAT.
+ */
+uint32_t fat_free_block_count(void) {
+    uint32_t count = 0;
+    for (uint32_t r = 0; r < FAT_REGIONS; r++) {
+        fat_lock(&regions[r]);
+        count += regions[r].free_count;
+        fat_unlock(&regions[r]);
+    }
+    return count;
+}
 
 // Initializes the FAT system, setting up the filesystem state for use
 void fat_init() {
-    mutex_init(&fat_mutex); // Initialize the mutex for FAT access control
-    mutex_enter_blocking(&fat_mutex); // Ensure exclusive access to the FAT
+    // Split the bitmap into regions and give each a mutex for FAT access control.
+    for (uint32_t r = 0; r < FAT_REGIONS; r++) {
+        mutex_init(&regions[r].mutex);
+        regions[r].first_word = (r * FREE_BITMAP_WORDS + FAT_REGIONS - 1) / FAT_REGIONS;
+        regions[r].end_word = ((r + 1) * FREE_BITMAP_WORDS + FAT_REGIONS - 1) / FAT_REGIONS;
+        regions[r].free_count = 0;
+        memset(&regions[r].stats, 0, sizeof(regions[r].stats));
+    }
+    fat_lock_all(); // Ensure exclusive access to the FAT
 
      // Set all blocks to 'free' state initially
+    memset(free_bitmap, 0, sizeof(free_bitmap));
     for (uint32_t i = 0; i < TOTAL_BLOCKS; i++) {
         FAT[i] = FAT_ENTRY_FREE;
+        fat_mark_free(i);
     }
 
     // Reserve blocks as needed for system use or mark bad blocks
-    for (uint32_t i = 0; i < NUMBER_OF_RESERVED_BLOCKS + 5; i++) {
+    for (uint32_t i = 0; i < NUMBER_OF_RESERVED_BLOCKS + METADATA_RESERVED_BLOCKS; i++) {
         FAT[i] = FAT_ENTRY_RESERVED;
+        fat_mark_used(i);
     }
+    for (uint32_t core = 0; core < FAT_CORES; core++) {
+        core_cursor[core] = fat_core_start_block(core);
+    }
+
+    // A freshly initialized FAT is the baseline the journal records changes against.
+    memset(dirty_bitmap, 0, sizeof(dirty_bitmap));
+    memset(block_refs, 0, sizeof(block_refs));
+    __atomic_store_n(&shared_blocks, 0, __ATOMIC_RELAXED);
 
 
-    mutex_exit(&fat_mutex); // Release the mutex after initializing the FAT
+    fat_unlock_all(); // Release the locks after initializing the FAT
 
     // Log the successful initialization
     printf("FAT initialization complete. Total blocks: %u\n", TOTAL_BLOCKS);
@@ -82,50 +403,26 @@ void fat_init() {
 }
 
 
+/**
+ * Allocates a free block, marking it as the end of a chain. The search starts at the calling
+ * core's cursor, just past its previous allocation (next fit), and uses the free bitmap, so
+ * it does not depend on how many blocks are already in use. Of the first few free blocks
+ * found, the least worn is taken (see fat_find_least_worn()).
+ *
+ * @return The allocated block number, or FAT_NO_FREE_BLOCKS if the FAT is full.
+ */
 uint32_t fat_allocate_block() {
-    uint32_t block = FAT_NO_FREE_BLOCKS;  // Default to no free blocks.
-    int retries = ALLOCATE_BLOCK_MAX_RETRIES;
-
-    while (retries > 0) {
-        mutex_enter_blocking(&fat_mutex); // Secure exclusive access to the FAT.
-
-        // Search for a free block starting after reserved blocks.
-        for (uint32_t i = NUMBER_OF_RESERVED_BLOCKS; i < TOTAL_BLOCKS; i++) {
-            if (FAT[i] == FAT_ENTRY_FREE) {
-                FAT[i] = FAT_ENTRY_END; // Mark found block as the end of a file chain.
-                block = i;  // Record the block number.
-                printf("Allocated block %u\n", block); // Diagnostic log
-                fflush(stdout);
-                break; // Exit the loop upon finding a free block.
-            }
-        }
-
-        mutex_exit(&fat_mutex);  // Release the FAT.
-
-        if (block != FAT_NO_FREE_BLOCKS) {
-            break; // Success, exit the loop.
-        } else {
-            // Retry logic, including a delay to allow for potential block freeing.
-            retries--;
-            printf("Retrying allocation, retries left: %d\n", retries); // Diagnostic log
-            fflush(stdout);
-            if (retries > 0) {
-                // Delay before retrying, if appropriate for the system.
-                // This delay gives time for other threads to potentially free up blocks.
-                sleep_ms(ALLOCATE_BLOCK_RETRY_DELAY_MS);
-            }
-        }
+    // Only this core moves its cursor, so it needs no lock of its own.
+    uint32_t core = fat_current_core();
+    uint32_t block = fat_sweep(core_cursor[core]);
+    if (block != FAT_NO_FREE_BLOCKS) {
+        core_cursor[core] = block + 1;
     }
 
-    if (block == FAT_NO_FREE_BLOCKS && retries == 0) {
-        // After all retries, no free block is available.
-        // Handle error for no free blocks available.
-        printf("Error: No free blocks available in FAT after retries.\n");
+    if (block == FAT_NO_FREE_BLOCKS) {
+        printf("Error: No free blocks available in FAT.\n");
         fflush(stdout);
     }
-    // Print debug message from fat_allocate_block with the allocated block value
-    printf("DEBUG FROM fat_allocate_block: Allocated block: %u\n", block);
-    fflush(stdout);
     return block; // Return the allocated block number or FAT_NO_FREE_BLOCKS if no block was found.
 }
  
@@ -142,14 +439,15 @@ void fat_free_block(uint32_t blockIndex) {
         return;
     }
 
-    // Lock the FAT for exclusive access.
-    mutex_enter_blocking(&fat_mutex);
+    // Lock the block's region of the FAT for exclusive access.
+    fat_region *region = fat_region_of(blockIndex);
+    fat_lock(region);
 
     // Check if the block index is invalid or reserved, but do it inside the mutex to avoid race conditions.
     if (FAT[blockIndex] == FAT_ENTRY_INVALID || FAT[blockIndex] == FAT_ENTRY_RESERVED) {
         printf("Error: Attempted to free a reserved or invalid block (%u).\n", blockIndex);
         fflush(stdout);
-        mutex_exit(&fat_mutex); // Release the mutex before returning.
+        fat_unlock(region); // Release the mutex before returning.
         return;
     }
 
@@ -157,21 +455,57 @@ void fat_free_block(uint32_t blockIndex) {
     if (FAT[blockIndex] == FAT_ENTRY_FREE) {
         printf("Warning: Attempted to free a block that is already free (%u).\n", blockIndex);
         fflush(stdout);
-        mutex_exit(&fat_mutex); // Release the mutex before returning.
+        fat_unlock(region); // Release the mutex before returning.
         return;
     }
 
     // Mark the block as free.
     FAT[blockIndex] = FAT_ENTRY_FREE;
+    fat_mark_free(blockIndex);
 
     // Release the FAT lock.
-    mutex_exit(&fat_mutex);
+    fat_unlock(region);
 
     // Log the freeing of the block.
     printf("Block %u successfully freed.\n", blockIndex);
     fflush(stdout);
 }
 
+
+/**
+ * Marks a block whose contents nothing refers to any more as retired. The entry is journaled
+ * like any other, so a block retired before a power loss is found again by
+ * fat_next_retired_block() after the mount and can still be erased and freed.
+ *
+ * @param blockIndex The block to retire.
+ */
+void fat_retire_block(uint32_t blockIndex) {
+    if (blockIndex < NUMBER_OF_RESERVED_BLOCKS || blockIndex >= TOTAL_BLOCKS) {
+        return;
+    }
+    fat_region *region = fat_region_of(blockIndex);
+    fat_lock(region);
+    FAT[blockIndex] = FAT_ENTRY_RETIRED;
+    fat_mark_used(blockIndex);
+    fat_unlock(region);
+}
+
+
+/**
+ * Returns the first retired block at or after a block.
+ *
+ * @param startBlock Block to start from.
+ * @return The block number, or FAT_ENTRY_END if no retired block follows.
+ */
+uint32_t fat_next_retired_block(uint32_t startBlock) {
+    for (uint32_t block = startBlock; block < TOTAL_BLOCKS; block++) {
+        if (FAT[block] == FAT_ENTRY_RETIRED) {
+            return block;
+        }
+    }
+    return FAT_ENTRY_END;
+}
+
  
 
 
@@ -183,11 +517,12 @@ int fat_get_next_block(uint32_t currentBlock, uint32_t* nextBlock) {
         return FAT_OUT_OF_RANGE; // Block index is out of range
     }
 
-    mutex_enter_blocking(&fat_mutex); // Secure exclusive access to the FAT
+    fat_region *region = fat_region_of(currentBlock);
+    fat_lock(region); // Secure exclusive access to the block's region of the FAT
 
     *nextBlock = FAT[currentBlock]; // Retrieve the next block index from the FAT
 
-    mutex_exit(&fat_mutex); // Release the FAT lock
+    fat_unlock(region); // Release the FAT lock
 
    
     // Handle special FAT entry values
@@ -250,8 +585,13 @@ void fat_link_blocks(uint32_t prevBlock, uint32_t nextBlock) {
     }
 
     printf("Acquiring FAT mutex for linking.\n");
-    // Lock the FAT for exclusive access
-    mutex_enter_blocking(&fat_mutex);
+    // Lock the regions of both blocks for exclusive access, in region order.
+    fat_region *first = fat_region_of(MIN(prevBlock, nextBlock));
+    fat_region *second = fat_region_of(MAX(prevBlock, nextBlock));
+    fat_lock(first);
+    if (second != first) {
+        fat_lock(second);
+    }
 
     // Check if the prevBlock is already linked to another block
     if (FAT[prevBlock] != FAT_ENTRY_FREE && FAT[prevBlock] != FAT_ENTRY_END) {
@@ -261,17 +601,22 @@ void fat_link_blocks(uint32_t prevBlock, uint32_t nextBlock) {
         // For example, you could prevent overwriting or clean up the overwritten chain.
     }
 
-    // Perform the linking
+    // Perform the linking; a free block linked from is in use from now on too.
     FAT[prevBlock] = nextBlock;
+    fat_mark_used(prevBlock);
 
     // If the next block was marked as free, update it to indicate it's now part of a chain
     // This step depends on your specific FAT implementation and might not be necessary
     if (FAT[nextBlock] == FAT_ENTRY_FREE) {
         FAT[nextBlock] = FAT_ENTRY_END;
+        fat_mark_used(nextBlock);
     }
 
-    // Release the FAT lock
-    mutex_exit(&fat_mutex);
+    // Release the FAT locks
+    if (second != first) {
+        fat_unlock(second);
+    }
+    fat_unlock(first);
 
     // Optionally, log the successful linking for debugging or auditing
     printf("Successfully linked block %u to block %u.\n", prevBlock, nextBlock);
@@ -288,13 +633,14 @@ uint32_t fat_allocate_nearest_block(uint32_t hintBlock) {
         return FAT_NO_FREE_BLOCKS; // Indicate failure to allocate
     }
 
-    // Lock the FAT for exclusive access
-    mutex_enter_blocking(&fat_mutex);
+    // The search may go anywhere, so lock the whole FAT.
+    fat_lock_all();
 
     if (FAT[hintBlock] == FAT_ENTRY_FREE) {
         // The hint block itself is free, so use it.
         FAT[hintBlock] = FAT_ENTRY_END; // Mark as the end of a file chain
-        mutex_exit(&fat_mutex); // Release the FAT lock
+        fat_mark_used(hintBlock);
+        fat_unlock_all(); // Release the FAT lock
         return hintBlock;
     }
 
@@ -306,12 +652,14 @@ uint32_t fat_allocate_nearest_block(uint32_t hintBlock) {
         if (checkBlockPrev < TOTAL_BLOCKS && FAT[checkBlockPrev] == FAT_ENTRY_FREE) {
             // Found a free block before the hint block
             FAT[checkBlockPrev] = FAT_ENTRY_END;
-            mutex_exit(&fat_mutex); // Release the FAT lock
+            fat_mark_used(checkBlockPrev);
+            fat_unlock_all(); // Release the FAT lock
             return checkBlockPrev;
         } else if (checkBlockNext < TOTAL_BLOCKS && FAT[checkBlockNext] == FAT_ENTRY_FREE) {
             // Found a free block after the hint block
             FAT[checkBlockNext] = FAT_ENTRY_END;
-            mutex_exit(&fat_mutex); // Release the FAT lock
+            fat_mark_used(checkBlockNext);
+            fat_unlock_all(); // Release the FAT lock
             return checkBlockNext;
         }
 
@@ -321,7 +669,7 @@ uint32_t fat_allocate_nearest_block(uint32_t hintBlock) {
         }
     }
 
-    mutex_exit(&fat_mutex); // Ensure the FAT lock is always released
+    fat_unlock_all(); // Ensure the FAT lock is always released
     printf("Error: No free blocks available near hint block %u.\n", hintBlock);
     fflush(stdout);
     return FAT_NO_FREE_BLOCKS; // Indicate failure to allocate
@@ -330,28 +678,608 @@ uint32_t fat_allocate_nearest_block(uint32_t hintBlock) {
 
 
 
-//first two blocks reserved for this function
-void saveFATEntriesToFileSystem() {
-    uint32_t address = 278528; 
-    printf("Saving file entries to flash memory...\n");
-    uint8_t *serializedData = malloc(sizeof(FAT)); 
-    memcpy(serializedData, FAT, sizeof(FAT)); 
+/**
+ * Allocates a free block at or after a starting block, wrapping around to the first data
+ * block if needed (next-fit), and preferring the least worn of the first few free blocks
+ * found. Unlike fat_allocate_block(), which keeps its own cursor, this lets callers such as
+ * the block log sweep the flash from a position of their own.
+ *
+ * @param startBlock Block number to start searching from.
+ * @return The allocated block number, or FAT_NO_FREE_BLOCKS if the FAT is full.
+ */
+uint32_t fat_allocate_block_from(uint32_t startBlock) {
+    uint32_t block = fat_sweep(startBlock);
+    if (block != FAT_NO_FREE_BLOCKS) {
+        return block;
+    }
+
+    printf("Error: No free blocks available in FAT.\n");
+    fflush(stdout);
+    return FAT_NO_FREE_BLOCKS;
+}
+
+
+/**
+ * Allocates the most worn free block, marking it as the end of a chain. Static wear
+ * levelling moves data that never changes onto such blocks, so they rest while the
+ * little-worn blocks the data leaves behind go back into circulation.
+ *
+ * @param minWear Fewest erases the block must have had.
+ * @return The block number, or FAT_NO_FREE_BLOCKS if no free block is worn that much.
+ */
+uint32_t fat_allocate_worn_block(uint32_t minWear) {
+    fat_lock_all();
+    uint32_t best = FAT_NO_FREE_BLOCKS;
+    uint32_t bestWear = minWear;
+    for (uint32_t word = 0; word < FREE_BITMAP_WORDS; word++) {
+        for (uint32_t bits = free_bitmap[word]; bits != 0; bits &= bits - 1) {
+            uint32_t block = word * 32 + __builtin_ctz(bits);
+            uint32_t wear = wear_table_count(block);
+            if (wear > bestWear || (wear == bestWear && best == FAT_NO_FREE_BLOCKS)) {
+                best = block;
+                bestWear = wear;
+            }
+        }
+    }
+    if (best != FAT_NO_FREE_BLOCKS) {
+        FAT[best] = FAT_ENTRY_END;
+        fat_mark_used(best);
+        fat_region_of(best)->stats.allocations++;
+    }
+    fat_unlock_all();
+    return best;
+}
+
+
+
+
+/**
+ * Rebuilds the free-extent index from the bitmap. Words with no free block, or with every
+ * block free, are handled in one step. Must be called with every region locked.
+ */
+static void fat_rebuild_free_extents(void) {
+    free_extent_count = 0;
+    uint32_t runStart = 0;
+    uint32_t runLength = 0;
+
+    for (uint32_t i = NUMBER_OF_RESERVED_BLOCKS; i < TOTAL_BLOCKS; ) {
+        uint32_t word = free_bitmap[i / 32];
+        if (i % 32 == 0 && (word == 0 || word == ~0u) && i + 32 <= TOTAL_BLOCKS) {
+            if (word == 0) {
+                if (runLength > 0) {
+                    free_extents[free_extent_count++] = (free_extent){ runStart, runLength };
+                    runLength = 0;
+                }
+            } else {
+                if (runLength == 0) {
+                    runStart = i;
+                }
+                runLength += 32;
+            }
+            i += 32;
+            continue;
+        }
+
+        if (word & (1u << (i % 32))) {
+            if (runLength == 0) {
+                runStart = i;
+            }
+            runLength++;
+        } else if (runLength > 0) {
+            free_extents[free_extent_count++] = (free_extent){ runStart, runLength };
+            runLength = 0;
+        }
+        i++;
+    }
+    if (runLength > 0) {
+        free_extents[free_extent_count++] = (free_extent){ runStart, runLength };
+    }
+    for (uint32_t r = 0; r < FAT_REGIONS; r++) {
+        regions[r].extents_stale = false;
+    }
+}
+
+
+// Whether any region changed since the free-extent index was built. Every region must be locked.
+static bool fat_free_extents_stale(void) {
+    for (uint32_t r = 0; r < FAT_REGIONS; r++) {
+        if (regions[r].extents_stale) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Allocates a run of physically consecutive free blocks and links them into a chain, so the
+ * run can be used directly as (part of) a file.
+ *
+ * The run is chosen best fit from the free-extent index: the smallest free run that is long
+ * enough, which keeps large runs intact for large files. A run starting exactly at 'hint' is
+ * preferred when it is long enough, so a file can be extended without breaking contiguity;
+ * among equally good runs, the one closest to the hint wins.
+ *
+ * @param count Number of blocks wanted.
+ * @param hint Preferred first block, e.g. the block after a file's last block.
+ * @return The first block of the run, or FAT_NO_FREE_BLOCKS if no free run is long enough.
+ */
+uint32_t fat_allocate_extent(uint32_t count, uint32_t hint) {
+    if (count == 0 || count > TOTAL_BLOCKS - NUMBER_OF_RESERVED_BLOCKS) {
+        return FAT_NO_FREE_BLOCKS;
+    }
+
+    // A run may cross regions, so the whole FAT is locked.
+    fat_lock_all();
+    uint32_t freeBlocks = 0;
+    for (uint32_t r = 0; r < FAT_REGIONS; r++) {
+        freeBlocks += regions[r].free_count;
+    }
+    if (freeBlocks < count) {
+        fat_unlock_all();
+        return FAT_NO_FREE_BLOCKS;
+    }
+    if (fat_free_extents_stale()) {
+        fat_rebuild_free_extents();
+    }
+
+    // Pick the run: one that starts at the hint wins outright, otherwise best fit.
+    int best = -1;
+    uint32_t bestStart = 0;
+    for (uint32_t e = 0; e < free_extent_count; e++) {
+        free_extent *extent = &free_extents[e];
+        if (extent->length < count) {
+            continue;
+        }
+        if (hint >= extent->start && hint + count <= extent->start + extent->length) {
+            best = e;
+            bestStart = hint;
+            break;
+        }
+        if (best < 0 || extent->length < free_extents[best].length
+            || (extent->length == free_extents[best].length
+                && (extent->start > hint ? extent->start - hint : hint - extent->start)
+                   < (bestStart > hint ? bestStart - hint : hint - bestStart))) {
+            best = e;
+            bestStart = extent->start;
+        }
+    }
+    if (best < 0) {
+        fat_unlock_all();
+        return FAT_NO_FREE_BLOCKS;
+    }
+
+    // Claim and link the blocks.
+    for (uint32_t b = bestStart; b < bestStart + count; b++) {
+        FAT[b] = (b + 1 < bestStart + count) ? b + 1 : FAT_ENTRY_END;
+        fat_mark_used(b);
+    }
+    fat_region_of(bestStart)->stats.allocations++;
+
+    // Update the chosen run in place instead of rebuilding the whole index.
+    free_extent *chosen = &free_extents[best];
+    uint32_t chosenEnd = chosen->start + chosen->length;
+    if (bestStart == chosen->start) {
+        chosen->start += count;
+        chosen->length -= count;
+    } else if (bestStart + count == chosenEnd) {
+        chosen->length -= count;
+    } else if (free_extent_count < MAX_FREE_EXTENTS) {
+        // Taken from the middle: the run splits in two.
+        chosen->length = bestStart - chosen->start;
+        free_extents[free_extent_count++] = (free_extent){ bestStart + count, chosenEnd - (bestStart + count) };
+    } else {
+        // No room to split the run; the index is rebuilt next time.
+        fat_unlock_all();
+        return bestStart;
+    }
+    if (chosen->length == 0) {
+        *chosen = free_extents[--free_extent_count];
+    }
+    for (uint32_t r = 0; r < FAT_REGIONS; r++) {
+        regions[r].extents_stale = false;
+    }
+
+    fat_unlock_all();
+    return bestStart;
+}
+
+
+/**
+ * Allocates a single block from the edge of a free run, so that no run is split: blocks
+ * that move on every write, like metadata pages, then fill the holes between files instead
+ * of cutting up the long runs that large files and the mount snapshot need. Among the edges
+ * worn at most WEAR_EDGE_MARGIN erases more than the least worn one, the edge of the
+ * shortest run wins, and then the least worn.
+ *
+ * @return The block number, marked as the end of a chain, or FAT_NO_FREE_BLOCKS if the FAT
+ *         is full.
+ */
+uint32_t fat_allocate_edge_block(void) {
+    fat_lock_all();
+    if (fat_free_extents_stale()) {
+        fat_rebuild_free_extents();
+    }
+
+    uint32_t leastWear = UINT32_MAX;
+    for (uint32_t e = 0; e < free_extent_count; e++) {
+        const free_extent *extent = &free_extents[e];
+        leastWear = MIN(leastWear, wear_table_count(extent->start));
+        leastWear = MIN(leastWear, wear_table_count(extent->start + extent->length - 1));
+    }
+
+    int best = -1;
+    uint32_t bestBlock = FAT_NO_FREE_BLOCKS;
+    uint32_t bestWear = 0;
+    for (uint32_t e = 0; e < free_extent_count; e++) {
+        const free_extent *extent = &free_extents[e];
+        uint32_t edges[2] = { extent->start, extent->start + extent->length - 1 };
+        for (uint32_t k = 0; k < 2; k++) {
+            uint32_t wear = wear_table_count(edges[k]);
+            if (wear > leastWear + WEAR_EDGE_MARGIN) {
+                continue;
+            }
+            if (best < 0 || extent->length < free_extents[best].length
+                || (extent->length == free_extents[best].length && wear < bestWear)) {
+                best = e;
+                bestBlock = edges[k];
+                bestWear = wear;
+            }
+        }
+    }
+    if (best < 0) {
+        fat_unlock_all();
+        return FAT_NO_FREE_BLOCKS;
+    }
+
+    FAT[bestBlock] = FAT_ENTRY_END;
+    fat_mark_used(bestBlock);
+    fat_region_of(bestBlock)->stats.allocations++;
+
+    // The run only loses an edge, so the index is updated in place.
+    free_extent *chosen = &free_extents[best];
+    if (bestBlock == chosen->start) {
+        chosen->start++;
+    }
+    chosen->length--;
+    if (chosen->length == 0) {
+        *chosen = free_extents[--free_extent_count];
+    }
+    for (uint32_t r = 0; r < FAT_REGIONS; r++) {
+        regions[r].extents_stale = false;
+    }
+    fat_unlock_all();
+    return bestBlock;
+}
+
+
+
+
+/**
+ * Collects the FAT entries that changed since the last call, for the metadata journal.
+ * The entries returned are no longer considered changed.
+ *
+ * @param pairs Receives (block, FAT value) pairs.
+ * @param maxPairs Capacity of pairs.
+ * @return The number of pairs written; fewer than maxPairs once every change is collected.
+ */
+uint32_t fat_collect_dirty(uint32_t *pairs, uint32_t maxPairs) {
+    uint32_t count = 0;
+    fat_lock_all();
+    for (uint32_t word = 0; word < FREE_BITMAP_WORDS && count < maxPairs; word++) {
+        while (dirty_bitmap[word] != 0 && count < maxPairs) {
+            uint32_t bit = __builtin_ctz(dirty_bitmap[word]);
+            uint32_t block = word * 32 + bit;
+            dirty_bitmap[word] &= ~(1u << bit);
+            pairs[2 * count] = block;
+            pairs[2 * count + 1] = FAT[block];
+            count++;
+        }
+    }
+    fat_unlock_all();
+    return count;
+}
+
+
+/**
+ * Forgets every pending FAT change, after a checkpoint has stored the whole FAT.
+ */
+void fat_clear_dirty(void) {
+    fat_lock_all();
+    memset(dirty_bitmap, 0, sizeof(dirty_bitmap));
+    fat_unlock_all();
+}
+
+
+/**
+ * Sets a FAT entry to a value recorded in the metadata journal, keeping the free bitmap in
+ * step. Used while replaying the journal.
+ */
+void fat_set_entry(uint32_t block, uint32_t value) {
+    if (block >= TOTAL_BLOCKS) {
+        return;
+    }
+    fat_lock_all();
+    FAT[block] = value;
+    if (value == FAT_ENTRY_FREE) {
+        fat_mark_free(block);
+    } else {
+        fat_mark_used(block);
+    }
+    dirty_bitmap[block / 32] &= ~(1u << (block % 32));
+    fat_unlock_all();
+}
+
+
+/**
+ * Returns the flash offset of one copy of a FAT sector.
+ */
+static uint32_t fat_sector_offset(uint32_t sector, uint32_t copy) {
+    return (FAT_CHECKPOINT_FIRST_BLOCK + copy * FAT_CHECKPOINT_BLOCKS + sector) * FILESYSTEM_BLOCK_SIZE;
+}
+
+
+/**
+ * Packs a FAT entry into 16 bits. Block numbers fit as they are, and the special values all
+ * lie in the top sixteen values of the 32-bit range, so only their low half is kept.
+ */
+static inline uint16_t fat_pack(uint32_t value) {
+    return (uint16_t)value;
+}
+
+
+/**
+ * Unpacks a FAT entry written by fat_pack().
+ */
+static inline uint32_t fat_unpack(uint16_t packed) {
+    return (packed >= FAT_PACKED_SPECIAL) ? (0xFFFF0000u | packed) : packed;
+}
+
+
+/**
+ * Erases one copy of a FAT sector and programs its entries, packed, a page at a time.
+ * Entries past the end of the FAT are written as free. Must be called with every region locked.
+ *
+ * @param crc Receives the CRC-32 of the sector as written.
+ */
+static int fat_write_sector(uint32_t sector, uint32_t copy, uint32_t *crc) {
+    uint32_t offset = fat_sector_offset(sector, copy);
+    if (flash_erase_range(offset, FILESYSTEM_BLOCK_SIZE) != FLASH_PROGRAM_SUCCESS) {
+        return FAT_CORRUPTED;
+    }
+
+    uint16_t page[FLASH_PAGE_SIZE / sizeof(uint16_t)];
+    uint32_t block = sector * FAT_SECTOR_ENTRIES;
+    *crc = 0;
+    for (uint32_t pageOffset = 0; pageOffset < FILESYSTEM_BLOCK_SIZE; pageOffset += FLASH_PAGE_SIZE) {
+        for (uint32_t i = 0; i < FLASH_PAGE_SIZE / sizeof(uint16_t); i++, block++) {
+            page[i] = fat_pack(block < TOTAL_BLOCKS ? FAT[block] : FAT_ENTRY_FREE);
+        }
+        *crc = block_log_crc32(*crc, (const uint8_t *)page, FLASH_PAGE_SIZE);
+        if (flash_program_safe(offset + pageOffset, (const uint8_t *)page, FLASH_PAGE_SIZE, NULL) != FLASH_PROGRAM_SUCCESS) {
+            return FAT_CORRUPTED;
+        }
+    }
+    return FAT_SUCCESS;
+}
+
+
+/**
+ * Writes every FAT sector that changed since the last save (all of them after fat_init())
+ * into the copy the last save did not use. The copies the last save wrote are left alone,
+ * so the checkpoint that refers to them stays valid until the new one is recorded.
+ *
+ * @param checkpoint Receives the copy and CRC of every FAT sector, to be recorded with the
+ *                   checkpoint and handed to fat_checkpoint_load().
+ * @return FAT_SUCCESS, or FAT_CORRUPTED if a sector could not be written.
+ */
+int fat_checkpoint_save(fat_checkpoint *checkpoint) {
+    uint64_t start = time_us_64();
+    int result = FAT_SUCCESS;
+    uint32_t written = 0;
+
+    fat_lock_all();
+    for (uint32_t sector = 0; sector < FAT_SECTORS; sector++) {
+        if (!(dirty_sectors & (1u << sector))) {
+            continue;
+        }
+        uint32_t copy = ((saved_fat.copies >> sector) & 1) ^ 1;
+        uint32_t crc;
+        if (fat_write_sector(sector, copy, &crc) != FAT_SUCCESS) {
+            printf("Error: Failed to write FAT sector %u.\n", sector);
+            result = FAT_CORRUPTED;
+            break;
+        }
+        saved_fat.copies = (saved_fat.copies & ~(1u << sector)) | (copy << sector);
+        saved_fat.crc[sector] = crc;
+        dirty_sectors &= ~(1u << sector);
+        written++;
+    }
+    *checkpoint = saved_fat;
+    fat_unlock_all();
+
+    persist_stats.saves++;
+    persist_stats.sectors_written += written;
+    persist_stats.bytes_written += written * FILESYSTEM_BLOCK_SIZE;
+    persist_stats.last_save_sectors = written;
+    persist_stats.last_save_us = (uint32_t)(time_us_64() - start);
+    return result;
+}
+
+
+/**
+ * Replaces the FAT with the sectors a checkpoint refers to and rebuilds the free bitmap.
+ * Every sector is checked against its CRC before anything is changed.
+ *
+ * @param checkpoint What fat_checkpoint_save() reported for the checkpoint.
+ * @return FAT_SUCCESS, or FAT_CORRUPTED if a sector does not match its CRC; the FAT is then
+ *         left as it was.
+ */
+int fat_checkpoint_load(const fat_checkpoint *checkpoint) {
+    for (uint32_t sector = 0; sector < FAT_SECTORS; sector++) {
+        uint32_t copy = (checkpoint->copies >> sector) & 1;
+        const uint8_t *data = (const uint8_t *)(XIP_BASE + fat_sector_offset(sector, copy));
+        if (block_log_crc32(0, data, FILESYSTEM_BLOCK_SIZE) != checkpoint->crc[sector]) {
+            printf("Error: FAT sector %u of the checkpoint is corrupted.\n", sector);
+            return FAT_CORRUPTED;
+        }
+    }
+
+    fat_lock_all();
+    for (uint32_t block = 0; block < TOTAL_BLOCKS; block++) {
+        uint32_t sector = block / FAT_SECTOR_ENTRIES;
+        uint32_t copy = (checkpoint->copies >> sector) & 1;
+        const uint16_t *entries = (const uint16_t *)(XIP_BASE + fat_sector_offset(sector, copy));
+        FAT[block] = fat_unpack(entries[block % FAT_SECTOR_ENTRIES]);
+    }
+    // Blocks free before but used in the checkpoint change without fat_mark_used(), so the
+    // free-extent index is rebuilt before it is used again.
+    memset(free_bitmap, 0, sizeof(free_bitmap));
+    for (uint32_t r = 0; r < FAT_REGIONS; r++) {
+        regions[r].free_count = 0;
+        regions[r].extents_stale = true;
+    }
+    for (uint32_t i = 0; i < TOTAL_BLOCKS; i++) {
+        if (FAT[i] == FAT_ENTRY_FREE) {
+            fat_mark_free(i);
+        }
+    }
+    // The FAT now matches the checkpoint, so nothing is pending for the journal or the next save.
+    memset(dirty_bitmap, 0, sizeof(dirty_bitmap));
+    dirty_sectors = 0;
+    saved_fat = *checkpoint;
+    for (uint32_t core = 0; core < FAT_CORES; core++) {
+        core_cursor[core] = fat_core_start_block(core);
+    }
+    fat_unlock_all();
+    return FAT_SUCCESS;
+}
+
+
+/**
+ * Adds a reference to a block that is already referenced, such as the start block of a file
+ * being copied.
+ *
+ * @return 0 on success, or -1 if the block is invalid or its count is at its maximum.
+ */
+int fat_ref_block(uint32_t block) {
+    if (block >= TOTAL_BLOCKS) {
+        return -1;
+    }
+    fat_region *region = fat_region_of(block);
+    fat_lock(region);
+    int result = -1;
+    if (block_refs[block] < UINT16_MAX) {
+        if (block_refs[block]++ == 0) {
+            __atomic_fetch_add(&shared_blocks, 1, __ATOMIC_RELAXED);
+        }
+        result = 0;
+    }
+    fat_unlock(region);
+    return result;
+}
+
+
+/**
+ * Drops a reference to a block, unless it is the last one.
+ *
+ * @return true if the block was shared and has one reference fewer now; false if the
+ *         caller holds its only reference and may free it.
+ */
+bool fat_unref_block(uint32_t block) {
+    if (block >= TOTAL_BLOCKS) {
+        return false;
+    }
+    fat_region *region = fat_region_of(block);
+    fat_lock(region);
+    bool shared = block_refs[block] > 0;
+    if (shared && --block_refs[block] == 0) {
+        __atomic_fetch_sub(&shared_blocks, 1, __ATOMIC_RELAXED);
+    }
+    fat_unlock(region);
+    return shared;
+}
 
-    flash_write_safe(address, serializedData, sizeof(FAT));
 
-    free(serializedData);
-    printf("File entries saved to flash memory.\n");
+/**
+ * Returns true if a block is referenced more than once.
+ */
+bool fat_block_shared(uint32_t block) {
+    if (block >= TOTAL_BLOCKS) {
+        return false;
+    }
+    fat_region *region = fat_region_of(block);
+    fat_lock(region);
+    bool shared = block_refs[block] > 0;
+    fat_unlock(region);
+    return shared;
 }
 
 
-// Function to load file entries from flash memory into a local array
-void loadFATEntriesFromFileSystem() {
-    uint32_t address = 278528; 
-    // Local array to hold the recovered file entries
-    uint32_t recoverFAT[TOTAL_BLOCKS];
+/**
+ * Returns the number of blocks referenced more than once; 0 as long as no file was copied.
+ */
+uint32_t fat_shared_block_count(void) {
+    return __atomic_load_n(&shared_blocks, __ATOMIC_RELAXED);
+}
 
-    // Read data from flash into the local array
-    flash_read_safe(address, (uint8_t*)recoverFAT, sizeof(recoverFAT));
+
+/**
+ * Recounts the references to every block after the FAT has been loaded: one for each link
+ * from another block, and one for each chain head given.
+ *
+ * @param heads The start blocks of every file.
+ * @param count Number of heads.
+ */
+void fat_rebuild_refs(const uint32_t *heads, uint32_t count) {
+    // Referenced once so far; a further reference makes the block shared.
+    uint32_t *seen = calloc(FREE_BITMAP_WORDS, sizeof(uint32_t));
+    if (seen == NULL) {
+        printf("Error: No memory to count block references.\n");
+        return;
+    }
+    fat_lock_all();
+    memset(block_refs, 0, sizeof(block_refs));
+    uint32_t shared = 0;
+    for (uint32_t i = 0; i < TOTAL_BLOCKS + count; i++) {
+        uint32_t block = (i < TOTAL_BLOCKS) ? FAT[i] : heads[i - TOTAL_BLOCKS];
+        if (block >= TOTAL_BLOCKS) {
+            continue;
+        }
+        uint32_t mask = 1u << (block % 32);
+        if (!(seen[block / 32] & mask)) {
+            seen[block / 32] |= mask;
+        } else if (block_refs[block] < UINT16_MAX && block_refs[block]++ == 0) {
+            shared++;
+        }
+    }
+    __atomic_store_n(&shared_blocks, shared, __ATOMIC_RELAXED);
+    fat_unlock_all();
+    free(seen);
+}
+
+
+/**
+ * Copies the counters of one FAT region.
+ */
+void fat_get_region_stats(uint32_t region, fat_region_stats *stats) {
+    if (region >= FAT_REGIONS || stats == NULL) {
+        return;
+    }
+    fat_lock(&regions[region]);
+    *stats = regions[region].stats;
+    fat_unlock(&regions[region]);
+}
+
+
+/**
+ * Copies the FAT checkpoint counters.
+ */
+void fat_get_persist_stats(fat_persist_stats *stats) {
+    *stats = persist_stats;
 }
 
 
+void fat_reset_persist_stats(void) {
+    memset(&persist_stats, 0, sizeof(persist_stats));
+}
@@ -1,53 +1,124 @@
 #include <string.h>
 #include <stdlib.h>
-#include "../config/flash_config.h"    
-#include "../FAT/fat_fs.h"            
-#include "../flash/flash_ops.h"       
-#include "../filesystem/filesystem.h"  
+#include "../config/flash_config.h"
+#include "../FAT/fat_fs.h"
+#include "../flash/flash_ops.h"
+#include "../filesystem/filesystem.h"
+#include "../filesystem/meta_table.h"
+#include "../filesystem/name_pool.h"
 #include "../directory/directories.h"
 #include "../directory/directory_helpers.h"
 #include "../HighLevelAPI/visual.h"
 
 /**
- * Prints the contents of a directory and recursively prints its subdirectories and files.
- * This function handles directory traversal up to a certain depth to prevent stack overflow
- * and ensures that each directory entry is only visited once.
+ * Returns a name as stored, without the leading slash of directory names.
+ */
+static const char* display_name(const name_ref* name) {
+    const char* text = name_pool_peek(name);
+    return (text[0] == '/') ? text + 1 : text;
+}
+
+/**
+ * Counts the files in a directory and their bytes, and prints the directory followed by its
+ * files if asked to. The directory's own list of files is followed, read in place.
  *
- * @param parentDirId The ID of the current directory to print.
- * @param level The current depth in the directory tree for proper indentation.
- * @param visited An array to keep track of visited directories to avoid infinite recursion.
+ * @param directory The directory, read with dir_entry_peek().
+ * @param level The depth of the directory, for indentation.
+ * @param print Whether to print the directory and its files.
+ * @param usage Totals to add the files to.
+ * @return 0, or -1 if the list of files is broken.
  */
-void print_directory(uint32_t parentDirId, int level, bool *visited) {
-    // Prevent going too deep to avoid stack overflow.
-    if (level > 30) {
-        print_indent(level);
-        printf("Maximum recursion level reached, stopping to prevent stack overflow.\n");
-        return;
+static int visit_directory(const DirectoryEntry* directory, int level, bool print, fs_usage* usage) {
+    uint32_t limit = file_entry_count();
+    uint32_t files = 0;
+    uint32_t bytes = 0;
+    uint32_t next = directory->first_file;
+    while (next != 0 && files < limit) {
+        const FileEntry* file = file_entry_peek(next - 1);
+        if (file == NULL || !file->in_use || file->parentDirId != directory->currentDirId) {
+            printf("Error: List of files of directory '%s' is broken.\n", display_name(&directory->name));
+            return -1;
+        }
+        files++;
+        bytes += file->size;
+        next = file->next_sibling;
+    }
+    usage->files += files;
+    usage->bytes += bytes;
+    if (!print) {
+        return 0;
     }
 
-    // Iterate through the FAT to find directory entries.
-    for (uint32_t i = 0; i < TOTAL_BLOCKS; i++) {
-        if (FAT[i] == FAT_ENTRY_END && !visited[i]) {
-            DirectoryEntry dirEntry;
-            flash_read_safe(i * FILESYSTEM_BLOCK_SIZE, (uint8_t*)&dirEntry, sizeof(DirectoryEntry));
+    print_indent(level);
+    printf("--%s (%u files, %u bytes)\n", display_name(&directory->name), files, bytes);
+    next = directory->first_file;
+    for (uint32_t i = 0; i < files; i++) {
+        const FileEntry* file = file_entry_peek(next - 1);
+        print_indent(level + 1);
+        printf("--%s (%u bytes)\n", name_pool_peek(&file->filename), file->size);
+        next = file->next_sibling;
+    }
+    return 0;
+}
 
-            // Check if the directory entry is in use and matches the parent ID.
-            if (dirEntry.in_use && dirEntry.is_directory && dirEntry.parentDirId == parentDirId) {
-                print_indent(level); // Indent the output according to the current directory level.
-                printf("--%s\n", dirEntry.name); // Print the directory name.
-                visited[i] = true; // Mark this directory as visited.
-                print_directory(dirEntry.currentDirId, level + 1, visited); // Recursively print subdirectories.
+/**
+ * Walks the tree below a directory depth first, following each directory's lists of
+ * subdirectories and files. The walk keeps the next subdirectory to visit at each level
+ * in a small array instead of recursing, reads entries in place so that the metadata page
+ * cache is left as it was, and visits each entry once. Called with the tables locked.
+ *
+ * @param top The directory to start from.
+ * @param print Whether to print each directory and its files.
+ * @param usage Receives the directories, files and bytes below top, top's files included.
+ * @return 0, or -1 if the tree is deeper than FS_TREE_MAX_DEPTH or a list is broken; the
+ *         totals then leave out what was skipped.
+ */
+static int walk_tree(const DirectoryEntry* top, bool print, fs_usage* usage) {
+    uint32_t pending[FS_TREE_MAX_DEPTH]; // Next subdirectory at each level, as slot + 1.
+    uint32_t parents[FS_TREE_MAX_DEPTH]; // currentDirId of the directory at each level.
+    uint32_t limit = dir_entry_count();
+    int result = 0;
+    int depth = 0;
+
+    memset(usage, 0, sizeof(fs_usage));
+    pending[0] = top->first_subdir;
+    parents[0] = top->currentDirId;
+    if (visit_directory(top, 0, print, usage) != 0) {
+        result = -1;
+    }
 
-                // Print files within the directory.
-                for (int j = 0; j < MAX_FILES; j++) {
-                    if (fileSystem[j].in_use && !fileSystem[j].is_directory && fileSystem[j].parentDirId == dirEntry.currentDirId) {
-                        print_indent(level + 1);
-                        printf("--%s\n", fileSystem[j].filename); // Print each file name.
-                    }
-                }
-            }
+    while (depth >= 0) {
+        uint32_t next = pending[depth];
+        if (next == 0) {
+            depth--;
+            continue;
         }
+        const DirectoryEntry* child = dir_entry_peek(next - 1);
+        if (child == NULL || !child->in_use || !child->is_directory || child->parentDirId != parents[depth]
+            || usage->directories >= limit) {
+            printf("Error: List of subdirectories is broken at depth %d.\n", depth);
+            pending[depth] = 0;
+            result = -1;
+            continue;
+        }
+        pending[depth] = child->next_sibling;
+        usage->directories++;
+        if (visit_directory(child, depth + 1, print, usage) != 0) {
+            result = -1;
+        }
+        if (child->first_subdir == 0) {
+            continue;
+        }
+        if (depth + 1 >= FS_TREE_MAX_DEPTH) {
+            printf("Maximum depth reached, subdirectories of '%s' skipped.\n", display_name(&child->name));
+            result = -1;
+            continue;
+        }
+        depth++;
+        pending[depth] = child->first_subdir;
+        parents[depth] = child->currentDirId;
     }
+    return result;
 }
 
 /**
@@ -62,20 +133,48 @@ void print_indent(int level) {
 }
 
 /**
- * Initiates the process of printing the entire filesystem's structure starting from the root.
+ * Prints the entire filesystem's structure starting from the root: every directory with the
+ * number of files it holds and their bytes, followed by its files and subdirectories. Reads
+ * only the metadata, which it leaves cached as it was; takes time in proportion to the
+ * number of entries.
  */
 void print_filesystem_structure() {
     printf("Filesystem Structure:\n");
-    bool visited[TOTAL_BLOCKS] = {false}; // Initialize all entries in the visited array to false.
-
-    // Find the root directory to start the printing process.
-    const char* parentPath = "/root";
-    DirectoryEntry* rootDirEntry = DIR_find_directory_entry(parentPath);
-    if (rootDirEntry) {
-        uint32_t rootDirId = rootDirEntry->currentDirId;
-        print_directory(rootDirId, 0, visited); // Start recursive print from the root.
-        free(rootDirEntry); // Free memory if your system allocates memory dynamically.
-    } else {
+    meta_table_lock();
+    DirectoryEntry* root = DIR_find_directory_entry("/root");
+    if (root == NULL) {
         printf("Root directory not found.\n");
+        meta_table_unlock();
+        return;
+    }
+    fs_usage usage;
+    walk_tree(root, true, &usage);
+    meta_table_unlock();
+    printf("%u directories, %u files, %u bytes\n", usage.directories, usage.files, usage.bytes);
+}
+
+/**
+ * Adds up the directories, files and bytes below a directory, like du. Takes time in
+ * proportion to the number of entries below it and reads no file data.
+ *
+ * @param path The path of the directory, such as "/root/logs".
+ * @param usage Receives the totals; the directory itself is not counted among directories.
+ * @return 0 on success, or -1 if the directory does not exist or part of the tree was
+ *         skipped (see walk_tree()).
+ */
+int fs_du(const char* path, fs_usage* usage) {
+    if (usage == NULL) {
+        return -1;
+    }
+    memset(usage, 0, sizeof(fs_usage));
+    meta_table_lock();
+    DirectoryEntry* directory = DIR_find_directory_entry(path);
+    if (directory == NULL) {
+        printf("Error: Directory '%s' not found.\n", path != NULL ? path : "(null)");
+        meta_table_unlock();
+        return -1;
     }
+    int result = walk_tree(directory, false, usage);
+    meta_table_unlock();
+    return result;
 }
@@ -0,0 +1,288 @@
+/**
+ * dentry_cache.c
+ *
+ * Resolves paths one component at a time, through a cache of directory lookups.
+ *
+ * - Directory entries hold their own name ("/a") and the currentDirId of the directory
+ *   they are in. The root directory is the first directory named "/root".
+ * - dentry_lookup() finds a child directory. The cache is checked first; on a miss the
+ *   directory table is scanned and the result stored, including a miss, which is cached
+ *   as a negative entry.
+ * - A cached directory keeps its slot in the directory table and its currentDirId, and is
+ *   only returned if the entry at that slot still has them. Directories are never renamed,
+ *   so only creating one can turn a cached miss wrong: fs_create_directory() drops it.
+ * - A key has a home entry in the table and may be stored in any of the DENTRY_CACHE_PROBE
+ *   entries from there on. When they are all taken, the one used longest ago is replaced.
+ *   Windows of neighbouring homes overlap, so a few keys sharing a home do not evict each
+ *   other, as they would in a set-associative cache of the same size.
+ */
+
+#include <string.h>
+#include <stdio.h>
+
+#include "../config/flash_config.h"
+#include "../directory/directories.h"
+#include "../directory/dentry_cache.h"
+#include "../filesystem/name_pool.h"
+
+
+// Slot of a negative entry: the name is known not to exist under the parent.
+#define DENTRY_NEGATIVE UINT32_MAX
+
+typedef struct {
+    uint32_t parentDirId;
+    uint32_t hash;            // name_pool_hash() of the name as stored, "/a".
+    uint32_t slot;            // Slot in the directory table, or DENTRY_NEGATIVE.
+    uint32_t dirId;           // currentDirId of the directory at the slot.
+    uint32_t last_used;       // Lookup tick of the last hit, for replacement.
+    uint8_t length;           // 0 marks an unused entry.
+    char name[DENTRY_NAME_MAX];
+} dentry;
+
+static dentry cache[DENTRY_CACHE_ENTRIES];
+static uint32_t tick;
+static dentry_cache_stats stats;
+
+
+/**
+ * Empties the cache. Called whenever the directory table is initialized.
+ */
+void dentry_cache_init(void) {
+    memset(cache, 0, sizeof(cache));
+    memset(&stats, 0, sizeof(stats));
+    tick = 0;
+}
+
+
+/**
+ * Writes a name as directory entries store it, with a leading slash, and hashes it.
+ *
+ * @return The length of the stored form, or 0 if the name is empty or too long.
+ */
+static size_t stored_name(const char* name, size_t length, char* stored, uint32_t* hash) {
+    if (name == NULL || length == 0 || length + 1 > NAME_POOL_MAX_LENGTH) {
+        return 0;
+    }
+    stored[0] = '/';
+    memcpy(stored + 1, name, length);
+    stored[length + 1] = '\0';
+    *hash = name_pool_hash(stored, length + 1);
+    return length + 1;
+}
+
+
+static uint32_t dentry_home(uint32_t parentDirId, uint32_t hash) {
+    return ((hash ^ (parentDirId * 2654435761u)) >> 3) % DENTRY_CACHE_ENTRIES;
+}
+
+
+/**
+ * Returns the cache entry of a name under a parent, or NULL if there is none.
+ */
+static dentry* dentry_find(uint32_t parentDirId, const char* name, size_t length, uint32_t hash) {
+    if (length > DENTRY_NAME_MAX) {
+        return NULL;
+    }
+    uint32_t home = dentry_home(parentDirId, hash);
+    for (uint32_t i = 0; i < DENTRY_CACHE_PROBE; i++) {
+        dentry* d = &cache[(home + i) % DENTRY_CACHE_ENTRIES];
+        if (d->length == length && d->hash == hash && d->parentDirId == parentDirId
+            && memcmp(d->name, name, length) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Caches the result of a lookup, replacing the entry of its window used longest ago if
+ * every entry there is taken.
+ */
+static void dentry_store(uint32_t parentDirId, const char* name, size_t length, uint32_t hash,
+                         uint32_t slot, uint32_t dirId) {
+    if (length > DENTRY_NAME_MAX) {
+        return;
+    }
+    uint32_t home = dentry_home(parentDirId, hash);
+    dentry* victim = &cache[home];
+    for (uint32_t i = 0; i < DENTRY_CACHE_PROBE; i++) {
+        dentry* d = &cache[(home + i) % DENTRY_CACHE_ENTRIES];
+        if (d->length == 0) {
+            victim = d;
+            break;
+        }
+        if (d->last_used < victim->last_used) {
+            victim = d;
+        }
+    }
+    if (victim->length != 0) {
+        stats.evictions++;
+    }
+    victim->parentDirId = parentDirId;
+    victim->hash = hash;
+    victim->slot = slot;
+    victim->dirId = dirId;
+    victim->last_used = ++tick;
+    victim->length = (uint8_t)length;
+    memcpy(victim->name, name, length);
+}
+
+
+/**
+ * Drops what the cache holds for a name under a parent, so that the next lookup scans the
+ * directory table. Called when a directory of that name is created.
+ */
+void dentry_cache_forget(uint32_t parentDirId, const char* name, size_t length) {
+    char stored[NAME_POOL_MAX_LENGTH + 1];
+    uint32_t hash;
+    if (stored_name(name, length, stored, &hash) == 0) {
+        return;
+    }
+    dentry* d = dentry_find(parentDirId, name, length, hash);
+    if (d != NULL) {
+        memset(d, 0, sizeof(*d));
+    }
+}
+
+
+/**
+ * Scans the directory table for a directory of a name under a parent. Under
+ * DENTRY_ROOT_PARENT the first directory named "/root" is taken, whatever its parentDirId.
+ */
+static DirectoryEntry* dentry_scan(uint32_t parentDirId, const char* stored, size_t length, uint32_t hash,
+                                   uint32_t* slot) {
+    uint32_t count = dir_entry_count();
+    for (uint32_t i = 0; i < count; i++) {
+        DirectoryEntry* entry = dir_entry_at(i);
+        if (entry != NULL && entry->in_use && entry->is_directory
+            && (parentDirId == DENTRY_ROOT_PARENT || entry->parentDirId == parentDirId)
+            && name_pool_matches(&entry->name, stored, length, hash)) {
+            *slot = i;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Finds a directory by its name and the directory it is in.
+ *
+ * @param parentDirId currentDirId of the directory to look in, or DENTRY_ROOT_PARENT with
+ *                    the name "root" for the root directory.
+ * @param name The directory's name, without slashes; it need not be NUL-terminated.
+ * @param length Length of the name.
+ * @return The directory's entry, or NULL if there is none. Like dir_entry_at(), the pointer
+ *         is only valid until other metadata pages are touched.
+ */
+DirectoryEntry* dentry_lookup(uint32_t parentDirId, const char* name, size_t length) {
+    char stored[NAME_POOL_MAX_LENGTH + 1];
+    uint32_t hash;
+    size_t storedLength = stored_name(name, length, stored, &hash);
+    if (storedLength == 0) {
+        return NULL;
+    }
+
+    dentry* cached = dentry_find(parentDirId, name, length, hash);
+    if (cached != NULL) {
+        cached->last_used = ++tick;
+        if (cached->slot == DENTRY_NEGATIVE) {
+            stats.negative_hits++;
+            return NULL;
+        }
+        DirectoryEntry* entry = dir_entry_at(cached->slot);
+        if (entry != NULL && entry->in_use && entry->is_directory && entry->currentDirId == cached->dirId) {
+            stats.hits++;
+            return entry;
+        }
+        stats.stale++;
+        memset(cached, 0, sizeof(*cached));
+    }
+
+    stats.misses++;
+    uint32_t slot = DENTRY_NEGATIVE;
+    DirectoryEntry* entry = dentry_scan(parentDirId, stored, storedLength, hash, &slot);
+    dentry_store(parentDirId, name, length, hash, slot, entry != NULL ? entry->currentDirId : 0);
+    return entry;
+}
+
+
+/**
+ * Walks the first length bytes of a path from the root directory. Empty components are
+ * skipped, and a first component "root" stands for the root directory itself.
+ */
+static DirectoryEntry* walk(const char* path, size_t length) {
+    DirectoryEntry* directory = dentry_lookup(DENTRY_ROOT_PARENT, "root", 4);
+    const char* at = path;
+    const char* end = path + length;
+    bool first = true;
+    while (directory != NULL) {
+        while (at < end && *at == '/') {
+            at++;
+        }
+        if (at == end) {
+            break;
+        }
+        const char* stop = memchr(at, '/', (size_t)(end - at));
+        if (stop == NULL) {
+            stop = end;
+        }
+        size_t n = (size_t)(stop - at);
+        if (!(first && n == 4 && memcmp(at, "root", 4) == 0)) {
+            directory = dentry_lookup(directory->currentDirId, at, n);
+        }
+        first = false;
+        at = stop;
+    }
+    return directory;
+}
+
+
+/**
+ * Resolves the directory at a path, such as "/root/logs/2024".
+ *
+ * @return The directory's entry, or NULL if a component of the path does not exist.
+ */
+DirectoryEntry* path_walk(const char* path) {
+    if (path == NULL) {
+        return NULL;
+    }
+    return walk(path, strlen(path));
+}
+
+
+/**
+ * Resolves the directory holding the last component of a path, and copies out that
+ * component: "/root/logs/today.txt" gives the directory "logs" and "today.txt". A path
+ * ending in a slash gives an empty last component.
+ *
+ * @param leaf Receives the last component.
+ * @param leaf_size Size of the leaf buffer.
+ * @return The directory's entry, or NULL if it does not exist or the last component does
+ *         not fit in the buffer.
+ */
+DirectoryEntry* path_walk_parent(const char* path, char* leaf, size_t leaf_size) {
+    if (path == NULL || leaf == NULL || leaf_size == 0) {
+        return NULL;
+    }
+    const char* slash = strrchr(path, '/');
+    const char* name = (slash != NULL) ? slash + 1 : path;
+    size_t length = strlen(name);
+    if (length >= leaf_size) {
+        printf("Error: Name '%s' is too long.\n", name);
+        return NULL;
+    }
+    memcpy(leaf, name, length + 1);
+    return walk(path, (slash != NULL) ? (size_t)(slash - path) : 0);
+}
+
+
+/**
+ * Copies out the counters of the cache.
+ */
+void dentry_cache_get_stats(dentry_cache_stats* out) {
+    if (out != NULL) {
+        *out = stats;
+    }
+}
@@ -8,74 +8,119 @@
 #include "../filesystem/filesystem.h"  
 #include "../directory/directories.h"
 #include "../directory/directory_helpers.h"
+#include "../directory/dentry_cache.h"
 #include "../filesystem/filesystem_helper.h"  
+#include "../filesystem/meta_table.h"
+#include "../filesystem/name_pool.h"
+#include "../filesystem/meta_journal.h"
 
 
-// static DirectoryEntry staticDirEntries[MAX_DIRECTORY_ENTRIES];
-DirectoryEntry dirEntries[MAX_DIRECTORY_ENTRIES];
+// Directory entries, stored on flash and paged in on demand; see dir_entry_at().
+static meta_table dir_table;
 
 
 
 /**
- * Initializes all directory entries in the global directory entries array.
+ * Initializes the directory table to an empty state.
  * This function is typically called at the start of the program or when resetting
- * the directory entries to ensure all entries are in a consistent, default state.
- * It sets each directory entry's properties to indicate that they are not in use.
+ * the directory entries. The table grows a page at a time as directories are created,
+ * and new pages are zeroed, which marks each of their entries as not in use. Cached path
+ * lookups refer to the previous table and are dropped.
  */
 void init_directory_entries() {
-    // Iterate through each directory entry in the global directory entries array.
-    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++) {
-        // Set the 'in use' flag to false to indicate the directory entry is not currently used.
-        dirEntries[i].in_use = false;
+    meta_table_init(&dir_table, META_TABLE_DIRECTORIES, sizeof(DirectoryEntry));
+    dentry_cache_init();
+}
 
-        // Set the 'is directory' flag to false as default, although this might be set true later when the directory is actually used.
-        dirEntries[i].is_directory = false;
 
-        // Initialize the name of the directory to an empty string indicating it is unused.
-        dirEntries[i].name[0] = '\0';
+/**
+ * Returns the directory entry at a slot of the directory table, paging it in if needed.
+ *
+ * @param slot Slot number, below dir_entry_count().
+ * @return Pointer to the entry, or NULL if the slot does not exist.
+ */
+DirectoryEntry* dir_entry_at(uint32_t slot) {
+    return (DirectoryEntry*)meta_table_get(&dir_table, slot);
+}
 
-        // Set the parent directory ID to 0, indicating no parent (useful for root or unused entries).
-        dirEntries[i].parentDirId = 0;
 
-        // Set the current directory ID to 0, also indicating no current directory association.
-        dirEntries[i].currentDirId = 0;
+/**
+ * Returns a read-only view of the directory entry at a slot, read in place from flash unless
+ * its page is cached. Meant for scans that only read, such as print_filesystem_structure().
+ */
+const DirectoryEntry* dir_entry_peek(uint32_t slot) {
+    return (const DirectoryEntry*)meta_table_peek(&dir_table, slot);
+}
 
-        // Initialize the size of the directory to 0, typically used to count number of files or total size.
-        dirEntries[i].size = 0;
 
-        // Initialize the start block to 0, which would be used to identify the start of directory data in storage.
-        dirEntries[i].start_block = 0;
-    }
+/**
+ * Returns the number of slots in the directory table, used or not.
+ */
+uint32_t dir_entry_count(void) {
+    return meta_table_capacity(&dir_table);
+}
+
+
+/**
+ * Returns the slot of a directory entry obtained from dir_entry_at().
+ *
+ * @return The slot, or -1 if the pointer is not a resident directory entry.
+ */
+int dir_entry_slot(const DirectoryEntry* entry) {
+    uint32_t slot = meta_table_slot(&dir_table, entry);
+    return (slot == UINT32_MAX) ? -1 : (int)slot;
+}
+
+
+/**
+ * Adds a page of unused entries to the directory table.
+ *
+ * @return 0 on success, or -1 if there is no free block.
+ */
+int dir_table_grow(void) {
+    return meta_table_grow(&dir_table);
 }
 
 
 
  
 /**
- * Attempts to create a new directory with the specified name if it doesn't already exist.
- * This function checks for the existence of a directory before attempting to create it,
- * ensuring that directory names are unique within the filesystem.
+ * Attempts to create a new directory at the specified path if it doesn't already exist.
+ * Every directory of the path but the last has to exist; the new directory is created in
+ * the one the path names last, so "/root/a/x" and "/root/b/x" are different directories.
  *
  * @param directory The path of the directory to create.
  * @return Returns true if the directory was successfully created, false otherwise.
  */
-bool fs_create_directory(const char* directory) {
+static bool fs_create_directory_locked(const char* directory) {
     // Check if the provided directory path is NULL or empty, which is not allowed.
     if (directory == NULL || *directory == '\0') {
         printf("ERROR: Path is NULL or empty.\n");
         return false;  // Return false indicating failure to proceed with an invalid path.
     }
 
-    // Attempt to find an existing directory entry with the same name to prevent duplicates.
-    DirectoryEntry* existingDir = DIR_find_directory_entry(directory);
-    if (existingDir != NULL) {
+    // Find the directory to create it in, and the name of the new directory.
+    char name[NAME_POOL_MAX_LENGTH + 1];
+    DirectoryEntry* parent = path_walk_parent(directory, name, sizeof(name));
+    if (parent == NULL || name[0] == '\0') {
+        printf("ERROR: Parent directory of '%s' not found.\n", directory);
+        return false;
+    }
+    uint32_t parentDirId = parent->currentDirId;
+
+    // Attempt to find an existing directory at the path to prevent duplicates; "/root"
+    // itself is one.
+    size_t length = strlen(name);
+    if (path_walk(directory) != NULL) {
         // If the directory already exists, log an error and prevent creation of a duplicate.
         printf("ERROR: Directory already exists: %s\n", directory);
         return false;  // Return false as the directory cannot be created again.
     }
 
     // If the directory does not exist, proceed to create a new directory entry.
-    DirectoryEntry* entry = createDirectoryEntry(directory);
+    DirectoryEntry* entry = createDirectoryEntry(name, parentDirId);
+    // The lookup above cached the name as missing.
+    dentry_cache_forget(parentDirId, name, length);
     if (entry == NULL) {
         // Log an error if creating the directory entry failed.
         printf("Error: Failed to create directory entry for '%s'.\n", directory);
@@ -83,11 +128,8 @@ bool fs_create_directory(const char* directory) {
         return false;  // Return false indicating that the directory entry creation failed.
     }
 
-    // Calculate the offset in the flash memory where this directory entry should be written.
-    uint32_t offsetInBytes = entry->start_block * FILESYSTEM_BLOCK_SIZE;
-
-    // Write the directory entry to flash storage at the calculated offset.
-    flash_write_safe(offsetInBytes, (const uint8_t*)entry, sizeof(DirectoryEntry));
+    // The entry is part of the directory table; committing it journals just the entry.
+    meta_journal_commit();
 
     // Log a success message indicating that the directory was successfully created.
     printf("SUCCESS: Directory created: %s\n", directory);
@@ -95,6 +137,18 @@ bool fs_create_directory(const char* directory) {
 }
 
 
+/**
+ * Creates a directory while holding the metadata tables exclusively; see
+ * fs_create_directory_locked().
+ */
+bool fs_create_directory(const char* directory) {
+    meta_table_lock();
+    bool created = fs_create_directory_locked(directory);
+    meta_table_unlock();
+    return created;
+}
+
+
 
 
  
@@ -120,9 +174,10 @@ bool reset_root_directory(void) {
     }
 
     // Check if the first directory entry is the root directory and it is in use.
-    if (dirEntries[0].is_directory && strcmp(dirEntries[0].name, "/root") == 0 && dirEntries[0].in_use) {
+    DirectoryEntry* first = dir_entry_at(0);
+    if (first != NULL && first->is_directory && name_pool_equals(&first->name, "/root") && first->in_use) {
         // Perform an integrity check on the existing root directory.
-        if (is_directory_valid(&dirEntries[0])) {
+        if (is_directory_valid(first)) {
             printf("Root directory is valid. No reset needed.\n");
             return true; // Return true if the root directory is already valid.
         } else {
@@ -149,13 +204,16 @@ bool reset_root_directory(void) {
 
     // Prepare the directory entry with appropriate values.
     freeEntry->is_directory = true;
-    strncpy(freeEntry->name, "/root", sizeof(freeEntry->name) - 1);
-    freeEntry->name[sizeof(freeEntry->name) - 1] = '\0'; // Ensure null termination.
+    if (name_pool_set(&freeEntry->name, "/root") != 0) {
+        printf("Failed to store the root directory name.\n");
+        return false;
+    }
     freeEntry->parentDirId = generateUniqueId(); // Set a unique ID for the parent directory ID.
     freeEntry->currentDirId = generateUniqueId(); // Set a unique ID for the current directory ID.
     freeEntry->in_use = true;
     freeEntry->start_block = rootBlock;
     freeEntry->size = 0; // Initialize size to 0 for directories.
+    dentry_cache_forget(DENTRY_ROOT_PARENT, "root", 4);
 
     printf("Root directory (re)initialized at block %u.\n", rootBlock);
     uint32_t flashAddress = rootBlock * FILESYSTEM_BLOCK_SIZE;
@@ -179,4 +237,89 @@ bool reset_root_directory(void) {
 
 
  
- 
\ No newline at end of file
+ 
+
+
+
+/**
+ * Opens a directory for listing. The listing follows the directory's own lists of
+ * subdirectories and files, so it touches only the directory's children, however many
+ * files other directories hold.
+ *
+ * @param path The path of the directory, such as "/root/logs".
+ * @return A handle for fs_readdir(), to be released with fs_closedir(), or NULL if the
+ *         directory does not exist or memory ran out.
+ */
+FS_DIR* fs_opendir(const char* path) {
+    meta_table_lock();
+    DirectoryEntry* directory = DIR_find_directory_entry(path);
+    if (directory == NULL) {
+        printf("Error: Directory '%s' not found.\n", path != NULL ? path : "(null)");
+        meta_table_unlock();
+        return NULL;
+    }
+    FS_DIR* dir = (FS_DIR*)malloc(sizeof(FS_DIR));
+    if (dir == NULL) {
+        printf("Error: Memory allocation failed for FS_DIR.\n");
+        meta_table_unlock();
+        return NULL;
+    }
+    memset(dir, 0, sizeof(FS_DIR));
+    dir->dirId = directory->currentDirId;
+    dir->next_subdir = directory->first_subdir;
+    dir->next_file = directory->first_file;
+    meta_table_unlock();
+    return dir;
+}
+
+
+/**
+ * Returns the next child of an open directory: its subdirectories first, then its files,
+ * each newest first. The following child is found before this one is returned, so the
+ * caller may remove or move the child it was handed and go on listing. If the following
+ * child is removed or moved meanwhile instead, the listing ends early.
+ *
+ * @param dir A handle from fs_opendir().
+ * @return The child, valid until the next call, or NULL after the last one.
+ */
+fs_dirent* fs_readdir(FS_DIR* dir) {
+    if (dir == NULL) {
+        return NULL;
+    }
+    meta_table_lock();
+    fs_dirent* found = NULL;
+    if (dir->next_subdir != 0) {
+        DirectoryEntry* child = dir_entry_at(dir->next_subdir - 1);
+        dir->next_subdir = 0;
+        if (child != NULL && child->in_use && child->is_directory && child->parentDirId == dir->dirId) {
+            dir->next_subdir = child->next_sibling;
+            dir->entry.is_directory = true;
+            dir->entry.size = 0;
+            // Directory names are stored with a leading slash; see createDirectoryEntry().
+            const char* name = name_pool_str(&child->name);
+            snprintf(dir->entry.name, sizeof(dir->entry.name), "%s", name[0] == '/' ? name + 1 : name);
+            found = &dir->entry;
+        }
+    }
+    if (found == NULL && dir->next_file != 0) {
+        FileEntry* file = file_entry_at(dir->next_file - 1);
+        dir->next_file = 0;
+        if (file != NULL && file->in_use && !file->is_directory && file->parentDirId == dir->dirId) {
+            dir->next_file = file->next_sibling;
+            dir->entry.is_directory = false;
+            dir->entry.size = file->size;
+            snprintf(dir->entry.name, sizeof(dir->entry.name), "%s", name_pool_str(&file->filename));
+            found = &dir->entry;
+        }
+    }
+    meta_table_unlock();
+    return found;
+}
+
+
+/**
+ * Releases a handle from fs_opendir().
+ */
+void fs_closedir(FS_DIR* dir) {
+    free(dir);
+}
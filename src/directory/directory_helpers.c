@@ -6,11 +6,11 @@
  * save, and load directory entries, which are essential for maintaining the directory
  * structure of the filesystem. Functions in this file handle tasks such as:
  *
- * - Creating new directory entries in the global directory entries array.
- * - Finding free entries in the directory entries array for new directories.
+ * - Creating new directory entries in the paged directory table.
+ * - Finding free entries in the directory table for new directories.
  * - Validating the integrity of directory entries.
- * - Saving all directory entries to a specific location in flash memory.
- * - Loading directory entries from flash memory into a local array.
+ * - Writing changed directory entries back to flash memory.
+ * - Listing the directory entries stored in flash memory.
  * - Displaying all active directory entries for debugging and system monitoring.
  *
  * The utilities provided here are crucial for the filesystem's operation, ensuring
@@ -34,59 +34,81 @@
 #include "../filesystem/filesystem.h"  
 #include "../directory/directories.h"
 #include "../filesystem/filesystem_helper.h" 
+#include "../filesystem/meta_table.h"
+#include "../filesystem/name_pool.h"
 
 #include "../directory/directory_helpers.h"
+#include "../directory/dentry_cache.h"
 
 
 
  
 
 /**
- * Creates a new directory entry for a given path in the filesystem's directory entries array.
- * This function searches for an unused directory entry and sets it up with the specified path,
- * handling interruptions and ensuring thread safety during its operations.
+ * Creates a new directory entry in the directory table. This function searches for an
+ * unused directory entry and sets it up with the specified name and parent.
  *
- * @param path The filesystem path for the new directory.
+ * @param name The name of the new directory, without slashes.
+ * @param parentDirId The currentDirId of the directory to create it in; 0 stands for the
+ *                    root directory.
  * @return Pointer to the newly created DirectoryEntry if successful, NULL if unsuccessful.
  */
-DirectoryEntry* createDirectoryEntry(const char* path) {
-    // Iterate through the directory entries to find an unused entry.
-    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++) {
-        if (!dirEntries[i].in_use) { // Check if the entry is not currently used.
-            // Get the ID of the root directory to set as the parent directory ID.
-            uint32_t rootDirId = get_root_directory_id();
-
-            // Copy the provided path into the directory entry's name field.
-            strncpy(dirEntries[i].name, path, sizeof(dirEntries[i].name) - 1);
-            dirEntries[i].name[sizeof(dirEntries[i].name) - 1] = '\0'; // Ensure null termination.
-
-            // Set the directory specific fields.
-            dirEntries[i].parentDirId = rootDirId;
-            dirEntries[i].currentDirId = generateUniqueId(); // Generate a unique ID for the new directory.
-            dirEntries[i].is_directory = true;
-            dirEntries[i].start_block = fat_allocate_block(); // Allocate a block for the directory.
-            dirEntries[i].in_use = true;
-            dirEntries[i].size = 0; // Initialize size to 0, usually used for files.
-
-            // Check if a block could not be allocated.
-            if (dirEntries[i].start_block == FAT_NO_FREE_BLOCKS) {
-                printf("Error: No space left on device to create new file.\n");
-                memset(&dirEntries[i], 0, sizeof(DirectoryEntry)); // Clean up the entry.
-                dirEntries[i].in_use = false; // Mark it as not in use.
-          
-                return NULL;
-            }
-
-            // Successfully created the directory entry, restore interrupts and return the entry.
-      
-            return &dirEntries[i];
-        }
+DirectoryEntry* createDirectoryEntry(const char* name, uint32_t parentDirId) {
+    // Directories are created in the root directory unless told otherwise. This looks up
+    // the directory table, so it is done before a free entry is picked.
+    if (parentDirId == 0) {
+        parentDirId = get_root_directory_id();
     }
 
-    // If all entries are in use, log an error and restore interrupts.
-    printf("Error: dirEntries is full, cannot create new file.\n");
+    // Entries store the name with a leading slash, as the root directory's "/root".
+    char stored[NAME_POOL_MAX_LENGTH + 1];
+    prepend_slash(name, stored, sizeof(stored));
 
-    return NULL;
+    // Find an unused entry, growing the directory table if every entry is in use.
+    DirectoryEntry* entry = find_free_directory_entry();
+    if (entry == NULL) {
+        printf("Error: Directory table is full, cannot create new directory.\n");
+        return NULL;
+    }
+
+    // Store the name in the directory entry. This may page in parts of the name pool, so
+    // the entry is pinned meanwhile.
+    meta_table_pin(entry);
+    int named = name_pool_set(&entry->name, stored);
+    meta_table_unpin(entry);
+    if (named != 0) {
+        printf("Error: No space left to store the name of '%s'.\n", name);
+        return NULL;
+    }
+
+    // Set the directory specific fields.
+    entry->parentDirId = parentDirId;
+    entry->currentDirId = generateUniqueId(); // Generate a unique ID for the new directory.
+    entry->is_directory = true;
+    entry->start_block = fat_allocate_block(); // Allocate a block for the directory.
+    entry->in_use = true;
+    entry->size = 0; // Initialize size to 0, usually used for files.
+
+    // Check if a block could not be allocated.
+    if (entry->start_block == FAT_NO_FREE_BLOCKS) {
+        printf("Error: No space left on device to create new file.\n");
+        name_pool_clear(&entry->name);
+        memset(entry, 0, sizeof(DirectoryEntry)); // Clean up the entry.
+        entry->in_use = false; // Mark it as not in use.
+        return NULL;
+    }
+
+    // List the new directory among its parent's subdirectories.
+    entry->first_file = 0;
+    entry->first_subdir = 0;
+    int slot = dir_entry_slot(entry);
+    if (slot >= 0) {
+        dir_link_directory((uint32_t)slot);
+        // Linking touched other entries; fetch the new one again.
+        entry = dir_entry_at((uint32_t)slot);
+    }
+
+    return entry;
 }
 
  
@@ -122,22 +144,24 @@ uint32_t get_root_directory_id() {
  * It is particularly useful for debugging and ensuring the integrity of directory data.
  */
 void DIR_all_directory_entries(void) {
-    // Iterate through the array of directory entries.
-    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++) {
+    // Iterate through the directory table, paging it in as needed.
+    uint32_t count = dir_entry_count();
+    for (uint32_t i = 0; i < count; i++) {
+        DirectoryEntry* entry = dir_entry_at(i);
         // Check if the current entry is in use and is a directory.
-        if (dirEntries[i].in_use && dirEntries[i].is_directory) {
+        if (entry != NULL && entry->in_use && entry->is_directory) {
             // Print a header for the entry to distinguish it clearly in output.
-            printf("\n\nEntry %d is a directory\n", i);
+            printf("\n\nEntry %u is a directory\n", i);
 
             // Print detailed information about the directory entry.
-            printf("Directory entry %d: %s\n", i, dirEntries[i].name);
-            printf("Parent Directory ID: %u\n", dirEntries[i].parentDirId);
-            printf("Current Directory ID: %u\n", dirEntries[i].currentDirId);
-            printf("Start block: %u\n", dirEntries[i].start_block);
-            printf("Directory size: %u bytes\n", dirEntries[i].size);
-            printf("Directory entry index: %d\n", i);
-            printf("in_use: %d\n", dirEntries[i].in_use);
-            printf("is_directory: %d\n", dirEntries[i].is_directory);
+            printf("Directory entry %u: %s\n", i, name_pool_str(&entry->name));
+            printf("Parent Directory ID: %u\n", entry->parentDirId);
+            printf("Current Directory ID: %u\n", entry->currentDirId);
+            printf("Start block: %u\n", entry->start_block);
+            printf("Directory size: %u bytes\n", entry->size);
+            printf("Directory entry index: %u\n", i);
+            printf("in_use: %d\n", entry->in_use);
+            printf("is_directory: %d\n", entry->is_directory);
 
             // Flush the output to ensure it appears immediately in the console or log file.
             fflush(stdout);
@@ -151,50 +175,154 @@ void DIR_all_directory_entries(void) {
 
  
 /**
- * Searches for an unused directory entry within the global directory entries array.
- * This function iterates through the array of directory entries and returns the first one
- * that is not currently in use, allowing it to be utilized for a new directory.
+ * Searches for an unused directory entry within the directory table.
+ * This function iterates through the table and returns the first entry that is not
+ * currently in use, allowing it to be utilized for a new directory. If every entry is
+ * in use, the table is grown by a page and the first new entry is returned.
  *
- * @return A pointer to an unused DirectoryEntry if one is found, or NULL if all entries are in use.
+ * @return A pointer to an unused DirectoryEntry, or NULL if the table cannot grow.
  */
 DirectoryEntry* find_free_directory_entry(void) {
-    // Iterate over each directory entry in the global 'dirEntries' array.
-    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++) {
+    // Iterate over each directory entry in the directory table.
+    uint32_t count = dir_entry_count();
+    for (uint32_t i = 0; i < count; i++) {
+        DirectoryEntry* entry = dir_entry_at(i);
         // Check if the current directory entry is marked as not in use.
-        if (!dirEntries[i].in_use) {
+        if (entry != NULL && !entry->in_use) {
             // If an unused entry is found, return a pointer to this directory entry.
-            // This entry can then be used to create a new directory or for other purposes.
-            return &dirEntries[i];
+            return entry;
+        }
+    }
+    // No unused entry is left, so add a page of them.
+    if (dir_table_grow() != 0) {
+        return NULL;
+    }
+    return dir_entry_at(count);
+}
+
+
+/**
+ * Finds a directory by its currentDirId, scanning the directory table. Directories are few
+ * next to files, so this is cheap compared with scanning the file table.
+ *
+ * @return Pointer to the directory's entry, or NULL if there is none.
+ */
+DirectoryEntry* dir_find_by_id(uint32_t dirId) {
+    uint32_t count = dir_entry_count();
+    for (uint32_t i = 0; i < count; i++) {
+        DirectoryEntry* entry = dir_entry_at(i);
+        if (entry != NULL && entry->in_use && entry->is_directory && entry->currentDirId == dirId) {
+            return entry;
         }
     }
-    // If no unused directory entry is found after checking all entries, return NULL.
-    // This indicates that there are no available slots left for new directories.
     return NULL;
 }
 
 
-DirectoryEntry* DIR_find_directory_entry(const char* directoryName) {
-    printf("\n\nENTERED DIR_find_directory_entry\n");
-    printf("Directory name: %s\n", directoryName);
-    fflush(stdout);
-    if(directoryName == NULL) {
-        printf("Directory name is NULL.\n");
-        return NULL;
+/**
+ * Adds a file to the front of its parent directory's list of files, so that fs_readdir()
+ * finds it without scanning the file table. The entry's parentDirId must be set. Files in
+ * a directory that does not exist are left out of every list.
+ *
+ * @param fileSlot Slot of the file in the file table.
+ */
+void dir_link_file(uint32_t fileSlot) {
+    FileEntry* file = file_entry_at(fileSlot);
+    if (file == NULL) {
+        return;
     }
+    // Each list step touches another page, so the entries in use are pinned meanwhile.
+    meta_table_pin(file);
+    file->next_sibling = 0;
+    file->prev_sibling = 0;
+    DirectoryEntry* directory = dir_find_by_id(file->parentDirId);
+    if (directory != NULL) {
+        meta_table_pin(directory);
+        uint32_t head = directory->first_file;
+        FileEntry* next = (head != 0) ? file_entry_at(head - 1) : NULL;
+        if (next != NULL) {
+            next->prev_sibling = fileSlot + 1;
+            file->next_sibling = head;
+        }
+        directory->first_file = fileSlot + 1;
+        meta_table_unpin(directory);
+    }
+    meta_table_unpin(file);
+}
 
-    char path[512]; // Define a sufficiently large buffer for the path
-    prepend_slash(directoryName, path, sizeof(path));
-    printf("Prepended path: %s\n", path);
 
-    for (uint32_t i = 0; i < MAX_DIRECTORY_ENTRIES; i++) {
-        if (dirEntries[i].in_use && dirEntries[i].is_directory && strcmp(dirEntries[i].name, path) == 0) {
-            printf("Directory entry found: %s\n", path);
-            fflush(stdout);
-            return &dirEntries[i]; // Return a pointer to the existing entry
+/**
+ * Takes a file out of its parent directory's list of files. Called before the file is
+ * removed or moved to another directory.
+ *
+ * @param fileSlot Slot of the file in the file table.
+ */
+void dir_unlink_file(uint32_t fileSlot) {
+    FileEntry* file = file_entry_at(fileSlot);
+    if (file == NULL) {
+        return;
+    }
+    meta_table_pin(file);
+    uint32_t prev = file->prev_sibling;
+    uint32_t next = file->next_sibling;
+    if (prev != 0) {
+        FileEntry* before = file_entry_at(prev - 1);
+        if (before != NULL) {
+            before->next_sibling = next;
+        }
+    } else {
+        DirectoryEntry* directory = dir_find_by_id(file->parentDirId);
+        if (directory != NULL && directory->first_file == fileSlot + 1) {
+            directory->first_file = next;
         }
     }
-    fflush(stdout);
-    return NULL;
+    if (next != 0) {
+        FileEntry* after = file_entry_at(next - 1);
+        if (after != NULL) {
+            after->prev_sibling = prev;
+        }
+    }
+    file->next_sibling = 0;
+    file->prev_sibling = 0;
+    meta_table_unpin(file);
+}
+
+
+/**
+ * Adds a directory to the front of its parent's list of subdirectories. Directories are
+ * never removed one at a time, so the list only ever grows.
+ *
+ * @param dirSlot Slot of the directory in the directory table.
+ */
+void dir_link_directory(uint32_t dirSlot) {
+    DirectoryEntry* child = dir_entry_at(dirSlot);
+    if (child == NULL) {
+        return;
+    }
+    meta_table_pin(child);
+    child->next_sibling = 0;
+    DirectoryEntry* parent = dir_find_by_id(child->parentDirId);
+    if (parent != NULL && parent != child) {
+        child->next_sibling = parent->first_subdir;
+        parent->first_subdir = dirSlot + 1;
+    }
+    meta_table_unpin(child);
+}
+
+
+/**
+ * Finds a directory by its path, walking the path one component at a time; see
+ * path_walk(). "/root" is the root directory, and "/logs" the same as "/root/logs".
+ *
+ * @param directoryName The path of the directory.
+ * @return Pointer to the directory's entry, or NULL if it does not exist.
+ */
+DirectoryEntry* DIR_find_directory_entry(const char* directoryName) {
+    if(directoryName == NULL) {
+        printf("Directory name is NULL.\n");
+        return NULL;
+    }
+    return path_walk(directoryName);
 }
 
 
@@ -234,69 +362,35 @@ bool is_directory_valid(const DirectoryEntry* directory) {
 
 
 /**
- * Saves all directory entries to a specific location in flash memory.
- * This function serializes the global directory entries array and writes it to a fixed
- * address in flash memory, ensuring that directory state is preserved across system restarts.
- *
- * @note The first two blocks of memory starting at the specified address are reserved for this operation.
+ * Saves all directory entries to flash memory.
+ * The directory table already lives on flash in its own chain of blocks, so this writes
+ * back every cached page that has changed, ensuring that directory state is preserved
+ * across system restarts.
  */
 void saveDirectoriesEntriesToFileSystem() {
-    // Specify the flash memory address where the directory entries will be stored.
-    uint32_t address = 270336;
-    printf("Saving file entries to flash memory...\n");
-
-    // Allocate memory for serialization of the directory entries.
-    // This assumes that the directory entries can be serialized directly as a byte array.
-    uint8_t *serializedData = malloc(sizeof(dirEntries));
-    if (!serializedData) {
-        printf("Failed to allocate memory for directory entries serialization.\n");
-        return; // Early return on memory allocation failure.
+    printf("Saving directory entries to flash memory...\n");
+    if (meta_table_sync() != 0) {
+        printf("Failed to write back the directory table.\n");
+        return;
     }
-
-    // Copy the directory entries from the global array into the allocated buffer.
-    // This essentially serializes the data if the structure allows for direct binary copying.
-    memcpy(serializedData, dirEntries, sizeof(dirEntries));
-
-    // Write the serialized data to flash memory at the specified address.
-    // The function `flash_write_safe` should ensure proper handling of flash-specific operations like sector erase before writing.
-    flash_write_safe(address, serializedData, sizeof(dirEntries));
-
-    // Free the allocated memory after the write operation to prevent memory leaks.
-    free(serializedData);
-
-    // Confirm that the directory entries have been saved to flash memory.
-    printf("File entries saved to flash memory.\n");
+    printf("Directory entries saved to flash memory.\n");
 }
 
 
 
 /**
- * Loads directory entries from flash memory into a local array.
- * This function reads directory entry data from a specified address in flash memory,
- * populating a local array with the recovered data. It's typically used during system
- * startup or recovery to restore the state of directory entries.
+ * Lists the directory entries stored in flash memory.
+ * This function walks the directory table, paging it in from flash as needed, and prints
+ * every entry in use. It is useful for debugging and during system verification.
  */
 void loadDirectoriesEntriesFromFileSystem() {
-    // Address in flash memory where the directory entries are stored.
-    //270336 / 4096 = block 66
-    uint32_t address = 270336;
-
-    // Local array to temporarily hold the directory entries recovered from flash memory.
-    DirectoryEntry recoverDirSystem[MAX_DIRECTORY_ENTRIES];
-
-    // Perform the read operation from flash memory into the local array.
-    // Ensure that the operation is performed safely to avoid data corruption.
-    flash_read_safe(address, (uint8_t*)recoverDirSystem, sizeof(recoverDirSystem));
-
-    // Optionally, iterate over the loaded directory entries to verify the integrity and correctness of the data.
-    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++) {
-        // Print each recovered directory entry's name to verify data has been loaded correctly.
-        // This is particularly useful for debugging and during system verification.
-        printf("Recovered Directory Entry %d: %s\n", i, recoverDirSystem[i].name);
+    uint32_t count = dir_entry_count();
+    for (uint32_t i = 0; i < count; i++) {
+        DirectoryEntry* entry = dir_entry_at(i);
+        if (entry != NULL && entry->in_use) {
+            printf("Recovered Directory Entry %u: %s\n", i, name_pool_str(&entry->name));
+        }
     }
-
-    // Additional logic can be implemented here to further process or integrate the loaded data
-    // into the running application, depending on system requirements.
 }
 
 
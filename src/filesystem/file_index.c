@@ -0,0 +1,367 @@
+/**
+ * @file file_index.c
+ *
+ * This module keeps the in-RAM lookup indexes of the file table.
+ *
+ * - Two open-addressing hash tables map keys to file table slots: one by parent directory
+ *   and name, one by unique file ID. Both use linear probing; removals leave deleted slots
+ *   behind, and the tables are rebuilt once too many have piled up.
+ * - Per-entry arrays keep each indexed entry's name hash and ID, so that lookups only page
+ *   in entries whose hash matches, and rehashing pages in nothing.
+ * - The tables grow with the file table and stay at most half full.
+ * - The per-entry arrays are saved in the mount snapshot; the hash tables are rebuilt from
+ *   them when it is loaded.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "../filesystem/filesystem.h"
+#include "../filesystem/file_index.h"
+#include "../filesystem/name_pool.h"
+#include "../filesystem/meta_journal.h"
+
+
+// Values of a hash table slot that does not refer to a file entry. A deleted slot keeps probe
+// sequences running past it, an empty one ends them.
+#define FILE_INDEX_EMPTY -1
+#define FILE_INDEX_DELETED -2
+
+// The tables grow with the file table: index_entries tracks file_entry_count() and
+// index_slots is kept at least twice that, so both tables stay at most half full.
+static int32_t *name_slots;      // File table slot numbers by (parentDirId, name).
+static int32_t *id_slots;        // File table slot numbers by unique_file_id.
+static uint32_t *name_hashes;    // Name hash of each indexed entry, checked before strcmp.
+static uint32_t *ids;            // unique_file_id of each indexed entry, so rehashing needs no page-ins.
+static bool *indexed;            // Whether each entry is currently in the indexes.
+static uint32_t index_entries;   // File table slots the per-entry arrays cover.
+static uint32_t index_slots;     // Slots in each hash table.
+static uint32_t deleted_slots;   // Removals since the hash tables were last rebuilt.
+
+/**
+ * Header of the indexes as saved in a mount snapshot. The per-entry arrays follow it; the
+ * hash tables are not saved, as they are rebuilt from those arrays in RAM.
+ */
+typedef struct {
+    uint32_t entries;
+} index_snapshot_header;
+
+
+/**
+ * Returns the name a file is stored and looked up under. Names are kept without a leading
+ * slash, so "/notes.txt" and "notes.txt" refer to the same file.
+ *
+ * @param name A file name, with or without a leading slash.
+ * @return Pointer into name past any leading slash.
+ */
+const char* file_index_key(const char* name) {
+    return (name[0] == '/') ? name + 1 : name;
+}
+
+
+/**
+ * Mixes the name_pool_hash() of a file name with its parent directory.
+ */
+static uint32_t hash_name(uint32_t nameHash, uint32_t parentDirId) {
+    return (nameHash ^ parentDirId) * 16777619u;
+}
+
+
+/**
+ * Spreads the bits of a unique file ID, which is random but not necessarily uniform in its
+ * low bits.
+ */
+static uint32_t hash_id(uint32_t id) {
+    id ^= id >> 16;
+    id *= 0x45d9f3bu;
+    id ^= id >> 16;
+    return id;
+}
+
+
+/**
+ * Puts a file entry into the first free or deleted slot of a table's probe sequence.
+ */
+static void table_insert(int32_t *table, uint32_t hash, int fileIndex) {
+    uint32_t slot = hash % index_slots;
+    while (table[slot] >= 0) {
+        slot = (slot + 1) % index_slots;
+    }
+    table[slot] = fileIndex;
+}
+
+
+/**
+ * Marks the slot holding a file entry as deleted.
+ */
+static void table_remove(int32_t *table, uint32_t hash, int fileIndex) {
+    uint32_t slot = hash % index_slots;
+    for (uint32_t probes = 0; probes < index_slots && table[slot] != FILE_INDEX_EMPTY; probes++) {
+        if (table[slot] == fileIndex) {
+            table[slot] = FILE_INDEX_DELETED;
+            return;
+        }
+        slot = (slot + 1) % index_slots;
+    }
+}
+
+
+/**
+ * Empties both hash tables and inserts every indexed entry again from the per-entry
+ * arrays, without touching the file table itself.
+ */
+static void rehash(void) {
+    for (uint32_t i = 0; i < index_slots; i++) {
+        name_slots[i] = FILE_INDEX_EMPTY;
+        id_slots[i] = FILE_INDEX_EMPTY;
+    }
+    deleted_slots = 0;
+    for (uint32_t i = 0; i < index_entries; i++) {
+        if (indexed[i]) {
+            table_insert(name_slots, name_hashes[i], i);
+            table_insert(id_slots, hash_id(ids[i]), i);
+        }
+    }
+}
+
+
+/**
+ * Makes the indexes cover every slot of the file table. Call after the table has grown.
+ *
+ * @return 0 on success, or -1 if there is not enough memory.
+ */
+int file_index_reserve(void) {
+    uint32_t entries = file_entry_count();
+    if (entries < index_entries) {
+        index_entries = entries; // The file table was emptied by init_file_entries().
+    }
+    if (entries > index_entries) {
+        uint32_t *newHashes = realloc(name_hashes, entries * sizeof(uint32_t));
+        if (newHashes == NULL) return -1;
+        name_hashes = newHashes;
+        uint32_t *newIds = realloc(ids, entries * sizeof(uint32_t));
+        if (newIds == NULL) return -1;
+        ids = newIds;
+        bool *newIndexed = realloc(indexed, entries * sizeof(bool));
+        if (newIndexed == NULL) return -1;
+        indexed = newIndexed;
+        memset(indexed + index_entries, 0, (entries - index_entries) * sizeof(bool));
+        index_entries = entries;
+    }
+
+    if (index_slots < 2 * index_entries || index_slots == 0) {
+        // Double the tables rather than growing them page by page, so rehashing stays rare.
+        uint32_t slots = (index_slots == 0) ? 32 : index_slots;
+        while (slots < 2 * index_entries) {
+            slots *= 2;
+        }
+        int32_t *newNames = realloc(name_slots, slots * sizeof(int32_t));
+        if (newNames == NULL) return -1;
+        name_slots = newNames;
+        int32_t *newIdSlots = realloc(id_slots, slots * sizeof(int32_t));
+        if (newIdSlots == NULL) return -1;
+        id_slots = newIdSlots;
+        index_slots = slots;
+        rehash();
+    }
+    return 0;
+}
+
+
+/**
+ * Adds an entry to both hash tables under its current keys.
+ */
+static void index_entry(int fileIndex, const FileEntry *entry) {
+    name_hashes[fileIndex] = hash_name(entry->filename.hash, entry->parentDirId);
+    ids[fileIndex] = entry->unique_file_id;
+    table_insert(name_slots, name_hashes[fileIndex], fileIndex);
+    table_insert(id_slots, hash_id(ids[fileIndex]), fileIndex);
+    indexed[fileIndex] = true;
+}
+
+
+/**
+ * Rebuilds both indexes from scratch by reading every entry of the file table. Call after
+ * the table has been initialized or loaded as a whole. Entries are read in place from
+ * flash, so the scan does not churn the page cache.
+ */
+void file_index_rebuild(void) {
+    file_index_reserve();
+    for (uint32_t i = 0; i < index_entries; i++) {
+        indexed[i] = false;
+    }
+    rehash();
+    for (uint32_t i = 0; i < index_entries; i++) {
+        const FileEntry *entry = file_entry_peek(i);
+        if (entry != NULL && entry->in_use) {
+            index_entry(i, entry);
+        }
+    }
+}
+
+
+/**
+ * Returns the number of bytes file_index_snapshot_write() produces.
+ */
+uint32_t file_index_snapshot_size(void) {
+    uint32_t flags = (index_entries * sizeof(bool) + 3) & ~3u;
+    return sizeof(index_snapshot_header) + index_entries * 2 * sizeof(uint32_t) + flags;
+}
+
+
+/**
+ * Saves the keys of every indexed entry for a mount snapshot, so the next mount can index
+ * the file table without reading its entries.
+ *
+ * @param sink Receives the bytes, file_index_snapshot_size() of them in all.
+ * @param context Passed through to sink.
+ */
+void file_index_snapshot_write(meta_snapshot_sink sink, void *context) {
+    static const uint8_t padding[3] = {0};
+    index_snapshot_header header = { .entries = index_entries };
+    sink(&header, sizeof(header), context);
+    sink(name_hashes, index_entries * sizeof(uint32_t), context);
+    sink(ids, index_entries * sizeof(uint32_t), context);
+    sink(indexed, index_entries * sizeof(bool), context);
+    sink(padding, ((index_entries * sizeof(bool) + 3) & ~3u) - index_entries * sizeof(bool), context);
+}
+
+
+/**
+ * Loads the keys of the indexed entries from a mount snapshot, read in place from flash,
+ * and rebuilds the hash tables from them. The file table must already be attached and
+ * unchanged since the snapshot was written.
+ *
+ * @param data The bytes written by file_index_snapshot_write().
+ * @param length Number of bytes available at data.
+ * @return 0 on success, or -1 if the snapshot does not fit the file table or memory is short;
+ *         rebuild the indexes with file_index_rebuild() then.
+ */
+int file_index_snapshot_load(const uint8_t *data, uint32_t length) {
+    index_snapshot_header header;
+    if (length < sizeof(header)) {
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+    uint32_t flags = (header.entries * sizeof(bool) + 3) & ~3u;
+    if (header.entries != file_entry_count()
+        || length < sizeof(header) + header.entries * 2 * sizeof(uint32_t) + flags
+        || file_index_reserve() != 0) {
+        return -1;
+    }
+
+    if (header.entries > 0) {
+        data += sizeof(header);
+        memcpy(name_hashes, data, header.entries * sizeof(uint32_t));
+        data += header.entries * sizeof(uint32_t);
+        memcpy(ids, data, header.entries * sizeof(uint32_t));
+        data += header.entries * sizeof(uint32_t);
+        memcpy(indexed, data, header.entries * sizeof(bool));
+    }
+    rehash();
+    return 0;
+}
+
+
+/**
+ * Adds an entry of the file table to both indexes. The entry's filename, parentDirId and
+ * unique_file_id must already be set; change them only after file_index_remove().
+ *
+ * @param fileIndex Slot of the entry in the file table.
+ */
+void file_index_insert(int fileIndex) {
+    if (fileIndex < 0 || (uint32_t)fileIndex >= index_entries) {
+        return;
+    }
+    // A slot reused without being removed first would otherwise keep its old keys.
+    file_index_remove(fileIndex);
+    if (indexed[fileIndex]) {
+        return; // The removal triggered a rebuild, which indexed the entry already.
+    }
+    index_entry(fileIndex, file_entry_at(fileIndex));
+}
+
+
+/**
+ * Removes an entry of the file table from both indexes. Call before the entry is freed or
+ * before its name, parent directory or unique ID changes.
+ *
+ * @param fileIndex Slot of the entry in the file table.
+ */
+void file_index_remove(int fileIndex) {
+    if (fileIndex < 0 || (uint32_t)fileIndex >= index_entries || !indexed[fileIndex]) {
+        return;
+    }
+    table_remove(name_slots, name_hashes[fileIndex], fileIndex);
+    table_remove(id_slots, hash_id(ids[fileIndex]), fileIndex);
+    indexed[fileIndex] = false;
+
+    // Too many deleted slots make misses walk long probe sequences; start afresh.
+    if (++deleted_slots > index_slots / 4) {
+        rehash();
+    }
+}
+
+
+/**
+ * Finds a slot of the file table that holds no file. Every in-use entry is indexed, so
+ * this only looks at the in-RAM flags.
+ *
+ * @return The lowest unused slot, or -1 if every slot is in use.
+ */
+int file_index_unused_slot(void) {
+    for (uint32_t i = 0; i < index_entries; i++) {
+        if (!indexed[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * Finds a file by name within a directory.
+ *
+ * @param name The file name, with or without a leading slash.
+ * @param parentDirId ID of the directory holding the file.
+ * @return Slot of the entry in the file table, or -1 if there is no such file.
+ */
+int file_index_find(const char* name, uint32_t parentDirId) {
+    const char *key = file_index_key(name);
+    size_t length = strnlen(key, NAME_POOL_MAX_LENGTH + 1);
+    uint32_t keyHash = name_pool_hash(key, length);
+    uint32_t hash = hash_name(keyHash, parentDirId);
+    for (uint32_t probes = 0, slot = hash % (index_slots ? index_slots : 1);
+         index_slots > 0 && probes < index_slots && name_slots[slot] != FILE_INDEX_EMPTY; probes++) {
+        int32_t i = name_slots[slot];
+        if (i >= 0 && name_hashes[i] == hash) {
+            // Only entries whose hash matches are paged in and compared.
+            FileEntry *entry = file_entry_at(i);
+            if (entry != NULL && entry->in_use && entry->parentDirId == parentDirId
+                && name_pool_matches(&entry->filename, key, length, keyHash)) {
+                return i;
+            }
+        }
+        slot = (slot + 1) % index_slots;
+    }
+    return -1;
+}
+
+
+/**
+ * Finds a file by its unique ID.
+ *
+ * @param unique_file_id The ID assigned when the file was created.
+ * @return Slot of the entry in the file table, or -1 if there is no such file.
+ */
+int file_index_find_id(uint32_t unique_file_id) {
+    for (uint32_t probes = 0, slot = hash_id(unique_file_id) % (index_slots ? index_slots : 1);
+         index_slots > 0 && probes < index_slots && id_slots[slot] != FILE_INDEX_EMPTY; probes++) {
+        int32_t i = id_slots[slot];
+        if (i >= 0 && ids[i] == unique_file_id) {
+            return i;
+        }
+        slot = (slot + 1) % index_slots;
+    }
+    return -1;
+}
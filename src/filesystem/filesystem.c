@@ -9,7 +9,9 @@
  *
  * Key Features:
  *  - File operations: open, read, write, close. remove, move, copy, and wipe.
- *  - Thread-safety across file and directory operations using mutexes.
+ *  - Thread-safety across file and directory operations: reads and writes hold the metadata
+ *    tables shared plus a lock of their own file, so different files are read and written
+ *    in parallel; operations that change the tables hold them exclusively.
  *  - Error management to maintain data integrity and system stability.
  *
  * The implementation leverages a simple yet effective FAT-like system for block management,
@@ -25,17 +27,29 @@
 #include <stdio.h>
 #include <string.h> 
 #include <stdlib.h> 
+#include <stddef.h>
 #include "hardware/sync.h"
 #include "hardware/flash.h"
 #include "pico/mutex.h"
+#include "pico/time.h"
 #include <ctype.h>
 #include "../config/flash_config.h"    
 #include "../FAT/fat_fs.h"            
 #include "../flash/flash_ops.h"       
+#include "../flash/flash_cache.h"
+#include "../flash/block_log.h"
+#include "../flash/wear_table.h"
 #include "../filesystem/filesystem.h"  
+#include "../filesystem/file_index.h"
+#include "../filesystem/meta_table.h"
+#include "../filesystem/name_pool.h"
+#include "../filesystem/meta_journal.h"
+#include "../filesystem/fs_async.h"
+#include "../filesystem/ring_log.h"
 #include "../directory/directories.h"
  #include "../filesystem/filesystem_helper.h"  
 #include "../directory/directory_helpers.h"
+#include "../directory/dentry_cache.h"
 
 #ifndef min
 #define min(a,b) ((a) < (b) ? (a) : (b))
@@ -50,64 +64,195 @@
 // 1589  
  
 bool fs_initialized = false;
-static mutex_t filesystem_mutex;
-FileEntry fileSystem[MAX_FILES];
+// Open files are locked through these, picked by file id; see fs_file_lock().
+static mutex_t file_locks[FS_FILE_LOCKS];
+// File entries, stored on flash and paged in on demand; see file_entry_at().
+static meta_table file_table;
 
 
 bool isValidChar(char c);
+
+
+/**
+ * Takes the locks a read or write of an open file needs: the metadata tables shared, so no
+ * entry is added, moved or committed meanwhile, and the lock of the file itself. Handles of
+ * the same file share a lock. Release them with fs_file_unlock().
+ *
+ * @return The file's lock, or NULL if the handle is invalid (the tables are still held).
+ */
+static mutex_t *fs_file_lock(FS_FILE *file) {
+    meta_table_lock_shared();
+    if (file == NULL || file->entry == NULL) {
+        return NULL;
+    }
+    mutex_t *lock = &file_locks[file->entry->unique_file_id % FS_FILE_LOCKS];
+    mutex_enter_blocking(lock);
+    return lock;
+}
+
+
+static void fs_file_unlock(mutex_t *lock) {
+    if (lock != NULL) {
+        mutex_exit(lock);
+    }
+    meta_table_unlock_shared();
+}
 bool isValidChar(char c) {
     return isalnum(c) || c == '_' || c == '-' || c == '/';
 }
 
 
 
+/**
+ * Superblock, in its own block after the reserved space. It identifies a formatted
+ * filesystem and records the layout it was formatted with, so that fs_mount() can refuse
+ * flash written by a different build before it reads anything else.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t checkpoint_first_block;
+    uint32_t checkpoint_blocks;
+    uint32_t journal_first_block;
+    uint32_t journal_sectors;
+    uint32_t crc;   // CRC of the fields above.
+} fs_superblock;
+
+/**
+ * Fills in the superblock describing the layout of this build.
+ */
+static void superblock_describe(fs_superblock *superblock) {
+    memset(superblock, 0, sizeof(*superblock));
+    superblock->magic = SUPERBLOCK_MAGIC;
+    superblock->version = FS_FORMAT_VERSION;
+    superblock->block_size = FILESYSTEM_BLOCK_SIZE;
+    superblock->total_blocks = TOTAL_BLOCKS;
+    superblock->checkpoint_first_block = FAT_CHECKPOINT_FIRST_BLOCK;
+    superblock->checkpoint_blocks = FAT_CHECKPOINT_BLOCKS;
+    superblock->journal_first_block = JOURNAL_FIRST_BLOCK;
+    superblock->journal_sectors = JOURNAL_SECTORS;
+    superblock->crc = block_log_crc32(0, (const uint8_t *)superblock, offsetof(fs_superblock, crc));
+}
+
+
+/**
+ * Writes the superblock. Called by fs_init() once the rest of the filesystem is formatted,
+ * so that a format interrupted by power loss is not mistaken for a filesystem.
+ */
+static int superblock_write(void) {
+    fs_superblock superblock;
+    superblock_describe(&superblock);
+    uint32_t offset = SUPERBLOCK_BLOCK * FILESYSTEM_BLOCK_SIZE;
+    if (flash_erase_range(offset, FILESYSTEM_BLOCK_SIZE) != 0
+        || flash_program_safe(offset, (const uint8_t *)&superblock, sizeof(superblock), NULL) != FLASH_PROGRAM_SUCCESS) {
+        printf("Error: Failed to write the superblock.\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Checks the superblock on flash against the layout of this build, straight from XIP.
+ */
+static bool superblock_valid(void) {
+    const fs_superblock *stored = (const fs_superblock *)(XIP_BASE + SUPERBLOCK_BLOCK * FILESYSTEM_BLOCK_SIZE);
+    fs_superblock expected;
+    superblock_describe(&expected);
+    if (stored->magic != SUPERBLOCK_MAGIC) {
+        printf("Error: No filesystem found; the flash needs to be formatted.\n");
+        return false;
+    }
+    if (memcmp(stored, &expected, sizeof(expected)) != 0) {
+        printf("Error: The filesystem on flash has a different version or layout.\n");
+        return false;
+    }
+    return true;
+}
+
+
+// Steps of static wear levelling. One block is moved at a time, spread over as many
+// fs_wear_level() calls as it takes: find a cold block and a worn free block, erase the worn
+// block if needed, copy the cold one a page at a time, then switch the file over.
+typedef enum {
+    WEAR_LEVEL_SCAN,
+    WEAR_LEVEL_ERASE,
+    WEAR_LEVEL_COPY,
+    WEAR_LEVEL_COMMIT,
+    WEAR_LEVEL_STEPS
+} wear_level_step;
+
+#define WEAR_LEVEL_FIRST_BLOCK (NUMBER_OF_RESERVED_BLOCKS + METADATA_RESERVED_BLOCKS)
+
+typedef struct {
+    wear_level_step step;
+    uint32_t cursor;        // Next block the scan looks at.
+    uint32_t scanned;       // Blocks looked at since the scan last found something.
+    uint32_t idle_max;      // wear_table_max() when the scan last gave up; it waits for more wear.
+    uint32_t source;        // Cold block being moved.
+    uint32_t target;        // Worn block it moves to.
+    uint32_t owner_id;      // unique_file_id of the file the source belongs to.
+    uint32_t copied;        // Bytes of the source copied to the target so far.
+    uint32_t step_us[WEAR_LEVEL_STEPS]; // Last duration of each step, to judge what fits a slice.
+} wear_level_state;
+
+static wear_level_state wear_level;
+static fs_wear_level_stats wear_level_stats;
+
+
+/**
+ * Forgets any move under way. Its target block was never committed, so after a mount it
+ * is free again.
+ */
+static void wear_level_reset(void) {
+    memset(&wear_level, 0, sizeof(wear_level));
+    wear_level.step = WEAR_LEVEL_SCAN;
+    wear_level.cursor = WEAR_LEVEL_FIRST_BLOCK;
+    wear_level.idle_max = UINT32_MAX;
+    memset(&wear_level_stats, 0, sizeof(wear_level_stats));
+}
+
+
 /**
  * Initializes the filesystem - this function should be called at the start of your program.
  * It sets all file entries to not in use, preparing the file system for operation.
  */
 void fs_init() {
+    // Count erases from zero; the counts guide which free blocks are allocated first.
+    wear_table_init();
+
     // Initialize the FAT table or similar structures needed for managing file allocations.
     fat_init();
 
-    // Initialize a mutex to control access to the filesystem, ensuring thread safety.
-    mutex_init(&filesystem_mutex);
+    // Start with an empty sector cache; file data is written through it.
+    flash_cache_init();
+
+    // Set up the log-structured writer that places file data in erased blocks.
+    block_log_init();
+
+    // Initialize the locks of open files, ensuring thread safety.
+    for (int i = 0; i < FS_FILE_LOCKS; i++) {
+        mutex_init(&file_locks[i]);
+    }
+    wear_level_reset();
+    // Queued asynchronous requests refer to handles of the previous filesystem.
+    fs_async_init();
+    fs_log_init();
 
     // Mark the filesystem as initialized to prevent reinitialization.
     fs_initialized = true;
 
+    // Start with an empty name pool; file and directory entries store their names there.
+    name_pool_init();
+
     // Initialize any directory entries, setting up the directory structure of the filesystem.
     init_directory_entries();
 
     // Initialize all file entries, setting them to a default state indicating they are not in use.
     init_file_entries();
 
-    // Start address for file blocks in the flash memory, defined in flash_config.h or similar.
-    uint32_t current_start_block = FLASH_TARGET_OFFSET;
-
-    // Loop through each file entry and initialize its start block in the flash storage.
-    for (int i = 0; i < MAX_FILES; i++) {
-        fileSystem[i].in_use = false; // Initially, no file is in use.
-        fileSystem[i].size = 0;       // Initialize the file size to 0.
-
-        // Set the start block for each file.
-        fileSystem[i].start_block = current_start_block;
-
-        // Increment the start block by the maximum file size to allocate space for each file.
-        current_start_block += MAX_FILE_SIZE;
-         
-        // Display the start block address for debugging.
-        printf("Current start block: %u\n", current_start_block);
-        fflush(stdout);
-
-        // Check if the current start block exceeds the defined usable flash space.
-        if (current_start_block >= FLASH_TARGET_OFFSET + FLASH_USABLE_SPACE) {
-            // If there isn't enough flash memory for the files, handle it as an error.
-            printf("Error: Not enough flash memory for the number of files.\n");
-            fflush(stdout);
-            return; // Exit if there is not enough memory to avoid further errors.
-        }
-    }
-
     // Reset the root directory to ensure it is clear and ready for new entries.
     int resetSuccess = reset_root_directory();
     if (!resetSuccess) {
@@ -116,6 +261,19 @@ void fs_init() {
         fs_initialized = false; // Mark filesystem as not initialized due to error.
         return; // Exit the function to prevent further operations.
     }
+
+    // Start the metadata journal from a checkpoint of the empty filesystem.
+    if (meta_journal_format() != JOURNAL_SUCCESS) {
+        printf("Critical error starting the metadata journal.\n");
+        fs_initialized = false;
+        return;
+    }
+
+    // Written last, so that an interrupted format is not taken for a filesystem.
+    if (superblock_write() != 0) {
+        fs_initialized = false;
+        return;
+    }
     
     // If all initializations are successful, confirm the filesystem is ready.
     fs_initialized = true;
@@ -124,6 +282,307 @@ void fs_init() {
 
 
 
+// Header of a mount snapshot: the saved file index followed by the saved name pool index.
+#define MOUNT_SNAPSHOT_MAGIC 0x534E4150   // "SNAP"
+#define SNAPSHOT_CHECKSUM_SEED 2166136261u
+typedef struct {
+    uint32_t magic;
+    uint32_t file_index_bytes;
+    uint32_t name_pool_bytes;
+} mount_snapshot_header;
+
+// State of a snapshot being streamed to flash a page at a time.
+typedef struct {
+    uint32_t offset;        // Flash offset of the next page.
+    uint32_t checksum;
+    uint32_t fill;          // Bytes waiting in page.
+    bool failed;
+    uint8_t page[FLASH_PAGE_SIZE];
+} snapshot_writer;
+
+static fs_mount_stats mount_stats;
+
+
+/**
+ * Checksums snapshot bytes a word at a time (FNV-1a over words), so that checking a large
+ * snapshot stays cheap next to the rebuild it saves.
+ */
+static uint32_t snapshot_checksum(uint32_t sum, const uint8_t *data, uint32_t length) {
+    uint32_t word;
+    for (; length >= 4; data += 4, length -= 4) {
+        memcpy(&word, data, sizeof(word));
+        sum = (sum ^ word) * 16777619u;
+    }
+    for (; length > 0; data++, length--) {
+        sum = (sum ^ *data) * 16777619u;
+    }
+    return sum;
+}
+
+
+/**
+ * Collects snapshot bytes and programs them a page at a time.
+ */
+static void snapshot_sink(const void *data, uint32_t length, void *context) {
+    snapshot_writer *writer = (snapshot_writer *)context;
+    const uint8_t *bytes = (const uint8_t *)data;
+    while (length > 0) {
+        uint32_t n = min(length, FLASH_PAGE_SIZE - writer->fill);
+        memcpy(writer->page + writer->fill, bytes, n);
+        writer->fill += n;
+        bytes += n;
+        length -= n;
+        if (writer->fill == FLASH_PAGE_SIZE) {
+            writer->checksum = snapshot_checksum(writer->checksum, writer->page, FLASH_PAGE_SIZE);
+            if (flash_program_safe(writer->offset, writer->page, FLASH_PAGE_SIZE, NULL) != FLASH_PROGRAM_SUCCESS) {
+                writer->failed = true;
+            }
+            writer->offset += FLASH_PAGE_SIZE;
+            writer->fill = 0;
+        }
+    }
+}
+
+
+/**
+ * Saves the file index and the name pool index to freshly allocated blocks, so that the
+ * next mount can load them instead of rebuilding them from every table entry.
+ *
+ * @param snapshot Receives where the snapshot was written.
+ * @return true if the snapshot was written; without space for it the next mount rebuilds.
+ */
+static bool mount_snapshot_write(meta_snapshot *snapshot) {
+    mount_snapshot_header header = {
+        .magic = MOUNT_SNAPSHOT_MAGIC,
+        .file_index_bytes = file_index_snapshot_size(),
+        .name_pool_bytes = name_pool_snapshot_size()
+    };
+    uint32_t length = sizeof(header) + header.file_index_bytes + header.name_pool_bytes;
+    uint32_t blocks = (length + FILESYSTEM_BLOCK_SIZE - 1) / FILESYSTEM_BLOCK_SIZE;
+
+    uint32_t first = fat_allocate_extent(blocks, NUMBER_OF_RESERVED_BLOCKS + METADATA_RESERVED_BLOCKS);
+    if (first == FAT_NO_FREE_BLOCKS) {
+        return false;
+    }
+
+    snapshot_writer *writer = malloc(sizeof(snapshot_writer));
+    if (writer == NULL) {
+        for (uint32_t i = 0; i < blocks; i++) {
+            fat_free_block(first + i);
+        }
+        return false;
+    }
+    writer->offset = first * FILESYSTEM_BLOCK_SIZE;
+    writer->checksum = SNAPSHOT_CHECKSUM_SEED;
+    writer->fill = 0;
+    writer->failed = flash_erase_range(writer->offset, blocks * FILESYSTEM_BLOCK_SIZE) != 0;
+
+    snapshot_sink(&header, sizeof(header), writer);
+    file_index_snapshot_write(snapshot_sink, writer);
+    name_pool_snapshot_write(snapshot_sink, writer);
+    writer->checksum = snapshot_checksum(writer->checksum, writer->page, writer->fill);
+    if (writer->fill > 0
+        && flash_program_safe(writer->offset, writer->page, writer->fill, NULL) != FLASH_PROGRAM_SUCCESS) {
+        writer->failed = true;
+    }
+
+    bool written = !writer->failed;
+    snapshot->first_block = first;
+    snapshot->blocks = blocks;
+    snapshot->length = length;
+    snapshot->checksum = writer->checksum;
+    free(writer);
+    if (!written) {
+        for (uint32_t i = 0; i < blocks; i++) {
+            fat_free_block(first + i);
+        }
+    }
+    return written;
+}
+
+
+/**
+ * Loads the indexes from a mount snapshot, reading it in place from XIP.
+ *
+ * @return true if both indexes were loaded; otherwise they have to be rebuilt.
+ */
+static bool mount_snapshot_load(const meta_snapshot *snapshot) {
+    if (snapshot->first_block == FAT_ENTRY_END || snapshot->length < sizeof(mount_snapshot_header)
+        || snapshot->first_block + snapshot->blocks > TOTAL_BLOCKS
+        || snapshot->length > snapshot->blocks * FILESYSTEM_BLOCK_SIZE) {
+        return false;
+    }
+
+    const uint8_t *data = (const uint8_t *)(XIP_BASE + snapshot->first_block * FILESYSTEM_BLOCK_SIZE);
+    if (snapshot_checksum(SNAPSHOT_CHECKSUM_SEED, data, snapshot->length) != snapshot->checksum) {
+        printf("Warning: Mount snapshot is damaged; rebuilding the indexes.\n");
+        return false;
+    }
+
+    mount_snapshot_header header;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != MOUNT_SNAPSHOT_MAGIC
+        || sizeof(header) + header.file_index_bytes + header.name_pool_bytes != snapshot->length) {
+        return false;
+    }
+    data += sizeof(header);
+    return file_index_snapshot_load(data, header.file_index_bytes) == 0
+        && name_pool_snapshot_load(data + header.file_index_bytes, header.name_pool_bytes) == 0;
+}
+
+
+/**
+ * Counts the references to every block after the FAT and the file table are loaded, which
+ * finds the blocks that copies of a file share (see fs_cp()). Entries are read in place.
+ */
+static void fs_rebuild_block_refs(void) {
+    uint32_t count = file_entry_count();
+    uint32_t *heads = malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+    if (heads == NULL) {
+        printf("Error: No memory to count block references.\n");
+        return;
+    }
+    uint32_t files = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const FileEntry *entry = file_entry_peek(i);
+        if (entry != NULL && entry->in_use && !entry->is_directory) {
+            heads[files++] = entry->start_block;
+        }
+    }
+    fat_rebuild_refs(heads, files);
+    free(heads);
+}
+
+
+/**
+ * Brings the filesystem up from what is already on flash, instead of formatting it as
+ * fs_init() does. The superblock is checked first. The FAT of the last metadata checkpoint
+ * is then loaded and the changes committed to the journal since are replayed; the tables
+ * themselves stay on flash and are paged in as they are used.
+ *
+ * After a clean fs_unmount() the file index and the name pool index are loaded from the
+ * snapshot it saved. Otherwise they are rebuilt from the tables, which reads every entry.
+ *
+ * @return 0 on success, -1 if the flash holds no filesystem of this layout, or -2 if its
+ *         metadata could not be recovered. In both error cases the filesystem is left
+ *         uninitialized and fs_init() has to format it.
+ */
+int fs_mount(void) {
+    uint64_t start = time_us_64();
+    memset(&mount_stats, 0, sizeof(mount_stats));
+
+    if (!superblock_valid()) {
+        return -1;
+    }
+
+    // The erase counts of the checkpoint are loaded by meta_journal_recover().
+    wear_table_init();
+    fat_init();
+    flash_cache_init();
+    uint64_t step = time_us_64();
+    block_log_init();
+    mount_stats.block_log_us = (uint32_t)(time_us_64() - step);
+    for (int i = 0; i < FS_FILE_LOCKS; i++) {
+        mutex_init(&file_locks[i]);
+    }
+    wear_level_reset();
+    fs_async_init();
+    fs_log_init();
+
+    // The tables are registered empty; the journal points them at their chains on flash.
+    name_pool_init();
+    init_directory_entries();
+    init_file_entries();
+    fs_initialized = true;
+
+    step = time_us_64();
+    meta_snapshot snapshot;
+    if (meta_journal_recover(&snapshot) != JOURNAL_SUCCESS) {
+        printf("Error: Filesystem metadata could not be recovered.\n");
+        fs_initialized = false;
+        return -2;
+    }
+    // Blocks retired before a power loss, and pages moved by the recovery's checkpoint, are
+    // not referred to by the recovered metadata, and the cache holds nothing yet: they are
+    // erased and freed right away.
+    block_log_requeue_retired();
+    if (block_log_reclaim() > 0) {
+        meta_journal_commit();
+    }
+    mount_stats.journal_us = (uint32_t)(time_us_64() - step);
+
+    meta_journal_stats journal;
+    meta_journal_get_stats(&journal);
+    mount_stats.replayed_records = journal.replayed_records;
+
+    // Only the RAM indexes are left, loaded from the snapshot if there is a valid one.
+    step = time_us_64();
+    mount_stats.used_snapshot = mount_snapshot_load(&snapshot);
+    if (!mount_stats.used_snapshot) {
+        if (name_pool_rebuild() != 0) {
+            fs_initialized = false;
+            return -2;
+        }
+        file_index_rebuild();
+    }
+    fs_rebuild_block_refs();
+    mount_stats.index_us = (uint32_t)(time_us_64() - step);
+    mount_stats.total_us = (uint32_t)(time_us_64() - start);
+
+    printf("Filesystem mounted in %u us.\n", (unsigned)mount_stats.total_us);
+    return 0;
+}
+
+
+/**
+ * Unmounts the filesystem cleanly: file data is synced, and a metadata checkpoint is taken
+ * together with a snapshot of the indexes, so that the next fs_mount() has nothing to
+ * replay or rebuild.
+ *
+ * @return 0 on success, or -1 if the checkpoint could not be written.
+ */
+static int fs_unmount_locked(void) {
+    fs_sync();
+
+    // A first checkpoint writes the table pages back, which moves them to fresh blocks, and
+    // drops the previous snapshot. Nothing refers to the blocks they held once it is written,
+    // so they are free again before the new snapshot is placed.
+    if (meta_journal_checkpoint(NULL) != JOURNAL_SUCCESS) {
+        printf("Error: Failed to write the metadata checkpoint.\n");
+        return -1;
+    }
+    block_log_reclaim();
+
+    meta_snapshot snapshot;
+    bool saved = mount_snapshot_write(&snapshot);
+    if (meta_journal_checkpoint(saved ? &snapshot : NULL) != JOURNAL_SUCCESS) {
+        printf("Error: Failed to write the metadata checkpoint.\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Unmounts while holding the metadata tables exclusively; see fs_unmount_locked().
+ */
+int fs_unmount(void) {
+    meta_table_lock();
+    int result = fs_unmount_locked();
+    meta_table_unlock();
+    return result;
+}
+
+
+/**
+ * Copies the timings of the last fs_mount().
+ */
+void fs_get_mount_stats(fs_mount_stats *stats) {
+    *stats = mount_stats;
+}
+
+
+
 /**
  * Performs a clean shutdown of the filesystem by ensuring that all crucial
  * filesystem data structures are saved to non-volatile storage. This function
@@ -133,17 +592,10 @@ void fs_init() {
 void shutdown() {
     printf("Initiating shutdown process...\n");
 
-    // Save all file entries to non-volatile storage to ensure no data loss.
-    printf("Saving file entries...\n");
-    saveFileEntriesToFileSystem();
-
-    // Save all directory entries to ensure the directory structure is preserved.
-    printf("Saving directory entries...\n");
-    saveDirectoriesEntriesToFileSystem();
-
-    // Save the current state of the File Allocation Table to preserve file system integrity.
-    printf("Saving FAT entries...\n");
-    saveFATEntriesToFileSystem();
+    // File data is synced, and the metadata journal is checkpointed together with a
+    // snapshot of the indexes, so that the next mount has nothing to replay or rebuild.
+    printf("Unmounting filesystem...\n");
+    fs_unmount();
 
     // Add any additional clean-up or save routines here.
     printf("Shutdown process complete. Safe to power off or restart.\n");
@@ -151,45 +603,90 @@ void shutdown() {
 
 
 /**
- * Initializes all file entries in the file system to default, unused states.
- * This function is typically called at the start of the program to prepare the file system.
+ * Initializes the file table to an empty state. This function is typically called at the
+ * start of the program to prepare the file system; the table grows as files are created.
  */
 void init_file_entries() {
-    // Loop through each file entry in the file system array.
-    for (int i = 0; i < MAX_FILES; i++) {
-        fileSystem[i].in_use = false;  // Mark the file as not currently in use.
-        fileSystem[i].is_directory = false;  // Indicate that this entry is not a directory.
-        fileSystem[i].filename[0] = '\0';  // Set the filename to an empty string to denote an unused entry.
-        fileSystem[i].parentDirId = 0;  // Reset the parent directory ID to 0, indicating no parent.
-        fileSystem[i].size = 0;  // Set the size of the file to 0, as it is unused.
-        fileSystem[i].start_block = 0;  // Set the start block to 0, indicating no data blocks are assigned.
-        fileSystem[i].unique_file_id = 0;  // Reset the unique file ID to 0.
+    // Start with no pages at all; new pages are zeroed, which marks every entry unused.
+    meta_table_init(&file_table, META_TABLE_FILES, sizeof(FileEntry));
+
+    // No file is in use, so both lookup indexes start out empty.
+    file_index_rebuild();
+}
+
+
+/**
+ * Returns the file entry at a slot of the file table, paging it in if needed. The pointer
+ * stays valid until a few other pages have been touched; pin it with meta_table_pin() to
+ * keep it longer.
+ *
+ * @param slot Slot number, below file_entry_count().
+ * @return Pointer to the entry, or NULL if the slot does not exist.
+ */
+FileEntry* file_entry_at(uint32_t slot) {
+    return (FileEntry*)meta_table_get(&file_table, slot);
+}
+
+
+/**
+ * Returns a read-only view of the file entry at a slot, read in place from flash unless its
+ * page is cached. Meant for scans that only read, such as rebuilding indexes at mount.
+ */
+const FileEntry* file_entry_peek(uint32_t slot) {
+    return (const FileEntry*)meta_table_peek(&file_table, slot);
+}
+
+
+/**
+ * Returns the number of slots in the file table, used or not.
+ */
+uint32_t file_entry_count(void) {
+    return meta_table_capacity(&file_table);
+}
+
+
+/**
+ * Returns the slot of a file entry obtained from file_entry_at().
+ *
+ * @return The slot, or -1 if the pointer is not a resident file entry.
+ */
+int file_entry_slot(const FileEntry* entry) {
+    uint32_t slot = meta_table_slot(&file_table, entry);
+    return (slot == UINT32_MAX) ? -1 : (int)slot;
+}
+
+
+/**
+ * Adds a page of unused entries to the file table and extends the lookup indexes to cover
+ * them.
+ *
+ * @return 0 on success, or -1 if there is no free block or memory.
+ */
+int file_table_grow(void) {
+    if (meta_table_grow(&file_table) != 0) {
+        return -1;
     }
+    return file_index_reserve();
 }
 
 
 /**
- * Opens a file based on a specified path and mode.
+ * Opens a file based on a specified path and mode. A file created for 'w' is only part of
+ * the next journal commit; fs_open() makes that commit, while fs_cp() first gives the new
+ * entry its contents so that the copy appears in a single commit.
  * 
  * @param FullPath The complete path of the file to open.
  * @param mode The mode in which to open the file ('r' for read, 'w' for write, 'a' for append).
  * @return A pointer to an FS_FILE structure representing the opened file, or NULL if an error occurs.
  */
-FS_FILE* fs_open(const char* FullPath, const char* mode) {
-    // Extract the last two components of the path: directory and filename
-    PathParts pathExtract = extract_last_two_parts(FullPath);
-    char* filename = pathExtract.filename;
-    char* directory_path = pathExtract.directory;
-
-    // Set the default directory path to "/root" if not specified
-    // if it was specified, it will not be updated to "/root"
-    set_default_path(directory_path, "/root");
-
-    // Attempt to find the directory in the filesystem
-    DirectoryEntry* directory = DIR_find_directory_entry(directory_path);
+static FS_FILE* fs_open_locked(const char* FullPath, const char* mode) {
+    // Walk the path to the directory holding the file, and split off the file name.
+    // A path without directories, such as "notes.txt", names a file in "/root".
+    char filename[NAME_POOL_MAX_LENGTH + 1];
+    DirectoryEntry* directory = path_walk_parent(FullPath, filename, sizeof(filename));
     if (!directory) {
         // If the directory is not found, output an error and return NULL
-        printf("Error: Directory '%s' not found.\n", directory_path);
+        printf("Error: Directory of '%s' not found.\n", FullPath);
         fflush(stdout);
         return NULL;
     }
@@ -222,12 +719,21 @@ FS_FILE* fs_open(const char* FullPath, const char* mode) {
             fflush(stdout);
             return NULL;
         }
-        // Initialize the file structure with the found or created entry
+        // Initialize the file structure with the found or created entry, keeping its
+        // page of the file table resident until the file is closed.
         file->entry = entry;
+        meta_table_pin(entry);
         // Set the initial position in the file. For append mode, set to the file size; for others, set to 0
         file->position = (strcmp(mode, "a") == 0) ? entry->size : 0;
         // Store the mode as a single character ('r', 'w', 'a')
         file->mode = mode[0];
+        // No block has been looked up yet; the block map is built on demand.
+        file->cursor_index = 0;
+        file->cursor_block = FAT_ENTRY_END;
+        file->cursor_prev = FAT_ENTRY_END;
+        file->block_map = NULL;
+        file->block_map_len = 0;
+        file->chain_version = entry->chain_version;
     } else {
         // If the mode string is not recognized, output an error and return NULL
         printf("Error: Invalid mode '%s'.\n", mode);
@@ -241,17 +747,324 @@ FS_FILE* fs_open(const char* FullPath, const char* mode) {
 }  
 
 
+/**
+ * Opens a file while holding the metadata tables exclusively; see fs_open_locked().
+ */
+FS_FILE* fs_open(const char* FullPath, const char* mode) {
+    meta_table_lock();
+    FS_FILE* result = fs_open_locked(FullPath, mode);
+    // A newly created file survives a power loss from here on.
+    if (result != NULL && result->mode == 'w') {
+        meta_journal_commit();
+    }
+    meta_table_unlock();
+    return result;
+}
+
+
+
+
+/**
+ * Finds the block holding a byte offset of a file. Blocks inside the file's contiguous
+ * extent are found directly (start_block + index); only blocks past the extent need a walk
+ * along the FAT chain, starting from the end of the extent.
+ *
+ * @param entry The file whose chain is searched.
+ * @param offset Byte offset within the file.
+ * @param block Receives the block number holding the offset.
+ * @return 0 on success, or -1 if the chain ends before the offset.
+ */
+static int fs_block_for_offset(const FileEntry *entry, uint32_t offset, uint32_t *block) {
+    uint32_t index = offset / FS_BLOCK_PAYLOAD_SIZE;
+    if (index < entry->extent_blocks) {
+        *block = entry->start_block + index;
+        return 0;
+    }
+
+    uint32_t current = entry->start_block;
+    uint32_t skip = index;
+    if (entry->extent_blocks > 0) {
+        current = entry->start_block + entry->extent_blocks - 1;
+        skip = index - (entry->extent_blocks - 1);
+    }
+    for (; skip > 0; skip--) {
+        if (fat_get_next_block(current, &current) != FAT_SUCCESS || current == FAT_ENTRY_END) {
+            return -1;
+        }
+    }
+    *block = current;
+    return 0;
+}
+
+
+/**
+ * Moves a file's cursor to a block.
+ *
+ * @param file The open file.
+ * @param index Position of the block within the file, counted in blocks.
+ * @param block The block number at that position.
+ * @param prev The block before it, or FAT_ENTRY_END if it is the first or not known.
+ */
+static void fs_set_cursor(FS_FILE *file, uint32_t index, uint32_t block, uint32_t prev) {
+    file->cursor_index = index;
+    file->cursor_block = block;
+    file->cursor_prev = prev;
+}
+
+
+/**
+ * Builds the block map of an open file by walking its whole chain once. Any previous map
+ * is replaced.
+ *
+ * @param file The open file.
+ * @return 0 on success, or -1 if the chain is broken or loops, or the map cannot be allocated.
+ */
+static int fs_build_block_map(FS_FILE *file) {
+    uint32_t count = 0;
+    uint32_t current = file->entry->start_block;
+    while (current != FAT_ENTRY_END) {
+        // A chain longer than the flash has blocks loops back on itself.
+        if (++count > TOTAL_BLOCKS || fat_get_next_block(current, &current) != FAT_SUCCESS) {
+            return -1;
+        }
+    }
+
+    // realloc() of zero bytes may free the map and return NULL, so an empty file gets none.
+    if (count == 0) {
+        free(file->block_map);
+        file->block_map = NULL;
+        file->block_map_len = 0;
+        return 0;
+    }
+    uint32_t *map = (uint32_t *)realloc(file->block_map, count * sizeof(uint32_t));
+    if (map == NULL) {
+        return -1;
+    }
+    current = file->entry->start_block;
+    for (uint32_t i = 0; i < count; i++) {
+        map[i] = current;
+        fat_get_next_block(current, &current);
+    }
+    file->block_map = map;
+    file->block_map_len = count;
+    return 0;
+}
+
+
+/**
+ * Finds the block at a given index of an open file. In order of preference the block comes
+ * from the contiguous extent, from the cursor or its neighbours, or from the block map,
+ * which is built on the first lookup that needs it. After warm-up every lookup is O(1).
+ * The cursor is left on the block found.
+ *
+ * @param file The open file.
+ * @param index Position of the block within the file, counted in blocks.
+ * @param block Receives the block number.
+ * @return 0 on success, or -1 if the chain ends before the index.
+ */
+static int fs_locate_block(FS_FILE *file, uint32_t index, uint32_t *block) {
+    FileEntry *entry = file->entry;
+
+    // Blocks were replaced through another handle; nothing cached can be trusted.
+    if (file->chain_version != entry->chain_version) {
+        free(file->block_map);
+        file->block_map = NULL;
+        file->block_map_len = 0;
+        file->cursor_block = FAT_ENTRY_END;
+        file->chain_version = entry->chain_version;
+    }
+
+    if (index < entry->extent_blocks) {
+        *block = entry->start_block + index;
+        fs_set_cursor(file, index, *block, index > 0 ? *block - 1 : FAT_ENTRY_END);
+        return 0;
+    }
+
+    if (file->cursor_block != FAT_ENTRY_END) {
+        if (index == file->cursor_index) {
+            *block = file->cursor_block;
+            return 0;
+        }
+        if (index == file->cursor_index + 1) {
+            uint32_t next;
+            if (fat_get_next_block(file->cursor_block, &next) != FAT_SUCCESS || next == FAT_ENTRY_END) {
+                return -1;
+            }
+            fs_set_cursor(file, index, next, file->cursor_block);
+            *block = next;
+            return 0;
+        }
+        if (index + 1 == file->cursor_index && file->cursor_prev != FAT_ENTRY_END) {
+            *block = file->cursor_prev;
+            fs_set_cursor(file, index, *block, FAT_ENTRY_END);
+            return 0;
+        }
+    }
+
+    // Random access: use the block map, building it (again, if the file has grown) first.
+    if (index >= file->block_map_len && fs_build_block_map(file) != 0) {
+        // Without a map, fall back to walking the chain.
+        if (fs_block_for_offset(entry, index * FS_BLOCK_PAYLOAD_SIZE, block) != 0) {
+            return -1;
+        }
+        fs_set_cursor(file, index, *block, FAT_ENTRY_END);
+        return 0;
+    }
+    if (index >= file->block_map_len) {
+        return -1;
+    }
+    *block = file->block_map[index];
+    fs_set_cursor(file, index, *block, index > 0 ? file->block_map[index - 1] : FAT_ENTRY_END);
+    return 0;
+}
+
+
+/**
+ * Puts a new block in place of an old one in a file's chain. The new block takes over the
+ * old block's successor and is linked from the previous block, or becomes the start block.
+ * The file's contiguous extent is shortened or extended to match. Replacing a block that
+ * was already in the chain bumps the file's chain version, so other handles drop their maps.
+ *
+ * @param entry The file whose chain is updated.
+ * @param index Position of the block within the file, counted in blocks.
+ * @param previousBlock The block before the old one, or FAT_ENTRY_END if it is the first.
+ * @param oldBlock The block being replaced, or FAT_ENTRY_END when appending a new block.
+ * @param newBlock The block taking its place.
+ */
+static void fs_replace_block(FileEntry *entry, uint32_t index, uint32_t previousBlock, uint32_t oldBlock, uint32_t newBlock) {
+    if (oldBlock != FAT_ENTRY_END || previousBlock == FAT_ENTRY_END) {
+        entry->chain_version++;
+    }
+    if (oldBlock != FAT_ENTRY_END) {
+        uint32_t nextBlock;
+        if (fat_get_next_block(oldBlock, &nextBlock) == FAT_SUCCESS && nextBlock != FAT_ENTRY_END) {
+            fat_link_blocks(newBlock, nextBlock);
+        }
+    }
+    if (previousBlock == FAT_ENTRY_END) {
+        entry->start_block = newBlock;
+        entry->extent_blocks = 1;
+    } else {
+        fat_link_blocks(previousBlock, newBlock);
+        // Blocks from here on are no longer known to follow start_block directly.
+        if (index < entry->extent_blocks) {
+            entry->extent_blocks = index;
+        }
+        if (index == entry->extent_blocks && newBlock == entry->start_block + index) {
+            entry->extent_blocks++;
+        }
+    }
+}
+
+
+/**
+ * Returns the position of the first block of a file's chain that is shared with a copy of
+ * the file (see fs_cp()), among its first count blocks. The blocks after it are shared as
+ * well, since both files reach them through it.
+ *
+ * @return The position, counted in blocks, or UINT32_MAX if none of them is shared.
+ */
+static uint32_t fs_first_shared_block(const FileEntry *entry, uint32_t count) {
+    if (fat_shared_block_count() == 0) {
+        return UINT32_MAX;
+    }
+    uint32_t current = entry->start_block;
+    for (uint32_t i = 0; i < count && current < TOTAL_BLOCKS; i++) {
+        if (fat_block_shared(current)) {
+            return i;
+        }
+        if (fat_get_next_block(current, &current) != FAT_SUCCESS) {
+            break;
+        }
+    }
+    return UINT32_MAX;
+}
 
 
 /**
- * Writes data to an open file.
+ * Gives a file its own copy of a block it shares with copies of the file, with new bytes
+ * applied to the copy. The copy takes the block's place in this file's chain and links to
+ * the same successor, which gains a reference. The shared block loses one, and is retired
+ * if the other files have let go of it meanwhile. The block before must be the file's own.
+ *
+ * @param entry The file whose chain is updated.
+ * @param index Position of the block within the file, counted in blocks.
+ * @param previousBlock The block before it, or FAT_ENTRY_END if it is the first.
+ * @param block In: the shared block. Out: the file's copy.
+ * @param used Payload bytes of the block that belong to the file.
+ * @param pos, data, len Bytes to write into the copy, as for block_log_write(); len may be 0.
+ * @return 0 on success, or -1 if the block could not be copied.
+ */
+static int fs_unshare_block(FileEntry *entry, uint32_t index, uint32_t previousBlock, uint32_t *block,
+                            uint32_t used, uint32_t pos, const uint8_t *data, size_t len) {
+    uint32_t shared = *block;
+    uint32_t copy;
+    if (block_log_clone(shared, used, pos, data, len, entry->unique_file_id, &copy) != BLOCK_LOG_SUCCESS) {
+        printf("Error: Failed to copy shared block %u.\n", shared);
+        return -1;
+    }
+    // The successor is referenced from the copy before the shared block lets go of its own
+    // reference, so a file writing through the other path always sees one of them shared.
+    uint32_t next;
+    if (fat_get_next_block(shared, &next) == FAT_SUCCESS && next != FAT_ENTRY_END) {
+        fat_ref_block(next);
+    }
+    fs_replace_block(entry, index, previousBlock, shared, copy);
+    if (!fat_unref_block(shared)) {
+        block_log_retire(shared);
+    }
+    *block = copy;
+    return 0;
+}
+
+
+/**
+ * Gives an open file its own copy of every block it shares among its first count blocks, so
+ * that the chain can be relinked there without affecting the file's copies.
+ *
+ * @return 0 on success, or -1 if a block could not be copied.
+ */
+static int fs_unshare_prefix(FS_FILE *file, uint32_t count) {
+    FileEntry *entry = file->entry;
+    uint32_t first = fs_first_shared_block(entry, count);
+    if (first == UINT32_MAX) {
+        return 0;
+    }
+    uint32_t previous = FAT_ENTRY_END;
+    uint32_t current = entry->start_block;
+    for (uint32_t i = 0; i < count && current != FAT_ENTRY_END; i++) {
+        if (i >= first) {
+            uint32_t start = i * FS_BLOCK_PAYLOAD_SIZE;
+            uint32_t used = (entry->size > start) ? MIN(entry->size - start, FS_BLOCK_PAYLOAD_SIZE) : 0;
+            if (fs_unshare_block(entry, i, previous, &current, used, 0, NULL, 0) != 0) {
+                return -1;
+            }
+        }
+        previous = current;
+        if (fat_get_next_block(previous, &current) != FAT_SUCCESS) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+
+
+/**
+ * Writes data to an open file at its current position.
+ *
+ * Each block carries FS_BLOCK_PAYLOAD_SIZE bytes of file data. Data appended into erased
+ * space is only programmed; overwriting existing data moves the affected block to a fresh
+ * erased block (see block_log.c). Appends of FS_BULK_WRITE_MIN_BLOCKS or more whole blocks
+ * are written as one contiguous run, bypassing the sector cache.
  * 
  * @param file Pointer to the FS_FILE structure representing the open file.
  * @param buffer Pointer to the data to be written.
  * @param size The number of bytes to write.
  * @return The number of bytes written, or -1 if an error occurs.
  */
-int fs_write(FS_FILE* file, const void* buffer, int size) {
+static int fs_write_locked(FS_FILE* file, const void* buffer, int size) {
     // Validate input parameters to ensure they are correct
     if (file == NULL || buffer == NULL || size < 0) {
         printf("Error: Invalid input parameters.\n");
@@ -263,65 +1076,154 @@ int fs_write(FS_FILE* file, const void* buffer, int size) {
         printf("Error: File not open in a writable or appendable mode.\n");
         return -1;
     }
-    // Initialize tracking variables for the current block and position within the block
-    uint32_t currentBlock = file->entry->start_block;
-    uint32_t currentBlockLINK = currentBlock;;
-    uint32_t currentBlockPosition = file->position % FILESYSTEM_BLOCK_SIZE;
     const uint8_t* writeBuffer = (const uint8_t*) buffer;
     int bytesWritten = 0;
-    bool isFirstBlock = (file->position == 0);  // Identify if we're starting at the beginning of the file.
+
+    // Find the block holding the current position, remembering the one before it so that
+    // a relocated or newly allocated block can be linked into the chain.
+    uint32_t startIndex = file->position / FS_BLOCK_PAYLOAD_SIZE;
+    if (fs_unshare_prefix(file, startIndex) != 0) {
+        return -1;
+    }
+    uint32_t previousBlock = FAT_ENTRY_END;
+    uint32_t currentBlock = file->entry->start_block;
+    if (startIndex > 0) {
+        if (fs_locate_block(file, startIndex - 1, &previousBlock) != 0
+            || fat_get_next_block(previousBlock, &currentBlock) != FAT_SUCCESS) {
+            printf("Error: Broken block chain before position %u.\n", file->position);
+            return -1;
+        }
+    }
 
     while (size > 0) {
-        // Initialize tracking variables for the current block and position within the block
-        if (currentBlockPosition == FILESYSTEM_BLOCK_SIZE || currentBlock == FAT_ENTRY_END) {
-            uint32_t newBlock = fat_allocate_block();
-            if (newBlock == FAT_NO_FREE_BLOCKS) {
+        // Past the last block of the file with several whole blocks still to go: write
+        // them as one contiguous run with batched erases and programs.
+        if (currentBlock == FAT_ENTRY_END && size >= FS_BULK_WRITE_MIN_BLOCKS * FS_BLOCK_PAYLOAD_SIZE) {
+            uint32_t count = size / FS_BLOCK_PAYLOAD_SIZE;
+            uint32_t blockIndex = file->position / FS_BLOCK_PAYLOAD_SIZE;
+            uint32_t hint = (previousBlock == FAT_ENTRY_END) ? 0 : previousBlock + 1;
+            uint32_t firstBlock = fat_allocate_extent(count, hint);
+            if (firstBlock != FAT_NO_FREE_BLOCKS) {
+                if (block_log_write_run(firstBlock, count, writeBuffer, file->entry->unique_file_id) != BLOCK_LOG_SUCCESS) {
+                    for (uint32_t i = 0; i < count; i++) {
+                        fat_free_block(firstBlock + i);
+                    }
+                    printf("Error: Failed to write block run at %u.\n", firstBlock);
+                    return bytesWritten > 0 ? bytesWritten : -1;
+                }
+                // The run is already linked internally; hook its first block into the chain.
+                fs_replace_block(file->entry, blockIndex, previousBlock, FAT_ENTRY_END, firstBlock);
+                if (file->entry->extent_blocks == blockIndex + 1 && firstBlock == file->entry->start_block + blockIndex) {
+                    file->entry->extent_blocks += count - 1;
+                }
+                fs_set_cursor(file, blockIndex + count - 1, firstBlock + count - 1, firstBlock + count - 2);
+
+                uint32_t runBytes = count * FS_BLOCK_PAYLOAD_SIZE;
+                writeBuffer += runBytes;
+                bytesWritten += runBytes;
+                size -= runBytes;
+                file->position += runBytes;
+                if (file->position > file->entry->size) {
+                    file->entry->size = file->position;
+                }
+                previousBlock = firstBlock + count - 1;
+                continue;
+            }
+            // No run that long is free; fall back to writing block by block.
+        }
+
+        // Past the last block of the file: take a fresh erased block from the log.
+        if (currentBlock == FAT_ENTRY_END) {
+            currentBlock = block_log_allocate();
+            if (currentBlock == FAT_NO_FREE_BLOCKS) {
                 printf("Error RUN OUT FROM MEMORY: No free blocks available. \n");
-                return -1;
-            }//FAT_ENTRY_END
-                // Link the current block to the new block in the FAT
-                fat_link_blocks(currentBlockLINK, newBlock);
-             if (isFirstBlock) {
-                file->entry->start_block = newBlock;  // Only set start_block if it's the first block being written to a new file.
-                isFirstBlock = false;
+                return bytesWritten > 0 ? bytesWritten : -1;
+            }
+            fs_replace_block(file->entry, file->position / FS_BLOCK_PAYLOAD_SIZE, previousBlock, FAT_ENTRY_END, currentBlock);
+        }
+
+        uint32_t blockIndex = file->position / FS_BLOCK_PAYLOAD_SIZE;
+        uint32_t blockPosition = file->position % FS_BLOCK_PAYLOAD_SIZE;
+        uint32_t blockStart = blockIndex * FS_BLOCK_PAYLOAD_SIZE;
+        // Payload bytes of this block that already belong to the file.
+        uint32_t used = (file->entry->size > blockStart) ? MIN(file->entry->size - blockStart, FS_BLOCK_PAYLOAD_SIZE) : 0;
+        int toWrite = MIN((int)(FS_BLOCK_PAYLOAD_SIZE - blockPosition), size);
+
+        // Appends into erased bytes are written in place; anything else moves the block
+        // to a fresh erased block, which then replaces the old one in the chain. A block
+        // shared with a copy of the file is never written: the new bytes go to a copy of it.
+        uint32_t writtenBlock = currentBlock;
+        if (fat_shared_block_count() > 0 && fat_block_shared(currentBlock)) {
+            if (fs_unshare_block(file->entry, blockIndex, previousBlock, &writtenBlock, used, blockPosition, writeBuffer, toWrite) != 0) {
+                return bytesWritten > 0 ? bytesWritten : -1;
+            }
+        } else {
+            if (block_log_write(&writtenBlock, used, blockPosition, writeBuffer, toWrite, file->entry->unique_file_id) != BLOCK_LOG_SUCCESS) {
+                printf("Error: Failed to write block %u.\n", currentBlock);
+                return bytesWritten > 0 ? bytesWritten : -1;
+            }
+            if (writtenBlock != currentBlock) {
+                fs_replace_block(file->entry, blockIndex, previousBlock, currentBlock, writtenBlock);
+                block_log_retire(currentBlock);
+            }
+        }
+        if (writtenBlock != currentBlock) {
+            currentBlock = writtenBlock;
+            // Only this block moved, so this handle's own map can be patched rather than dropped.
+            if (file->chain_version + 1 == file->entry->chain_version) {
+                file->chain_version = file->entry->chain_version;
+                if (blockIndex < file->block_map_len) {
+                    file->block_map[blockIndex] = writtenBlock;
+                }
             }
-            currentBlock = newBlock;
-            // Calculate the amount of writable space in the current block
-            currentBlockPosition = 0;
-        }
-        currentBlockLINK = currentBlock;
-        // Calculate writable space in the current block
-        int remainingSpaceInBlock = FILESYSTEM_BLOCK_SIZE - currentBlockPosition;
-        int toWrite = MIN(remainingSpaceInBlock, size);
-        
-
-        if (isFirstBlock) {
-            // Adjust for the FileEntry metadata space if it's the very first write operation of the file          
-            remainingSpaceInBlock = FILESYSTEM_BLOCK_SIZE - currentBlockPosition;
-            toWrite = MIN(remainingSpaceInBlock, size);
-            isFirstBlock = false;  // Ensure this adjustment only happens once
-        }
-        
-        uint32_t writeOffset = currentBlock * FILESYSTEM_BLOCK_SIZE + currentBlockPosition;
-        printf("Write offset: %u\n", writeOffset);
-        flash_write_safe(writeOffset, writeBuffer, toWrite);
+        }
+        fs_set_cursor(file, blockIndex, currentBlock, previousBlock);
 
         writeBuffer += toWrite;
         bytesWritten += toWrite;
         size -= toWrite;
         file->position += toWrite;
-        currentBlockPosition += toWrite;
 
-        // Check if we've written to the end of the block
-        if (currentBlockPosition >= FILESYSTEM_BLOCK_SIZE) {
-            currentBlockPosition = 0; // Reset for next block
-            currentBlock = FAT_ENTRY_END; // Force allocation of new block on next iteration
+        // Grow the file when writing past its current end.
+        if (file->position > file->entry->size) {
+            file->entry->size = file->position;
+        }
+
+        // Move on to the next block of the chain once this payload is full.
+        if (blockPosition + toWrite == FS_BLOCK_PAYLOAD_SIZE) {
+            previousBlock = currentBlock;
+            if (fat_get_next_block(previousBlock, &currentBlock) != FAT_SUCCESS) {
+                printf("Error: Broken block chain at block %u.\n", previousBlock);
+                return bytesWritten;
+            }
         }
     }
+
     return bytesWritten;
 }
 
 
+/**
+ * Writes to an open file; see fs_write_locked(). Writes to different files run in parallel.
+ * The static wear levelling slice that follows needs the tables to itself, so it is skipped
+ * while any other file is being used and done by a later write instead.
+ */
+int fs_write(FS_FILE* file, const void* buffer, int size) {
+    mutex_t *lock = fs_file_lock(file);
+    int result = fs_write_locked(file, buffer, size);
+    fs_file_unlock(lock);
+
+#if WEAR_LEVEL_SLICE_US > 0
+    // Static wear levelling advances a little with every write, within a fixed time slice.
+    if (result >= 0 && meta_table_try_lock()) {
+        fs_wear_level(WEAR_LEVEL_SLICE_US);
+        meta_table_unlock();
+    }
+#endif
+    return result;
+}
+
+
 
 
 /**
@@ -332,7 +1234,7 @@ int fs_write(FS_FILE* file, const void* buffer, int size) {
  *
  * @param file A pointer to the FS_FILE structure representing the file to be closed.
  */
-void fs_close(FS_FILE* file) {
+static void fs_close_locked(FS_FILE* file) {
     // Check if the file pointer is valid before attempting to close.
     if (file == NULL) {
         // Print an error message and exit the function if the file pointer is NULL.
@@ -341,77 +1243,470 @@ void fs_close(FS_FILE* file) {
         return;
     }
 
-    // Free the memory allocated for the FS_FILE structure.
-    // This is important to prevent memory leaks.
-    free(file);
+    // Let the entry's page be evicted again, then free the memory allocated for the
+    // FS_FILE structure and its block map. This is important to prevent memory leaks.
+    meta_table_unpin(file->entry);
+    free(file->block_map);
+    free(file);
+}
+
+
+/**
+ * Closes a file while holding the metadata tables exclusively; see fs_close_locked().
+ */
+void fs_close(FS_FILE* file) {
+    meta_table_lock();
+    fs_close_locked(file);
+    meta_table_unlock();
+}
+
+
+ 
+ 
+
+
+ 
+ 
+/**
+ * Reads data from an open file into a buffer.
+ * 
+ * @param file Pointer to the FS_FILE structure representing the open file.
+ * @param buffer Pointer to the buffer where the read data should be stored.
+ * @param size The number of bytes to read.
+ * @return The number of bytes actually read, or -1 on error.
+ */
+static int fs_read_locked(FS_FILE* file, void* buffer, int size) {
+    // Check for NULL pointers to ensure the file and buffer are valid.
+    if (file == NULL || buffer == NULL) {
+        printf("Error: Null file or buffer pointer provided.\n");
+        return -1; // Return -1 to indicate an error due to invalid input.
+    }
+
+    // Validate the requested size and the file mode (must be either 'r' for read or 'a' for append).
+    if (size <= 0 || (file->mode != 'r' && file->mode != 'a')) {
+        printf("Error: Invalid read request.\n");
+        return -1; // Return -1 to indicate an error due to invalid size or inappropriate file mode.
+    }
+
+    // Never read past the end of the file.
+    if (file->position >= file->entry->size) {
+        return READ_SUCCESS_NO_DATA;
+    }
+    if ((uint32_t)size > file->entry->size - file->position) {
+        size = file->entry->size - file->position;
+    }
+
+    // Find the block holding the current position and the position within that block.
+    uint32_t currentBlock;
+    if (fs_locate_block(file, file->position / FS_BLOCK_PAYLOAD_SIZE, &currentBlock) != 0) {
+        printf("Error: File position %u is beyond the block chain.\n", file->position);
+        return -1;
+    }
+    uint32_t currentBlockPosition = file->position % FS_BLOCK_PAYLOAD_SIZE;
+    uint8_t* readBuffer = (uint8_t*)buffer; // Cast buffer to uint8_t* for byte-level operations.
+    int totalBytesRead = 0; // Track the total number of bytes successfully read.
+    int remainingSize = size; // Track the remaining number of bytes to read.
+
+    // Continue reading while there are bytes remaining and the current block is not the end of the file.
+    while (remainingSize > 0 && currentBlock != FAT_ENTRY_END) {
+        // Calculate the number of bytes to read from this block's payload.
+        int bytesToRead = MIN((int)(FS_BLOCK_PAYLOAD_SIZE - currentBlockPosition), remainingSize);
+        // Calculate the offset in flash where the current block's data starts.
+        uint32_t readOffset = currentBlock * FILESYSTEM_BLOCK_SIZE + currentBlockPosition;
+
+        // Read through the sector cache so data not yet written back is visible. Sectors
+        // that are not cached are copied straight from XIP into the caller's buffer.
+        if (flash_cache_read(readOffset, readBuffer, bytesToRead) != FLASH_CACHE_SUCCESS) {
+            printf("Error: Failed to read block %u.\n", currentBlock);
+            return -1;
+        }
+
+        // Update the buffer pointer, total bytes read, and remaining size.
+        readBuffer += bytesToRead;
+        totalBytesRead += bytesToRead;
+        remainingSize -= bytesToRead;
+        // Update the file position.
+        file->position += bytesToRead;
+        // Recalculate the current block position.
+        currentBlockPosition = (file->position % FS_BLOCK_PAYLOAD_SIZE);
+
+        // If the end of the block is reached and there are still bytes to read, move to the next block.
+        if (currentBlockPosition == 0 && remainingSize > 0) {
+            uint32_t nextBlock;
+            // Fetch the next block from the FAT.
+            if (fat_get_next_block(currentBlock, &nextBlock) == FAT_SUCCESS && nextBlock != FAT_ENTRY_END) {
+                fs_set_cursor(file, file->position / FS_BLOCK_PAYLOAD_SIZE, nextBlock, currentBlock);
+                currentBlock = nextBlock;
+            } else {
+                printf("End of file chain reached or no next block available. Current block: %u, \n", currentBlock);
+                break; // Break the loop if no more blocks are available or an error occurred.
+            }
+        }
+    }
+    return totalBytesRead; // Return the total number of bytes read.
+}
+
+
+/**
+ * Reads from an open file; see fs_read_locked(). Reads of different files run in parallel.
+ */
+int fs_read(FS_FILE* file, void* buffer, int size) {
+    mutex_t *lock = fs_file_lock(file);
+    int result = fs_read_locked(file, buffer, size);
+    fs_file_unlock(lock);
+    return result;
+}
+
+
+
+
+
+
+/**
+ * Maps part of a file for reading in place. Instead of copying, this returns a pointer
+ * straight into the memory-mapped flash (XIP window), so the caller can parse the data
+ * with no copies and no heap allocations.
+ *
+ * Only bytes stored contiguously in flash can be mapped, which is at most the rest of one
+ * block's payload. The returned length stops at the end of the file, at len, or at the end
+ * of the payload; call again with a larger offset to map the rest. A cached copy of the
+ * block is written back first so that the flash holds the latest data.
+ *
+ * The pointer stays valid until the file is written to again or the filesystem is shut down.
+ *
+ * @param file Pointer to the open file.
+ * @param offset Byte offset within the file to map from.
+ * @param len Number of bytes wanted.
+ * @param ptr Receives the address of the first byte in the XIP window.
+ * @return The number of bytes mapped (0 at end of file), or -1 on error.
+ */
+static int fs_map_locked(FS_FILE* file, uint32_t offset, uint32_t len, const void** ptr) {
+    if (file == NULL || file->entry == NULL || ptr == NULL) {
+        printf("Error: Null file or pointer provided.\n");
+        return -1;
+    }
+
+    // Nothing to map at or past the end of the file.
+    if (offset >= file->entry->size || len == 0) {
+        *ptr = NULL;
+        return READ_SUCCESS_NO_DATA;
+    }
+    len = MIN(len, file->entry->size - offset);
+
+    uint32_t block;
+    if (fs_locate_block(file, offset / FS_BLOCK_PAYLOAD_SIZE, &block) != 0) {
+        printf("Error: Offset %u is beyond the block chain.\n", offset);
+        return -1;
+    }
+
+    uint32_t position = offset % FS_BLOCK_PAYLOAD_SIZE;
+    int mapped = MIN(FS_BLOCK_PAYLOAD_SIZE - position, len);
+    uint32_t flashOffset = block * FILESYSTEM_BLOCK_SIZE + position;
+
+    // The XIP window shows the flash itself, so pending writes must reach it first.
+    flash_cache_flush(flashOffset);
+
+    *ptr = (const void *)(XIP_BASE + flashOffset);
+    return mapped;
+}
+
+
+/**
+ * Maps part of an open file; see fs_map_locked().
+ */
+int fs_map(FS_FILE* file, uint32_t offset, uint32_t len, const void** ptr) {
+    mutex_t *lock = fs_file_lock(file);
+    int result = fs_map_locked(file, offset, len, ptr);
+    fs_file_unlock(lock);
+    return result;
+}
+
+
+
+/**
+ * Writes all file data held in the sector cache back to flash.
+ *
+ * fs_write() only updates the RAM copy of a block, so data written since the last sync
+ * is lost on power failure. Call this at points where the data must be durable. Blocks
+ * retired by overwrites are erased and returned to the FAT at the same time.
+ *
+ * @return 0 on success, or -1 if the filesystem is not initialized.
+ */
+static int fs_sync_locked(void) {
+    if (!fs_initialized) {
+        printf("Error: Filesystem not initialized.\n");
+        return -1;
+    }
+
+    flash_cache_sync();
+
+    // Commit the metadata describing the data; only the changed parts are written.
+    if (meta_journal_commit() != JOURNAL_SUCCESS) {
+        return 0;
+    }
+
+    // Blocks replaced by relocated copies are erased here, off the write path, now that no
+    // committed entry refers to them any more. Their release is committed as well.
+    block_log_reclaim();
+    meta_journal_commit();
+    return 0;
+}
+
+
+/**
+ * Syncs while holding the metadata tables exclusively; see fs_sync_locked().
+ */
+int fs_sync(void) {
+    meta_table_lock();
+    int result = fs_sync_locked();
+    meta_table_unlock();
+    return result;
+}
+
+
+
+/**
+ * Finds a block in a file's chain. Blocks of the contiguous extent are found directly.
+ *
+ * @param index Receives the position of the block in the file, counted in blocks.
+ * @param previous Receives the block before it, or FAT_ENTRY_END if it is the first.
+ * @return true if the block belongs to the file.
+ */
+static bool wear_level_find(const FileEntry *entry, uint32_t block, uint32_t *index, uint32_t *previous) {
+    if (block >= entry->start_block && block - entry->start_block < entry->extent_blocks) {
+        *index = block - entry->start_block;
+        *previous = (*index > 0) ? block - 1 : FAT_ENTRY_END;
+        return true;
+    }
+    uint32_t prev = FAT_ENTRY_END;
+    uint32_t current = entry->start_block;
+    uint32_t blocks = entry->size / FS_BLOCK_PAYLOAD_SIZE + 1;
+    for (uint32_t i = 0; i < blocks && current != FAT_ENTRY_END; i++) {
+        if (current == block) {
+            *index = i;
+            *previous = prev;
+            return true;
+        }
+        prev = current;
+        if (fat_get_next_block(prev, &current) != FAT_SUCCESS) {
+            return false;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Finds a block in a file's chain that may be moved: blocks the file shares with copies of
+ * it (see fs_cp()) stay where they are, since only this file's chain would be relinked.
+ */
+static bool wear_level_locate(const FileEntry *entry, uint32_t block, uint32_t *index, uint32_t *previous) {
+    return wear_level_find(entry, block, index, previous)
+        && fs_first_shared_block(entry, *index + 1) == UINT32_MAX;
+}
+
+
+/**
+ * Returns the file a block of data belongs to, by the owner recorded in its trailer.
+ */
+static const FileEntry *wear_level_owner(uint32_t owner_id) {
+    int slot = file_index_find_id(owner_id);
+    const FileEntry *entry = (slot >= 0) ? file_entry_peek(slot) : NULL;
+    return (entry != NULL && entry->in_use && !entry->is_directory) ? entry : NULL;
+}
+
+
+/**
+ * Looks at the next WEAR_LEVEL_SCAN_BLOCKS blocks for sealed file data that is at least
+ * WEAR_LEVEL_THRESHOLD erases behind the most worn block. When one is found and a free block
+ * is worn well beyond it, that block is allocated and the move begins.
+ */
+static void wear_level_scan(void) {
+    uint32_t max = wear_table_max();
+    for (uint32_t n = 0; n < WEAR_LEVEL_SCAN_BLOCKS; n++) {
+        uint32_t block = wear_level.cursor;
+        wear_level.cursor = (block + 1 < TOTAL_BLOCKS) ? block + 1 : WEAR_LEVEL_FIRST_BLOCK;
+        if (++wear_level.scanned > TOTAL_BLOCKS - WEAR_LEVEL_FIRST_BLOCK) {
+            // All the way round without a cold block: nothing to do until more wear.
+            wear_level.idle_max = max;
+            wear_level.scanned = 0;
+            return;
+        }
+
+        // Only sealed blocks of a live file are moved. Open blocks are still being appended
+        // to, and blocks without a trailer hold metadata.
+        block_trailer trailer;
+        const FileEntry *entry;
+        uint32_t index, previous;
+        if (wear_table_count(block) + WEAR_LEVEL_THRESHOLD > max
+            || !block_log_read_trailer(block, &trailer)
+            || (entry = wear_level_owner(trailer.owner_id)) == NULL
+            || !wear_level_locate(entry, block, &index, &previous)) {
+            continue;
+        }
+
+        uint32_t target = fat_allocate_worn_block(wear_table_count(block) + WEAR_LEVEL_THRESHOLD / 2);
+        if (target == FAT_NO_FREE_BLOCKS) {
+            // The worn blocks are all in use; wait until the hot data wears something further.
+            wear_level.idle_max = max;
+            wear_level.scanned = 0;
+            return;
+        }
+        wear_level.source = block;
+        wear_level.target = target;
+        wear_level.owner_id = trailer.owner_id;
+        wear_level.copied = 0;
+        wear_level.scanned = 0;
+        wear_level.step = WEAR_LEVEL_ERASE;
+        return;
+    }
+}
+
+
+/**
+ * Drops the move under way. The target may hold part of a copy, so it is retired to be
+ * erased by the next fs_sync() rather than freed.
+ */
+static void wear_level_abandon(void) {
+    block_log_retire(wear_level.target);
+    wear_level.step = WEAR_LEVEL_SCAN;
+    wear_level_stats.abandoned++;
 }
 
 
- 
- 
 /**
- * Reads data from an open file into a buffer.
- * 
- * @param file Pointer to the FS_FILE structure representing the open file.
- * @param buffer Pointer to the buffer where the read data should be stored.
- * @param size The number of bytes to read.
- * @return The number of bytes actually read, or -1 on error.
+ * Puts the copy in place of the source block in the file's chain, provided the file still
+ * holds the same data there, and commits the new links and entry in one journal commit. The
+ * source is retired, so until that commit the chain on flash stays intact.
+ *
+ * @return 1 if the block was moved, or 0 if the move was dropped.
  */
-int fs_read(FS_FILE* file, void* buffer, int size) {
-    // Check for NULL pointers to ensure the file and buffer are valid.
-    if (file == NULL || buffer == NULL) {
-        printf("Error: Null file or buffer pointer provided.\n");
-        return -1; // Return -1 to indicate an error due to invalid input.
+static int wear_level_commit(void) {
+    int slot = file_index_find_id(wear_level.owner_id);
+    FileEntry *entry = (slot >= 0) ? file_entry_at(slot) : NULL;
+    uint32_t index, previous;
+    bool same = entry != NULL && entry->in_use && wear_level_locate(entry, wear_level.source, &index, &previous);
+
+    // The source may have changed through the cache while it was copied.
+    uint8_t page[FLASH_PAGE_SIZE];
+    for (uint32_t offset = 0; same && offset < FILESYSTEM_BLOCK_SIZE; offset += FLASH_PAGE_SIZE) {
+        same = flash_cache_read(wear_level.source * FILESYSTEM_BLOCK_SIZE + offset, page, FLASH_PAGE_SIZE) == FLASH_CACHE_SUCCESS
+            && memcmp(page, (const void *)(XIP_BASE + wear_level.target * FILESYSTEM_BLOCK_SIZE + offset), FLASH_PAGE_SIZE) == 0;
     }
-
-    // Validate the requested size and the file mode (must be either 'r' for read or 'a' for append).
-    if (size <= 0 || (file->mode != 'r' && file->mode != 'a')) {
-        printf("Error: Invalid read request.\n");
-        return -1; // Return -1 to indicate an error due to invalid size or inappropriate file mode.
+    if (!same) {
+        wear_level_abandon();
+        return 0;
     }
 
-    // Initialize variables to track the current block and the current position within that block.
-    uint32_t currentBlock = file->entry->start_block;
-    uint32_t currentBlockPosition = file->position % FILESYSTEM_BLOCK_SIZE;
-    uint8_t* readBuffer = (uint8_t*)buffer; // Cast buffer to uint8_t* for byte-level operations.
-    int totalBytesRead = 0; // Track the total number of bytes successfully read.
-    int remainingSize = size; // Track the remaining number of bytes to read.
+    fs_replace_block(entry, index, previous, wear_level.source, wear_level.target);
+    block_log_retire(wear_level.source);
+    meta_journal_commit();
+    wear_level.step = WEAR_LEVEL_SCAN;
+    wear_level_stats.migrations++;
+    return 1;
+}
 
-    // Continue reading while there are bytes remaining and the current block is not the end of the file.
-    while (remainingSize > 0 && currentBlock != FAT_ENTRY_END) {
-        // Calculate the number of bytes to read in this iteration.
-        int bytesToRead = MIN(FILESYSTEM_BLOCK_SIZE - currentBlockPosition, remainingSize);
-        // Calculate the offset in flash where the current block's data starts.
-        uint32_t readOffset = currentBlock * FILESYSTEM_BLOCK_SIZE + currentBlockPosition;
 
-        // Perform the read operation from flash storage.
-        flash_read_safe(readOffset, readBuffer, bytesToRead);
+/**
+ * Runs static wear levelling for about budget_us microseconds.
+ *
+ * Dynamic wear levelling only spreads the erases of blocks that get rewritten; blocks holding
+ * files that never change are never erased at all. This moves such data, a block at a time,
+ * onto the most worn free blocks, once it sits WEAR_LEVEL_THRESHOLD erases behind the most
+ * worn block. The worn blocks then rest under data that does not change, and the little-worn
+ * blocks go back into circulation.
+ *
+ * The work is split into steps that each take one flash operation or less, and a step is
+ * only started if its last duration still fits the budget. The first step of a call always
+ * runs, so a call takes at most the budget or one sector erase, whichever is longer.
+ * fs_write() calls this with WEAR_LEVEL_SLICE_US.
+ *
+ * @param budget_us Time to spend, in microseconds.
+ * @return The number of blocks moved, or -1 if the filesystem is not initialized.
+ */
+static int fs_wear_level_locked(uint32_t budget_us) {
+    if (!fs_initialized) {
+        return -1;
+    }
+    uint32_t max = wear_table_max();
+    if (wear_level.step == WEAR_LEVEL_SCAN && (max < WEAR_LEVEL_THRESHOLD || max == wear_level.idle_max)) {
+        return 0;
+    }
 
-        // Update the buffer pointer, total bytes read, and remaining size.
-        readBuffer += bytesToRead;
-        totalBytesRead += bytesToRead;
-        remainingSize -= bytesToRead;
-        // Update the file position.
-        file->position += bytesToRead;
-        // Recalculate the current block position.
-        currentBlockPosition = (file->position % FILESYSTEM_BLOCK_SIZE);
+    uint64_t began = time_us_64();
+    int moved = 0;
+    bool worked = false;
+    for (;;) {
+        uint64_t now = time_us_64();
+        wear_level_step step = wear_level.step;
+        if (worked && (now - began) + wear_level.step_us[step] > budget_us) {
+            break;
+        }
 
-        // If the end of the block is reached and there are still bytes to read, move to the next block.
-        if (currentBlockPosition == 0 && remainingSize > 0) {
-            uint32_t nextBlock;
-            // Fetch the next block from the FAT.
-            if (fat_get_next_block(currentBlock, &nextBlock) == FAT_SUCCESS && nextBlock != FAT_ENTRY_END) {
-                currentBlock = nextBlock;
-            } else {
-                printf("End of file chain reached or no next block available. Current block: %u, \n", currentBlock);
-                break; // Break the loop if no more blocks are available or an error occurred.
+        switch (step) {
+            case WEAR_LEVEL_SCAN:
+                wear_level_scan();
+                break;
+            case WEAR_LEVEL_ERASE:
+                if (block_log_prepare_run(wear_level.target, 1) == BLOCK_LOG_SUCCESS) {
+                    wear_level.step = WEAR_LEVEL_COPY;
+                } else {
+                    wear_level_abandon();
+                }
+                break;
+            case WEAR_LEVEL_COPY: {
+                uint8_t page[FLASH_PAGE_SIZE];
+                uint32_t offset = wear_level.copied;
+                if (flash_cache_read(wear_level.source * FILESYSTEM_BLOCK_SIZE + offset, page, FLASH_PAGE_SIZE) != FLASH_CACHE_SUCCESS
+                    || flash_program_safe(wear_level.target * FILESYSTEM_BLOCK_SIZE + offset, page, FLASH_PAGE_SIZE, NULL) != FLASH_PROGRAM_SUCCESS) {
+                    wear_level_abandon();
+                } else if ((wear_level.copied += FLASH_PAGE_SIZE) == FILESYSTEM_BLOCK_SIZE) {
+                    wear_level.step = WEAR_LEVEL_COMMIT;
+                }
+                break;
             }
+            default:
+                moved += wear_level_commit();
+                break;
+        }
+
+        uint32_t took = (uint32_t)(time_us_64() - now);
+        wear_level.step_us[step] = took;
+        if (took > wear_level_stats.max_step_us) {
+            wear_level_stats.max_step_us = took;
+        }
+        worked = true;
+        if (wear_level.step == WEAR_LEVEL_SCAN && wear_level.idle_max == wear_table_max()) {
+            break;
         }
     }
-    return totalBytesRead; // Return the total number of bytes read.
+
+    uint32_t elapsed = (uint32_t)(time_us_64() - began);
+    wear_level_stats.slices++;
+    if (elapsed > wear_level_stats.max_slice_us) {
+        wear_level_stats.max_slice_us = elapsed;
+    }
+    return moved;
 }
 
 
+/**
+ * Runs a wear levelling slice while holding the metadata tables exclusively; see fs_wear_level_locked().
+ */
+int fs_wear_level(uint32_t budget_us) {
+    meta_table_lock();
+    int result = fs_wear_level_locked(budget_us);
+    meta_table_unlock();
+    return result;
+}
+
+
+/**
+ * Copies out the static wear levelling counters.
+ */
+void fs_get_wear_level_stats(fs_wear_level_stats *stats) {
+    *stats = wear_level_stats;
+}
 
 
 
@@ -429,7 +1724,7 @@ int fs_read(FS_FILE* file, void* buffer, int size) {
  * @return 0 if successful, or -1 if an error occurred (such as attempting to seek
  *         to an invalid position or passing an invalid file pointer or whence value).
  */
-int fs_seek(FS_FILE* file, long offset, int whence) {
+static int fs_seek_locked(FS_FILE* file, long offset, int whence) {
     if (file == NULL) {
         printf("Error: Null file pointer provided.\n");
         return -1;  // Error due to invalid file pointer
@@ -466,6 +1761,106 @@ int fs_seek(FS_FILE* file, long offset, int whence) {
     file->position = new_position;
     return 0; // Success indicates the new position was set without issues
 }
+
+
+/**
+ * Moves the position of an open file; see fs_seek_locked().
+ */
+int fs_seek(FS_FILE* file, long offset, int whence) {
+    mutex_t *lock = fs_file_lock(file);
+    int result = fs_seek_locked(file, offset, whence);
+    fs_file_unlock(lock);
+    return result;
+}
+
+
+
+/**
+ * Reserves flash space for a file ahead of writing it. The missing blocks are taken as one
+ * physically contiguous extent, placed right after the file's last block when possible, and
+ * erased up front so that later writes into them are plain programs. While a file's blocks
+ * stay contiguous, seeks and reads find any block directly instead of walking the FAT.
+ *
+ * The file size does not change; the reserved blocks are filled by fs_write() as usual.
+ *
+ * @param file Pointer to a file opened for writing or appending.
+ * @param bytes Total number of bytes the file should have room for.
+ * @return 0 on success (including when enough space is already reserved), or -1 if the
+ *         arguments are invalid or no run of free blocks is long enough.
+ */
+static int fs_reserve_locked(FS_FILE* file, uint32_t bytes) {
+    if (file == NULL || file->entry == NULL) {
+        printf("Error: Null file pointer provided.\n");
+        return -1;
+    }
+    if (file->mode != 'a' && file->mode != 'w') {
+        printf("Error: File not open in a writable or appendable mode.\n");
+        return -1;
+    }
+
+    // Reserved blocks are linked after the last one, which must not be shared with a copy.
+    if (fs_unshare_prefix(file, UINT32_MAX) != 0) {
+        return -1;
+    }
+    FileEntry *entry = file->entry;
+    uint32_t needed = (bytes + FS_BLOCK_PAYLOAD_SIZE - 1) / FS_BLOCK_PAYLOAD_SIZE;
+
+    // Find the last block of the chain and how many blocks the file already owns.
+    uint32_t lastBlock = entry->start_block;
+    uint32_t owned = 1;
+    uint32_t nextBlock;
+    while (fat_get_next_block(lastBlock, &nextBlock) == FAT_SUCCESS && nextBlock != FAT_ENTRY_END) {
+        lastBlock = nextBlock;
+        owned++;
+    }
+    if (needed <= owned) {
+        return 0;
+    }
+
+    uint32_t firstBlock;
+    uint32_t count;
+    if (entry->size == 0 && owned == 1) {
+        // Nothing written yet: move the whole file onto one extent.
+        count = needed;
+        firstBlock = fat_allocate_extent(count, entry->start_block);
+        if (firstBlock == FAT_NO_FREE_BLOCKS) {
+            printf("Error: No run of %u free blocks available.\n", count);
+            return -1;
+        }
+        fat_free_block(entry->start_block);
+        entry->start_block = firstBlock;
+        entry->extent_blocks = count;
+        entry->chain_version++;
+    } else {
+        count = needed - owned;
+        firstBlock = fat_allocate_extent(count, lastBlock + 1);
+        if (firstBlock == FAT_NO_FREE_BLOCKS) {
+            printf("Error: No run of %u free blocks available.\n", count);
+            return -1;
+        }
+        fat_link_blocks(lastBlock, firstBlock);
+        if (entry->extent_blocks == owned && firstBlock == entry->start_block + owned) {
+            entry->extent_blocks += count;
+        }
+    }
+
+    if (block_log_prepare_run(firstBlock, count) != BLOCK_LOG_SUCCESS) {
+        printf("Error: Failed to erase reserved blocks at %u.\n", firstBlock);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Reserves space for an open file; see fs_reserve_locked().
+ */
+int fs_reserve(FS_FILE* file, uint32_t bytes) {
+    mutex_t *lock = fs_file_lock(file);
+    int result = fs_reserve_locked(file, bytes);
+    fs_file_unlock(lock);
+    return result;
+}
  
 
 
@@ -474,36 +1869,27 @@ int fs_seek(FS_FILE* file, long offset, int whence) {
 
 
 /**
- * Copies a file from the source path to the destination path, ensuring not to overwrite existing files
- * in the destination by appending "Copy" to the file name if necessary.
+ * Opens the source of a copy for reading and creates the copy, ensuring not to overwrite
+ * existing files in the destination by appending "Copy" to the file name if necessary.
+ * Nothing is committed: the caller commits once the copy has its contents.
  *
  * @param source_path The path to the source file.
  * @param dest_path The path to the destination where the file should be copied.
+ * @param source Receives the source, open for reading.
+ * @param copy Receives the new, empty copy, open for writing.
  * @return Returns 0 on success, -1 on error.
  */
-int fs_cp(const char* source_path, const char* dest_path) {
-    // Extract the directory and filename parts from both source and destination paths using custom function.
-    PathParts old_path = extract_last_two_parts(source_path);
-    PathParts new_path = extract_last_two_parts(dest_path);
-
-    // Store filenames and directory paths from the extracted path parts.
-    char* source_filename = old_path.filename;
-    char* source_directory_path = old_path.directory;
-    char* dest_directory_path = new_path.directory;
-    char* dest_filename = new_path.filename;
-    
-    // Initially set destination filename to be the same as the source filename.
-    strcpy(dest_filename, source_filename);
+static int fs_cp_open(const char* source_path, const char* dest_path, FS_FILE** source, FS_FILE** copy) {
+    // Walk both paths to the directories they end in, splitting off the file names. The
+    // copy keeps the source's name; the last component of the destination path is not used.
+    char source_filename[NAME_POOL_MAX_LENGTH + 1];
+    char dest_filename[NAME_POOL_MAX_LENGTH + 1];
 
-    // Set the default directory path to "/root" if no specific directory is provided in the paths.
-    set_default_path(dest_directory_path, "/root");
-    set_default_path(source_directory_path, "/root");
-     
     // Look up the directory entry of the source to get its directory information.
-    DirectoryEntry* directory = DIR_find_directory_entry(source_directory_path);
+    DirectoryEntry* directory = path_walk_parent(source_path, source_filename, sizeof(source_filename));
     if (directory == NULL) {
         // Return error if the source directory does not exist.
-        printf("Error: Source directory '%s' does not exist.\n", source_directory_path);
+        printf("Error: Source directory of '%s' does not exist.\n", source_path);
         return -1;
     }
     // Store the parent directory ID from the source directory entry for later use.
@@ -524,14 +1910,15 @@ int fs_cp(const char* source_path, const char* dest_path) {
     }
     
     // Look up the directory entry of the destination to get its directory information.
-    DirectoryEntry* destDirEntry = DIR_find_directory_entry(dest_directory_path);
+    DirectoryEntry* destDirEntry = path_walk_parent(dest_path, dest_filename, sizeof(dest_filename));
     if (!destDirEntry) {
         // Return error if the destination directory does not exist.
-        printf("Error: Destination directory '%s' does not exist.\n", dest_directory_path);
+        printf("Error: Destination directory of '%s' does not exist.\n", dest_path);
         return -1;
     }
     // Store the parent directory ID from the destination directory entry for later use.
     uint32_t dest_directory_parentDirId = destDirEntry->currentDirId;
+    strcpy(dest_filename, source_filename);
 
     // Check if the filename already exists in the destination directory.
     int check = find_file_existance(dest_filename, dest_directory_parentDirId);
@@ -551,13 +1938,21 @@ int fs_cp(const char* source_path, const char* dest_path) {
         strcpy(dest_filename, source_filename);
     }
 
-    // Construct the full paths for the source and destination files based on the directory and filename.
-    char dest_full_path[256], source_full_path[256];
+    // Construct the full path of the copy from the destination's directories and its name.
+    char dest_directory_path[256], dest_full_path[256];
+    const char* dest_slash = strrchr(dest_path, '/');
+    size_t dest_directory_length = (dest_slash != NULL) ? (size_t)(dest_slash - dest_path) : 0;
+    if (dest_directory_length >= sizeof(dest_directory_path)) {
+        printf("Error: Destination path '%s' is too long.\n", dest_path);
+        return -1;
+    }
+    memcpy(dest_directory_path, dest_path, dest_directory_length);
+    dest_directory_path[dest_directory_length] = '\0';
+    set_default_path(dest_directory_path, "/root");
     construct_full_path(dest_directory_path, dest_filename, dest_full_path, sizeof(dest_full_path));
-    construct_full_path(source_directory_path, source_filename, source_full_path, sizeof(source_full_path));
 
     // Open the destination file with write permission to create a new or overwrite an existing file.
-    FS_FILE* fileCopy = fs_open(dest_full_path, "w");
+    FS_FILE* fileCopy = fs_open_locked(dest_full_path, "w");
     if (fileCopy == NULL) {
         // Return error if opening the file fails.
         printf("Error: Failed to open file '%s' for copying.\n", dest_filename);
@@ -565,24 +1960,241 @@ int fs_cp(const char* source_path, const char* dest_path) {
     }
 
     // Open the source file with read permission to read the contents.
-    FS_FILE* oldfile = fs_open(source_full_path, "r");
+    FS_FILE* oldfile = fs_open_locked(source_path, "r");
     if (oldfile == NULL) {
         // Return error if opening the file fails.
         printf("Error: Failed to open file '%s' for reading.\n", source_filename);
+        fs_close(fileCopy);
+        return -1;
+    }
+    *source = oldfile;
+    *copy = fileCopy;
+    return 0;
+}
+
+
+/**
+ * Copies a file from the source path to the destination path, ensuring not to overwrite existing files
+ * in the destination by appending "Copy" to the file name if necessary. The copy is created
+ * and given the source's blocks in one journal commit, so after a power loss it is either
+ * complete or not there at all.
+ *
+ * @param source_path The path to the source file.
+ * @param dest_path The path to the destination where the file should be copied.
+ * @return Returns 0 on success, -1 on error.
+ */
+static int fs_cp_locked(const char* source_path, const char* dest_path) {
+    FS_FILE* oldfile;
+    FS_FILE* fileCopy;
+    if (fs_cp_open(source_path, dest_path, &oldfile, &fileCopy) != 0) {
         return -1;
     }
 
-    // Set the size and start block of the destination file to match those of the source file.
+    // Share the source's chain instead of copying its data: the copy gives up the block it
+    // was created with and takes a reference to the source's first block. Whichever file is
+    // written first then gets its own copy of the blocks it changes (see fs_unshare_block()).
+    if (fat_ref_block(oldfile->entry->start_block) != 0) {
+        printf("Error: Too many copies share the blocks of '%s'.\n", source_path);
+        fs_close(oldfile);
+        fs_close(fileCopy);
+        return -1;
+    }
+    if (!fat_unref_block(fileCopy->entry->start_block)) {
+        fat_free_block(fileCopy->entry->start_block);
+    }
     fileCopy->entry->size = oldfile->entry->size;
     fileCopy->entry->start_block = oldfile->entry->start_block;
+    fileCopy->entry->extent_blocks = oldfile->entry->extent_blocks;
+    fileCopy->entry->chain_version++;
 
     // Close both file handles after copying is complete.
     fs_close(oldfile);
     fs_close(fileCopy);
+    meta_journal_commit();
 
     return 0;  // Return success after the file is successfully copied.
 }
 
+
+/**
+ * Copies a file while holding the metadata tables exclusively; see fs_cp_locked().
+ */
+int fs_cp(const char* source_path, const char* dest_path) {
+    meta_table_lock();
+    int result = fs_cp_locked(source_path, dest_path);
+    meta_table_unlock();
+    return result;
+}
+
+
+
+/**
+ * Starts a physical copy of a file, for when the copy must not share blocks with its source,
+ * e.g. before a risky update of the source in place. The copy is named as by fs_cp() and
+ * gets one contiguous extent of freshly erased blocks for all of the source's data, which
+ * fs_cp_deep_step() then fills a few blocks at a time.
+ *
+ * The copy holds the bytes copied so far, so a copy that is closed early is a shorter file.
+ *
+ * @param source_path The path to the source file.
+ * @param dest_path The path to the destination where the file should be copied.
+ * @return The copy in progress, or NULL on error.
+ */
+static FS_COPY* fs_cp_deep_open_locked(const char* source_path, const char* dest_path) {
+    FS_COPY* copy = malloc(sizeof(FS_COPY));
+    if (copy == NULL) {
+        printf("Error: Memory allocation failed for FS_COPY.\n");
+        return NULL;
+    }
+    if (fs_cp_open(source_path, dest_path, &copy->source, &copy->copy) != 0) {
+        free(copy);
+        return NULL;
+    }
+
+    FileEntry* source = copy->source->entry;
+    FileEntry* entry = copy->copy->entry;
+    copy->source_id = source->unique_file_id;
+    copy->source_version = source->chain_version;
+    copy->source_size = source->size;
+    copy->next_block = source->start_block;
+    copy->blocks = (source->size + FS_BLOCK_PAYLOAD_SIZE - 1) / FS_BLOCK_PAYLOAD_SIZE;
+    copy->copied = 0;
+    copy->first_block = entry->start_block;
+
+    // The copy gives up the block it was created with for an extent holding all of the data.
+    if (copy->blocks > 0) {
+        uint32_t firstBlock = fat_allocate_extent(copy->blocks, entry->start_block);
+        if (firstBlock == FAT_NO_FREE_BLOCKS) {
+            printf("Error: No run of %u free blocks available for a copy of '%s'.\n", copy->blocks, source_path);
+            fs_close(copy->source);
+            fs_close(copy->copy);
+            free(copy);
+            return NULL;
+        }
+        fat_free_block(entry->start_block);
+        entry->start_block = firstBlock;
+        entry->extent_blocks = copy->blocks;
+        entry->chain_version++;
+        copy->first_block = firstBlock;
+    }
+    meta_journal_commit();
+    return copy;
+}
+
+
+/**
+ * Starts a physical copy while holding the metadata tables exclusively; see
+ * fs_cp_deep_open_locked().
+ */
+FS_COPY* fs_cp_deep_open(const char* source_path, const char* dest_path) {
+    meta_table_lock();
+    FS_COPY* copy = fs_cp_deep_open_locked(source_path, dest_path);
+    meta_table_unlock();
+    return copy;
+}
+
+
+/**
+ * Copies the next blocks of a physical copy started by fs_cp_deep_open(). The blocks are
+ * erased with the largest erase commands that fit, then each is read from the XIP window
+ * and programmed as one batch of pages (see block_log_copy_block()), staged in the copy's
+ * own buffer. The time a call takes is bounded by max_blocks, so a large file can be copied
+ * between other work.
+ *
+ * @param copy The copy in progress.
+ * @param max_blocks Most blocks to copy in this call.
+ * @return The number of blocks left to copy, 0 once the copy is complete, or -1 if a block
+ *         could not be copied or the source was written to or removed since the copy started.
+ */
+static int fs_cp_deep_step_locked(FS_COPY* copy, uint32_t max_blocks) {
+    if (copy == NULL) {
+        printf("Error: Null copy provided.\n");
+        return -1;
+    }
+    FileEntry* source = copy->source->entry;
+    FileEntry* entry = copy->copy->entry;
+    if (!source->in_use || source->unique_file_id != copy->source_id
+        || source->chain_version != copy->source_version || source->size != copy->source_size) {
+        printf("Error: Source of the copy changed before it was complete.\n");
+        return -1;
+    }
+
+    uint32_t count = MIN(max_blocks, copy->blocks - copy->copied);
+    if (count == 0) {
+        return copy->blocks - copy->copied;
+    }
+    uint32_t firstTarget = copy->first_block + copy->copied;
+    if (block_log_prepare_run(firstTarget, count) != BLOCK_LOG_SUCCESS) {
+        printf("Error: Failed to erase blocks at %u for the copy.\n", firstTarget);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t start = copy->copied * FS_BLOCK_PAYLOAD_SIZE;
+        uint32_t used = MIN(copy->source_size - start, FS_BLOCK_PAYLOAD_SIZE);
+        if (copy->next_block >= TOTAL_BLOCKS
+            || block_log_copy_block(copy->next_block, used, firstTarget + i, entry->unique_file_id, copy->image) != BLOCK_LOG_SUCCESS) {
+            printf("Error: Failed to copy block %u of '%s'.\n", copy->copied, name_pool_str(&source->filename));
+            meta_journal_commit();
+            return -1;
+        }
+        copy->copied++;
+        entry->size = start + used;
+        if (fat_get_next_block(copy->next_block, &copy->next_block) != FAT_SUCCESS) {
+            copy->next_block = FAT_ENTRY_END;
+        }
+    }
+    meta_journal_commit();
+    return copy->blocks - copy->copied;
+}
+
+
+/**
+ * Advances a physical copy while holding the metadata tables exclusively; see
+ * fs_cp_deep_step_locked().
+ */
+int fs_cp_deep_step(FS_COPY* copy, uint32_t max_blocks) {
+    meta_table_lock();
+    int result = fs_cp_deep_step_locked(copy, max_blocks);
+    meta_table_unlock();
+    return result;
+}
+
+
+/**
+ * Closes the files of a physical copy and frees it, whether or not the copy is complete.
+ */
+void fs_cp_deep_close(FS_COPY* copy) {
+    if (copy == NULL) {
+        return;
+    }
+    fs_close(copy->source);
+    fs_close(copy->copy);
+    free(copy);
+}
+
+
+/**
+ * Copies a file physically, block by block, as fs_cp_deep_open() and fs_cp_deep_step() do;
+ * the metadata tables are released every FS_CP_DEEP_STEP_BLOCKS blocks.
+ *
+ * @param source_path The path to the source file.
+ * @param dest_path The path to the destination where the file should be copied.
+ * @return Returns 0 on success, -1 on error.
+ */
+int fs_cp_deep(const char* source_path, const char* dest_path) {
+    FS_COPY* copy = fs_cp_deep_open(source_path, dest_path);
+    if (copy == NULL) {
+        return -1;
+    }
+    int left;
+    do {
+        left = fs_cp_deep_step(copy, FS_CP_DEEP_STEP_BLOCKS);
+    } while (left > 0);
+    fs_cp_deep_close(copy);
+    return (left == 0) ? 0 : -1;
+}
+
  
 /**
  * Moves a file from one location to another within the filesystem.
@@ -591,15 +2203,11 @@ int fs_cp(const char* source_path, const char* dest_path) {
  * @param new_path New path for the file after moving.
  * @return Returns 0 on success, -1 on error.
  */
-int fs_mv(const char* old_path, const char* new_path){
-    // Extract the directory and filename parts from both the old and new paths.
-    PathParts old_paths = extract_last_two_parts(old_path);
-    PathParts new_paths = extract_last_two_parts(new_path);
-
-    // Store extracted filename and directory path for both source and destination.
-    char* source_filename = old_paths.filename;
-    char* dest_directory_path = new_paths.directory;
-    char* dest_filename = new_paths.filename;
+static int fs_mv_locked(const char* old_path, const char* new_path) {
+    // The file keeps its name; only the directory the new path ends in is used.
+    const char* source_slash = strrchr(old_path, '/');
+    const char* source_filename = (source_slash != NULL) ? source_slash + 1 : old_path;
+    char dest_filename[NAME_POOL_MAX_LENGTH + 1];
 
     // Check if the source filename is empty, which indicates an invalid path.
     if (source_filename[0] == '\0') {
@@ -607,26 +2215,18 @@ int fs_mv(const char* old_path, const char* new_path){
         return -1; // Return error code.
     }
 
-    // Set the destination directory path to "/root" if it is empty, providing a default path.
-    if (dest_directory_path[0] == '\0') {
-        strcpy(dest_directory_path, "/root"); // Default path if empty.
-    }
-
-    // Lookup the directory entry for the destination path to ensure it exists.
-    DirectoryEntry* destDirEntry = DIR_find_directory_entry(dest_directory_path);
+    // Walk the new path to the directory the file moves to, to ensure it exists.
+    DirectoryEntry* destDirEntry = path_walk_parent(new_path, dest_filename, sizeof(dest_filename));
     if (!destDirEntry) {
-        printf("Error: Destination directory '%s' does not exist.\n", dest_directory_path);
+        printf("Error: Destination directory of '%s' does not exist.\n", new_path);
         return -1; // Return error if destination directory does not exist.
     }
 
-    // Simulate a delay which may be used for sync purposes or to mimic I/O delay.
-    sleep_ms(1000);
-
     // Get the unique directory ID from the destination directory entry.
     uint32_t parentID = destDirEntry->currentDirId;
 
     // Open the original file to access its details, including the unique file ID.
-    FS_FILE* oldfile = fs_open(source_filename, "r");
+    FS_FILE* oldfile = fs_open(old_path, "r");
     if (oldfile == NULL) {
         printf("Error: Failed to open file '%s' for reading.\n", source_filename);
         return -1; // Return error if file opening fails.
@@ -639,23 +2239,32 @@ int fs_mv(const char* old_path, const char* new_path){
     int fileIndex = find_file_entry_by_unique_file_id(uniqueIdFile);
     if (fileIndex == -1) {
         printf("Error: File '%s' not found for reading.\n", source_filename);
+        fs_close(oldfile);
         return -1; // Return error if file not found.
     }
 
-    // Update the parent directory ID in the file system to reflect the new location.
-    fileSystem[fileIndex].parentDirId = parentID;
-
-    // Calculate the write offset based on the start block of the file.
-    uint32_t writeOffset = (fileSystem[fileIndex].start_block * FILESYSTEM_BLOCK_SIZE);
+    // Update the parent directory ID in the file table to reflect the new location,
+    // re-indexing the file under its new directory. Only the entry's change is committed;
+    // the file's data blocks are left untouched.
+    dir_unlink_file(fileIndex);
+    file_index_remove(fileIndex);
+    oldfile->entry->parentDirId = parentID;
+    file_index_insert(fileIndex);
+    dir_link_file(fileIndex);
+    fs_close(oldfile);
+    meta_journal_commit();
+    return 0; // Return success.
+}
 
-    // Write the updated file entry back to the flash memory to finalize the move.
-    flash_write_safe(writeOffset, (const uint8_t*)&fileSystem[fileIndex], sizeof(FileEntry));
 
-    // Confirm the move operation has been completed successfully.
-    printf("Data written to file.\n");
-    printf("File '%s' successfully copied to '%s'.\n", source_filename, dest_directory_path);
-    
-    return 0; // Return success.
+/**
+ * Moves a file while holding the metadata tables exclusively; see fs_mv_locked().
+ */
+int fs_mv(const char* old_path, const char* new_path) {
+    meta_table_lock();
+    int result = fs_mv_locked(old_path, new_path);
+    meta_table_unlock();
+    return result;
 }
 
 
@@ -667,7 +2276,7 @@ int fs_mv(const char* old_path, const char* new_path){
  * @param path The path of the file to be removed.
  * @return Returns 0 on success, negative values on error.
  */
-int fs_rm(const char* path) {
+static int fs_rm_locked(const char* path) {
     // First, check if the provided file path is NULL to ensure it is valid.
     if (!path) {
         printf("Error: Path is NULL.\n");
@@ -675,24 +2284,17 @@ int fs_rm(const char* path) {
         return -1; // Return error for invalid argument.
     }   
 
-    // Extract the last two parts of the path which include the filename and its immediate directory.
-    PathParts new_path = extract_last_two_parts(path);
-    char* source_filename = new_path.filename;
-    char* source_directory_path = new_path.directory;
-
-    // Set the default path to "/root" if the extracted directory path is empty.
-    set_default_path(source_directory_path, "/root");
-
-    // Try to find the directory entry using the possibly updated directory path.
-    DirectoryEntry* directory = DIR_find_directory_entry(source_directory_path);
+    // Walk the path to the directory holding the file, splitting off the file name.
+    char source_filename[NAME_POOL_MAX_LENGTH + 1];
+    DirectoryEntry* directory = path_walk_parent(path, source_filename, sizeof(source_filename));
     if (directory == NULL) {
-        printf("Error: Source directory '%s' does not exist.\n", source_directory_path);
+        printf("Error: Source directory of '%s' does not exist.\n", path);
         return -1; // Return error if the directory does not exist.
     }
     uint32_t source_directory_parentDirId = directory->currentDirId;
 
-    // Attempt to find the file entry within the identified directory using the provided path.
-    FileEntry* fileEntry = FILE_find_file_entry(path, source_directory_parentDirId);
+    // Attempt to find the file entry within the identified directory by its name.
+    FileEntry* fileEntry = FILE_find_file_entry(source_filename, source_directory_parentDirId);
     if (!fileEntry) {
         printf("Error: File '%s' not found.\n", path);
         fflush(stdout);
@@ -720,6 +2322,11 @@ int fs_rm(const char* path) {
             break; // Break out of the loop on error.
         }
 
+        // A block still used by a copy of the file keeps the rest of the chain for the copy.
+        if (fat_unref_block(currentBlock)) {
+            break;
+        }
+
         // Free the current block and move to the next.
         fat_free_block(currentBlock);
 
@@ -731,35 +2338,48 @@ int fs_rm(const char* path) {
         currentBlock = nextBlock;
     }
 
-    // Reset the file entry data to default values and mark it as not in use.
+    // Drop the file from its directory's list and the lookup indexes and release its name,
+    // then reset the entry and mark it as not in use.
+    int fileIndex = file_entry_slot(fileEntry);
+    dir_unlink_file(fileIndex);
+    fileEntry = file_entry_at(fileIndex);
+    file_index_remove(fileIndex);
+    name_pool_clear(&fileEntry->filename);
     memset(fileEntry, 0, sizeof(FileEntry));
     fileEntry->in_use = false;
+    meta_journal_commit();
 
     printf("File '%s' successfully removed.\n", path);
 
-    // Locate the file in the filesystem array and update its status to not in use.
-    int fileIndex = find_file_entry_by_name(path);
-    if (fileIndex == -1) {
-        printf("Error: File '%s' not found for reading.\n", path);
-        return -1; // Return error if file index is not found.
-    }
-    fileSystem[fileIndex].in_use = false;
-
     fflush(stdout);
     return 0; // Return success indicating the file was successfully removed.
 }
 
 
+/**
+ * Removes a file while holding the metadata tables exclusively; see fs_rm_locked().
+ */
+int fs_rm(const char* path) {
+    meta_table_lock();
+    int result = fs_rm_locked(path);
+    meta_table_unlock();
+    return result;
+}
+
+
 
 
 
 /**
  * Securely wipes a file from the filesystem, erasing its contents and freeing its blocks.
+ * Blocks a copy of the file still uses are left to the copy. The others are erased by a
+ * sync before this returns (with the flush worker running, the erases are queued and reads
+ * already see the blocks erased).
  *
  * @param path The path of the file to be wiped.
  * @return Returns 0 on success, or negative error codes on failure.
  */
-int fs_wipe(const char* path){
+static int fs_wipe_locked(const char* path) {
     // Check if the provided file path is NULL, ensuring the path is valid before proceeding.
     if (!path) {
         printf("Error: Path is NULL.\n");
@@ -767,24 +2387,17 @@ int fs_wipe(const char* path){
         return -1; // Return error indicating invalid arguments.
     }
 
-    // Extract the directory and filename from the provided path to find the file in the filesystem.
-    PathParts new_path = extract_last_two_parts(path);
-    char* source_filename= new_path.filename;
-    char* source_directory_path= new_path.directory;
-
-    // Default to "/root" directory if no specific directory path is extracted.
-    set_default_path(source_directory_path, "/root");
-     
-    // Attempt to locate the directory in the filesystem where the file should be located.
-    DirectoryEntry* directory = DIR_find_directory_entry(source_directory_path);
+    // Walk the path to the directory where the file should be located.
+    char source_filename[NAME_POOL_MAX_LENGTH + 1];
+    DirectoryEntry* directory = path_walk_parent(path, source_filename, sizeof(source_filename));
     if (directory == NULL) {
-        printf("Error: Source directory '%s' does not exist.\n", source_directory_path);
+        printf("Error: Source directory of '%s' does not exist.\n", path);
         return -1; // Return error if the directory does not exist.
     }
     uint32_t source_directory_parentDirId = directory->currentDirId;
 
     // Find the file entry within the identified directory.
-    FileEntry* fileEntry = FILE_find_file_entry(path, source_directory_parentDirId);
+    FileEntry* fileEntry = FILE_find_file_entry(source_filename, source_directory_parentDirId);
     if (!fileEntry) {
         printf("Error: File '%s' not found.\n", path);
         fflush(stdout);
@@ -798,8 +2411,21 @@ int fs_wipe(const char* path){
         return -3; // Return error for attempting to remove a directory with a file removal function.
     }
 
-    // Loop through all blocks assigned to the file, freeing each one.
+    // The entry's slot in the file table, which is about to be cleared.
+    int fileIndex = file_entry_slot(fileEntry);
     uint32_t currentBlock = fileEntry->start_block;
+
+    // Drop the file from its directory's list and the lookup indexes, release its name and
+    // reset the entry, clearing all its properties. A commit made from here on no longer
+    // refers to the file's blocks.
+    dir_unlink_file(fileIndex);
+    fileEntry = file_entry_at(fileIndex);
+    file_index_remove(fileIndex);
+    name_pool_clear(&fileEntry->filename);
+    memset(fileEntry, 0, sizeof(FileEntry));
+
+    // Loop through all blocks that belonged to the file, retiring each one for erasure once
+    // its link to the next has been read.
     uint32_t nextBlock;
     int result;
 
@@ -811,10 +2437,15 @@ int fs_wipe(const char* path){
             break; // Exit the loop on error.
         }
 
-        // Free the current block and prepare to move to the next.
-        fat_free_block(currentBlock);
+        // A block still used by a copy of the file keeps the rest of the chain for the copy.
+        if (fat_unref_block(currentBlock)) {
+            break;
+        }
 
-        // Break the loop if there are no more blocks to free.
+        // Retire the current block and prepare to move to the next.
+        block_log_retire(currentBlock);
+
+        // Break the loop if there are no more blocks to wipe.
         if (nextBlock == FAT_ENTRY_END || nextBlock >= TOTAL_BLOCKS) {
             break;
         }
@@ -822,23 +2453,24 @@ int fs_wipe(const char* path){
         currentBlock = nextBlock;
     }
 
-    // Locate the file in the filesystem array and mark it as not in use.
-    int fileIndex = find_file_entry_by_name(path);
-    if (fileIndex == -1) {
-        printf("Error: File '%s' not found for reading.\n", path);
-        return -1; // Return error if the file index is not found.
-    }
-    uint32_t writeOffset = (fileSystem[fileIndex].start_block * FILESYSTEM_BLOCK_SIZE);
-
-    // Erase the flash memory at the location of the file to securely wipe its data.
-    flash_erase_safe(writeOffset);
-
-    // Reset the file entry to zero, clearing all its properties.
-    memset(&fileSystem[fileIndex], 0, sizeof(FileEntry));
+    // Once the data written so far is on flash and the removal is committed, nothing refers
+    // to the blocks any more, and the sync erases and frees them.
+    fs_sync_locked();
     
     fflush(stdout);
     return 0; // Return success after the file has been securely wiped.
 }
 
 
+/**
+ * Wipes a file while holding the metadata tables exclusively; see fs_wipe_locked().
+ */
+int fs_wipe(const char* path) {
+    meta_table_lock();
+    int result = fs_wipe_locked(path);
+    meta_table_unlock();
+    return result;
+}
+
+
 
@@ -11,9 +11,13 @@
 #include "../config/flash_config.h"    
 #include "../FAT/fat_fs.h"            
 #include "../flash/flash_ops.h"       
+#include "../flash/block_log.h"
 #include "../filesystem/filesystem.h"  
 #include "../directory/directories.h"
 #include "../filesystem/filesystem_helper.h" 
+#include "../filesystem/file_index.h"
+#include "../filesystem/meta_table.h"
+#include "../filesystem/name_pool.h"
 #include "../directory/directory_helpers.h"
 
 
@@ -56,65 +60,54 @@ void prepend_slash(const char* path, char* buffer, size_t buffer_size) {
 
 
 
+/**
+ * Finds a file entry by name in any directory, using the name hash index of the root
+ * directory first and falling back to a scan of all entries for other directories.
+ *
+ * @param filename The name of the file, with or without a leading slash.
+ * @return The slot of the file in the file table, or -1 if not found.
+ */
 int find_file_entry_by_name(const char* filename) {
-
-    char path[1024]; // Define a sufficiently large buffer for the path
-    prepend_slash(filename, path, sizeof(path));
-    
-    if (path == NULL) {
+    if (filename == NULL) {
         printf("Error: Filename is NULL.\n");
         return -1;
     }
 
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (fileSystem[i].in_use && strcmp(fileSystem[i].filename, path) == 0) {
-            printf("File found: %s at index %d\n", path, i);
+    int index = file_index_find(filename, get_root_directory_id());
+    if (index >= 0) {
+        return index;
+    }
+
+    const char* key = file_index_key(filename);
+    uint32_t count = file_entry_count();
+    for (uint32_t i = 0; i < count; i++) {
+        FileEntry* entry = file_entry_at(i);
+        if (entry != NULL && entry->in_use && name_pool_equals(&entry->filename, key)) {
             return i;
         }
     }
 
-    printf("File not found: %s\n", path);
+    printf("File not found: %s\n", filename);
     return -1; // File not found
 }
 
 
 /**
  * Checks for the existence of a file within a filesystem based on its name and parent directory ID.
- * 
- * This function searches through the global filesystem array to find a file that matches
- * both the provided filename and parent directory identifier. It also ensures the filename
- * starts with a slash for consistency in comparisons.
  *
- * @param filename The name of the file to search for, which may not initially include a leading slash.
+ * The file is looked up in the name hash index, so the cost does not grow with the number
+ * of files. A leading slash on the name is ignored.
+ *
+ * @param filename The name of the file to search for, with or without a leading slash.
  * @param parentID The identifier of the parent directory in which the file is supposed to exist.
  * @return Returns 0 if the file is found, -1 if not found or if there is an error (e.g., NULL filename).
  */
 int find_file_existance(const char* filename, uint32_t parentID) {
-    // Define a sufficiently large buffer for the path to accommodate the filename with a leading slash.
-    char path[1024];
-
-    // Prepend a slash to the filename to ensure consistent formatting in the filesystem.
-    prepend_slash(filename, path, sizeof(path));
-
-    // Check if the filename after modification is NULL, which should never be true given the buffer handling.
-    if (path == NULL) {
+    if (filename == NULL) {
         printf("Error: Filename processing failed or filename is NULL.\n");
         return -1;
     }
-
-    // Loop through all file entries in the global file system array to find a match.
-    for (int i = 0; i < MAX_FILES; i++) {
-        // Check if the current file entry is in use and matches both the filename and parent directory ID.
-        if (fileSystem[i].in_use && strcmp(fileSystem[i].filename, path) == 0 && fileSystem[i].parentDirId == parentID) {
-            // If a matching file is found, print its details and return 0.
-            printf("File found: %s at index %d\n", path, i);
-            return 0;  // File exists
-        }
-    }
-
-    // If no matching file is found after checking all entries, print a not found message and return -1.
-    printf("File not found: %s\n", path);
-    return -1;  // File not found
+    return (file_index_find(filename, parentID) >= 0) ? 0 : -1;
 }
 
 
@@ -166,29 +159,18 @@ uint32_t generateUniqueId() {
 
 
 /**
- * Searches for a file entry in the global fileSystem array by a unique identifier.
- * This function iterates through the fileSystem array, checking each entry to see if it is in use
- * and if its unique identifier matches the one provided.
+ * Searches for a file entry in the file table by a unique identifier.
+ * The ID is looked up in the unique ID hash index rather than compared against every entry.
  *
  * @param unique_file_id The unique identifier of the file to locate.
- * @return The index of the file in the fileSystem array if found, or -1 if no matching file is found.
+ * @return The slot of the file in the file table if found, or -1 if no matching file is found.
  */
 int find_file_entry_by_unique_file_id(uint32_t unique_file_id) {
-    // Iterate over each file entry in the global fileSystem array.
-    for (int i = 0; i < MAX_FILES; i++) {
-        // Check if the current file entry is in use and if the unique ID matches the one being searched for.
-        if (fileSystem[i].in_use && fileSystem[i].unique_file_id == unique_file_id) {
-            // If a match is found, print the index at which the file is located for verification.
-            printf("File found at index %d\n", i);
-            
-            // Return the index of the file entry, indicating where it was found.
-            return i;
-        }
+    int index = file_index_find_id(unique_file_id);
+    if (index == -1) {
+        printf("File not found:\n");
     }
-
-    // If no file with the given unique ID is found after checking all entries, print a message to indicate this.
-    printf("File not found:\n");
-    return -1; // Return -1 to indicate that the file was not found in the file system.
+    return index;
 }
 
 
@@ -211,48 +193,68 @@ FileEntry* createFileEntry(const char* path,  uint32_t parentDirId) {
     if (parentDirId == 0) {
         parentDirId = get_root_directory_id();
     }
-    printf("debug createFileEntry for path: %s\n", path);
-    sleep_ms(1000);
-
-    sleep_ms(1000);
-    printf("debug createFileEntry for path: %s\n", path);
-    for (int i = 0; i < MAX_FILES; i++) {
-        printf("Checking file entry at index %d\n", i);
-        sleep_ms(100);
-        if (!fileSystem[i].in_use) {
-            printf("Creating new file entry at index %d\n", i);
-            // printf("Root directory ID: %u\n", rootDirId);
-            strncpy(fileSystem[i].filename, path, sizeof(fileSystem[i].filename) - 1);
-            printf("Filename: %s\n", fileSystem[i].filename);
-            fileSystem[i].filename[sizeof(fileSystem[i].filename) - 1] = '\0';
-            fileSystem[i].in_use = true;
-            fileSystem[i].is_directory = false; // Default to file
-            fileSystem[i].size = 0;
-            
-            fileSystem[i].start_block = fat_allocate_block();
-            fileSystem[i].parentDirId = parentDirId;
-            fileSystem[i].unique_file_id = generateUniqueId();
-
-            printf("New file created: %s\n", fileSystem[i].filename);
-            printf("Start block: %u\n", fileSystem[i].start_block);
-            printf("File size: %u\n", fileSystem[i].size);
-            printf("Filesystem entry index: %d\n", i);
-            // printf("Parent Directory ID: %u\n", fileSystem[i].parentDirId);
-            
+    // Reuse the first unused slot, growing the file table by a page when every slot is taken.
+    // The index knows which slots are in use, so no page is read to find a free one.
+    int slot = file_index_unused_slot();
+    if (slot < 0) {
+        slot = file_entry_count();
+        if (file_table_grow() != 0) {
+            printf("Error: Filesystem is full, cannot create new file.\n");
             fflush(stdout);
-            if (fileSystem[i].start_block == FAT_NO_FREE_BLOCKS) {
-                printf("Error: No space left on device to create new file.\n");
-                fflush(stdout);
-                memset(&fileSystem[i], 0, sizeof(FileEntry)); // Cleanup
-                fileSystem[i].in_use = false; // Explicitly mark it as not in use
-                return NULL;
-            }
-            return &fileSystem[i];
+            return NULL;
         }
     }
-    printf("Error: Filesystem is full, cannot create new file.\n");
+    uint32_t i = slot;
+    FileEntry* entry = file_entry_at(i);
+    if (entry == NULL) {
+        printf("Error: Failed to load file table entry %u.\n", i);
+        fflush(stdout);
+        return NULL;
+    }
+
+    printf("Creating new file entry at index %u\n", i);
+    // Names are stored without a leading slash; see file_index_key(). Storing the name may
+    // page in parts of the name pool, so the entry is pinned meanwhile.
+    meta_table_pin(entry);
+    int named = name_pool_set(&entry->filename, file_index_key(path));
+    meta_table_unpin(entry);
+    if (named != 0) {
+        printf("Error: No space left to store the name of '%s'.\n", path);
+        fflush(stdout);
+        return NULL;
+    }
+    printf("Filename: %s\n", name_pool_str(&entry->filename));
+    entry->in_use = true;
+    entry->is_directory = false; // Default to file
+    entry->size = 0;
+
+    entry->start_block = block_log_allocate(); // An erased block, ready for appends.
+    entry->extent_blocks = 1;
+    entry->chain_version++; // Handles still open on a removed file must not reuse their maps.
+    entry->parentDirId = parentDirId;
+    // IDs are random; draw again in the unlikely case this one is already taken.
+    do {
+        entry->unique_file_id = generateUniqueId();
+    } while (file_index_find_id(entry->unique_file_id) >= 0);
+
+    printf("New file created: %s\n", name_pool_str(&entry->filename));
+    printf("Start block: %u\n", entry->start_block);
+    printf("File size: %u\n", entry->size);
+    printf("Filesystem entry index: %u\n", i);
+
     fflush(stdout);
-    return NULL;
+    if (entry->start_block == FAT_NO_FREE_BLOCKS) {
+        printf("Error: No space left on device to create new file.\n");
+        fflush(stdout);
+        name_pool_clear(&entry->filename);
+        memset(entry, 0, sizeof(FileEntry)); // Cleanup
+        entry->in_use = false; // Explicitly mark it as not in use
+        return NULL;
+    }
+    file_index_insert(i);
+    // List the file in its directory; this touches other entries, so fetch it again.
+    dir_link_file(i);
+    return file_entry_at(i);
 }
  
 
@@ -275,18 +277,24 @@ void reset_file_content(FileEntry* entry) {
             printf("Error: Failed to free block %u.\n", currentBlock);
             break;
         }
+        // The rest of the chain is still used by a copy of the file.
+        if (fat_unref_block(currentBlock)) {
+            break;
+        }
         fat_free_block(currentBlock);
         if (nextBlock == FAT_ENTRY_END) break;
         currentBlock = nextBlock;
     }
 
-    entry->start_block = fat_allocate_block();
+    entry->start_block = block_log_allocate();
     if (entry->start_block == FAT_NO_FREE_BLOCKS) {
         printf("Error: No free blocks available to allocate.\n");
         entry->size = 0;
         return;
     }
     entry->size = 0;
+    entry->extent_blocks = 1;
+    entry->chain_version++;
     printf("File content reset successfully. New start block: %u, Size reset to 0.\n", entry->start_block);
 }
 
@@ -295,37 +303,25 @@ void reset_file_content(FileEntry* entry) {
 
 /**
  * Searches for a file entry in the global filesystem based on the filename and its parent directory ID.
- * This function formats the filename to ensure it has a leading slash, then checks each file entry
- * in the global file system to find a match that is not a directory.
+ * The lookup goes through the name hash index; a leading slash on the name is ignored.
  *
- * @param filename The name of the file to search for. It may not initially include a leading slash.
+ * @param filename The name of the file to search for, with or without a leading slash.
  * @param parentID The identifier of the parent directory in which the file is supposed to exist.
  * @return Pointer to the FileEntry if found, or NULL if no matching file is found.
  */
 FileEntry* FILE_find_file_entry(const char* filename, uint32_t parentID) {
-    // Define a sufficiently large buffer to modify the filename with a leading slash.
-    char newfilename[512];
-    prepend_slash(filename, newfilename, sizeof(newfilename));  // Ensure the filename starts with a slash for consistent comparison.
-
-    // Log entering the function and what file is being searched for to help with debugging.
-    printf("Searching for file entry: %s\n", newfilename);
-    fflush(stdout);  // Flush stdout to ensure the log message is displayed immediately.
-
-    // Iterate through all file entries in the global file system array.
-    for (int i = 0; i < MAX_FILES; i++) {
-        // Check if the current file entry is active, not a directory, matches the filename, and belongs to the correct parent directory.
-        if (fileSystem[i].in_use && !fileSystem[i].is_directory 
-            && strcmp(fileSystem[i].filename, newfilename) == 0
-            && fileSystem[i].parentDirId == parentID) {
-            // If a matching file is found, print a confirmation message and return a pointer to the file entry.
-            printf("File entry found: %s\n", newfilename);
-            fflush(stdout);  // Ensure the output is displayed immediately.
-            return &fileSystem[i];
-        }
+    if (filename == NULL) {
+        return NULL;
     }
-
-    // If no matching file is found after checking all entries, return NULL.
-    return NULL;
+    int index = file_index_find(filename, parentID);
+    if (index < 0) {
+        return NULL;
+    }
+    FileEntry* entry = file_entry_at(index);
+    if (entry == NULL || entry->is_directory) {
+        return NULL;
+    }
+    return entry;
 }
 
   
@@ -493,68 +489,38 @@ void set_default_path(char* path, const char* default_path) {
 
 
 /**
- * Saves the file system entries to a designated area in flash memory.
- * This function is tasked with serializing the `fileSystem` array and writing it
- * to a fixed address in flash memory, ensuring that file system entries are
+ * Saves the file system entries to flash memory.
+ * The file table already lives on flash in its own chain of blocks, so this writes back
+ * every cached page of it that has changed, ensuring that file system entries are
  * persisted across power cycles or reboots.
  */
 void saveFileEntriesToFileSystem() {
-    // Address in flash memory where the file system entries are to be stored.
-    // This is set to 262144, assuming this address space is reserved for this purpose.
-    uint32_t address = 262144;
     printf("Saving file entries to flash memory...\n");
 
-    // Allocate memory for serialization of the file system entries.
-    // This assumes the `fileSystem` structure can be serialized directly.
-    uint8_t *serializedData = malloc(sizeof(fileSystem));
-    if (serializedData == NULL) {
-        printf("Failed to allocate memory for file system serialization.\n");
-        return; // Early return if memory allocation fails
+    // Pages of the file and directory tables share one cache, so both are written here.
+    if (meta_table_sync() != 0) {
+        printf("Failed to write back the file table.\n");
+        return;
     }
-
-    // Copy the file system data into the allocated buffer.
-    // This simulates serialization if the data structure allows direct binary copying.
-    memcpy(serializedData, fileSystem, sizeof(fileSystem));
-
-    // Write the serialized data to flash memory at the specified address.
-    // `flash_write_safe` should ensure that the write operation handles any necessary precautions
-    // like erasing the flash sector before writing.
-    flash_write_safe(address, serializedData, sizeof(fileSystem));
-
-    // Free the allocated memory after the write operation is complete to avoid memory leaks.
-    free(serializedData);
     printf("File entries saved to flash memory.\n");
 }
 
 
 
 /**
- * Loads file entries from a specific address in flash memory into a local array.
- * This function reads the serialized data representing file system entries from flash
- * memory and populates a local array with this data. It can be used during system
- * initialization to restore the state of the file system from persistent storage.
+ * Lists the file entries stored in flash memory.
+ * This function walks the file table, paging it in from flash a block at a time, and
+ * prints every entry in use. It can be used to verify the state of the file system.
  */
 void loadFileEntriesFromFileSystem() {
-    // Address in flash memory where the file system entries are stored.
-    uint32_t address = 262144;
-
-    // Local array to hold the file entries recovered from flash memory.
-    // This ensures that the file system can be restored to its last known state.
-    FileEntry recoveredFileSystem[MAX_FILES];
-
-    // Read the data from flash memory into the local array.
-    // This assumes the data at the specified address is a valid serialized array of FileEntry structures.
-    flash_read_safe(address, (uint8_t*)recoveredFileSystem, sizeof(recoveredFileSystem));
-
-    // Optionally, iterate over the loaded file entries to verify the integrity and correctness of the data.
-    for (int i = 0; i < MAX_FILES; i++) {
-        // Print each recovered file entry's name to verify that data has been loaded correctly.
-        // This is helpful for debugging and ensuring that the load operation was successful.
-        printf("Recovered File Entry %d: %s\n", i, recoveredFileSystem[i].filename);
+    uint32_t count = file_entry_count();
+    for (uint32_t i = 0; i < count; i++) {
+        FileEntry* entry = file_entry_at(i);
+        if (entry != NULL && entry->in_use) {
+            // Print each recovered file entry's name to verify that data has been loaded correctly.
+            printf("Recovered File Entry %u: %s\n", i, name_pool_str(&entry->filename));
+        }
     }
-
-    // Additional logic can be implemented here to further process or integrate the loaded data
-    // into the running application, depending on system requirements.
 }
 
 
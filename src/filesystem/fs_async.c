@@ -0,0 +1,339 @@
+/**
+ * @file fs_async.c
+ *
+ * Non-blocking reads and writes on top of fs_read() and fs_write().
+ *
+ * - Requests wait in a FIFO of FS_ASYNC_QUEUE_DEPTH entries. Submitting one only fills in
+ *   an entry, so it takes a few microseconds whatever the flash is doing.
+ * - fs_poll() takes requests from the front of the queue a group at a time. A group is the
+ *   first request plus every request right after it that reads or writes the same file in
+ *   the same way and still ends inside the block the first one starts in. A group of one
+ *   runs straight on the caller's buffer; larger groups are gathered into (or scattered
+ *   from) one block-sized staging buffer, so the whole group costs one fs_write() or
+ *   fs_read() and its block lookup, write-back and wear levelling slice.
+ * - Requests complete strictly in the order they were queued, which is what lets
+ *   fs_async_pending() work from the handle alone.
+ * - Callbacks run after their group has been taken off the queue, so they may queue
+ *   further requests. fs_poll() does not run again from inside a callback.
+ * - The queue, the handles and the counters are guarded by async_mutex, so either core may
+ *   queue requests and poll. One caller at a time is the poller: it owns the staging buffer
+ *   and runs groups and callbacks with the mutex released, and a poll by anyone else
+ *   returns at once.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "hardware/sync.h"
+#include "pico/mutex.h"
+#include "pico/time.h"
+#include "../config/flash_config.h"
+#include "../filesystem/filesystem.h"
+#include "../filesystem/fs_async.h"
+
+#if !PICO_ON_DEVICE
+#include <sched.h>
+#endif
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+
+typedef enum {
+    ASYNC_READ,
+    ASYNC_WRITE
+} async_op;
+
+/**
+ * A queued request.
+ */
+typedef struct {
+    fs_async_handle handle;
+    async_op op;
+    FS_FILE *file;
+    uint8_t *buffer;
+    int size;
+    fs_async_callback callback;
+    void *context;
+} async_request;
+
+// Everything below but the staging buffer is guarded by async_mutex.
+auto_init_mutex(async_mutex);
+static async_request queue[FS_ASYNC_QUEUE_DEPTH];
+static uint32_t queue_head = 0;    // Index of the oldest queued request.
+static uint32_t queue_count = 0;
+static fs_async_handle next_handle = 1;
+static fs_async_handle last_completed = 0;   // Handle of the most recently completed request.
+static uintptr_t poller = 0;       // Caller running fs_poll(), or 0.
+static uint8_t staging[FS_BLOCK_PAYLOAD_SIZE];   // Belongs to the poller.
+static fs_async_stats async_stats;
+
+#if PICO_ON_DEVICE
+// A core draining the queue sleeps while the other core polls.
+static inline uintptr_t async_self(void) { return get_core_num() + 1; }
+static inline void async_wait(void) { __wfe(); }
+static inline void async_signal(void) { __sev(); }
+#else
+// Host builds use threads in place of cores; each is told apart by an address of its own.
+static _Thread_local char async_marker;
+static inline uintptr_t async_self(void) { return (uintptr_t)&async_marker; }
+static inline void async_wait(void) { sched_yield(); }
+static inline void async_signal(void) {}
+#endif
+
+
+/**
+ * Drops every queued request without running it or invoking its callback, and resets the
+ * counters. Handles already given out are never reused.
+ */
+void fs_async_init(void) {
+    mutex_enter_blocking(&async_mutex);
+    queue_head = 0;
+    queue_count = 0;
+    last_completed = next_handle - 1;
+    memset(&async_stats, 0, sizeof(async_stats));
+    mutex_exit(&async_mutex);
+}
+
+
+/**
+ * Adds a request to the back of the queue.
+ *
+ * @return Its handle, or FS_ASYNC_INVALID if the queue is full or the request invalid.
+ */
+static fs_async_handle async_submit(async_op op, FS_FILE *file, void *buffer, int size,
+                                    fs_async_callback callback, void *context) {
+    bool valid = (file != NULL && buffer != NULL && size > 0);
+    if (!valid) {
+        printf("Error: Invalid asynchronous request.\n");
+    }
+    mutex_enter_blocking(&async_mutex);
+    if (!valid || queue_count == FS_ASYNC_QUEUE_DEPTH) {
+        async_stats.rejected++;
+        mutex_exit(&async_mutex);
+        return FS_ASYNC_INVALID;
+    }
+
+    async_request *request = &queue[(queue_head + queue_count) % FS_ASYNC_QUEUE_DEPTH];
+    request->handle = next_handle++;
+    if (next_handle == FS_ASYNC_INVALID) {
+        next_handle++;
+    }
+    request->op = op;
+    request->file = file;
+    request->buffer = (uint8_t *)buffer;
+    request->size = size;
+    request->callback = callback;
+    request->context = context;
+
+    queue_count++;
+    async_stats.submitted++;
+    if (queue_count > async_stats.max_queued) {
+        async_stats.max_queued = queue_count;
+    }
+    fs_async_handle handle = request->handle;
+    mutex_exit(&async_mutex);
+    return handle;
+}
+
+
+/**
+ * Queues a read of up to 'size' bytes at the file position the requests before it leave.
+ * The callback receives the number of bytes read, 0 at the end of the file, or -1.
+ *
+ * @return A handle for the request, or FS_ASYNC_INVALID if it could not be queued.
+ */
+fs_async_handle fs_read_async(FS_FILE* file, void* buffer, int size, fs_async_callback callback, void* context) {
+    return async_submit(ASYNC_READ, file, buffer, size, callback, context);
+}
+
+
+/**
+ * Queues a write of 'size' bytes at the file position the requests before it leave.
+ * The callback receives the number of bytes written, or -1.
+ *
+ * @return A handle for the request, or FS_ASYNC_INVALID if it could not be queued.
+ */
+fs_async_handle fs_write_async(FS_FILE* file, const void* buffer, int size, fs_async_callback callback, void* context) {
+    return async_submit(ASYNC_WRITE, file, (void *)buffer, size, callback, context);
+}
+
+
+/**
+ * Takes the next group of requests off the front of the queue. Called by the poller with
+ * async_mutex held.
+ *
+ * @param group Receives the requests, oldest first.
+ * @return How many requests the group has; at least one.
+ */
+static uint32_t async_take_group(async_request *group) {
+    group[0] = queue[queue_head];
+    uint32_t count = 1;
+    uint32_t end = group[0].file->position % FS_BLOCK_PAYLOAD_SIZE + group[0].size;
+
+    while (count < queue_count && end < FS_BLOCK_PAYLOAD_SIZE) {
+        const async_request *next = &queue[(queue_head + count) % FS_ASYNC_QUEUE_DEPTH];
+        if (next->file != group[0].file || next->op != group[0].op
+            || end + next->size > FS_BLOCK_PAYLOAD_SIZE) {
+            break;
+        }
+        group[count++] = *next;
+        end += next->size;
+    }
+
+    queue_head = (queue_head + count) % FS_ASYNC_QUEUE_DEPTH;
+    queue_count -= count;
+    return count;
+}
+
+
+/**
+ * Runs a group of requests with a single fs_read() or fs_write() and invokes their callbacks.
+ * Called by the poller with async_mutex released.
+ */
+static void async_run_group(async_request *group, uint32_t count) {
+    FS_FILE *file = group[0].file;
+    int results[FS_ASYNC_QUEUE_DEPTH];
+
+    if (count == 1) {
+        results[0] = (group[0].op == ASYNC_WRITE)
+            ? fs_write(file, group[0].buffer, group[0].size)
+            : fs_read(file, group[0].buffer, group[0].size);
+    } else {
+        int total = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            if (group[i].op == ASYNC_WRITE) {
+                memcpy(staging + total, group[i].buffer, group[i].size);
+            }
+            total += group[i].size;
+        }
+        int done = (group[0].op == ASYNC_WRITE) ? fs_write(file, staging, total) : fs_read(file, staging, total);
+
+        // Hand out what the call transferred in request order; a short read or write leaves
+        // the requests at the back with fewer bytes, or none.
+        int offset = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            if (done < 0) {
+                results[i] = done;
+                continue;
+            }
+            results[i] = MIN(group[i].size, done - offset);
+            if (group[i].op == ASYNC_READ && results[i] > 0) {
+                memcpy(group[i].buffer, staging + offset, results[i]);
+            }
+            offset += results[i];
+        }
+    }
+
+    mutex_enter_blocking(&async_mutex);
+    async_stats.calls++;
+    async_stats.merged += count - 1;
+    mutex_exit(&async_mutex);
+
+    for (uint32_t i = 0; i < count; i++) {
+        mutex_enter_blocking(&async_mutex);
+        last_completed = group[i].handle;
+        async_stats.completed++;
+        mutex_exit(&async_mutex);
+        if (group[i].callback != NULL) {
+            group[i].callback(group[i].handle, results[i], group[i].context);
+        }
+    }
+}
+
+
+/**
+ * Runs queued requests, oldest first, until the queue is empty or about budget_us have
+ * passed. At least one group of requests runs on every call, so polling always makes
+ * progress; a group can take as long as the fs_read() or fs_write() it needs. Returns at
+ * once when called from a callback, or while the other core is polling.
+ *
+ * @param budget_us Time to spend, in microseconds.
+ * @return The number of requests completed.
+ */
+int fs_poll(uint32_t budget_us) {
+    mutex_enter_blocking(&async_mutex);
+    if (poller != 0) {
+        mutex_exit(&async_mutex);
+        return 0;
+    }
+    poller = async_self();
+    uint64_t began = time_us_64();
+    int completed = 0;
+    async_request group[FS_ASYNC_QUEUE_DEPTH];
+
+    while (queue_count > 0) {
+        if (completed > 0 && time_us_64() - began >= budget_us) {
+            break;
+        }
+        uint32_t count = async_take_group(group);
+        mutex_exit(&async_mutex);
+        async_run_group(group, count);
+        completed += count;
+        mutex_enter_blocking(&async_mutex);
+    }
+
+    poller = 0;
+    mutex_exit(&async_mutex);
+    async_signal();
+    return completed;
+}
+
+
+/**
+ * Runs every queued request, including any queued by callbacks meanwhile, and waits for
+ * the other core to finish any it is running. Does nothing when called from a callback.
+ */
+void fs_async_drain(void) {
+    uintptr_t self = async_self();
+    for (;;) {
+        mutex_enter_blocking(&async_mutex);
+        uint32_t queued = queue_count;
+        uintptr_t current = poller;
+        mutex_exit(&async_mutex);
+
+        if (current == self || (queued == 0 && current == 0)) {
+            return;
+        }
+        if (current != 0) {
+            async_wait();
+        } else {
+            fs_poll(UINT32_MAX);
+        }
+    }
+}
+
+
+/**
+ * Returns true if a request has been queued and its callback has not run yet.
+ */
+bool fs_async_pending(fs_async_handle handle) {
+    // Handles are handed out in order and requests complete in order.
+    mutex_enter_blocking(&async_mutex);
+    bool pending = handle != FS_ASYNC_INVALID && handle > last_completed && handle < next_handle;
+    mutex_exit(&async_mutex);
+    return pending;
+}
+
+
+/**
+ * Returns the number of requests waiting to run.
+ */
+uint32_t fs_async_queued(void) {
+    mutex_enter_blocking(&async_mutex);
+    uint32_t queued = queue_count;
+    mutex_exit(&async_mutex);
+    return queued;
+}
+
+
+/**
+ * Copies out the asynchronous I/O counters.
+ */
+void fs_async_get_stats(fs_async_stats* stats) {
+    if (stats != NULL) {
+        mutex_enter_blocking(&async_mutex);
+        *stats = async_stats;
+        mutex_exit(&async_mutex);
+    }
+}
@@ -0,0 +1,665 @@
+/**
+ * @file meta_journal.c
+ *
+ * This module keeps the filesystem metadata durable with an append-only journal.
+ *
+ * - The journal is a ring of JOURNAL_SECTORS sectors. Each sector starts with a header
+ *   holding a sequence number; the sectors in use follow each other in sequence order,
+ *   starting with the sector of the latest checkpoint.
+ * - Records are appended at the write position, never straddling a sector. Each has a small
+ *   header with its type, length and a CRC, so a record torn by power loss is recognized.
+ * - A commit appends the chunks of metadata pages that changed (see meta_table_collect()),
+ *   the FAT entries that changed, and a commit record with the current table roots. Records
+ *   are collected in RAM and programmed together, so a commit programs a few pages.
+ * - Before a metadata page is written back to its table, pending changes are committed, so
+ *   the tables on flash never hold changes the journal does not know about.
+ * - When only one free sector is left, a checkpoint writes every page back, saves the FAT
+ *   sectors that changed (see fat_checkpoint_save()), and starts a fresh sector with a
+ *   checkpoint record. Older sectors are free again once it is written.
+ * - Recovery loads the FAT of the latest checkpoint and replays every record up to the last
+ *   commit record. Records after it belong to a commit that never completed.
+ * - A checkpoint taken at unmount can refer to a mount snapshot of the RAM indexes. It is
+ *   only handed back by recovery if nothing follows the checkpoint, and its blocks are
+ *   freed by the next checkpoint.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "hardware/flash.h"
+#include "pico/time.h"
+#include "../config/flash_config.h"
+#include "../FAT/fat_fs.h"
+#include "../flash/flash_ops.h"
+#include "../flash/block_log.h"
+#include "../flash/wear_table.h"
+#include "../filesystem/meta_table.h"
+#include "../filesystem/meta_journal.h"
+
+
+#define JOURNAL_MAGIC 0x4A524E4C   // "JRNL"
+
+// Record types. An erased record header reads JOURNAL_RECORD_END.
+#define JOURNAL_RECORD_PAGE 1        // A changed range of a table page.
+#define JOURNAL_RECORD_ZERO_PAGE 2   // A page added to a table, zeroed.
+#define JOURNAL_RECORD_FAT 3         // Changed FAT entries as (block, value) pairs.
+#define JOURNAL_RECORD_COMMIT 4      // Ends a commit; holds the table roots.
+#define JOURNAL_RECORD_CHECKPOINT 5  // Starts a sector after a checkpoint.
+#define JOURNAL_RECORD_END 0xFFFF
+
+// Longest page range or FAT run stored in one record.
+#define JOURNAL_MAX_DELTA 512
+#define JOURNAL_FAT_PAIRS (JOURNAL_MAX_DELTA / 8)
+
+/**
+ * Header at the start of every journal sector.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;   // One more than the sector before it in the journal.
+} journal_sector_header;
+
+/**
+ * Header of a record. The payload follows, padded to 4 bytes.
+ */
+typedef struct {
+    uint16_t type;
+    uint16_t length;     // Payload length in bytes, without padding.
+    uint32_t crc;        // CRC-32 of the header (with this field zero) and the padded payload.
+} journal_record_header;
+
+/**
+ * Payload header of a JOURNAL_RECORD_PAGE or JOURNAL_RECORD_ZERO_PAGE record; the bytes of
+ * a page record follow it.
+ */
+typedef struct {
+    uint8_t table;       // META_TABLE_* identifier.
+    uint8_t reserved;
+    uint16_t offset;     // Byte offset within the page.
+    uint32_t page;
+} journal_page_delta;
+
+/**
+ * Where one metadata table lives on flash.
+ */
+typedef struct {
+    uint32_t first_block;
+    uint32_t blocks;
+} journal_root;
+
+/**
+ * Payload of a JOURNAL_RECORD_CHECKPOINT record.
+ */
+typedef struct {
+    journal_root roots[META_TABLE_COUNT];
+    fat_checkpoint fat;  // FAT sectors written by fat_checkpoint_save().
+    wear_checkpoint wear; // Erase count sectors written by wear_table_save().
+    meta_snapshot snapshot;
+} journal_checkpoint;
+
+/**
+ * A position in the chain of journal sectors being replayed.
+ */
+typedef struct {
+    uint32_t sector;     // Index into the chain.
+    uint32_t offset;     // Byte offset within the sector.
+} journal_pos;
+
+typedef void (*journal_visitor)(const journal_record_header *header, const uint8_t *payload,
+                                journal_pos next, void *context);
+
+static uint8_t journal_buffer[JOURNAL_BUFFER_SIZE];
+static uint32_t buffer_used = 0;     // Bytes of records waiting in journal_buffer.
+static uint32_t base_sector = 0;     // Ring index of the sector holding the checkpoint.
+static uint32_t current_sector = 0;  // Ring index of the sector being appended to.
+static uint32_t write_pos = 0;       // Offset in current_sector where the buffer goes.
+static uint32_t sequence = 0;        // Sequence number of current_sector.
+static bool journal_ready = false;   // Set once the journal has been formatted or recovered.
+static bool journal_busy = false;    // Set while the journal itself writes metadata.
+static bool checkpoint_due = false;  // Only one free sector is left.
+static bool checkpoint_taken = false;// A checkpoint covered the commit in progress.
+static bool io_failed = false;
+static uint32_t commit_bytes = 0;
+static meta_snapshot current_snapshot = { .first_block = FAT_ENTRY_END }; // Referred to by the checkpoint.
+static meta_journal_stats journal_stats;
+
+static int write_checkpoint(const meta_snapshot *snapshot);
+
+
+/**
+ * Returns the flash offset of a sector of the ring.
+ */
+static uint32_t sector_offset(uint32_t sector) {
+    return (JOURNAL_FIRST_BLOCK + sector) * FILESYSTEM_BLOCK_SIZE;
+}
+
+
+/**
+ * Programs the buffered records at the write position.
+ */
+static void flush(void) {
+    if (buffer_used == 0) {
+        return;
+    }
+    if (flash_program_safe(sector_offset(current_sector) + write_pos, journal_buffer, buffer_used, NULL) != FLASH_PROGRAM_SUCCESS) {
+        printf("Error: Failed to write the metadata journal.\n");
+        io_failed = true;
+    }
+    write_pos += buffer_used;
+    commit_bytes += buffer_used;
+    journal_stats.bytes_written += buffer_used;
+    buffer_used = 0;
+}
+
+
+/**
+ * Erases a ring sector and makes it the current one, with the next sequence number.
+ */
+static void open_sector(uint32_t sector) {
+    journal_sector_header header = { .magic = JOURNAL_MAGIC, .sequence = ++sequence };
+    if (flash_erase_sector(sector_offset(sector)) != FLASH_PROGRAM_SUCCESS
+        || flash_program_safe(sector_offset(sector), (const uint8_t *)&header, sizeof(header), NULL) != FLASH_PROGRAM_SUCCESS) {
+        printf("Error: Failed to start journal sector %u.\n", sector);
+        io_failed = true;
+    }
+    journal_stats.sectors_erased++;
+    current_sector = sector;
+    write_pos = sizeof(header);
+}
+
+
+/**
+ * Computes the CRC of a record in place, treating its crc field as zero.
+ */
+static uint32_t record_crc(const uint8_t *record, uint32_t size) {
+    static const uint8_t zeros[4] = {0};
+    uint32_t crc = block_log_crc32(0, record, 4);
+    crc = block_log_crc32(crc, zeros, 4);
+    return block_log_crc32(crc, record + sizeof(journal_record_header), size - sizeof(journal_record_header));
+}
+
+
+/**
+ * Appends a record whose payload is a header part followed by a data part.
+ */
+static void append(uint16_t type, const void *head, uint32_t headLength, const void *data, uint32_t dataLength) {
+    if (checkpoint_taken) {
+        return; // The checkpoint already holds every change.
+    }
+    uint32_t length = headLength + dataLength;
+    uint32_t size = sizeof(journal_record_header) + ((length + 3) & ~3u);
+
+    if (write_pos + buffer_used + size > FILESYSTEM_BLOCK_SIZE) {
+        flush();
+        uint32_t next = (current_sector + 1) % JOURNAL_SECTORS;
+        if ((next + 1) % JOURNAL_SECTORS == base_sector) {
+            // The commit does not fit the free sectors; the last one takes a checkpoint
+            // of everything instead.
+            write_checkpoint(NULL);
+            checkpoint_taken = true;
+            return;
+        }
+        open_sector(next);
+        if ((next + 2) % JOURNAL_SECTORS == base_sector) {
+            checkpoint_due = true;
+        }
+    }
+    if (buffer_used + size > JOURNAL_BUFFER_SIZE) {
+        flush();
+    }
+
+    uint8_t *record = journal_buffer + buffer_used;
+    journal_record_header header = { .type = type, .length = length, .crc = 0 };
+    memset(record, 0, size);
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), head, headLength);
+    if (dataLength > 0) {
+        memcpy(record + sizeof(header) + headLength, data, dataLength);
+    }
+    header.crc = record_crc(record, size);
+    memcpy(record, &header, sizeof(header));
+    buffer_used += size;
+    journal_stats.records++;
+}
+
+
+/**
+ * Receives changed page ranges from meta_table_collect() and journals them.
+ */
+static void emit_delta(uint8_t id, uint32_t page, uint32_t offset, const uint8_t *data, uint32_t length) {
+    journal_page_delta delta = { .table = id, .reserved = 0, .offset = offset, .page = page };
+    if (data == NULL) {
+        append(JOURNAL_RECORD_ZERO_PAGE, &delta, sizeof(delta), NULL, 0);
+        return;
+    }
+    while (length > 0) {
+        uint32_t chunk = (length < JOURNAL_MAX_DELTA) ? length : JOURNAL_MAX_DELTA;
+        append(JOURNAL_RECORD_PAGE, &delta, sizeof(delta), data, chunk);
+        delta.offset += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+
+/**
+ * Reads the roots of every metadata table.
+ */
+static void current_roots(journal_root *roots) {
+    for (uint8_t id = 0; id < META_TABLE_COUNT; id++) {
+        meta_table *table = meta_table_lookup(id);
+        roots[id].first_block = (table != NULL) ? table->first_block : FAT_ENTRY_END;
+        roots[id].blocks = (table != NULL) ? table->blocks : 0;
+    }
+}
+
+
+/**
+ * Frees the blocks of a mount snapshot in the FAT.
+ */
+static void free_snapshot(const meta_snapshot *snapshot) {
+    uint32_t block = snapshot->first_block;
+    for (uint32_t i = 0; i < snapshot->blocks && block < TOTAL_BLOCKS; i++) {
+        uint32_t next = FAT_ENTRY_END;
+        fat_get_next_block(block, &next);
+        fat_free_block(block);
+        block = next;
+    }
+}
+
+
+/**
+ * Writes every metadata page back, saves the changed FAT sectors and starts the next
+ * sector with a checkpoint record. Until that record is written, the previous checkpoint
+ * and its journal sectors stay intact.
+ *
+ * @param snapshot Mount snapshot the checkpoint refers to, or NULL for none. A previous
+ *                 snapshot is freed, since the indexes it holds are about to be outdated.
+ */
+static int write_checkpoint(const meta_snapshot *snapshot) {
+    buffer_used = 0; // Everything still buffered is part of the checkpoint.
+    if (meta_table_sync() != 0) {
+        io_failed = true;
+    }
+    // Freed after the pages have moved to fresh blocks, so that its extent is not cut up
+    // by them and is free for the next snapshot.
+    if (current_snapshot.first_block != FAT_ENTRY_END
+        && (snapshot == NULL || snapshot->first_block != current_snapshot.first_block)) {
+        free_snapshot(&current_snapshot);
+    }
+
+    journal_checkpoint checkpoint;
+    current_roots(checkpoint.roots);
+    if (snapshot != NULL) {
+        checkpoint.snapshot = *snapshot;
+    } else {
+        memset(&checkpoint.snapshot, 0, sizeof(checkpoint.snapshot));
+        checkpoint.snapshot.first_block = FAT_ENTRY_END;
+    }
+    if (fat_checkpoint_save(&checkpoint.fat) != FAT_SUCCESS) {
+        io_failed = true;
+        return JOURNAL_IO_ERROR;
+    }
+    if (wear_table_save(&checkpoint.wear) != WEAR_SUCCESS) {
+        io_failed = true;
+        return JOURNAL_IO_ERROR;
+    }
+    meta_table_collect(NULL);
+    fat_clear_dirty();
+
+    open_sector((current_sector + 1) % JOURNAL_SECTORS);
+    checkpoint_taken = false;
+    append(JOURNAL_RECORD_CHECKPOINT, &checkpoint, sizeof(checkpoint), NULL, 0);
+    flush();
+
+    base_sector = current_sector;
+    current_snapshot = checkpoint.snapshot;
+    checkpoint_due = false;
+    journal_stats.checkpoints++;
+    return io_failed ? JOURNAL_IO_ERROR : JOURNAL_SUCCESS;
+}
+
+
+/**
+ * Commits pending changes before a metadata page is written back to flash.
+ */
+static void writeback_hook(void) {
+    meta_journal_commit();
+}
+
+
+/**
+ * Erases the journal and starts it with a checkpoint of the current metadata. Call after
+ * the filesystem has been initialized from scratch.
+ *
+ * @return JOURNAL_SUCCESS, or JOURNAL_IO_ERROR if the checkpoint could not be written.
+ */
+int meta_journal_format(void) {
+    for (uint32_t sector = 0; sector < JOURNAL_SECTORS; sector++) {
+        flash_erase_sector(sector_offset(sector));
+    }
+    buffer_used = 0;
+    sequence = 0;
+    current_sector = JOURNAL_SECTORS - 1;
+    base_sector = current_sector;
+    io_failed = false;
+    checkpoint_taken = false;
+    current_snapshot.first_block = FAT_ENTRY_END;
+    memset(&journal_stats, 0, sizeof(journal_stats));
+
+    journal_busy = true;
+    int result = write_checkpoint(NULL);
+    journal_busy = false;
+    journal_ready = true;
+    meta_table_set_writeback_hook(writeback_hook);
+    return result;
+}
+
+
+/**
+ * Appends every metadata change since the previous commit to the journal and ends it with
+ * a commit record, so the changes survive a power loss. The cost depends on the size of the
+ * change, not on the size of the tables. Does nothing if nothing changed.
+ *
+ * @return JOURNAL_SUCCESS, or JOURNAL_IO_ERROR if the journal could not be written.
+ */
+int meta_journal_commit(void) {
+    if (!journal_ready || journal_busy) {
+        return JOURNAL_SUCCESS;
+    }
+    journal_busy = true;
+    block_log_commit_begin();
+    uint64_t start = time_us_64();
+    uint32_t recordsBefore = journal_stats.records;
+    commit_bytes = 0;
+    checkpoint_taken = false;
+    io_failed = false;
+
+    meta_table_collect(emit_delta);
+
+    uint32_t pairs[2 * JOURNAL_FAT_PAIRS];
+    uint32_t count;
+    do {
+        count = fat_collect_dirty(pairs, JOURNAL_FAT_PAIRS);
+        if (count > 0) {
+            append(JOURNAL_RECORD_FAT, pairs, count * 2 * sizeof(uint32_t), NULL, 0);
+        }
+    } while (count == JOURNAL_FAT_PAIRS);
+
+    if (!checkpoint_taken && journal_stats.records != recordsBefore) {
+        journal_root roots[META_TABLE_COUNT];
+        current_roots(roots);
+        append(JOURNAL_RECORD_COMMIT, roots, sizeof(roots), NULL, 0);
+        flush();
+        journal_stats.commits++;
+    }
+    if (checkpoint_due) {
+        write_checkpoint(NULL);
+    }
+
+    journal_stats.last_commit_bytes = commit_bytes;
+    journal_stats.last_commit_us = (uint32_t)(time_us_64() - start);
+    journal_busy = false;
+
+    // Table pages moved by write-backs before the commit are not referred to by it.
+    block_log_commit_end(!io_failed);
+    return io_failed ? JOURNAL_IO_ERROR : JOURNAL_SUCCESS;
+}
+
+
+/**
+ * Commits pending changes, writes every metadata page back and restarts the journal from a
+ * fresh checkpoint. Used at shutdown, so that the next boot has nothing to replay.
+ *
+ * @param snapshot Mount snapshot for the checkpoint to refer to, already written to its
+ *                 blocks, or NULL for none.
+ * @return JOURNAL_SUCCESS, or JOURNAL_IO_ERROR if the checkpoint could not be written.
+ */
+int meta_journal_checkpoint(const meta_snapshot *snapshot) {
+    if (!journal_ready) {
+        return JOURNAL_IO_ERROR;
+    }
+    meta_journal_commit();
+    journal_busy = true;
+    io_failed = false;
+    int result = write_checkpoint(snapshot);
+    journal_busy = false;
+    return result;
+}
+
+
+/**
+ * Checks the record at an offset of a sector.
+ *
+ * @return The record header, or NULL if there is no intact record there.
+ */
+static const journal_record_header *record_at(uint32_t sector, uint32_t offset) {
+    if (offset + sizeof(journal_record_header) > FILESYSTEM_BLOCK_SIZE) {
+        return NULL;
+    }
+    const uint8_t *record = (const uint8_t *)(XIP_BASE + sector_offset(sector) + offset);
+    const journal_record_header *header = (const journal_record_header *)record;
+    uint32_t size = sizeof(journal_record_header) + ((header->length + 3) & ~3u);
+    if (header->type == JOURNAL_RECORD_END || offset + size > FILESYSTEM_BLOCK_SIZE
+        || record_crc(record, size) != header->crc) {
+        return NULL;
+    }
+    return header;
+}
+
+
+/**
+ * Calls a visitor for every intact record of the chain that starts before a limit.
+ *
+ * @return The position after the last record visited.
+ */
+static journal_pos walk(const uint32_t *chain, uint32_t chainLength, journal_pos limit,
+                        journal_visitor visit, void *context) {
+    journal_pos pos = { .sector = 0, .offset = sizeof(journal_sector_header) };
+    journal_pos end = pos;
+    while (pos.sector < chainLength
+           && (pos.sector < limit.sector || (pos.sector == limit.sector && pos.offset < limit.offset))) {
+        const journal_record_header *header = record_at(chain[pos.sector], pos.offset);
+        if (header == NULL) {
+            // The rest of this sector is unused; the next sector of the chain continues.
+            pos.sector++;
+            pos.offset = sizeof(journal_sector_header);
+            continue;
+        }
+        pos.offset += sizeof(journal_record_header) + ((header->length + 3) & ~3u);
+        end = pos;
+        visit(header, (const uint8_t *)(header + 1), pos, context);
+    }
+    return end;
+}
+
+
+/**
+ * What the first replay pass finds: the end of the last commit and the roots it recorded.
+ */
+typedef struct {
+    journal_pos committed;
+    journal_root roots[META_TABLE_COUNT];
+} journal_scan;
+
+
+static void find_commits(const journal_record_header *header, const uint8_t *payload, journal_pos next, void *context) {
+    journal_scan *scan = context;
+    if (header->type == JOURNAL_RECORD_COMMIT && header->length == sizeof(scan->roots)) {
+        memcpy(scan->roots, payload, sizeof(scan->roots));
+        scan->committed = next;
+    }
+}
+
+
+static void replay_fat(const journal_record_header *header, const uint8_t *payload, journal_pos next, void *context) {
+    (void)next;
+    (void)context;
+    if (header->type != JOURNAL_RECORD_FAT) {
+        return;
+    }
+    for (uint32_t i = 0; i + 8 <= header->length; i += 8) {
+        uint32_t pair[2];
+        memcpy(pair, payload + i, sizeof(pair));
+        fat_set_entry(pair[0], pair[1]);
+    }
+    journal_stats.replayed_records++;
+}
+
+
+static void replay_pages(const journal_record_header *header, const uint8_t *payload, journal_pos next, void *context) {
+    (void)next;
+    (void)context;
+    if ((header->type != JOURNAL_RECORD_PAGE && header->type != JOURNAL_RECORD_ZERO_PAGE)
+        || header->length < sizeof(journal_page_delta)) {
+        return;
+    }
+    journal_page_delta delta;
+    memcpy(&delta, payload, sizeof(delta));
+    const uint8_t *data = (header->type == JOURNAL_RECORD_PAGE) ? payload + sizeof(delta) : NULL;
+    if (meta_table_apply(delta.table, delta.page, delta.offset, data, header->length - sizeof(delta)) != 0) {
+        printf("Error: Journal record for table %u page %u cannot be applied.\n", delta.table, delta.page);
+    }
+    journal_stats.replayed_records++;
+}
+
+
+/**
+ * Checks whether nothing was appended after the checkpoint record of a sector, not even
+ * part of a record, so that appending can continue right after it.
+ */
+static bool nothing_after(uint32_t sector, uint32_t offset) {
+    const uint8_t *bytes = (const uint8_t *)(XIP_BASE + sector_offset(sector));
+    for (uint32_t i = offset; i < FILESYSTEM_BLOCK_SIZE; i++) {
+        if (bytes[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Restores the metadata from flash: loads the FAT saved by the latest checkpoint, replays
+ * every committed change after it, and points the metadata tables at their chains. The
+ * tables must have been initialized with meta_table_init().
+ *
+ * If nothing follows the checkpoint, as after a clean unmount, appending continues after
+ * it and its mount snapshot is handed back. Otherwise the replayed state is written to a
+ * fresh checkpoint and there is no usable snapshot.
+ *
+ * @param snapshot Receives the usable mount snapshot; first_block is FAT_ENTRY_END if none.
+ * @return JOURNAL_SUCCESS, JOURNAL_NOT_FOUND if there is no checkpoint, or
+ *         JOURNAL_CORRUPTED if the checkpoint's FAT copy is damaged.
+ */
+int meta_journal_recover(meta_snapshot *snapshot) {
+    memset(&journal_stats, 0, sizeof(journal_stats));
+    snapshot->first_block = FAT_ENTRY_END;
+
+    // The checkpoint to start from is the one with the highest sequence number.
+    journal_sector_header headers[JOURNAL_SECTORS];
+    int base = -1;
+    journal_checkpoint checkpoint;
+    for (uint32_t sector = 0; sector < JOURNAL_SECTORS; sector++) {
+        memcpy(&headers[sector], (const void *)(XIP_BASE + sector_offset(sector)), sizeof(headers[sector]));
+        if (headers[sector].magic != JOURNAL_MAGIC) {
+            continue;
+        }
+        const journal_record_header *first = record_at(sector, sizeof(journal_sector_header));
+        if (first != NULL && first->type == JOURNAL_RECORD_CHECKPOINT && first->length == sizeof(checkpoint)
+            && (base < 0 || headers[sector].sequence > headers[base].sequence)) {
+            base = sector;
+            memcpy(&checkpoint, first + 1, sizeof(checkpoint));
+        }
+    }
+    if (base < 0) {
+        printf("Error: No metadata checkpoint found.\n");
+        return JOURNAL_NOT_FOUND;
+    }
+
+    // The sectors after it follow in sequence order.
+    uint32_t chain[JOURNAL_SECTORS];
+    uint32_t chainLength = 0;
+    uint32_t sector = base;
+    do {
+        chain[chainLength++] = sector;
+        sector = (sector + 1) % JOURNAL_SECTORS;
+    } while (chainLength < JOURNAL_SECTORS && headers[sector].magic == JOURNAL_MAGIC
+             && headers[sector].sequence == headers[chain[chainLength - 1]].sequence + 1);
+
+    if (fat_checkpoint_load(&checkpoint.fat) != FAT_SUCCESS) {
+        return JOURNAL_CORRUPTED;
+    }
+    // Erase counts only guide allocation; without them leveling starts over from zero.
+    if (wear_table_load(&checkpoint.wear) != WEAR_SUCCESS) {
+        wear_table_init();
+    }
+
+    base_sector = base;
+    current_sector = chain[chainLength - 1];
+    sequence = headers[current_sector].sequence;
+    current_snapshot = checkpoint.snapshot;
+    buffer_used = 0;
+    io_failed = false;
+    checkpoint_taken = false;
+    checkpoint_due = false;
+
+    uint32_t afterCheckpoint = sizeof(journal_sector_header) + sizeof(journal_record_header)
+                               + ((sizeof(checkpoint) + 3) & ~3u);
+    bool clean = (chainLength == 1 && nothing_after(base, afterCheckpoint));
+    if (clean) {
+        // Nothing to replay: the tables are exactly as the checkpoint left them.
+        for (uint8_t id = 0; id < META_TABLE_COUNT; id++) {
+            meta_table *table = meta_table_lookup(id);
+            if (table != NULL) {
+                meta_table_attach(table, checkpoint.roots[id].first_block, checkpoint.roots[id].blocks);
+            }
+        }
+        write_pos = afterCheckpoint;
+        *snapshot = checkpoint.snapshot;
+        journal_ready = true;
+        meta_table_set_writeback_hook(writeback_hook);
+        return JOURNAL_SUCCESS;
+    }
+
+    journal_busy = true;
+    journal_pos everything = { .sector = chainLength, .offset = 0 };
+    journal_scan scan;
+    memcpy(scan.roots, checkpoint.roots, sizeof(scan.roots));
+    scan.committed.sector = 0;
+    scan.committed.offset = 0;
+    walk(chain, chainLength, everything, find_commits, &scan);
+
+    // The FAT goes first: replaying table pages follows the chains it describes.
+    walk(chain, chainLength, scan.committed, replay_fat, NULL);
+    fat_clear_dirty();
+    for (uint8_t id = 0; id < META_TABLE_COUNT; id++) {
+        meta_table *table = meta_table_lookup(id);
+        if (table != NULL) {
+            meta_table_attach(table, scan.roots[id].first_block, scan.roots[id].blocks);
+        }
+    }
+    walk(chain, chainLength, scan.committed, replay_pages, NULL);
+
+    // Whatever follows on flash may be torn; the checkpoint starts the next sector.
+    write_pos = FILESYSTEM_BLOCK_SIZE;
+    int result = write_checkpoint(NULL);
+    journal_busy = false;
+    journal_ready = true;
+    meta_table_set_writeback_hook(writeback_hook);
+    return result;
+}
+
+
+void meta_journal_get_stats(meta_journal_stats *stats) {
+    if (stats != NULL) {
+        *stats = journal_stats;
+    }
+}
+
+
+void meta_journal_reset_stats(void) {
+    uint32_t replayed = journal_stats.replayed_records;
+    memset(&journal_stats, 0, sizeof(journal_stats));
+    journal_stats.replayed_records = replayed;
+}
@@ -0,0 +1,743 @@
+/**
+ * @file meta_table.c
+ *
+ * This module keeps the file and directory tables on flash and pages them into RAM through
+ * a small cache shared by all tables.
+ *
+ * - Each table is a chain of blocks in the FAT, one page of records per block. A table
+ *   starts empty and grows a page at a time, so the number of entries is limited by free
+ *   flash rather than by a compile-time array size.
+ * - Up to META_CACHE_PAGES pages stay resident. When another page is needed, the least
+ *   recently used page that is not pinned is written back (if it changed) and reused.
+ * - Pinned pages are never evicted. If every resident page is pinned, extra pages are
+ *   allocated up to META_CACHE_MAX_LINES and released again once unpinned.
+ * - A page is written back only if it differs from what is on flash, so callers do not
+ *   need to mark records dirty after changing them. The last commit may refer to the page
+ *   on flash, so it is not overwritten: the new contents go to a fresh block that takes
+ *   its place in the table's chain.
+ * - Scans that only read, such as rebuilding indexes at mount, use meta_table_peek(),
+ *   which reads pages that are not cached straight from the XIP-mapped flash without
+ *   copying them into the cache.
+ * - Each resident page keeps a checksum of every META_JOURNAL_CHUNK-byte chunk as of the
+ *   last meta_table_collect(), which reports just the chunks that changed since. The
+ *   metadata journal uses this to record changes in proportion to their size, and commits
+ *   them through the write-back hook before any page reaches flash.
+ * - The tables are guarded by one reader-writer lock. File reads and writes hold it shared:
+ *   they only touch the pinned entry of their own open file, which a per-file lock guards.
+ *   Anything that adds, removes or renames entries, or commits them, holds it exclusively.
+ *   Writers take precedence over new readers so that a stream of reads cannot starve them,
+ *   and the exclusive holder may take the lock again in either mode.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "pico/mutex.h"
+#include "../config/flash_config.h"
+#include "../FAT/fat_fs.h"
+#include "../flash/flash_ops.h"
+#include "../flash/block_log.h"
+#include "../filesystem/meta_table.h"
+
+#if !PICO_ON_DEVICE
+#include <sched.h>
+#endif
+
+
+/**
+ * A cache slot holding one page of one table.
+ */
+typedef struct {
+    meta_table *table;    // Table the page belongs to, or NULL if the slot is unused.
+    uint32_t page;        // Page number within the table.
+    uint32_t block;       // Flash block holding the page.
+    uint32_t last_used;   // Access tick used to find the least recently used page.
+    uint16_t pins;        // Number of outstanding meta_table_pin() calls.
+    bool fresh;           // Added by meta_table_grow() and not collected yet.
+    uint8_t *data;        // The page contents, FILESYSTEM_BLOCK_SIZE bytes.
+    uint32_t *sums;       // Chunk checksums as of the last collect, after data in the same buffer.
+} meta_line;
+
+#define META_CHUNKS_PER_PAGE (FILESYSTEM_BLOCK_SIZE / META_JOURNAL_CHUNK)
+
+static meta_line meta_lines[META_CACHE_MAX_LINES];
+static uint32_t meta_tick = 0;
+static meta_table_stats meta_stats;
+static meta_table *meta_tables[META_TABLE_COUNT];
+static void (*writeback_hook)(void) = NULL;
+
+// State of the reader-writer lock, guarded by lock_mutex.
+auto_init_mutex(lock_mutex);
+static uint32_t lock_readers = 0;      // Holders of the shared lock.
+static uintptr_t lock_owner = 0;       // Holder of the exclusive lock, or 0.
+static uint32_t lock_depth = 0;        // Times the owner has taken the lock without releasing it.
+static uint32_t lock_writers_waiting = 0;
+
+#if PICO_ON_DEVICE
+// A waiting core sleeps until the lock is released.
+static inline uintptr_t lock_self(void) { return get_core_num() + 1; }
+static inline void lock_wait(void) { __wfe(); }
+static inline void lock_signal(void) { __sev(); }
+#else
+// Host builds use threads in place of cores; each is told apart by an address of its own.
+static _Thread_local char lock_marker;
+static inline uintptr_t lock_self(void) { return (uintptr_t)&lock_marker; }
+static inline void lock_wait(void) { sched_yield(); }
+static inline void lock_signal(void) {}
+#endif
+
+
+/**
+ * Checksums one chunk of a page (FNV-1a over 32-bit words).
+ */
+static uint32_t chunk_sum(const uint8_t *chunk) {
+    const uint32_t *words = (const uint32_t *)chunk;
+    uint32_t sum = 2166136261u;
+    for (uint32_t i = 0; i < META_JOURNAL_CHUNK / 4; i++) {
+        sum = (sum ^ words[i]) * 16777619u;
+        sum ^= sum >> 15;
+    }
+    return sum;
+}
+
+
+/**
+ * Records the current contents of a page as the baseline for the next collect.
+ */
+static void line_snapshot(meta_line *line) {
+    for (uint32_t i = 0; i < META_CHUNKS_PER_PAGE; i++) {
+        line->sums[i] = chunk_sum(line->data + i * META_JOURNAL_CHUNK);
+    }
+}
+
+
+/**
+ * Finds the flash block holding a page by following the table's chain. The walk starts at
+ * the last page looked up when that is not past the one wanted, so a sequential scan
+ * follows each link once.
+ */
+static uint32_t page_block(meta_table *table, uint32_t page) {
+    uint32_t block = table->first_block;
+    uint32_t i = 0;
+    if (table->hint_block != FAT_ENTRY_END && table->hint_page <= page) {
+        block = table->hint_block;
+        i = table->hint_page;
+    }
+    for (; i < page && block != FAT_ENTRY_END; i++) {
+        if (fat_get_next_block(block, &block) != FAT_SUCCESS) {
+            return FAT_ENTRY_END;
+        }
+    }
+    if (block != FAT_ENTRY_END) {
+        table->hint_page = page;
+        table->hint_block = block;
+    }
+    return block;
+}
+
+
+/**
+ * Swaps the block holding a page for another one that already has the page's contents,
+ * relinking the table's chain around it. The old block is retired rather than freed, so
+ * the chain recorded by the last journal commit stays readable until the next one.
+ */
+static void line_move(meta_line *line, uint32_t block) {
+    meta_table *table = line->table;
+    uint32_t next = FAT_ENTRY_END;
+    fat_get_next_block(line->block, &next);
+    if (next != FAT_ENTRY_END) {
+        fat_link_blocks(block, next);
+    }
+    if (line->page == 0) {
+        table->first_block = block;
+    } else {
+        fat_link_blocks(page_block(table, line->page - 1), block);
+    }
+    if (table->hint_page == line->page) {
+        table->hint_block = block;
+    }
+    block_log_retire_flushed(line->block);
+    line->block = block;
+}
+
+
+/**
+ * Checks whether a block has not been programmed since it was erased.
+ */
+static bool block_erased(uint32_t block) {
+    const uint32_t *words = (const uint32_t *)(XIP_BASE + block * FILESYSTEM_BLOCK_SIZE);
+    for (uint32_t i = 0; i < FILESYSTEM_BLOCK_SIZE / 4; i++) {
+        if (words[i] != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Writes a page back to flash if it differs from the flash copy. The page moves to a fresh
+ * block and the old one is retired, so the copy the last commit or checkpoint refers to
+ * stays intact until a later commit points elsewhere. A block still erased since
+ * meta_table_grow() holds nothing the journal needs, and is programmed where it is.
+ */
+static int line_writeback(meta_line *line) {
+    uint32_t offset = line->block * FILESYSTEM_BLOCK_SIZE;
+    if (memcmp(line->data, (const void *)(XIP_BASE + offset), FILESYSTEM_BLOCK_SIZE) == 0) {
+        return 0;
+    }
+    if (writeback_hook != NULL) {
+        // The journal must hold every change before it reaches the table on flash.
+        writeback_hook();
+        if (memcmp(line->data, (const void *)(XIP_BASE + offset), FILESYSTEM_BLOCK_SIZE) == 0) {
+            return 0;
+        }
+    }
+
+    if (block_erased(line->block)) {
+        if (flash_program_safe(offset, line->data, FILESYSTEM_BLOCK_SIZE, NULL) != FLASH_PROGRAM_SUCCESS) {
+            printf("Error: Failed to write metadata page at block %u.\n", line->block);
+            return -1;
+        }
+        meta_stats.writebacks++;
+        return 0;
+    }
+
+    uint32_t moved = block_log_allocate_edge();
+    if (moved == FAT_NO_FREE_BLOCKS) {
+        printf("Error: No free block to write back metadata page %u.\n", line->page);
+        return -1;
+    }
+    if (flash_program_safe(moved * FILESYSTEM_BLOCK_SIZE, line->data, FILESYSTEM_BLOCK_SIZE, NULL) != FLASH_PROGRAM_SUCCESS) {
+        printf("Error: Failed to write metadata page at block %u.\n", moved);
+        fat_free_block(moved);
+        return -1;
+    }
+    line_move(line, moved);
+    meta_stats.writebacks++;
+    return 0;
+}
+
+
+/**
+ * Writes back a page and gives its slot up. The slot's buffer is kept for reuse.
+ *
+ * @return 0 on success, or -1 if the page could not be written and stays resident.
+ */
+static int line_release(meta_line *line) {
+    if (line_writeback(line) != 0) {
+        return -1;
+    }
+    line->table = NULL;
+    meta_stats.resident--;
+    return 0;
+}
+
+
+/**
+ * Finds the resident line holding a record pointer, or NULL.
+ */
+static meta_line *line_for_record(const void *record) {
+    const uint8_t *p = (const uint8_t *)record;
+    for (int i = 0; i < META_CACHE_MAX_LINES; i++) {
+        meta_line *line = &meta_lines[i];
+        if (line->table != NULL && p >= line->data && p < line->data + FILESYSTEM_BLOCK_SIZE) {
+            return line;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Returns a free line to load a page into, evicting the least recently used unpinned page
+ * when META_CACHE_PAGES are already resident.
+ */
+static meta_line *line_claim(void) {
+    meta_line *victim = NULL;
+    meta_line *unused = NULL;
+    for (int i = 0; i < META_CACHE_MAX_LINES; i++) {
+        meta_line *line = &meta_lines[i];
+        if (line->table == NULL) {
+            // Prefer a slot that already owns a buffer.
+            if (unused == NULL || (unused->data == NULL && line->data != NULL)) {
+                unused = line;
+            }
+        } else if (line->pins == 0 && (victim == NULL || line->last_used < victim->last_used)) {
+            victim = line;
+        }
+    }
+
+    if (victim != NULL && (meta_stats.resident >= META_CACHE_PAGES || unused == NULL)) {
+        return (line_release(victim) == 0) ? victim : NULL;
+    }
+    if (unused == NULL) {
+        printf("Error: Every metadata cache page is pinned.\n");
+        return NULL;
+    }
+    if (unused->data == NULL) {
+        unused->data = malloc(FILESYSTEM_BLOCK_SIZE + META_CHUNKS_PER_PAGE * sizeof(uint32_t));
+        if (unused->data == NULL) {
+            printf("Error: No memory for a metadata cache page.\n");
+            return NULL;
+        }
+        unused->sums = (uint32_t *)(unused->data + FILESYSTEM_BLOCK_SIZE);
+    }
+    return unused;
+}
+
+
+/**
+ * Returns the resident line holding a page, loading it from flash if needed.
+ */
+static meta_line *line_load(meta_table *table, uint32_t page) {
+    for (int i = 0; i < META_CACHE_MAX_LINES; i++) {
+        meta_line *line = &meta_lines[i];
+        if (line->table == table && line->page == page) {
+            meta_stats.hits++;
+            line->last_used = ++meta_tick;
+            return line;
+        }
+    }
+
+    uint32_t block = page_block(table, page);
+    if (block == FAT_ENTRY_END) {
+        printf("Error: Metadata page %u is missing from its chain.\n", page);
+        return NULL;
+    }
+    meta_line *line = line_claim();
+    if (line == NULL) {
+        return NULL;
+    }
+    memcpy(line->data, (const void *)(XIP_BASE + block * FILESYSTEM_BLOCK_SIZE), FILESYSTEM_BLOCK_SIZE);
+    line_snapshot(line);
+    line->table = table;
+    line->page = page;
+    line->block = block;
+    line->pins = 0;
+    line->fresh = false;
+    line->last_used = ++meta_tick;
+    meta_stats.misses++;
+    if (++meta_stats.resident > meta_stats.peak_resident) {
+        meta_stats.peak_resident = meta_stats.resident;
+    }
+    return line;
+}
+
+
+/**
+ * Drops every cached page of a table without writing it back.
+ */
+static void drop_lines(const meta_table *table) {
+    for (int i = 0; i < META_CACHE_MAX_LINES; i++) {
+        if (meta_lines[i].table == table) {
+            meta_lines[i].table = NULL;
+            meta_stats.resident--;
+        }
+    }
+}
+
+
+/**
+ * Empties a table: it has no pages and any of its pages still cached are dropped without
+ * being written back. The blocks of a previous chain are not freed here; this is meant for
+ * filesystem initialization, where the FAT has just been reset.
+ *
+ * @param table The table to initialize.
+ * @param id The table's META_TABLE_* identifier, under which the journal records it.
+ * @param record_size Size of one record in bytes, at most FILESYSTEM_BLOCK_SIZE.
+ */
+void meta_table_init(meta_table *table, uint8_t id, uint16_t record_size) {
+    drop_lines(table);
+    table->first_block = FAT_ENTRY_END;
+    table->blocks = 0;
+    table->hint_block = FAT_ENTRY_END;
+    table->record_size = record_size;
+    table->records_per_page = FILESYSTEM_BLOCK_SIZE / record_size;
+    table->id = id;
+    if (id < META_TABLE_COUNT) {
+        meta_tables[id] = table;
+    }
+}
+
+
+/**
+ * Points an initialized table at a chain of blocks already on flash, as recorded by the
+ * metadata journal. Cached pages of the table are dropped without being written back.
+ *
+ * @param table The table, initialized with meta_table_init().
+ * @param first_block First block of the chain, or FAT_ENTRY_END for an empty table.
+ * @param blocks Number of blocks in the chain.
+ */
+void meta_table_attach(meta_table *table, uint32_t first_block, uint32_t blocks) {
+    drop_lines(table);
+    table->first_block = first_block;
+    table->blocks = (first_block == FAT_ENTRY_END) ? 0 : blocks;
+    table->hint_block = FAT_ENTRY_END;
+}
+
+
+/**
+ * Returns the table registered under a META_TABLE_* identifier, or NULL.
+ */
+meta_table *meta_table_lookup(uint8_t id) {
+    return (id < META_TABLE_COUNT) ? meta_tables[id] : NULL;
+}
+
+
+/**
+ * Returns the number of record slots in a table, used or not.
+ */
+uint32_t meta_table_capacity(const meta_table *table) {
+    return table->blocks * table->records_per_page;
+}
+
+
+/**
+ * Returns a pointer to the record at a slot, paging it in if needed.
+ *
+ * @param table The table to read.
+ * @param slot Record number within the table.
+ * @return Pointer to the record in the page cache, or NULL if the slot is past the end of
+ *         the table or the page cannot be loaded.
+ */
+void *meta_table_get(meta_table *table, uint32_t slot) {
+    if (slot >= meta_table_capacity(table)) {
+        return NULL;
+    }
+    meta_line *line = line_load(table, slot / table->records_per_page);
+    if (line == NULL) {
+        return NULL;
+    }
+    return line->data + (slot % table->records_per_page) * table->record_size;
+}
+
+
+/**
+ * Returns a read-only pointer to the record at a slot. A cached page is used if there is
+ * one, so changes not yet written back are seen; otherwise the record is read in place
+ * from the XIP-mapped flash and the cache is left alone. The pointer must not be written
+ * through and is only valid until the table is next changed.
+ *
+ * @return Pointer to the record, or NULL if the slot is past the end of the table.
+ */
+const void *meta_table_peek(meta_table *table, uint32_t slot) {
+    if (slot >= meta_table_capacity(table)) {
+        return NULL;
+    }
+    uint32_t page = slot / table->records_per_page;
+    uint32_t offset = (slot % table->records_per_page) * table->record_size;
+    for (int i = 0; i < META_CACHE_MAX_LINES; i++) {
+        if (meta_lines[i].table == table && meta_lines[i].page == page) {
+            return meta_lines[i].data + offset;
+        }
+    }
+    uint32_t block = page_block(table, page);
+    if (block == FAT_ENTRY_END) {
+        return NULL;
+    }
+    return (const void *)(XIP_BASE + block * FILESYSTEM_BLOCK_SIZE + offset);
+}
+
+
+/**
+ * Returns the slot number of a record obtained from meta_table_get().
+ *
+ * @return The slot, or UINT32_MAX if the pointer is not a resident record of the table.
+ */
+uint32_t meta_table_slot(const meta_table *table, const void *record) {
+    meta_line *line = line_for_record(record);
+    if (line == NULL || line->table != table) {
+        return UINT32_MAX;
+    }
+    uint32_t index = ((const uint8_t *)record - line->data) / table->record_size;
+    return line->page * table->records_per_page + index;
+}
+
+
+/**
+ * Adds one page of zeroed (unused) records to the end of a table.
+ *
+ * @param table The table to grow.
+ * @return 0 on success, or -1 if no block is free or the page cannot be cached.
+ */
+int meta_table_grow(meta_table *table) {
+    uint32_t block = block_log_allocate();
+    if (block == FAT_NO_FREE_BLOCKS) {
+        printf("Error: No free block to grow a metadata table.\n");
+        return -1;
+    }
+
+    meta_line *line = line_claim();
+    if (line == NULL) {
+        fat_free_block(block);
+        return -1;
+    }
+
+    if (table->first_block == FAT_ENTRY_END) {
+        table->first_block = block;
+    } else {
+        fat_link_blocks(page_block(table, table->blocks - 1), block);
+    }
+
+    // The block is erased; the zeroed page reaches it on the next write-back.
+    memset(line->data, 0, FILESYSTEM_BLOCK_SIZE);
+    line_snapshot(line);
+    line->table = table;
+    line->page = table->blocks;
+    line->block = block;
+    line->pins = 0;
+    line->fresh = true;
+    line->last_used = ++meta_tick;
+    if (++meta_stats.resident > meta_stats.peak_resident) {
+        meta_stats.peak_resident = meta_stats.resident;
+    }
+    table->blocks++;
+    return 0;
+}
+
+
+/**
+ * Keeps the page holding a record resident until meta_table_unpin() is called for it.
+ */
+void meta_table_pin(const void *record) {
+    meta_line *line = line_for_record(record);
+    if (line != NULL) {
+        line->pins++;
+    }
+}
+
+
+/**
+ * Releases a pin. A page over the META_CACHE_PAGES budget is written back and freed as
+ * soon as its last pin goes.
+ */
+void meta_table_unpin(const void *record) {
+    meta_line *line = line_for_record(record);
+    if (line == NULL || line->pins == 0) {
+        return;
+    }
+    if (--line->pins == 0 && meta_stats.resident > META_CACHE_PAGES && line_release(line) == 0) {
+        free(line->data);
+        line->data = NULL;
+    }
+}
+
+
+/**
+ * Writes every resident page that differs from flash back to flash. Pages stay resident.
+ *
+ * @return 0 on success, or -1 if any page could not be written.
+ */
+int meta_table_sync(void) {
+    int result = 0;
+    for (int i = 0; i < META_CACHE_MAX_LINES; i++) {
+        if (meta_lines[i].table != NULL && line_writeback(&meta_lines[i]) != 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+
+/**
+ * Reports every range of the resident pages that changed since the previous call (or since
+ * the page was loaded), a META_JOURNAL_CHUNK-byte chunk at a time, and makes the current
+ * contents the baseline for the next call. Adjacent changed chunks are reported together.
+ * Pages evicted in between were written back, and the write-back hook collected them first.
+ *
+ * @param emit Receives the changed ranges; NULL just resets the baseline, for example after
+ *             every page has been synced for a checkpoint.
+ */
+void meta_table_collect(meta_table_emit emit) {
+    for (int i = 0; i < META_CACHE_MAX_LINES; i++) {
+        meta_line *line = &meta_lines[i];
+        if (line->table == NULL) {
+            continue;
+        }
+        if (line->fresh && emit != NULL) {
+            emit(line->table->id, line->page, 0, NULL, 0);
+        }
+        line->fresh = false;
+
+        uint32_t run = META_CHUNKS_PER_PAGE; // First chunk of the current changed run.
+        for (uint32_t chunk = 0; chunk <= META_CHUNKS_PER_PAGE; chunk++) {
+            bool changed = false;
+            if (chunk < META_CHUNKS_PER_PAGE) {
+                uint32_t sum = chunk_sum(line->data + chunk * META_JOURNAL_CHUNK);
+                changed = (sum != line->sums[chunk]);
+                line->sums[chunk] = sum;
+            }
+            if (changed && run == META_CHUNKS_PER_PAGE) {
+                run = chunk;
+            } else if (!changed && run != META_CHUNKS_PER_PAGE) {
+                if (emit != NULL) {
+                    emit(line->table->id, line->page, run * META_JOURNAL_CHUNK,
+                         line->data + run * META_JOURNAL_CHUNK, (chunk - run) * META_JOURNAL_CHUNK);
+                }
+                run = META_CHUNKS_PER_PAGE;
+            }
+        }
+    }
+}
+
+
+/**
+ * Replays a range reported by meta_table_collect() into a table's page. The change is made
+ * in the cache and reaches flash with the page's next write-back.
+ *
+ * @param id Identifier of the table.
+ * @param page Page within the table; the table must already be attached with its final size.
+ * @param offset Byte offset within the page.
+ * @param data The bytes to store, or NULL to zero the whole page.
+ * @param length Number of bytes.
+ * @return 0 on success, or -1 if the table or page does not exist or the range is invalid.
+ */
+int meta_table_apply(uint8_t id, uint32_t page, uint32_t offset, const uint8_t *data, uint32_t length) {
+    meta_table *table = meta_table_lookup(id);
+    if (table == NULL || page >= table->blocks || offset > FILESYSTEM_BLOCK_SIZE
+        || length > FILESYSTEM_BLOCK_SIZE - offset) {
+        return -1;
+    }
+    meta_line *line = line_load(table, page);
+    if (line == NULL) {
+        return -1;
+    }
+    if (data == NULL) {
+        memset(line->data, 0, FILESYSTEM_BLOCK_SIZE);
+    } else {
+        memcpy(line->data + offset, data, length);
+    }
+    return 0;
+}
+
+
+/**
+ * Sets a function called before any changed page is programmed to flash, or NULL for none.
+ * The metadata journal uses it to commit pending changes first, so that what is on flash is
+ * never newer than the journal.
+ */
+void meta_table_set_writeback_hook(void (*hook)(void)) {
+    writeback_hook = hook;
+}
+
+
+/**
+ * Takes the lock exclusively, waiting for readers and for another owner to leave. The
+ * owner may call this again; each call needs a meta_table_unlock().
+ */
+void meta_table_lock(void) {
+    uintptr_t self = lock_self();
+    bool waiting = false;
+    for (;;) {
+        mutex_enter_blocking(&lock_mutex);
+        if (lock_owner == self || (lock_owner == 0 && lock_readers == 0)) {
+            lock_owner = self;
+            lock_depth++;
+            if (waiting) {
+                lock_writers_waiting--;
+            }
+            mutex_exit(&lock_mutex);
+            return;
+        }
+        // Announce the wait so that no new reader gets in ahead.
+        if (!waiting) {
+            lock_writers_waiting++;
+            waiting = true;
+        }
+        mutex_exit(&lock_mutex);
+        lock_wait();
+    }
+}
+
+
+/**
+ * Takes the lock exclusively if that is possible without waiting.
+ *
+ * @return true if the lock was taken; release it with meta_table_unlock().
+ */
+bool meta_table_try_lock(void) {
+    uintptr_t self = lock_self();
+    bool taken = false;
+    mutex_enter_blocking(&lock_mutex);
+    if (lock_owner == self || (lock_owner == 0 && lock_readers == 0 && lock_writers_waiting == 0)) {
+        lock_owner = self;
+        lock_depth++;
+        taken = true;
+    }
+    mutex_exit(&lock_mutex);
+    return taken;
+}
+
+
+/**
+ * Releases one meta_table_lock() or meta_table_try_lock().
+ */
+void meta_table_unlock(void) {
+    mutex_enter_blocking(&lock_mutex);
+    if (lock_depth > 0 && --lock_depth == 0) {
+        lock_owner = 0;
+    }
+    mutex_exit(&lock_mutex);
+    lock_signal();
+}
+
+
+/**
+ * Takes the lock shared, waiting while it is held or wanted exclusively. Called by the
+ * exclusive owner, it takes the lock again exclusively instead. A reader must not take the
+ * lock a second time, since a writer may be waiting in between.
+ */
+void meta_table_lock_shared(void) {
+    uintptr_t self = lock_self();
+    for (;;) {
+        mutex_enter_blocking(&lock_mutex);
+        if (lock_owner == self) {
+            lock_depth++;
+            mutex_exit(&lock_mutex);
+            return;
+        }
+        if (lock_owner == 0 && lock_writers_waiting == 0) {
+            lock_readers++;
+            mutex_exit(&lock_mutex);
+            return;
+        }
+        mutex_exit(&lock_mutex);
+        lock_wait();
+    }
+}
+
+
+/**
+ * Releases one meta_table_lock_shared().
+ */
+void meta_table_unlock_shared(void) {
+    uintptr_t self = lock_self();
+    mutex_enter_blocking(&lock_mutex);
+    if (lock_owner == self) {
+        if (--lock_depth == 0) {
+            lock_owner = 0;
+        }
+    } else if (lock_readers > 0) {
+        lock_readers--;
+    }
+    mutex_exit(&lock_mutex);
+    lock_signal();
+}
+
+
+void meta_table_get_stats(meta_table_stats *stats) {
+    if (stats != NULL) {
+        *stats = meta_stats;
+    }
+}
+
+
+void meta_table_reset_stats(void) {
+    uint32_t resident = meta_stats.resident;
+    memset(&meta_stats, 0, sizeof(meta_stats));
+    meta_stats.resident = resident;
+    meta_stats.peak_resident = resident;
+}
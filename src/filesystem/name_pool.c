@@ -0,0 +1,613 @@
+/**
+ * @file name_pool.c
+ *
+ * This module stores file and directory names in a packed, deduplicated pool.
+ *
+ * - The pool is a paged table on flash (see meta_table.c) addressed by byte offset. Each
+ *   name is a record of a small header (reference count, length, capacity) followed by the
+ *   name and a terminator, padded to 4 bytes. Records never straddle a page.
+ * - A name used by several entries is stored once; the record counts its references.
+ * - An in-RAM hash table maps name hashes to record offsets, so finding an existing name
+ *   only reads the pool for records whose hash matches.
+ * - When the last reference goes, the record is put on a free list and reused by a later
+ *   name of a similar length. New records are otherwise appended at the end of the pool.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "../config/flash_config.h"
+#include "../filesystem/meta_table.h"
+#include "../filesystem/name_pool.h"
+#include "../filesystem/meta_journal.h"
+
+
+// Values of a dedup table slot that does not refer to a record.
+#define NAME_POOL_EMPTY 0xFFFFFFFF
+#define NAME_POOL_DELETED 0xFFFFFFFE
+
+// Pool offsets are counted in units of the pool table's 4-byte records.
+#define NAME_POOL_UNIT 4
+
+// A freed record is only reused for a name that wastes at most this many bytes of it.
+#define NAME_POOL_REUSE_SLACK 16
+
+/**
+ * Header of a name record. The name follows, then a terminator and padding.
+ */
+typedef struct {
+    uint16_t refs;       // name_ref values pointing at the record; 0 once it is free.
+    uint8_t length;      // Length of the name stored in the record.
+    uint8_t capacity;    // Longest name the record can hold.
+} name_record;
+
+/**
+ * A record whose name is no longer referenced.
+ */
+typedef struct {
+    uint32_t offset;
+    uint8_t capacity;
+} free_record;
+
+static meta_table pool_table;
+static uint32_t pool_end;            // Offset at which the next record is appended.
+
+static uint32_t *dedup_hashes;       // Hash of the name in each slot.
+static uint32_t *dedup_offsets;      // Record offset in each slot, or EMPTY / DELETED.
+static uint32_t dedup_slots;
+static uint32_t dedup_deleted;
+
+static free_record *free_records;
+static uint32_t free_count;
+static uint32_t free_capacity;
+
+static name_pool_stats pool_stats;
+
+/**
+ * Header of the pool's index as saved in a mount snapshot. The (hash, offset) pair of every
+ * referenced record follows it, then the free list; the dedup table is rebuilt from the pairs.
+ */
+typedef struct {
+    uint32_t pool_end;
+    uint32_t free_count;
+    name_pool_stats stats;
+} pool_snapshot_header;
+
+
+/**
+ * Returns the number of pool bytes taken by a record that holds names up to capacity bytes.
+ */
+static uint32_t record_bytes(uint32_t capacity) {
+    return (sizeof(name_record) + capacity + 1 + NAME_POOL_UNIT - 1) & ~(uint32_t)(NAME_POOL_UNIT - 1);
+}
+
+
+/**
+ * Returns the record at a pool offset, paging it in if needed.
+ */
+static name_record *record_at(uint32_t offset) {
+    return (name_record *)meta_table_get(&pool_table, offset / NAME_POOL_UNIT);
+}
+
+
+/**
+ * Returns the record at a pool offset for reading only, without paging it into the cache.
+ */
+static const name_record *record_peek(uint32_t offset) {
+    return (const name_record *)meta_table_peek(&pool_table, offset / NAME_POOL_UNIT);
+}
+
+
+/**
+ * Puts a record into the first free or deleted slot of the dedup table's probe sequence.
+ */
+static void dedup_put(uint32_t hash, uint32_t offset) {
+    uint32_t slot = hash % dedup_slots;
+    while (dedup_offsets[slot] != NAME_POOL_EMPTY && dedup_offsets[slot] != NAME_POOL_DELETED) {
+        slot = (slot + 1) % dedup_slots;
+    }
+    dedup_hashes[slot] = hash;
+    dedup_offsets[slot] = offset;
+}
+
+
+/**
+ * Resizes the dedup table so that it stays at most half full, and drops deleted slots.
+ *
+ * @return 0 on success, or -1 if there is not enough memory.
+ */
+static int dedup_resize(void) {
+    uint32_t slots = 32;
+    while (slots < 4 * pool_stats.strings) {
+        slots *= 2;
+    }
+    uint32_t *hashes = malloc(slots * sizeof(uint32_t));
+    uint32_t *offsets = malloc(slots * sizeof(uint32_t));
+    if (hashes == NULL || offsets == NULL) {
+        free(hashes);
+        free(offsets);
+        printf("Error: No memory for the name pool index.\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < slots; i++) {
+        offsets[i] = NAME_POOL_EMPTY;
+    }
+
+    uint32_t *oldHashes = dedup_hashes;
+    uint32_t *oldOffsets = dedup_offsets;
+    uint32_t oldSlots = dedup_slots;
+    dedup_hashes = hashes;
+    dedup_offsets = offsets;
+    dedup_slots = slots;
+    dedup_deleted = 0;
+    for (uint32_t i = 0; i < oldSlots; i++) {
+        if (oldOffsets[i] != NAME_POOL_EMPTY && oldOffsets[i] != NAME_POOL_DELETED) {
+            dedup_put(oldHashes[i], oldOffsets[i]);
+        }
+    }
+    free(oldHashes);
+    free(oldOffsets);
+    return 0;
+}
+
+
+/**
+ * Finds the record holding a name.
+ *
+ * @return Offset of the record, or NAME_POOL_EMPTY if the name is not in the pool.
+ */
+static uint32_t dedup_find(const char *name, size_t length, uint32_t hash) {
+    if (dedup_slots == 0) {
+        return NAME_POOL_EMPTY;
+    }
+    uint32_t slot = hash % dedup_slots;
+    for (uint32_t probes = 0; probes < dedup_slots && dedup_offsets[slot] != NAME_POOL_EMPTY; probes++) {
+        uint32_t offset = dedup_offsets[slot];
+        if (offset != NAME_POOL_DELETED && dedup_hashes[slot] == hash) {
+            name_record *record = record_at(offset);
+            if (record != NULL && record->length == length && memcmp(record + 1, name, length) == 0) {
+                return offset;
+            }
+        }
+        slot = (slot + 1) % dedup_slots;
+    }
+    return NAME_POOL_EMPTY;
+}
+
+
+/**
+ * Marks the dedup slot of a record as deleted.
+ */
+static void dedup_remove(uint32_t hash, uint32_t offset) {
+    uint32_t slot = hash % dedup_slots;
+    for (uint32_t probes = 0; probes < dedup_slots && dedup_offsets[slot] != NAME_POOL_EMPTY; probes++) {
+        if (dedup_offsets[slot] == offset) {
+            dedup_offsets[slot] = NAME_POOL_DELETED;
+            dedup_deleted++;
+            return;
+        }
+        slot = (slot + 1) % dedup_slots;
+    }
+}
+
+
+/**
+ * Takes a record from the free list that fits a name of the given length without wasting
+ * more than NAME_POOL_REUSE_SLACK bytes.
+ *
+ * @return Offset of the record, or NAME_POOL_EMPTY if none fits.
+ */
+static uint32_t take_free_record(size_t length, uint8_t *capacity) {
+    int best = -1;
+    for (uint32_t i = 0; i < free_count; i++) {
+        if (free_records[i].capacity >= length && free_records[i].capacity <= length + NAME_POOL_REUSE_SLACK
+            && (best < 0 || free_records[i].capacity < free_records[best].capacity)) {
+            best = i;
+        }
+    }
+    if (best < 0) {
+        return NAME_POOL_EMPTY;
+    }
+    uint32_t offset = free_records[best].offset;
+    *capacity = free_records[best].capacity;
+    free_records[best] = free_records[--free_count];
+    return offset;
+}
+
+
+/**
+ * Appends a record able to hold a name of the given length, growing the pool if needed.
+ *
+ * @return Offset of the record, or NAME_POOL_EMPTY if the pool cannot grow.
+ */
+static uint32_t append_record(size_t length) {
+    uint32_t bytes = record_bytes(length);
+    uint32_t inPage = pool_end % FILESYSTEM_BLOCK_SIZE;
+    if (inPage + bytes > FILESYSTEM_BLOCK_SIZE) {
+        pool_end += FILESYSTEM_BLOCK_SIZE - inPage; // Records never straddle a page.
+    }
+    while (pool_end + bytes > meta_table_capacity(&pool_table) * NAME_POOL_UNIT) {
+        if (meta_table_grow(&pool_table) != 0) {
+            printf("Error: No space left to store a name.\n");
+            return NAME_POOL_EMPTY;
+        }
+    }
+    uint32_t offset = pool_end;
+    pool_end += bytes;
+    return offset;
+}
+
+
+/**
+ * Empties the pool and its index. Call when the filesystem is initialized, before any file
+ * or directory entry is created.
+ */
+void name_pool_init(void) {
+    meta_table_init(&pool_table, META_TABLE_NAMES, NAME_POOL_UNIT);
+    pool_end = 0;
+    for (uint32_t i = 0; i < dedup_slots; i++) {
+        dedup_offsets[i] = NAME_POOL_EMPTY;
+    }
+    dedup_deleted = 0;
+    free_count = 0;
+    memset(&pool_stats, 0, sizeof(pool_stats));
+}
+
+
+/**
+ * Rebuilds the in-RAM index, free list and counters from the records of the pool table,
+ * after the metadata journal has restored it on flash. A record header with no capacity
+ * marks the unused tail of a page. Records are read in place from flash.
+ *
+ * @return 0 on success, or -1 if there is not enough memory for the index.
+ */
+int name_pool_rebuild(void) {
+    for (uint32_t i = 0; i < dedup_slots; i++) {
+        dedup_offsets[i] = NAME_POOL_EMPTY;
+    }
+    dedup_deleted = 0;
+    free_count = 0;
+    memset(&pool_stats, 0, sizeof(pool_stats));
+    pool_end = 0;
+
+    for (uint32_t page = 0; page < pool_table.blocks; page++) {
+        uint32_t offset = page * FILESYSTEM_BLOCK_SIZE;
+        uint32_t pageEnd = offset + FILESYSTEM_BLOCK_SIZE;
+        while (offset + sizeof(name_record) <= pageEnd) {
+            const name_record *record = record_peek(offset);
+            if (record == NULL) {
+                return -1;
+            }
+            uint32_t bytes = record_bytes(record->capacity);
+            if (record->capacity == 0 || record->length > record->capacity || offset + bytes > pageEnd) {
+                break;
+            }
+
+            if (record->refs > 0) {
+                uint32_t hash = name_pool_hash((const char *)(record + 1), record->length);
+                uint32_t refs = record->refs;
+                if ((pool_stats.strings + 1) * 2 > dedup_slots && dedup_resize() != 0) {
+                    return -1;
+                }
+                dedup_put(hash, offset);
+                pool_stats.strings++;
+                pool_stats.references += refs;
+                pool_stats.bytes_live += bytes;
+            } else {
+                uint8_t capacity = record->capacity;
+                if (free_count == free_capacity) {
+                    uint32_t grown = (free_capacity == 0) ? 16 : free_capacity * 2;
+                    free_record *records = realloc(free_records, grown * sizeof(free_record));
+                    if (records == NULL) {
+                        return -1;
+                    }
+                    free_records = records;
+                    free_capacity = grown;
+                }
+                free_records[free_count].offset = offset;
+                free_records[free_count].capacity = capacity;
+                free_count++;
+            }
+            offset += bytes;
+            pool_end = offset;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Hashes a name (FNV-1a). Every name_ref stores this hash of its name.
+ *
+ * @param name The name; it need not be NUL-terminated.
+ * @param length Number of bytes of name to hash.
+ */
+uint32_t name_pool_hash(const char* name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+
+/**
+ * Adds a reference to a name, storing the name in the pool if it is not there yet.
+ *
+ * @return Offset of the name's record, or NAME_POOL_EMPTY if it cannot be stored.
+ */
+static uint32_t intern(const char *name, size_t length, uint32_t hash) {
+    uint32_t offset = dedup_find(name, length, hash);
+    if (offset != NAME_POOL_EMPTY) {
+        record_at(offset)->refs++;
+        pool_stats.references++;
+        pool_stats.shared++;
+        return offset;
+    }
+
+    if ((pool_stats.strings + dedup_deleted + 1) * 2 > dedup_slots && dedup_resize() != 0) {
+        return NAME_POOL_EMPTY;
+    }
+
+    uint8_t capacity = length;
+    offset = take_free_record(length, &capacity);
+    if (offset == NAME_POOL_EMPTY) {
+        offset = append_record(length);
+        if (offset == NAME_POOL_EMPTY) {
+            return NAME_POOL_EMPTY;
+        }
+    }
+
+    name_record *record = record_at(offset);
+    if (record == NULL) {
+        return NAME_POOL_EMPTY;
+    }
+    record->refs = 1;
+    record->length = length;
+    record->capacity = capacity;
+    memcpy(record + 1, name, length);
+    ((char *)(record + 1))[length] = '\0';
+
+    dedup_put(hash, offset);
+    pool_stats.strings++;
+    pool_stats.references++;
+    pool_stats.bytes_live += record_bytes(capacity);
+    return offset;
+}
+
+
+/**
+ * Drops a reference to the record at an offset, freeing the record with the last one.
+ */
+static void release(uint32_t offset, uint32_t hash) {
+    name_record *record = record_at(offset);
+    if (record == NULL || record->refs == 0) {
+        return;
+    }
+    pool_stats.references--;
+    if (--record->refs > 0) {
+        return;
+    }
+
+    uint8_t capacity = record->capacity;
+    dedup_remove(hash, offset);
+    pool_stats.strings--;
+    pool_stats.bytes_live -= record_bytes(capacity);
+
+    if (free_count == free_capacity) {
+        uint32_t grown = (free_capacity == 0) ? 16 : free_capacity * 2;
+        free_record *records = realloc(free_records, grown * sizeof(free_record));
+        if (records == NULL) {
+            return; // The record is simply not reused.
+        }
+        free_records = records;
+        free_capacity = grown;
+    }
+    free_records[free_count].offset = offset;
+    free_records[free_count].capacity = capacity;
+    free_count++;
+}
+
+
+/**
+ * Points a reference at a name, replacing any name it held before. Names longer than
+ * NAME_POOL_MAX_LENGTH bytes are truncated.
+ *
+ * @param ref The reference to update, for example the name of a file entry.
+ * @param name The new name.
+ * @return 0 on success, or -1 if the name cannot be stored; the reference is then unchanged.
+ */
+int name_pool_set(name_ref* ref, const char* name) {
+    size_t length = strnlen(name, NAME_POOL_MAX_LENGTH);
+    if (length == 0) {
+        name_pool_clear(ref); // An empty name needs no record.
+        return 0;
+    }
+    uint32_t hash = name_pool_hash(name, length);
+    if (ref->length > 0 && name_pool_matches(ref, name, length, hash)) {
+        return 0;
+    }
+
+    // Take the new reference before dropping the old one, so a shared record survives.
+    uint32_t offset = intern(name, length, hash);
+    if (offset == NAME_POOL_EMPTY) {
+        return -1;
+    }
+    name_pool_clear(ref);
+    ref->offset = offset;
+    ref->hash = hash;
+    ref->length = length;
+    return 0;
+}
+
+
+/**
+ * Drops the name a reference holds, leaving it empty. Call before an entry holding a name
+ * is cleared or reused.
+ */
+void name_pool_clear(name_ref* ref) {
+    if (ref->length > 0) {
+        release(ref->offset, ref->hash);
+    }
+    ref->offset = 0;
+    ref->hash = 0;
+    ref->length = 0;
+}
+
+
+/**
+ * Checks whether a reference holds a given name. The hash and length are compared first;
+ * the pool is only read when both match.
+ *
+ * @param ref The reference to check.
+ * @param name The name to compare against; it need not be NUL-terminated.
+ * @param length Length of name in bytes.
+ * @param hash name_pool_hash() of name.
+ */
+bool name_pool_matches(const name_ref* ref, const char* name, size_t length, uint32_t hash) {
+    if (ref->hash != hash || ref->length != length) {
+        return false;
+    }
+    if (length == 0) {
+        return true;
+    }
+    name_record *record = record_at(ref->offset);
+    return record != NULL && memcmp(record + 1, name, length) == 0;
+}
+
+
+/**
+ * Checks whether a reference holds a given NUL-terminated name.
+ */
+bool name_pool_equals(const name_ref* ref, const char* name) {
+    size_t length = strnlen(name, NAME_POOL_MAX_LENGTH + 1);
+    return name_pool_matches(ref, name, length, name_pool_hash(name, length));
+}
+
+
+/**
+ * Returns the name a reference holds. The string lives in the metadata page cache: use it
+ * straight away, or copy it, before touching other file or directory entries.
+ *
+ * @return The NUL-terminated name, or "" for an empty reference.
+ */
+const char* name_pool_str(const name_ref* ref) {
+    if (ref->length == 0) {
+        return "";
+    }
+    name_record *record = record_at(ref->offset);
+    return (record != NULL) ? (const char *)(record + 1) : "";
+}
+
+
+/**
+ * Returns the name a reference holds for reading only. A name whose page is not cached is
+ * read in place from flash, so scans over many names do not churn the page cache.
+ *
+ * @return The NUL-terminated name, or "" for an empty reference.
+ */
+const char* name_pool_peek(const name_ref* ref) {
+    if (ref->length == 0) {
+        return "";
+    }
+    const name_record *record = record_peek(ref->offset);
+    return (record != NULL) ? (const char *)(record + 1) : "";
+}
+
+
+/**
+ * Returns the number of bytes name_pool_snapshot_write() produces.
+ */
+uint32_t name_pool_snapshot_size(void) {
+    return sizeof(pool_snapshot_header) + pool_stats.strings * 2 * sizeof(uint32_t) + free_count * sizeof(free_record);
+}
+
+
+/**
+ * Saves the pool's index and free list for a mount snapshot, so the next mount does not
+ * have to read and hash every record of the pool.
+ *
+ * @param sink Receives the bytes, name_pool_snapshot_size() of them in all.
+ * @param context Passed through to sink.
+ */
+void name_pool_snapshot_write(meta_snapshot_sink sink, void *context) {
+    pool_snapshot_header header = { .pool_end = pool_end, .free_count = free_count, .stats = pool_stats };
+    sink(&header, sizeof(header), context);
+
+    uint32_t pairs[64];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < dedup_slots; i++) {
+        if (dedup_offsets[i] == NAME_POOL_EMPTY || dedup_offsets[i] == NAME_POOL_DELETED) {
+            continue;
+        }
+        pairs[count++] = dedup_hashes[i];
+        pairs[count++] = dedup_offsets[i];
+        if (count == 64) {
+            sink(pairs, sizeof(pairs), context);
+            count = 0;
+        }
+    }
+    sink(pairs, count * sizeof(uint32_t), context);
+    sink(free_records, free_count * sizeof(free_record), context);
+}
+
+
+/**
+ * Loads the pool's index and free list from a mount snapshot, read in place from flash.
+ * The pool table must already be attached and unchanged since the snapshot was written.
+ *
+ * @param data The bytes written by name_pool_snapshot_write().
+ * @param length Number of bytes available at data.
+ * @return 0 on success, or -1 if the snapshot does not fit the pool or memory is short;
+ *         rebuild the index with name_pool_rebuild() then.
+ */
+int name_pool_snapshot_load(const uint8_t *data, uint32_t length) {
+    pool_snapshot_header header;
+    if (length < sizeof(header)) {
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+    uint32_t pairBytes = header.stats.strings * 2 * sizeof(uint32_t);
+    if (header.pool_end > meta_table_capacity(&pool_table) * NAME_POOL_UNIT
+        || length != sizeof(header) + pairBytes + header.free_count * sizeof(free_record)) {
+        return -1;
+    }
+
+    free_record *records = malloc((header.free_count ? header.free_count : 1) * sizeof(free_record));
+    if (records == NULL) {
+        return -1;
+    }
+    data += sizeof(header);
+    memcpy(records, data + pairBytes, header.free_count * sizeof(free_record));
+    free(free_records);
+    free_records = records;
+    free_count = header.free_count;
+    free_capacity = header.free_count ? header.free_count : 1;
+
+    // Start the dedup table afresh at the size the strings need, then fill it.
+    free(dedup_hashes);
+    free(dedup_offsets);
+    dedup_hashes = NULL;
+    dedup_offsets = NULL;
+    dedup_slots = 0;
+    pool_stats = header.stats;
+    if (dedup_resize() != 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < header.stats.strings; i++) {
+        uint32_t pair[2];
+        memcpy(pair, data + i * sizeof(pair), sizeof(pair));
+        dedup_put(pair[0], pair[1]);
+    }
+    pool_end = header.pool_end;
+    return 0;
+}
+
+
+void name_pool_get_stats(name_pool_stats* stats) {
+    if (stats != NULL) {
+        *stats = pool_stats;
+        stats->bytes_used = pool_end;
+        stats->pages = pool_table.blocks;
+    }
+}
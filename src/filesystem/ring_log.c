@@ -0,0 +1,572 @@
+/**
+ * @file ring_log.c
+ *
+ * Ring-log files: append-only logs of small records kept in a fixed ring of blocks.
+ *
+ * - fs_log_open() creates the file with a chain of capacity_blocks erased blocks taken from
+ *   the block log, or finds the chain of an existing log. The chain is the ring; the file's
+ *   size stays 0, and its blocks have no block trailer, so static wear levelling leaves them
+ *   alone. The ring wears its own blocks evenly anyway.
+ * - Producers claim a slot of a bounded multi-producer queue with a compare-and-swap on its
+ *   head and publish the record with a release store of the slot's sequence number, as in
+ *   D. Vyukov's bounded MPMC queue. No lock is taken, and a full queue refuses the record
+ *   instead of waiting.
+ * - One caller at a time, holding the 'draining' flag, takes records from the tail and packs
+ *   them into a page buffer. A page is sealed once the next record does not fit, and the
+ *   sealed pages are programmed FS_LOG_BATCH_PAGES at a time with one flash command each
+ *   run of them within a block, so appends cost no flash operation until then.
+ * - Every page starts with a header holding a sequence number, the length of its records
+ *   and a CRC. Page n lives at position (n - 1) modulo the ring, and the block of a page is
+ *   erased when its first page comes up, which drops the oldest records once the ring has
+ *   wrapped. After a restart the highest valid sequence number tells where to continue.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "../config/flash_config.h"
+#include "../FAT/fat_fs.h"
+#include "../flash/flash_ops.h"
+#include "../flash/block_log.h"
+#include "../filesystem/filesystem.h"
+#include "../filesystem/filesystem_helper.h"
+#include "../filesystem/meta_table.h"
+#include "../filesystem/meta_journal.h"
+#include "../filesystem/name_pool.h"
+#include "../filesystem/ring_log.h"
+#include "../directory/directories.h"
+#include "../directory/dentry_cache.h"
+
+#if !PICO_ON_DEVICE
+#include <sched.h>
+#endif
+
+
+/**
+ * Header at the start of every programmed page.
+ */
+typedef struct {
+    uint32_t sequence;   // Page sequence number, from 1.
+    uint32_t crc;        // CRC-32 of the record bytes.
+    uint16_t used;       // Bytes of records after the header.
+    uint16_t magic;
+} ring_page_header;
+
+#define RING_PAGE_MAGIC 0x52A7
+#define RING_PAGE_CAPACITY (FLASH_PAGE_SIZE - sizeof(ring_page_header))
+#define RING_PAGES_PER_BLOCK (FILESYSTEM_BLOCK_SIZE / FLASH_PAGE_SIZE)
+// Each record is stored behind a 16-bit length.
+#define RING_RECORD_OVERHEAD 2
+// Queued records at which an append tries to pack them; a page holds at least this many.
+#define RING_DRAIN_RECORDS (RING_PAGE_CAPACITY / (FS_LOG_MAX_RECORD + RING_RECORD_OVERHEAD))
+
+#if FS_LOG_MAX_RECORD + 2 + 12 > FLASH_PAGE_SIZE
+#error "FS_LOG_MAX_RECORD does not fit in a page"
+#endif
+#if FS_LOG_BATCH_PAGES < 1 || FS_LOG_BATCH_PAGES > 16
+#error "FS_LOG_BATCH_PAGES must be from 1 to the pages in a block"
+#endif
+
+static fs_log logs[FS_LOG_MAX_OPEN];
+
+#if PICO_ON_DEVICE
+// A caller waiting for the drain sleeps until it is released.
+static inline void ring_wait(void) { __wfe(); }
+static inline void ring_signal(void) { __sev(); }
+#else
+static inline void ring_wait(void) { sched_yield(); }
+static inline void ring_signal(void) {}
+#endif
+
+
+/**
+ * Forgets every open log without flushing it; their handles belong to the previous
+ * filesystem. Called by fs_init() and fs_mount().
+ */
+void fs_log_init(void) {
+    memset(logs, 0, sizeof(logs));
+}
+
+
+/**
+ * Returns the flash offset of the page with a given sequence number.
+ */
+static uint32_t ring_page_offset(const fs_log *log, uint32_t sequence) {
+    uint32_t position = (sequence - 1) % (log->block_count * RING_PAGES_PER_BLOCK);
+    return log->blocks[position / RING_PAGES_PER_BLOCK] * FILESYSTEM_BLOCK_SIZE
+        + (position % RING_PAGES_PER_BLOCK) * FLASH_PAGE_SIZE;
+}
+
+
+/**
+ * Returns the header of a programmed page, or NULL if the page is erased, torn or not part
+ * of a ring log.
+ */
+static const ring_page_header *ring_page_at(uint32_t offset) {
+    const uint8_t *page = (const uint8_t *)(XIP_BASE + offset);
+    const ring_page_header *header = (const ring_page_header *)page;
+    if (header->magic != RING_PAGE_MAGIC || header->used > RING_PAGE_CAPACITY
+        || header->crc != block_log_crc32(0, page + sizeof(ring_page_header), header->used)) {
+        return NULL;
+    }
+    return header;
+}
+
+
+static bool ring_range_erased(uint32_t offset, size_t len) {
+    const uint8_t *flash = (const uint8_t *)(XIP_BASE + offset);
+    for (size_t i = 0; i < len; i++) {
+        if (flash[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Takes the drain flag without waiting.
+ *
+ * @return true if the caller now packs and programs pages.
+ */
+static bool ring_try_begin(fs_log *log) {
+    return !__atomic_exchange_n(&log->draining, true, __ATOMIC_ACQUIRE);
+}
+
+
+static void ring_begin(fs_log *log) {
+    while (!ring_try_begin(log)) {
+        ring_wait();
+    }
+}
+
+
+static void ring_end(fs_log *log) {
+    __atomic_store_n(&log->draining, false, __ATOMIC_RELEASE);
+    ring_signal();
+}
+
+
+/**
+ * Seals the page being filled: writes its header, except for the sequence number, which is
+ * set when the page is programmed, and leaves the unused tail of the page erased.
+ */
+static void ring_seal_page(fs_log *log) {
+    uint8_t *page = log->pages[log->pages_sealed];
+    ring_page_header header = {
+        .sequence = 0,
+        .crc = block_log_crc32(0, page + sizeof(ring_page_header), log->page_used),
+        .used = (uint16_t)log->page_used,
+        .magic = RING_PAGE_MAGIC
+    };
+    memcpy(page, &header, sizeof(header));
+    memset(page + sizeof(header) + log->page_used, 0xFF, RING_PAGE_CAPACITY - log->page_used);
+    log->pages_sealed++;
+    log->page_used = 0;
+}
+
+
+/**
+ * Programs the sealed pages at the next pages of the ring, with one flash command for each
+ * run of them that falls within a block. Entering a block erases it first; a page left
+ * programmed by a write torn before a restart is skipped along with the rest of its block.
+ * Called with the drain flag held.
+ *
+ * @return FS_LOG_SUCCESS, or FS_LOG_IO_ERROR if a flash operation failed. The pages not
+ *         programmed stay sealed, to be retried.
+ */
+static int ring_program_pages(fs_log *log) {
+    uint32_t done = 0;
+    int result = FS_LOG_SUCCESS;
+    while (done < log->pages_sealed) {
+        uint32_t offset;
+        uint32_t run;
+        for (;;) {
+            offset = ring_page_offset(log, log->next_page);
+            uint32_t in_block = (log->next_page - 1) % RING_PAGES_PER_BLOCK;
+            run = log->pages_sealed - done;
+            if (run > RING_PAGES_PER_BLOCK - in_block) {
+                run = RING_PAGES_PER_BLOCK - in_block;
+            }
+            if (in_block == 0) {
+                if (!ring_range_erased(offset, FILESYSTEM_BLOCK_SIZE)) {
+                    if (flash_erase_sector(offset) != FLASH_PROGRAM_SUCCESS) {
+                        result = FS_LOG_IO_ERROR;
+                        break;
+                    }
+                    log->stats.blocks_overwritten++;
+                }
+                break;
+            }
+            if (ring_range_erased(offset, run * FLASH_PAGE_SIZE)) {
+                break;
+            }
+            log->next_page += RING_PAGES_PER_BLOCK - in_block;
+        }
+        if (result != FS_LOG_SUCCESS) {
+            break;
+        }
+
+        for (uint32_t i = 0; i < run; i++) {
+            uint32_t sequence = log->next_page + i;
+            memcpy(log->pages[done + i] + offsetof(ring_page_header, sequence), &sequence, sizeof(sequence));
+        }
+        if (flash_program_batch(offset, log->pages[done], run * FLASH_PAGE_SIZE) != FLASH_PROGRAM_SUCCESS) {
+            result = FS_LOG_IO_ERROR;
+            break;
+        }
+        log->next_page += run;
+        log->stats.pages_programmed += run;
+        done += run;
+    }
+
+    // Move what was not programmed, and the page being filled, to the front of the buffer.
+    if (done > 0) {
+        uint32_t kept = log->pages_sealed - done + (log->pages_sealed < FS_LOG_BATCH_PAGES ? 1 : 0);
+        memmove(log->pages[0], log->pages[done], kept * FLASH_PAGE_SIZE);
+        log->pages_sealed -= done;
+    }
+    return result;
+}
+
+
+/**
+ * Calls the visitor for each record packed in a page, and counts them.
+ *
+ * @return false if the visitor asked to stop.
+ */
+static bool ring_visit_page(const uint8_t *records, uint32_t used, fs_log_visitor visitor, void *context,
+                            int *visited) {
+    const uint8_t *at = records;
+    const uint8_t *end = records + used;
+    bool more = true;
+    while (at < end && more) {
+        uint16_t length;
+        memcpy(&length, at, RING_RECORD_OVERHEAD);
+        more = visitor(at + RING_RECORD_OVERHEAD, length, context);
+        at += RING_RECORD_OVERHEAD + length;
+        (*visited)++;
+    }
+    return more;
+}
+
+
+/**
+ * Moves every published record from the queue into the page buffer, sealing the page being
+ * filled whenever the next record does not fit and programming the sealed pages once there
+ * are FS_LOG_BATCH_PAGES of them. Called with the drain flag held.
+ *
+ * @param partial Whether to program the sealed pages and a partly filled page at the end.
+ * @return FS_LOG_SUCCESS, or FS_LOG_IO_ERROR if a page could not be programmed.
+ */
+static int ring_pack(fs_log *log, bool partial) {
+    for (;;) {
+        uint32_t tail = log->queue_tail;
+        fs_log_slot *slot = &log->queue[tail % FS_LOG_QUEUE_DEPTH];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != tail + 1) {
+            break;
+        }
+        if (log->page_used + RING_RECORD_OVERHEAD + slot->length > RING_PAGE_CAPACITY) {
+            ring_seal_page(log);
+        }
+        if (log->pages_sealed == FS_LOG_BATCH_PAGES && ring_program_pages(log) != FS_LOG_SUCCESS) {
+            return FS_LOG_IO_ERROR;
+        }
+        uint8_t *at = log->pages[log->pages_sealed] + sizeof(ring_page_header) + log->page_used;
+        memcpy(at, &slot->length, RING_RECORD_OVERHEAD);
+        memcpy(at + RING_RECORD_OVERHEAD, slot->data, slot->length);
+        log->page_used += RING_RECORD_OVERHEAD + slot->length;
+
+        // Hand the slot back to the producer that claims it on the next lap.
+        __atomic_store_n(&slot->sequence, tail + FS_LOG_QUEUE_DEPTH, __ATOMIC_RELEASE);
+        __atomic_store_n(&log->queue_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    if (partial && log->page_used > 0) {
+        ring_seal_page(log);
+    }
+    if (partial && log->pages_sealed > 0) {
+        return ring_program_pages(log);
+    }
+    return FS_LOG_SUCCESS;
+}
+
+
+/**
+ * Returns true if a file exists at a path, without creating it.
+ */
+static bool ring_log_exists(const char *path) {
+    char filename[NAME_POOL_MAX_LENGTH + 1];
+    DirectoryEntry *directory = path_walk_parent(path, filename, sizeof(filename));
+    return directory != NULL && filename[0] != '\0'
+        && FILE_find_file_entry(filename, directory->currentDirId) != NULL;
+}
+
+
+/**
+ * Gives a new log file a chain of erased blocks. Called with the metadata tables locked.
+ *
+ * @return 0 on success, or -1 if the flash is full.
+ */
+static int ring_log_allocate(fs_log *log, uint32_t capacity_blocks) {
+    FileEntry *entry = log->file->entry;
+    log->blocks[0] = entry->start_block;
+    log->block_count = 1;
+    while (log->block_count < capacity_blocks) {
+        uint32_t block = block_log_allocate();
+        if (block == FAT_NO_FREE_BLOCKS) {
+            return -1;
+        }
+        fat_link_blocks(log->blocks[log->block_count - 1], block);
+        if (entry->extent_blocks == log->block_count && block == entry->start_block + log->block_count) {
+            entry->extent_blocks++;
+        }
+        log->blocks[log->block_count++] = block;
+    }
+    return 0;
+}
+
+
+/**
+ * Finds the blocks of an existing log file and the page to continue at.
+ *
+ * @return 0 on success, or -1 if the chain is broken, longer than FS_LOG_MAX_BLOCKS or
+ *         shared with a copy of the file (see fs_cp()).
+ */
+static int ring_log_recover(fs_log *log) {
+    uint32_t block = log->file->entry->start_block;
+    log->block_count = 0;
+    while (block != FAT_ENTRY_END) {
+        // The ring is rewritten in place, which a copy sharing its blocks would see.
+        if (log->block_count == FS_LOG_MAX_BLOCKS || fat_block_shared(block)) {
+            return -1;
+        }
+        log->blocks[log->block_count++] = block;
+        if (fat_get_next_block(block, &block) != FAT_SUCCESS) {
+            return -1;
+        }
+    }
+
+    uint32_t newest = 0;
+    for (uint32_t b = 0; b < log->block_count; b++) {
+        for (uint32_t p = 0; p < RING_PAGES_PER_BLOCK; p++) {
+            const ring_page_header *header = ring_page_at(log->blocks[b] * FILESYSTEM_BLOCK_SIZE + p * FLASH_PAGE_SIZE);
+            if (header != NULL && header->sequence > newest) {
+                newest = header->sequence;
+            }
+        }
+    }
+    log->next_page = newest + 1;
+    return 0;
+}
+
+
+/**
+ * Opens a ring log, creating it with a ring of capacity_blocks blocks if the file does not
+ * exist. An existing log keeps the ring it was created with.
+ *
+ * @param path Path of the log file.
+ * @param capacity_blocks Blocks in the ring of a new log, from 2 to FS_LOG_MAX_BLOCKS.
+ * @return The open log, or NULL if it could not be opened or created, or FS_LOG_MAX_OPEN
+ *         logs are open already.
+ */
+fs_log *fs_log_open(const char *path, uint32_t capacity_blocks) {
+    if (path == NULL || capacity_blocks < 2 || capacity_blocks > FS_LOG_MAX_BLOCKS) {
+        printf("Error: Invalid ring log request.\n");
+        return NULL;
+    }
+
+    meta_table_lock();
+    fs_log *log = NULL;
+    for (int i = 0; i < FS_LOG_MAX_OPEN && log == NULL; i++) {
+        if (!logs[i].in_use) {
+            log = &logs[i];
+        }
+    }
+    if (log == NULL) {
+        printf("Error: Too many ring logs open.\n");
+        meta_table_unlock();
+        return NULL;
+    }
+
+    memset(log, 0, sizeof(*log));
+    bool exists = ring_log_exists(path);
+    log->file = fs_open(path, exists ? "r" : "w");
+    int result = (log->file == NULL) ? -1 : 0;
+    if (result == 0 && exists) {
+        result = ring_log_recover(log);
+    } else if (result == 0) {
+        log->next_page = 1;
+        result = ring_log_allocate(log, capacity_blocks);
+        if (result == 0) {
+            meta_journal_commit();
+        }
+    }
+    if (result != 0) {
+        printf("Error: Failed to open ring log '%s'.\n", path);
+        if (log->file != NULL) {
+            fs_close(log->file);
+            if (!exists) {
+                fs_rm(path);
+            }
+        }
+        meta_table_unlock();
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < FS_LOG_QUEUE_DEPTH; i++) {
+        log->queue[i].sequence = i;
+    }
+    log->in_use = true;
+    meta_table_unlock();
+    return log;
+}
+
+
+/**
+ * Queues a record. This only copies the record into RAM; when a page's worth of records is
+ * queued and nobody else is doing so, they are packed and full pages programmed.
+ *
+ * @param length Bytes in the record, from 1 to FS_LOG_MAX_RECORD.
+ * @return FS_LOG_SUCCESS, FS_LOG_FULL if the queue had no room (the record is dropped),
+ *         FS_LOG_IO_ERROR if programming failed, or FS_LOG_INVALID_ARGUMENT.
+ */
+int fs_log_append(fs_log *log, const void *record, uint16_t length) {
+    if (log == NULL || !log->in_use || record == NULL || length == 0 || length > FS_LOG_MAX_RECORD) {
+        return FS_LOG_INVALID_ARGUMENT;
+    }
+
+    // Claim the slot at the head once it has been handed back by the drain.
+    uint32_t position = __atomic_load_n(&log->queue_head, __ATOMIC_RELAXED);
+    fs_log_slot *slot;
+    for (;;) {
+        slot = &log->queue[position % FS_LOG_QUEUE_DEPTH];
+        int32_t lag = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+        if (lag == 0) {
+            if (__atomic_compare_exchange_n(&log->queue_head, &position, position + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (lag < 0) {
+            // Full. The records may have been published just after a drain gave up on them,
+            // so drain them here if nobody else is; only refuse the record if that fails.
+            if (!ring_try_begin(log)) {
+                __atomic_fetch_add(&log->stats.dropped, 1, __ATOMIC_RELAXED);
+                return FS_LOG_FULL;
+            }
+            int drained = ring_pack(log, false);
+            ring_end(log);
+            if (drained != FS_LOG_SUCCESS) {
+                return drained;
+            }
+            position = __atomic_load_n(&log->queue_head, __ATOMIC_RELAXED);
+        } else {
+            position = __atomic_load_n(&log->queue_head, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(slot->data, record, length);
+    slot->length = length;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&log->stats.appended, 1, __ATOMIC_RELAXED);
+
+    uint32_t queued = position + 1 - __atomic_load_n(&log->queue_tail, __ATOMIC_ACQUIRE);
+    uint32_t most = __atomic_load_n(&log->stats.max_queued, __ATOMIC_RELAXED);
+    while (queued > most && !__atomic_compare_exchange_n(&log->stats.max_queued, &most, queued, true,
+                                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    int result = FS_LOG_SUCCESS;
+    if (queued >= RING_DRAIN_RECORDS && ring_try_begin(log)) {
+        result = ring_pack(log, false);
+        ring_end(log);
+    }
+    return result;
+}
+
+
+/**
+ * Programs every queued record, including a partly filled page, so that all records
+ * appended before the call survive a power loss.
+ *
+ * @return FS_LOG_SUCCESS, or FS_LOG_IO_ERROR if a page could not be programmed.
+ */
+int fs_log_flush(fs_log *log) {
+    if (log == NULL || !log->in_use) {
+        return FS_LOG_INVALID_ARGUMENT;
+    }
+    ring_begin(log);
+    int result = ring_pack(log, true);
+    ring_end(log);
+    return result;
+}
+
+
+/**
+ * Visits every record of a log, oldest first: the records on flash, then those still in
+ * RAM. Appends made meanwhile by other callers wait in the queue.
+ *
+ * @return The number of records visited, or FS_LOG_INVALID_ARGUMENT.
+ */
+int fs_log_iterate(fs_log *log, fs_log_visitor visitor, void *context) {
+    if (log == NULL || !log->in_use || visitor == NULL) {
+        return FS_LOG_INVALID_ARGUMENT;
+    }
+    ring_begin(log);
+    ring_pack(log, false);
+
+    int visited = 0;
+    bool more = true;
+    uint32_t pages = log->block_count * RING_PAGES_PER_BLOCK;
+    uint32_t first = (log->next_page > pages) ? log->next_page - pages : 1;
+    for (uint32_t sequence = first; sequence < log->next_page && more; sequence++) {
+        const ring_page_header *header = ring_page_at(ring_page_offset(log, sequence));
+        if (header == NULL || header->sequence != sequence) {
+            continue; // Erased with its block, or skipped after a torn write.
+        }
+        more = ring_visit_page((const uint8_t *)header + sizeof(ring_page_header), header->used,
+                               visitor, context, &visited);
+    }
+
+    // Then the sealed pages still in RAM, and the page being filled.
+    for (uint32_t p = 0; p < log->pages_sealed && more; p++) {
+        ring_page_header header;
+        memcpy(&header, log->pages[p], sizeof(header));
+        more = ring_visit_page(log->pages[p] + sizeof(ring_page_header), header.used, visitor, context, &visited);
+    }
+    if (more && log->pages_sealed < FS_LOG_BATCH_PAGES) {
+        ring_visit_page(log->pages[log->pages_sealed] + sizeof(ring_page_header), log->page_used,
+                        visitor, context, &visited);
+    }
+    ring_end(log);
+    return visited;
+}
+
+
+/**
+ * Flushes a log and closes it. Appends must have stopped.
+ *
+ * @return FS_LOG_SUCCESS, or FS_LOG_IO_ERROR if the last records could not be programmed.
+ */
+int fs_log_close(fs_log *log) {
+    if (log == NULL || !log->in_use) {
+        return FS_LOG_INVALID_ARGUMENT;
+    }
+    int result = fs_log_flush(log);
+    meta_table_lock();
+    fs_close(log->file);
+    log->file = NULL;
+    log->in_use = false;
+    meta_table_unlock();
+    return result;
+}
+
+
+/**
+ * Copies out the counters of a log.
+ */
+void fs_log_get_stats(const fs_log *log, fs_log_stats *stats) {
+    if (log != NULL && stats != NULL) {
+        *stats = log->stats;
+    }
+}
@@ -0,0 +1,687 @@
+/**
+ * @file block_log.c
+ *
+ * This module implements the on-flash format and the log-structured writer for file data
+ * blocks. Previously every write erased a sector and put a flash_data header in front of
+ * the data, so payloads were shifted and a block never held a full block of file data.
+ *
+ * Block layout:
+ * - Bytes [0, FS_BLOCK_PAYLOAD_SIZE) hold file data, starting at the first byte.
+ * - The last FS_BLOCK_TRAILER_SIZE bytes hold a block_trailer (sequence, owner, length, CRC).
+ *   The trailer stays erased while the block is still being filled and is programmed once,
+ *   when the payload becomes full.
+ *
+ * Writing:
+ * - Data that lands in bytes that are still erased is written in place; on NOR flash that
+ *   only needs page programs, so appends run at program speed.
+ * - Data that would overwrite programmed bytes, or any byte of a sealed block, is written to
+ *   a freshly erased block together with the rest of the payload. Once the file's chain
+ *   points at the new block, the old one is retired: marked in the FAT, and erased later by
+ *   block_log_reclaim(), outside the write path, after a commit no longer refers to it.
+ * - New blocks are taken in a forward sweep through the flash so erases are spread out. Each
+ *   core sweeps from a head of its own, so two writers take blocks from different FAT regions.
+ * - Large sequential writes can bypass the cache with block_log_write_run(), which erases
+ *   a run of consecutive blocks with 64 KB block erases where possible and programs each
+ *   block image in a single batch. block_log_copy_block() does the same for blocks copied
+ *   from other blocks.
+ *
+ * Apart from these two, all reads and writes go through the sector cache, so
+ * data that has not been written back yet is seen consistently.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "hardware/flash.h"
+#include "pico/mutex.h"
+#include "../config/flash_config.h"
+#include "../FAT/fat_fs.h"
+#include "../flash/flash_ops.h"
+#include "../flash/flash_cache.h"
+#include "../flash/block_log.h"
+#include "../flash/flush_worker.h"
+
+// First block that can hold file data; the ones below are reserved by fat_init().
+#define BLOCK_LOG_FIRST_BLOCK (NUMBER_OF_RESERVED_BLOCKS + METADATA_RESERVED_BLOCKS)
+
+static uint32_t pending_erase[(TOTAL_BLOCKS + 31) / 32]; // Retired blocks waiting to be erased.
+static uint32_t flushed_erase[(TOTAL_BLOCKS + 31) / 32]; // Those whose replacement is already on flash.
+static uint32_t commit_erase[(TOTAL_BLOCKS + 31) / 32];  // Flushed ones a commit in progress covers.
+static uint32_t log_head[FAT_CORES];                     // Where each core's next allocation starts looking.
+static uint32_t log_sequence = 0;                        // Highest sequence number handed out.
+static block_log_stats log_stats;
+static uint8_t relocation_image[FS_BLOCK_PAYLOAD_SIZE];  // Payload being moved by block_copy_to_fresh().
+static mutex_t log_mutex;                                // Guards the state above.
+
+
+/**
+ * CRC-32 (IEEE 802.3) over a buffer, using a 16-entry table to keep the flash footprint small.
+ */
+uint32_t block_log_crc32(uint32_t crc, const uint8_t *data, size_t len) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc >> 4) ^ table[(crc ^ data[i]) & 0x0F];
+        crc = (crc >> 4) ^ table[(crc ^ (data[i] >> 4)) & 0x0F];
+    }
+    return ~crc;
+}
+
+
+/**
+ * Checks whether a range of flash is still erased, looking at the flash itself rather than
+ * the cache: only erased bytes on flash can be programmed without an erase. Anything the
+ * flush worker still has queued for the range is written first.
+ */
+static bool block_range_erased(uint32_t offset, size_t len) {
+    flush_worker_barrier(offset, len);
+    const uint8_t *flash = (const uint8_t *)(XIP_BASE + offset);
+    for (size_t i = 0; i < len; i++) {
+        if (flash[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Computes the CRC of a block's payload as currently seen through the cache.
+ */
+static uint32_t block_payload_crc(uint32_t block, uint32_t length) {
+    uint8_t chunk[FLASH_PAGE_SIZE];
+    uint32_t crc = 0;
+    uint32_t base = block * FILESYSTEM_BLOCK_SIZE;
+
+    for (uint32_t done = 0; done < length; done += sizeof(chunk)) {
+        uint32_t n = MIN(sizeof(chunk), length - done);
+        flash_cache_read(base + done, chunk, n);
+        crc = block_log_crc32(crc, chunk, n);
+    }
+    return crc;
+}
+
+
+/**
+ * Writes the trailer of a block whose payload has just become full.
+ */
+static void block_seal(uint32_t block, uint32_t owner_id) {
+    block_trailer trailer;
+
+    mutex_enter_blocking(&log_mutex);
+    trailer.sequence = ++log_sequence;
+    log_stats.sealed++;
+    mutex_exit(&log_mutex);
+
+    trailer.owner_id = owner_id;
+    trailer.length = FS_BLOCK_PAYLOAD_SIZE;
+    trailer.magic = BLOCK_TRAILER_MAGIC;
+    trailer.crc = block_payload_crc(block, FS_BLOCK_PAYLOAD_SIZE);
+
+    flash_cache_write(block * FILESYSTEM_BLOCK_SIZE + FS_BLOCK_PAYLOAD_SIZE, (const uint8_t *)&trailer, sizeof(trailer));
+}
+
+
+/**
+ * Resets the log state and recovers the highest sequence number from the trailers already
+ * on flash, so blocks sealed after a restart still sort after older ones.
+ * Called from fs_init() after the FAT and the cache have been set up.
+ */
+void block_log_init(void) {
+    mutex_init(&log_mutex);
+    memset(pending_erase, 0, sizeof(pending_erase));
+    memset(flushed_erase, 0, sizeof(flushed_erase));
+    memset(commit_erase, 0, sizeof(commit_erase));
+    memset(&log_stats, 0, sizeof(log_stats));
+    for (uint32_t core = 0; core < FAT_CORES; core++) {
+        log_head[core] = fat_core_start_block(core);
+    }
+    log_sequence = 0;
+
+    for (uint32_t block = BLOCK_LOG_FIRST_BLOCK; block < TOTAL_BLOCKS; block++) {
+        block_trailer trailer;
+        memcpy(&trailer, (const void *)(XIP_BASE + block * FILESYSTEM_BLOCK_SIZE + FS_BLOCK_PAYLOAD_SIZE), sizeof(trailer));
+        if (trailer.magic == BLOCK_TRAILER_MAGIC && trailer.sequence > log_sequence) {
+            log_sequence = trailer.sequence;
+        }
+    }
+}
+
+
+/**
+ * Makes sure a block just allocated is erased: a block freed without being erased may
+ * still have data on flash or a stale cached image.
+ */
+static void block_make_erased(uint32_t block) {
+    uint32_t offset = block * FILESYSTEM_BLOCK_SIZE;
+    flash_cache_invalidate(offset);
+    if (!block_range_erased(offset, FILESYSTEM_BLOCK_SIZE)) {
+        flash_erase_sector(offset);
+    }
+}
+
+
+/**
+ * Allocates a block for new data and makes sure it is erased. Blocks are taken in a forward
+ * sweep starting after the previous allocation. Retired blocks are not reclaimed here, as
+ * the last commit may still refer to them; they come back with the next fs_sync().
+ *
+ * @return The block number, or FAT_NO_FREE_BLOCKS if no block is available.
+ */
+uint32_t block_log_allocate(void) {
+    uint32_t core = fat_current_core();
+    uint32_t block = fat_allocate_block_from(log_head[core]);
+    if (block == FAT_NO_FREE_BLOCKS) {
+        return FAT_NO_FREE_BLOCKS;
+    }
+
+    mutex_enter_blocking(&log_mutex);
+    log_head[core] = block + 1;
+    mutex_exit(&log_mutex);
+    block_make_erased(block);
+    return block;
+}
+
+
+/**
+ * Allocates an erased block for data that moves on every write, such as a metadata page,
+ * from the edge of a free run so that no run is split; see fat_allocate_edge_block().
+ *
+ * @return The block number, or FAT_NO_FREE_BLOCKS if no block is available.
+ */
+uint32_t block_log_allocate_edge(void) {
+    uint32_t block = fat_allocate_edge_block();
+    if (block == FAT_NO_FREE_BLOCKS) {
+        return FAT_NO_FREE_BLOCKS;
+    }
+    block_make_erased(block);
+    return block;
+}
+
+
+/**
+ * Copies the payload of a block, with new bytes applied, to a fresh block and seals it if
+ * the payload is full. The source block is left as it is.
+ *
+ * @param fresh Receives the new block.
+ * @return BLOCK_LOG_SUCCESS, or a negative BLOCK_LOG_* error code.
+ */
+static int block_copy_to_fresh(uint32_t block, uint32_t used, uint32_t pos, const uint8_t *data, size_t len,
+                               uint32_t owner_id, uint32_t *fresh) {
+    uint32_t target = block_log_allocate();
+    if (target == FAT_NO_FREE_BLOCKS) {
+        return BLOCK_LOG_NO_SPACE;
+    }
+
+    // The payload is staged in relocation_image, which log_mutex guards; neither the cache
+    // nor the flush worker takes log_mutex, so holding it over the copy cannot deadlock.
+    uint32_t new_used = MAX(used, pos + len);
+    mutex_enter_blocking(&log_mutex);
+    flash_cache_read(block * FILESYSTEM_BLOCK_SIZE, relocation_image, used);
+    if (len > 0) {
+        memcpy(relocation_image + pos, data, len);
+    }
+    int result = flash_cache_write(target * FILESYSTEM_BLOCK_SIZE, relocation_image, new_used);
+    mutex_exit(&log_mutex);
+    if (result != FLASH_CACHE_SUCCESS) {
+        fat_free_block(target);
+        return BLOCK_LOG_IO_ERROR;
+    }
+
+    if (new_used == FS_BLOCK_PAYLOAD_SIZE) {
+        block_seal(target, owner_id);
+    }
+    *fresh = target;
+    return BLOCK_LOG_SUCCESS;
+}
+
+
+/**
+ * Writes bytes into the payload of a data block.
+ *
+ * If the block is still open and the target bytes are erased on flash, the data is written
+ * in place. Otherwise the payload is copied, with the new bytes applied, to a fresh block
+ * and *block is updated; the caller must then replace the old block with the new one in the
+ * file's chain and retire the old one with block_log_retire(). A block is sealed when its
+ * payload fills up.
+ *
+ * @param block In: the block to write to. Out: the block now holding the data.
+ * @param used Number of payload bytes of the block already in use.
+ * @param pos Payload position of the first byte to write; at most used.
+ * @param data Bytes to write.
+ * @param len Number of bytes; pos + len must not exceed FS_BLOCK_PAYLOAD_SIZE.
+ * @param owner_id unique_file_id of the owning file, recorded in the trailer.
+ * @return BLOCK_LOG_SUCCESS, or a negative BLOCK_LOG_* error code.
+ */
+int block_log_write(uint32_t *block, uint32_t used, uint32_t pos, const uint8_t *data, size_t len, uint32_t owner_id) {
+    if (block == NULL || data == NULL || *block >= TOTAL_BLOCKS || used > FS_BLOCK_PAYLOAD_SIZE
+        || pos > used || len > FS_BLOCK_PAYLOAD_SIZE - pos) {
+        printf("Error: Invalid block log write (block %u, pos %u, length %u).\n",
+               block ? *block : 0, pos, (unsigned)len);
+        return BLOCK_LOG_INVALID_ARGUMENT;
+    }
+
+    uint32_t base = *block * FILESYSTEM_BLOCK_SIZE;
+    block_trailer trailer;
+
+    // Fast path: the bytes are still erased, so programming them is enough.
+    if (!block_log_read_trailer(*block, &trailer) && block_range_erased(base + pos, len)) {
+        if (flash_cache_write(base + pos, data, len) != FLASH_CACHE_SUCCESS) {
+            return BLOCK_LOG_IO_ERROR;
+        }
+        mutex_enter_blocking(&log_mutex);
+        log_stats.in_place_writes++;
+        mutex_exit(&log_mutex);
+
+        if (pos + len == FS_BLOCK_PAYLOAD_SIZE) {
+            block_seal(*block, owner_id);
+        }
+        return BLOCK_LOG_SUCCESS;
+    }
+
+    // Slow path: move the payload with the new bytes applied to a fresh block.
+    uint32_t fresh;
+    int result = block_copy_to_fresh(*block, used, pos, data, len, owner_id, &fresh);
+    if (result != BLOCK_LOG_SUCCESS) {
+        return result;
+    }
+    *block = fresh;
+
+    mutex_enter_blocking(&log_mutex);
+    log_stats.relocations++;
+    mutex_exit(&log_mutex);
+    return BLOCK_LOG_SUCCESS;
+}
+
+
+/**
+ * Copies a block that other files still use, applying new bytes to the copy only. Unlike
+ * block_log_write(), the old block is neither written nor retired.
+ *
+ * @param block The shared block.
+ * @param used Number of payload bytes of the block in use.
+ * @param pos Payload position of the first byte to write; at most used.
+ * @param data Bytes to write; may be NULL if len is 0.
+ * @param len Number of bytes; pos + len must not exceed FS_BLOCK_PAYLOAD_SIZE.
+ * @param owner_id unique_file_id of the file the copy is for, recorded in the trailer.
+ * @param copy Receives the new block.
+ * @return BLOCK_LOG_SUCCESS, or a negative BLOCK_LOG_* error code.
+ */
+int block_log_clone(uint32_t block, uint32_t used, uint32_t pos, const uint8_t *data, size_t len,
+                    uint32_t owner_id, uint32_t *copy) {
+    if (copy == NULL || (data == NULL && len > 0) || block >= TOTAL_BLOCKS || used > FS_BLOCK_PAYLOAD_SIZE
+        || pos > used || len > FS_BLOCK_PAYLOAD_SIZE - pos) {
+        printf("Error: Invalid block clone (block %u, pos %u, length %u).\n", block, pos, (unsigned)len);
+        return BLOCK_LOG_INVALID_ARGUMENT;
+    }
+    int result = block_copy_to_fresh(block, used, pos, data, len, owner_id, copy);
+    if (result == BLOCK_LOG_SUCCESS) {
+        mutex_enter_blocking(&log_mutex);
+        log_stats.clones++;
+        mutex_exit(&log_mutex);
+    }
+    return result;
+}
+
+
+/**
+ * Makes sure a run of physically consecutive blocks is erased and not cached, so it can be
+ * programmed directly. Sectors that are already blank are left alone; 64 KB-aligned groups
+ * of 16 blocks that need erasing are erased with one block erase command.
+ *
+ * @param first_block First block of the run.
+ * @param count Number of blocks in the run.
+ * @return BLOCK_LOG_SUCCESS, or a negative BLOCK_LOG_* error code.
+ */
+int block_log_prepare_run(uint32_t first_block, uint32_t count) {
+    if (count == 0 || first_block < BLOCK_LOG_FIRST_BLOCK || first_block >= TOTAL_BLOCKS
+        || count > TOTAL_BLOCKS - first_block) {
+        printf("Error: Invalid block run (first %u, count %u).\n", first_block, count);
+        return BLOCK_LOG_INVALID_ARGUMENT;
+    }
+
+    // Erase what needs erasing, using the largest erase command that fits.
+    uint32_t offset = first_block * FILESYSTEM_BLOCK_SIZE;
+    uint32_t end = offset + count * FILESYSTEM_BLOCK_SIZE;
+    while (offset < end) {
+        uint32_t unit = (offset % FLASH_BLOCK_SIZE == 0 && end - offset >= FLASH_BLOCK_SIZE) ? FLASH_BLOCK_SIZE : FLASH_SECTOR_SIZE;
+        if (block_range_erased(offset, unit)) {
+            // Nothing to erase, but a stale cached image must not be written back over the run.
+            for (uint32_t sector = offset; sector < offset + unit; sector += FLASH_SECTOR_SIZE) {
+                flash_cache_invalidate(sector);
+            }
+        } else if (flash_erase_range(offset, unit) != FLASH_PROGRAM_SUCCESS) {
+            return BLOCK_LOG_IO_ERROR;
+        }
+        offset += unit;
+    }
+    return BLOCK_LOG_SUCCESS;
+}
+
+
+/**
+ * Fills in the trailer of a block image staged in RAM whose payload is full, for blocks that
+ * are programmed directly instead of through the cache.
+ */
+static void block_image_seal(uint8_t *image, uint32_t owner_id, uint32_t crc) {
+    block_trailer trailer;
+
+    mutex_enter_blocking(&log_mutex);
+    trailer.sequence = ++log_sequence;
+    mutex_exit(&log_mutex);
+    trailer.owner_id = owner_id;
+    trailer.length = FS_BLOCK_PAYLOAD_SIZE;
+    trailer.magic = BLOCK_TRAILER_MAGIC;
+    trailer.crc = crc;
+    memcpy(image + FS_BLOCK_PAYLOAD_SIZE, &trailer, sizeof(trailer));
+}
+
+
+/**
+ * Writes full payloads to a run of physically consecutive blocks, as allocated by
+ * fat_allocate_extent(), bypassing the sector cache.
+ *
+ * The run is erased where needed by block_log_prepare_run(). Each block image, payload and
+ * sealed trailer, is then staged in RAM and programmed as one batch of 16 pages in a single
+ * interrupt window.
+ *
+ * @param first_block First block of the run.
+ * @param count Number of blocks in the run.
+ * @param data count * FS_BLOCK_PAYLOAD_SIZE bytes of file data. May live in flash.
+ * @param owner_id unique_file_id of the owning file, recorded in each trailer.
+ * @return BLOCK_LOG_SUCCESS, or a negative BLOCK_LOG_* error code.
+ */
+int block_log_write_run(uint32_t first_block, uint32_t count, const uint8_t *data, uint32_t owner_id) {
+    if (data == NULL) {
+        return BLOCK_LOG_INVALID_ARGUMENT;
+    }
+    int result = block_log_prepare_run(first_block, count);
+    if (result != BLOCK_LOG_SUCCESS) {
+        return result;
+    }
+
+    // The staging buffer also keeps the source out of the program path: XIP is
+    // unavailable while the flash is being programmed.
+    uint8_t *image = malloc(FILESYSTEM_BLOCK_SIZE);
+    if (image == NULL) {
+        printf("Failed to allocate memory for block image.\n");
+        return BLOCK_LOG_NO_MEMORY;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *payload = data + i * FS_BLOCK_PAYLOAD_SIZE;
+        memcpy(image, payload, FS_BLOCK_PAYLOAD_SIZE);
+        block_image_seal(image, owner_id, block_log_crc32(0, payload, FS_BLOCK_PAYLOAD_SIZE));
+
+        if (flash_program_batch((first_block + i) * FILESYSTEM_BLOCK_SIZE, image, FILESYSTEM_BLOCK_SIZE) != FLASH_PROGRAM_SUCCESS) {
+            free(image);
+            return BLOCK_LOG_IO_ERROR;
+        }
+    }
+    free(image);
+
+    mutex_enter_blocking(&log_mutex);
+    log_stats.sealed += count;
+    log_stats.bulk_blocks += count;
+    mutex_exit(&log_mutex);
+    return BLOCK_LOG_SUCCESS;
+}
+
+
+/**
+ * Copies the payload of a block of file data to an erased block, bypassing the sector cache,
+ * as needed to duplicate a file block by block (see fs_cp_deep_step()).
+ *
+ * The payload is read through the XIP window, after a cached copy of the source has been
+ * written back, into the caller's staging buffer: XIP is unavailable while the flash is being
+ * programmed. It is then programmed as one batch of whole pages. A full payload is sealed,
+ * reusing the CRC of the source's trailer when the source is sealed; a partial one is left
+ * open, so that appends can fill it in place.
+ *
+ * @param source The block to copy.
+ * @param used Payload bytes of the source that belong to the file.
+ * @param target An erased block that is not cached, e.g. prepared by block_log_prepare_run().
+ * @param owner_id unique_file_id of the file the copy is for, recorded in the trailer.
+ * @param image Staging buffer of FILESYSTEM_BLOCK_SIZE bytes in RAM.
+ * @return BLOCK_LOG_SUCCESS, or a negative BLOCK_LOG_* error code.
+ */
+int block_log_copy_block(uint32_t source, uint32_t used, uint32_t target, uint32_t owner_id, uint8_t *image) {
+    if (image == NULL || source >= TOTAL_BLOCKS || target < BLOCK_LOG_FIRST_BLOCK || target >= TOTAL_BLOCKS
+        || used == 0 || used > FS_BLOCK_PAYLOAD_SIZE) {
+        printf("Error: Invalid block copy (source %u, target %u, length %u).\n", source, target, used);
+        return BLOCK_LOG_INVALID_ARGUMENT;
+    }
+
+    uint32_t base = source * FILESYSTEM_BLOCK_SIZE;
+    flash_cache_flush(base);
+    uint32_t length = FILESYSTEM_BLOCK_SIZE;
+    if (used == FS_BLOCK_PAYLOAD_SIZE) {
+        block_trailer trailer;
+        memcpy(image, (const void *)(XIP_BASE + base), FS_BLOCK_PAYLOAD_SIZE);
+        uint32_t crc = block_log_read_trailer(source, &trailer) ? trailer.crc : block_log_crc32(0, image, FS_BLOCK_PAYLOAD_SIZE);
+        block_image_seal(image, owner_id, crc);
+    } else {
+        // Only the pages holding the payload are programmed; the rest of the last page is
+        // left erased.
+        length = (used + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+        memcpy(image, (const void *)(XIP_BASE + base), used);
+        memset(image + used, 0xFF, length - used);
+    }
+
+    if (flash_program_batch(target * FILESYSTEM_BLOCK_SIZE, image, length) != FLASH_PROGRAM_SUCCESS) {
+        return BLOCK_LOG_IO_ERROR;
+    }
+    mutex_enter_blocking(&log_mutex);
+    log_stats.copied_blocks++;
+    if (used == FS_BLOCK_PAYLOAD_SIZE) {
+        log_stats.sealed++;
+    }
+    mutex_exit(&log_mutex);
+    return BLOCK_LOG_SUCCESS;
+}
+
+
+/**
+ * Marks a block retired in the FAT and adds it to one of the sets waiting to be erased.
+ */
+static void retire_into(uint32_t *set, uint32_t block) {
+    if (block < BLOCK_LOG_FIRST_BLOCK || block >= TOTAL_BLOCKS) {
+        return;
+    }
+    flash_cache_invalidate(block * FILESYSTEM_BLOCK_SIZE);
+    fat_retire_block(block);
+
+    mutex_enter_blocking(&log_mutex);
+    set[block / 32] |= 1u << (block % 32);
+    mutex_exit(&log_mutex);
+}
+
+
+/**
+ * Queues a block that no longer holds live data for erasure. Call it only once nothing in
+ * RAM refers to the block, so that any later commit sees it unreferenced. The block stays
+ * allocated in the FAT, marked retired, until block_log_reclaim() has erased it, so it
+ * cannot be handed out unerased.
+ */
+void block_log_retire(uint32_t block) {
+    retire_into(pending_erase, block);
+}
+
+
+/**
+ * Like block_log_retire(), for a block whose contents were replaced by a block already
+ * programmed to flash rather than held in the sector cache. Such a block only has to wait
+ * for the next commit to end, which erases it (see block_log_commit_end()).
+ */
+void block_log_retire_flushed(uint32_t block) {
+    retire_into(flushed_erase, block);
+}
+
+
+/**
+ * Queues the blocks the recovered FAT marks as retired for erasure again. Blocks retired
+ * after the last fs_sync() before a power loss would otherwise stay allocated for good.
+ * Call after the metadata has been recovered at mount.
+ *
+ * @return The number of blocks queued.
+ */
+int block_log_requeue_retired(void) {
+    int queued = 0;
+    mutex_enter_blocking(&log_mutex);
+    for (uint32_t block = fat_next_retired_block(BLOCK_LOG_FIRST_BLOCK); block != FAT_ENTRY_END;
+         block = fat_next_retired_block(block + 1)) {
+        pending_erase[block / 32] |= 1u << (block % 32);
+        queued++;
+    }
+    mutex_exit(&log_mutex);
+    return queued;
+}
+
+
+/**
+ * Erases the blocks of one retired set and returns them to the FAT as free.
+ *
+ * @return The number of blocks reclaimed.
+ */
+static int reclaim_set(uint32_t *set) {
+    int reclaimed = 0;
+
+    for (uint32_t word = 0; word < (TOTAL_BLOCKS + 31) / 32; word++) {
+        mutex_enter_blocking(&log_mutex);
+        uint32_t bits = set[word];
+        set[word] = 0;
+        mutex_exit(&log_mutex);
+
+        while (bits != 0) {
+            uint32_t bit = __builtin_ctz(bits);
+            bits &= bits - 1;
+            uint32_t block = word * 32 + bit;
+
+            // With the flush worker running, the erase happens in the background; reads
+            // already see the block as erased and later writes queue up behind it.
+            if (flush_worker_running()) {
+                flash_cache_invalidate(block * FILESYSTEM_BLOCK_SIZE);
+                flush_worker_submit_erase(block * FILESYSTEM_BLOCK_SIZE);
+            } else {
+                flash_erase_sector(block * FILESYSTEM_BLOCK_SIZE);
+            }
+            fat_free_block(block);
+            reclaimed++;
+        }
+    }
+
+    mutex_enter_blocking(&log_mutex);
+    log_stats.reclaimed += reclaimed;
+    mutex_exit(&log_mutex);
+    return reclaimed;
+}
+
+
+/**
+ * Erases every retired block and returns it to the FAT as free. Committed metadata may
+ * still point at a retired block until the next commit, and the data that replaced it may
+ * still be in the sector cache, so call this only after flash_cache_sync() and a successful
+ * meta_journal_commit(), as fs_sync() does.
+ *
+ * @return The number of blocks reclaimed.
+ */
+int block_log_reclaim(void) {
+    return reclaim_set(flushed_erase) + reclaim_set(pending_erase);
+}
+
+
+/**
+ * Called by the metadata journal as a commit starts: the blocks retired so far with
+ * block_log_retire_flushed() are no longer referred to by what the commit will record.
+ */
+void block_log_commit_begin(void) {
+    mutex_enter_blocking(&log_mutex);
+    for (uint32_t word = 0; word < (TOTAL_BLOCKS + 31) / 32; word++) {
+        commit_erase[word] |= flushed_erase[word];
+        flushed_erase[word] = 0;
+    }
+    mutex_exit(&log_mutex);
+}
+
+
+/**
+ * Called by the metadata journal as a commit ends. If the commit reached flash, the blocks
+ * taken by block_log_commit_begin() are erased and returned to the FAT as free; otherwise
+ * they wait for the next commit.
+ *
+ * @param committed Whether the commit was written.
+ * @return The number of blocks reclaimed.
+ */
+int block_log_commit_end(bool committed) {
+    if (committed) {
+        return reclaim_set(commit_erase);
+    }
+    mutex_enter_blocking(&log_mutex);
+    for (uint32_t word = 0; word < (TOTAL_BLOCKS + 31) / 32; word++) {
+        flushed_erase[word] |= commit_erase[word];
+        commit_erase[word] = 0;
+    }
+    mutex_exit(&log_mutex);
+    return 0;
+}
+
+
+/**
+ * Reads the trailer of a block through the cache.
+ *
+ * @param block The block to inspect.
+ * @param trailer Receives the trailer; may be NULL if only the state is needed.
+ * @return true if the block has been sealed, false while it is still open.
+ */
+bool block_log_read_trailer(uint32_t block, block_trailer *trailer) {
+    block_trailer local;
+    if (trailer == NULL) {
+        trailer = &local;
+    }
+    if (block >= TOTAL_BLOCKS
+        || flash_cache_read(block * FILESYSTEM_BLOCK_SIZE + FS_BLOCK_PAYLOAD_SIZE, (uint8_t *)trailer, sizeof(*trailer)) != FLASH_CACHE_SUCCESS) {
+        return false;
+    }
+    return trailer->magic == BLOCK_TRAILER_MAGIC;
+}
+
+
+/**
+ * Checks the payload of a sealed block against the CRC in its trailer. Open blocks have no
+ * CRC yet and are reported as valid.
+ *
+ * @return false if the block is sealed and its payload does not match the stored CRC.
+ */
+bool block_log_verify(uint32_t block) {
+    block_trailer trailer;
+    if (!block_log_read_trailer(block, &trailer)) {
+        return true;
+    }
+    return trailer.length <= FS_BLOCK_PAYLOAD_SIZE && block_payload_crc(block, trailer.length) == trailer.crc;
+}
+
+
+/**
+ * Copies the current block log counters into the caller's structure.
+ */
+void block_log_get_stats(block_log_stats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    mutex_enter_blocking(&log_mutex);
+    *stats = log_stats;
+    mutex_exit(&log_mutex);
+}
+
+
+/**
+ * Resets the block log counters to zero.
+ */
+void block_log_reset_stats(void) {
+    mutex_enter_blocking(&log_mutex);
+    memset(&log_stats, 0, sizeof(log_stats));
+    mutex_exit(&log_mutex);
+}
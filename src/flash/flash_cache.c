@@ -0,0 +1,310 @@
+/**
+ * @file flash_cache.c
+ *
+ * This module implements a small write-back cache of whole flash sectors held in RAM.
+ * Without it every filesystem write erases and reprograms a complete 4 KB sector, even
+ * when only a handful of bytes change, which is slow and wears the flash quickly.
+ *
+ * - Writes are applied to a RAM copy of the sector and the sector is marked dirty.
+ * - Further writes to a dirty sector cost nothing on the flash side; they are counted
+ *   as erases avoided.
+ * - When a slot is needed for another sector, the least recently used one is evicted
+ *   and written back with at most one erase; sectors that were only appended into
+ *   erased space are programmed page by page without erasing at all.
+ * - flash_cache_sync() writes back every dirty sector, e.g. before shutdown.
+ *
+ * Reads of sectors that are not resident are served straight from the memory-mapped
+ * flash (XIP) and do not occupy a cache slot.
+ *
+ * While the flush worker runs (see flush_worker.h), write-backs are queued to it instead of
+ * being programmed here, and reads check its queue before the flash.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "hardware/flash.h"
+#include "pico/mutex.h"
+#include "../config/flash_config.h"
+#include "../flash/flash_ops.h"
+#include "../flash/flash_cache.h"
+#include "../flash/flush_worker.h"
+
+
+/**
+ * A single cache slot holding the RAM image of one flash sector.
+ */
+typedef struct {
+    uint32_t sector_offset;             // Flash offset of the cached sector, sector aligned.
+    uint32_t last_used;                 // Access tick used to find the least recently used slot.
+    bool valid;                         // The slot currently holds a sector image.
+    bool dirty;                         // The image differs from flash and must be written back.
+    uint8_t data[FLASH_SECTOR_SIZE];    // The sector contents.
+} cache_line;
+
+static cache_line cache_lines[FLASH_CACHE_SECTORS];
+static uint32_t cache_tick = 0;          // Monotonic counter stamped on every access.
+static flash_cache_stats cache_stats;
+static mutex_t cache_mutex;              // Serialises access to the cache slots.
+static bool cache_initialized = false;   // Set once flash_cache_init() has run.
+
+
+/**
+ * Checks that a range lies entirely within the part of the flash the filesystem may use.
+ */
+static bool cache_range_valid(uint32_t offset, size_t len) {
+    return offset >= FLASH_TARGET_OFFSET && len <= PICO_FLASH_SIZE_BYTES
+        && offset <= PICO_FLASH_SIZE_BYTES - len;
+}
+
+
+/**
+ * Finds the slot holding a sector, or NULL if the sector is not resident.
+ */
+static cache_line* cache_lookup(uint32_t sector_offset) {
+    for (int i = 0; i < FLASH_CACHE_SECTORS; i++) {
+        if (cache_lines[i].valid && cache_lines[i].sector_offset == sector_offset) {
+            return &cache_lines[i];
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Writes a dirty slot back to flash. flash_program_safe() only erases the sector when a
+ * bit has to go from 0 back to 1, and only programs the pages that actually changed. With
+ * the flush worker running, the image is only copied to its queue.
+ */
+static void cache_writeback(cache_line *line) {
+    if (!line->valid || !line->dirty) {
+        return;
+    }
+
+    if (flush_worker_running()) {
+        flush_worker_submit(line->sector_offset, line->data);
+    } else {
+        flash_program_safe(line->sector_offset, line->data, FLASH_SECTOR_SIZE, NULL);
+    }
+
+    line->dirty = false;
+    cache_stats.writebacks++;
+}
+
+
+/**
+ * Returns the slot for a sector, loading it from flash if needed. When every slot is
+ * taken, the least recently used one is written back (if dirty) and reused.
+ */
+static cache_line* cache_acquire(uint32_t sector_offset) {
+    cache_line *line = cache_lookup(sector_offset);
+    if (line != NULL) {
+        cache_stats.hits++;
+        line->last_used = ++cache_tick;
+        return line;
+    }
+    cache_stats.misses++;
+
+    // Prefer an empty slot, otherwise take the least recently used one.
+    cache_line *victim = &cache_lines[0];
+    for (int i = 0; i < FLASH_CACHE_SECTORS; i++) {
+        if (!cache_lines[i].valid) {
+            victim = &cache_lines[i];
+            break;
+        }
+        if (cache_lines[i].last_used < victim->last_used) {
+            victim = &cache_lines[i];
+        }
+    }
+
+    if (victim->valid) {
+        cache_writeback(victim);
+        cache_stats.evictions++;
+    }
+
+    // Load the current sector contents so partial writes keep the surrounding bytes.
+    if (!flush_worker_read(sector_offset, victim->data, FLASH_SECTOR_SIZE)) {
+        memcpy(victim->data, (const void *)(XIP_BASE + sector_offset), FLASH_SECTOR_SIZE);
+    }
+    victim->sector_offset = sector_offset;
+    victim->valid = true;
+    victim->dirty = false;
+    victim->last_used = ++cache_tick;
+    return victim;
+}
+
+
+/**
+ * Empties the cache without writing anything back and resets the statistics.
+ * Called from fs_init() before the filesystem is used.
+ */
+void flash_cache_init(void) {
+    mutex_init(&cache_mutex);
+    memset(cache_lines, 0, sizeof(cache_lines));
+    memset(&cache_stats, 0, sizeof(cache_stats));
+    cache_tick = 0;
+    cache_initialized = true;
+}
+
+
+/**
+ * Reads a range of flash through the cache. Bytes of resident sectors come from RAM so
+ * that writes not yet written back are visible; everything else is copied from XIP.
+ *
+ * @param offset Flash offset to start reading from. Any alignment is accepted.
+ * @param buffer Destination buffer of at least len bytes.
+ * @param len Number of bytes to read; the range may span several sectors.
+ * @return FLASH_CACHE_SUCCESS, or a negative FLASH_CACHE_* error code.
+ */
+int flash_cache_read(uint32_t offset, uint8_t *buffer, size_t len) {
+    if (buffer == NULL) {
+        return FLASH_CACHE_NULL_POINTER;
+    }
+    if (!cache_range_valid(offset, len)) {
+        printf("Error: Cache read outside the filesystem area (offset %u, length %u).\n", offset, (unsigned)len);
+        return FLASH_CACHE_INVALID_RANGE;
+    }
+
+    mutex_enter_blocking(&cache_mutex);
+    while (len > 0) {
+        uint32_t sector_offset = offset & ~(FLASH_SECTOR_SIZE - 1);
+        uint32_t in_sector = offset - sector_offset;
+        size_t chunk = MIN(len, FLASH_SECTOR_SIZE - in_sector);
+
+        cache_line *line = cache_lookup(sector_offset);
+        if (line != NULL) {
+            cache_stats.hits++;
+            line->last_used = ++cache_tick;
+            memcpy(buffer, line->data + in_sector, chunk);
+        } else {
+            cache_stats.misses++;
+            if (!flush_worker_read(offset, buffer, chunk)) {
+                memcpy(buffer, (const void *)(XIP_BASE + offset), chunk);
+            }
+        }
+
+        buffer += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    mutex_exit(&cache_mutex);
+    return FLASH_CACHE_SUCCESS;
+}
+
+
+/**
+ * Writes a range of bytes into the cached sector images. Nothing reaches the flash until
+ * the sector is evicted, flushed or synced.
+ *
+ * @param offset Flash offset to start writing at. Any alignment is accepted.
+ * @param data Bytes to write.
+ * @param len Number of bytes to write; the range may span several sectors.
+ * @return FLASH_CACHE_SUCCESS, or a negative FLASH_CACHE_* error code.
+ */
+int flash_cache_write(uint32_t offset, const uint8_t *data, size_t len) {
+    if (data == NULL) {
+        return FLASH_CACHE_NULL_POINTER;
+    }
+    if (!cache_range_valid(offset, len)) {
+        printf("Error: Cache write outside the filesystem area (offset %u, length %u).\n", offset, (unsigned)len);
+        return FLASH_CACHE_INVALID_RANGE;
+    }
+
+    mutex_enter_blocking(&cache_mutex);
+    while (len > 0) {
+        uint32_t sector_offset = offset & ~(FLASH_SECTOR_SIZE - 1);
+        uint32_t in_sector = offset - sector_offset;
+        size_t chunk = MIN(len, FLASH_SECTOR_SIZE - in_sector);
+
+        cache_line *line = cache_acquire(sector_offset);
+        // A sector that is already dirty will be erased once for all pending writes.
+        if (line->dirty) {
+            cache_stats.erases_avoided++;
+        }
+        memcpy(line->data + in_sector, data, chunk);
+        line->dirty = true;
+
+        data += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    mutex_exit(&cache_mutex);
+    return FLASH_CACHE_SUCCESS;
+}
+
+
+/**
+ * Writes back the sector containing the given offset if it is resident and dirty.
+ * The sector stays in the cache as a clean copy. On return the flash holds it, even if
+ * the flush worker wrote it.
+ */
+int flash_cache_flush(uint32_t offset) {
+    uint32_t sector_offset = offset & ~(FLASH_SECTOR_SIZE - 1);
+
+    mutex_enter_blocking(&cache_mutex);
+    cache_line *line = cache_lookup(sector_offset);
+    if (line != NULL) {
+        cache_writeback(line);
+    }
+    mutex_exit(&cache_mutex);
+    flush_worker_barrier(sector_offset, FLASH_SECTOR_SIZE);
+    return FLASH_CACHE_SUCCESS;
+}
+
+
+/**
+ * Writes back every dirty sector so that the flash holds all data written so far,
+ * including what was queued for the flush worker.
+ */
+int flash_cache_sync(void) {
+    mutex_enter_blocking(&cache_mutex);
+    for (int i = 0; i < FLASH_CACHE_SECTORS; i++) {
+        cache_writeback(&cache_lines[i]);
+    }
+    mutex_exit(&cache_mutex);
+    flush_worker_drain();
+    return FLASH_CACHE_SUCCESS;
+}
+
+
+/**
+ * Drops the sector containing the given offset without writing it back. Used when the
+ * sector is rewritten directly on flash, so the cached image would otherwise be stale.
+ */
+void flash_cache_invalidate(uint32_t offset) {
+    // The raw flash routines may run before the filesystem has set the cache up.
+    if (!cache_initialized) {
+        return;
+    }
+    uint32_t sector_offset = offset & ~(FLASH_SECTOR_SIZE - 1);
+
+    mutex_enter_blocking(&cache_mutex);
+    cache_line *line = cache_lookup(sector_offset);
+    if (line != NULL) {
+        line->valid = false;
+        line->dirty = false;
+    }
+    mutex_exit(&cache_mutex);
+}
+
+
+/**
+ * Copies the current cache counters into the caller's structure.
+ */
+void flash_cache_get_stats(flash_cache_stats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    mutex_enter_blocking(&cache_mutex);
+    *stats = cache_stats;
+    mutex_exit(&cache_mutex);
+}
+
+
+/**
+ * Resets the cache counters to zero without touching the cached data.
+ */
+void flash_cache_reset_stats(void) {
+    mutex_enter_blocking(&cache_mutex);
+    memset(&cache_stats, 0, sizeof(cache_stats));
+    mutex_exit(&cache_mutex);
+}
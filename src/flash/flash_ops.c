@@ -20,18 +20,90 @@
 #include <string.h>
 #include "hardware/flash.h"
 #include "hardware/sync.h"
+#include "pico/mutex.h"
 #include "../config/flash_config.h"    
 #include "../flash/flash_ops.h" 
 #include "../tests/flash_ops_test.h"
 #include "flash_ops_helper.h"
+#include "flash_cache.h"
+#include "wear_table.h"
+#include "flush_worker.h"
  #include <stdlib.h>
 
+#if PICO_ON_DEVICE
+#include "pico/flash.h"
+#include "pico/multicore.h"
+#endif
+
  
 
 #define FLASH_TARGET_OFFSET (256 * 1024) // Offset where user data starts  
 #define FLASH_SIZE PICO_FLASH_SIZE_BYTES // Total flash size available
 #define METADATA_SIZE sizeof(flash_data)  
 
+// Running totals of the physical flash operations issued by this module. Both cores may
+// issue operations, so the totals are only changed through OP_COUNT().
+static flash_op_stats op_totals;
+#define OP_COUNT(field, n) __atomic_fetch_add(&op_totals.field, (n), __ATOMIC_RELAXED)
+
+// Only one erase or program command can be in progress, whichever core issues it.
+auto_init_mutex(flash_mutex);
+
+// A sector being rewritten by flash_program_safe(); guarded by flash_mutex.
+static uint8_t sector_image[FLASH_SECTOR_SIZE];
+
+// Number of pages needed to cover a byte count.
+#define PAGES_FOR(len) (((len) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE)
+
+/**
+ * One erase (data NULL) or program command, in the form flash_safe_execute() passes along.
+ */
+typedef struct {
+    uint32_t offset;
+    const uint8_t *data;
+    size_t len;
+} flash_raw_op;
+
+static void flash_raw_call(void *param) {
+    const flash_raw_op *op = (const flash_raw_op *)param;
+    if (op->data == NULL) {
+        flash_range_erase(op->offset, op->len);
+    } else {
+        flash_range_program(op->offset, op->data, op->len);
+    }
+}
+
+
+/**
+ * Issues one erase or program command with interrupts disabled. While the flush worker or
+ * a filesystem user runs on the other core, that core must not run from XIP either, so the
+ * command goes through flash_safe_execute(), which pauses it. The caller holds flash_mutex.
+ */
+static void flash_raw_locked(uint32_t offset, const uint8_t *data, size_t len) {
+    flash_raw_op op = { offset, data, len };
+#if PICO_ON_DEVICE
+    if (flush_worker_running() || multicore_lockout_victim_is_initialized(get_core_num() ^ 1)) {
+        flash_safe_execute(flash_raw_call, &op, UINT32_MAX);
+        return;
+    }
+#endif
+    uint32_t ints = save_and_disable_interrupts();
+    flash_raw_call(&op);
+    restore_interrupts(ints);
+}
+
+
+/**
+ * Issues one erase or program command. Commands from the two cores are serialised by
+ * flash_mutex, since neither could pause the other while it is paused.
+ */
+static void flash_raw(uint32_t offset, const uint8_t *data, size_t len) {
+    mutex_enter_blocking(&flash_mutex);
+    flash_raw_locked(offset, data, len);
+    mutex_exit(&flash_mutex);
+}
+
+
 /**
  * Write data safely to the flash memory at a specified offset, ensuring that all parameters and alignment rules
  * are strictly adhered to in order to prevent data corruption and adhere to device specifications.
@@ -64,8 +136,8 @@ void flash_write_safe(uint32_t offset, const uint8_t *data, size_t data_len) {
         return;  // Return if the data size is too large for one sector.
     }
 
-    // Prevent writing beyond the physical memory limits of the flash.
-    if (flash_offset + METADATA_SIZE > FLASH_TARGET_OFFSET + FLASH_SIZE) {
+    // Prevent writing beyond the physical memory limits of the flash; offsets are from its start.
+    if (flash_offset > FLASH_SIZE - FLASH_SECTOR_SIZE) {
         printf("Error: Attempt to write beyond flash memory limits.\n");
         return;  // Return if the write operation would exceed the flash memory boundaries.
     }
@@ -84,28 +156,32 @@ void flash_write_safe(uint32_t offset, const uint8_t *data, size_t data_len) {
 
     // Calculate the total size required for storing the data and metadata.
     size_t total_size = sizeof(flash_data) + flashData.data_len;
+    // Only whole pages can be programmed; the rest of the last one stays erased.
+    size_t program_size = PAGES_FOR(total_size) * FLASH_PAGE_SIZE;
 
     // Allocate memory for the buffer that will hold both the metadata and the actual data.
-    uint8_t *flash_data_buffer = malloc(total_size);
+    uint8_t *flash_data_buffer = malloc(program_size);
     if (!flash_data_buffer) {
         printf("Failed to allocate memory for flash data buffer.\n");
         return;  // Return if memory allocation fails.
     }
 
     // Serialize the flashData structure into the allocated buffer.
+    memset(flash_data_buffer + total_size, 0xFF, program_size - total_size);
     serialize_flash_data(&flashData, flash_data_buffer, total_size);
 
-    // Disable interrupts to ensure the flash write operation is not interrupted, maintaining atomicity.
-    uint32_t ints = save_and_disable_interrupts();
-
-    // Erase the flash sector before writing new data to ensure it's clean for programming.
-    flash_range_erase(offset, FLASH_SECTOR_SIZE);
+    // The sector is replaced as a whole, so any cached copy of it is now stale, and an
+    // image of it still queued for the worker must not land over the new contents.
+    flash_cache_invalidate(offset);
+    flush_worker_barrier(offset, FLASH_SECTOR_SIZE);
 
-    // Program the flash memory with new data and metadata.
-    flash_range_program(offset, flash_data_buffer, total_size);
+    // Erase the flash sector before writing new data, then program the data and metadata.
+    flash_raw(offset, NULL, FLASH_SECTOR_SIZE);
+    wear_table_note_erase(offset, FLASH_SECTOR_SIZE);
+    flash_raw(offset, flash_data_buffer, program_size);
 
-    // Restore interrupts to their original state once the flash operation is complete.
-    restore_interrupts(ints);
+    OP_COUNT(erases, 1);
+    OP_COUNT(pages_programmed, PAGES_FOR(total_size));
 
     // Free the allocated buffer after the write operation is done.
     free(flash_data_buffer);
@@ -122,6 +198,7 @@ void flash_write_safe(uint32_t offset, const uint8_t *data, size_t data_len) {
  * Read data safely from the flash memory at a specified offset. This function checks
  * alignment and memory bounds to ensure data integrity and prevent memory access errors.
  * It only proceeds with reading if the data is marked valid and properly initialized.
+ * The data is copied once, directly from the memory-mapped flash, without heap allocations.
  * 
  * @param offset The offset from the base where data is read in the flash memory.
  * @param buffer The buffer to store read data.
@@ -140,43 +217,33 @@ void flash_read_safe(uint32_t offset, uint8_t *buffer, size_t buffer_len) {
     }
 
     // Ensure the read operation does not extend beyond the flash memory's bounds.
-    if (flash_offset + METADATA_SIZE > FLASH_TARGET_OFFSET + FLASH_SIZE) {
+    if (flash_offset > FLASH_SIZE - FLASH_SECTOR_SIZE) {
         printf("Error: Attempt to read beyond flash memory limits.\n");
         return; // Exit function if attempting to read beyond available flash memory.
     }
 
-    // Calculate the total size needed to read, including both metadata and the user data.
-    const size_t total_size = sizeof(flash_data) + buffer_len;
-
-    // Allocate a buffer to hold the flash data including the metadata.
-    uint8_t *flash_data_buffer = malloc(total_size);
-    if (flash_data_buffer == NULL) {
-        printf("Failed to allocate memory for flash data buffer.\n");
-        return; // Exit if memory allocation fails.
-    }
-
-    // Copy the data from flash memory starting at the computed offset into the allocated buffer.
-    memcpy(flash_data_buffer, (const void *)(XIP_BASE + offset), total_size);
-
-    // Deserialize the buffer into a flash_data struct to extract metadata and actual data.
-    flash_data data;
-    deserialize_flash_data(flash_data_buffer, &data);
+    // The sector is memory mapped through XIP, so the header fields and the payload are
+    // parsed in place instead of being staged in heap buffers. The header is stored in
+    // the packed layout written by serialize_flash_data(): valid, write_count, data_len.
+    const uint8_t *flash_ptr = (const uint8_t *)(XIP_BASE + flash_offset);
+    bool valid;
+    size_t data_len;
+    memcpy(&valid, flash_ptr, sizeof(valid));
+    memcpy(&data_len, flash_ptr + sizeof(valid) + sizeof(uint32_t), sizeof(data_len));
+    const uint8_t *payload = flash_ptr + sizeof(valid) + sizeof(uint32_t) + sizeof(data_len);
 
     // Check if the data is valid before copying it to the user-provided buffer.
-    if (data.valid) {
+    if (valid) {
         // Ensure that the buffer is large enough to hold the data.
-        if (buffer_len >= data.data_len) {
-            // Copy only the amount of data specified in data_len to prevent buffer overflow.
-            memcpy(buffer, data.data_ptr, data.data_len);
+        if (buffer_len >= data_len) {
+            // A single copy straight from the mapped flash into the caller's buffer.
+            memcpy(buffer, payload, data_len);
         } else {
             printf("Error: Buffer provided is too small for the data length.\n");
         }
     } else {
         printf("Error: Invalid data at specified flash offset.\n");
     }
-
-    // Free the allocated buffer after use.
-    free(flash_data_buffer);
 }
 
 
@@ -192,8 +259,8 @@ void flash_read_safe(uint32_t offset, uint8_t *buffer, size_t buffer_len) {
  * @param offset The offset within the flash memory where the sector begins to be erased.
  */
 void flash_erase_safe(uint32_t offset) {
-    // Calculate the actual address in flash memory where the erasing will start, including the predefined offset.
-    uint32_t flash_offset = FLASH_TARGET_OFFSET + offset;
+    // Offsets are from the start of the flash, as for flash_write_safe() and flash_read_safe().
+    uint32_t flash_offset = offset;
 
     // Ensure the offset aligns with the sector size to prevent partial erasure of sectors.
     if (flash_offset % FLASH_SECTOR_SIZE != 0) {
@@ -202,7 +269,7 @@ void flash_erase_safe(uint32_t offset) {
     }
 
     // Check if the erasing would go beyond the limits of the flash memory.
-    if (flash_offset + METADATA_SIZE > FLASH_TARGET_OFFSET + FLASH_SIZE) {
+    if (flash_offset > FLASH_SIZE - FLASH_SECTOR_SIZE) {
         printf("Error: Attempt to erase beyond flash memory limits.\n");
         return; // Stop the operation to prevent memory corruption due to out-of-bounds access.
     }
@@ -211,26 +278,15 @@ void flash_erase_safe(uint32_t offset) {
     uint32_t initial_count = get_flash_write_count(offset);
     initial_count += 1;
 
-    // Disable interrupts to ensure the erasure process is not interrupted, maintaining the atomicity of the operation.
-    uint32_t ints = save_and_disable_interrupts();
-
     // Compute the exact start of the sector to be erased, ensuring it is rounded down to the nearest sector boundary.
     uint32_t sector_start = flash_offset & ~(FLASH_SECTOR_SIZE - 1);
 
     // Verify that the calculated sector start does not exceed the flash memory's boundary.
-    if (sector_start >= FLASH_TARGET_OFFSET + FLASH_SIZE) {
+    if (sector_start >= FLASH_SIZE) {
         printf("Error: Sector start address is out of bounds.\n");
-        restore_interrupts(ints);
-        return; // Restore interrupts and abort if the start address is invalid.
+        return; // Abort if the start address is invalid.
     }
 
-    // Back up the existing metadata from the sector before erasing to preserve critical data like write counts.
-    flash_data metadata_backup;
-    memcpy(&metadata_backup, (const void*)(XIP_BASE + sector_start), sizeof(flash_data));
-
-    // Perform the actual erasure of the sector.
-    flash_range_erase(sector_start, FLASH_SECTOR_SIZE);
-
     // Set up metadata for restoration after erasing. Mark data as invalid since it has been erased.
     flash_data metadata_to_restore = {
         .valid = false,
@@ -238,12 +294,256 @@ void flash_erase_safe(uint32_t offset) {
         .data_len = 0,
         .data_ptr = NULL
     };
+    // Only whole pages can be programmed, so the metadata goes in front of an erased page.
+    uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xFF, sizeof(page));
+    serialize_flash_data(&metadata_to_restore, page, sizeof(page));
+
+    // Drop any cached copy of the sector so it cannot be written back over the erase, and
+    // wait for the worker to finish any image of it still queued.
+    flash_cache_invalidate(sector_start);
+    flush_worker_barrier(sector_start, FLASH_SECTOR_SIZE);
+
+    // Perform the actual erasure of the sector, then restore the metadata at its start to
+    // maintain the integrity of flash management data.
+    flash_raw(sector_start, NULL, FLASH_SECTOR_SIZE);
+    wear_table_note_erase(sector_start, FLASH_SECTOR_SIZE);
+    flash_raw(sector_start, page, sizeof(page));
+
+    OP_COUNT(erases, 1);
+    OP_COUNT(pages_programmed, 1);
+}
 
-    // Restore the metadata at the start of the erased sector to maintain the integrity of flash management data.
-    flash_range_program(sector_start, (const uint8_t *)&metadata_to_restore, sizeof(flash_data));
 
-    // Re-enable interrupts after completing the erasure to restore normal operation.
-    restore_interrupts(ints);
+
+/**
+ * Checks whether programming new bytes over the current flash contents only needs
+ * bits to go from 1 to 0. NOR flash can clear bits with a program operation, but
+ * setting a bit back to 1 requires erasing the whole sector.
+ */
+static bool flash_can_program_over(const uint8_t *current, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if ((current[i] & data[i]) != data[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Programs the pages of one sector that cover [in_sector, in_sector + len). Bytes of the
+ * page outside that range are sent as 0xFF, which leaves them unchanged on NOR flash.
+ * Pages whose target bytes already hold the requested values are skipped. The caller holds
+ * flash_mutex.
+ *
+ * @return The number of pages actually programmed.
+ */
+static uint32_t flash_program_pages(uint32_t sector_offset, uint32_t in_sector, const uint8_t *data, size_t len) {
+    uint8_t page[FLASH_PAGE_SIZE];
+    uint32_t programmed = 0;
+    uint32_t end = in_sector + len;
+
+    for (uint32_t page_start = in_sector & ~(FLASH_PAGE_SIZE - 1); page_start < end; page_start += FLASH_PAGE_SIZE) {
+        uint32_t from = MAX(page_start, in_sector);
+        uint32_t to = MIN(page_start + FLASH_PAGE_SIZE, end);
+        const uint8_t *current = (const uint8_t *)(XIP_BASE + sector_offset + from);
+
+        // Nothing to do if the flash already holds these bytes.
+        if (memcmp(current, data + (from - in_sector), to - from) == 0) {
+            continue;
+        }
+
+        memset(page, 0xFF, sizeof(page));
+        memcpy(page + (from - page_start), data + (from - in_sector), to - from);
+
+        flash_raw_locked(sector_offset + page_start, page, FLASH_PAGE_SIZE);
+        programmed++;
+    }
+    return programmed;
+}
+
+
+/**
+ * Writes bytes to flash at any offset, avoiding the sector erase whenever possible.
+ *
+ * For each sector touched, the target bytes are compared with the current flash contents.
+ * If only 1 -> 0 bit changes are needed (for example when appending into a region that is
+ * still erased), just the affected 256-byte pages are programmed. Otherwise the sector is
+ * read, patched in RAM, erased and reprogrammed, skipping pages that are left blank.
+ *
+ * @param offset Flash offset of the first byte to write. Any alignment is accepted.
+ * @param data Pointer to the bytes to write.
+ * @param data_len Number of bytes to write; the range may span several sectors.
+ * @param stats Optional; receives the erase and page program counts for this call.
+ * @return FLASH_PROGRAM_SUCCESS, or a negative FLASH_PROGRAM_* error code.
+ */
+int flash_program_safe(uint32_t offset, const uint8_t *data, size_t data_len, flash_op_stats *stats) {
+    flash_op_stats call = {0};
+
+    if (data == NULL) {
+        printf("Error: No data provided to flash_program_safe.\n");
+        return FLASH_PROGRAM_NULL_POINTER;
+    }
+
+    // Only the filesystem area may be written; the program image lives below it.
+    if (offset < FLASH_TARGET_OFFSET || data_len > FLASH_SIZE || offset > FLASH_SIZE - data_len) {
+        printf("Error: Attempt to program outside the filesystem area (offset %u, length %u).\n", offset, (unsigned)data_len);
+        return FLASH_PROGRAM_INVALID_RANGE;
+    }
+
+    // Sectors still queued for the flush worker are written first, so this lands on top.
+    flush_worker_barrier(offset, data_len);
+
+    while (data_len > 0) {
+        uint32_t sector_offset = offset & ~(FLASH_SECTOR_SIZE - 1);
+        uint32_t in_sector = offset - sector_offset;
+        size_t chunk = MIN(data_len, FLASH_SECTOR_SIZE - in_sector);
+        const uint8_t *current = (const uint8_t *)(XIP_BASE + offset);
+
+        mutex_enter_blocking(&flash_mutex);
+        if (flash_can_program_over(current, data, chunk)) {
+            // Fast path: the target bytes can be programmed in place.
+            call.pages_programmed += flash_program_pages(sector_offset, in_sector, data, chunk);
+        } else {
+            // Slow path: read-modify-erase-write of the whole sector, staged in sector_image.
+            memcpy(sector_image, (const void *)(XIP_BASE + sector_offset), FLASH_SECTOR_SIZE);
+            memcpy(sector_image + in_sector, data, chunk);
+
+            flash_raw_locked(sector_offset, NULL, FLASH_SECTOR_SIZE);
+            wear_table_note_erase(sector_offset, FLASH_SECTOR_SIZE);
+            call.erases++;
+
+            // After the erase every page reads 0xFF, so blank pages need no program.
+            call.pages_programmed += flash_program_pages(sector_offset, 0, sector_image, FLASH_SECTOR_SIZE);
+        }
+        mutex_exit(&flash_mutex);
+
+        data += chunk;
+        offset += chunk;
+        data_len -= chunk;
+    }
+
+    OP_COUNT(erases, call.erases);
+    OP_COUNT(pages_programmed, call.pages_programmed);
+    if (stats != NULL) {
+        *stats = call;
+    }
+    return FLASH_PROGRAM_SUCCESS;
+}
+
+
+
+/**
+ * Erases a single sector so that every byte reads 0xFF, without writing any metadata
+ * back. Any cached copy of the sector is dropped first.
+ *
+ * @param offset Flash offset of the sector; must be sector aligned.
+ * @return FLASH_PROGRAM_SUCCESS, or FLASH_PROGRAM_INVALID_RANGE.
+ */
+int flash_erase_sector(uint32_t offset) {
+    if (offset % FLASH_SECTOR_SIZE != 0 || offset < FLASH_TARGET_OFFSET || offset >= FLASH_SIZE) {
+        printf("Error: Invalid sector offset for erase (%u).\n", offset);
+        return FLASH_PROGRAM_INVALID_RANGE;
+    }
+
+    flash_cache_invalidate(offset);
+    flush_worker_barrier(offset, FLASH_SECTOR_SIZE);
+
+    flash_raw(offset, NULL, FLASH_SECTOR_SIZE);
+    wear_table_note_erase(offset, FLASH_SECTOR_SIZE);
+
+    OP_COUNT(erases, 1);
+    return FLASH_PROGRAM_SUCCESS;
+}
+
+
+
+/**
+ * Erases a sector-aligned range of flash. Where the range covers a whole 64 KB block that is
+ * 64 KB aligned, a single block erase is issued instead of sixteen sector erases, which is
+ * considerably faster. Interrupts are disabled once per erase command rather than for the
+ * whole range, so long ranges do not block interrupts for seconds.
+ *
+ * @param offset Flash offset of the first sector; must be sector aligned.
+ * @param len Number of bytes to erase; must be a multiple of the sector size.
+ * @return FLASH_PROGRAM_SUCCESS, or FLASH_PROGRAM_INVALID_RANGE.
+ */
+int flash_erase_range(uint32_t offset, size_t len) {
+    if (offset % FLASH_SECTOR_SIZE != 0 || len % FLASH_SECTOR_SIZE != 0
+        || offset < FLASH_TARGET_OFFSET || len > FLASH_SIZE || offset > FLASH_SIZE - len) {
+        printf("Error: Invalid range for erase (offset %u, length %u).\n", offset, (unsigned)len);
+        return FLASH_PROGRAM_INVALID_RANGE;
+    }
+
+    while (len > 0) {
+        // Use a block erase when the rest of a 64 KB block is covered and aligned.
+        size_t unit = (offset % FLASH_BLOCK_SIZE == 0 && len >= FLASH_BLOCK_SIZE) ? FLASH_BLOCK_SIZE : FLASH_SECTOR_SIZE;
+
+        for (uint32_t sector = offset; sector < offset + unit; sector += FLASH_SECTOR_SIZE) {
+            flash_cache_invalidate(sector);
+        }
+        flush_worker_barrier(offset, unit);
+
+        flash_raw(offset, NULL, unit);
+        wear_table_note_erase(offset, unit);
+
+        if (unit == FLASH_BLOCK_SIZE) {
+            OP_COUNT(block_erases, 1);
+        } else {
+            OP_COUNT(erases, 1);
+        }
+        offset += unit;
+        len -= unit;
+    }
+    return FLASH_PROGRAM_SUCCESS;
+}
+
+
+/**
+ * Programs a run of whole pages that are already erased, with a single interrupt-disable
+ * window for the whole batch. The data must be in RAM: XIP is unavailable while the flash
+ * is being programmed, so a source buffer in flash would fault.
+ *
+ * @param offset Flash offset of the first page; must be page aligned.
+ * @param data Bytes to program, in RAM.
+ * @param len Number of bytes; must be a multiple of the page size.
+ * @return FLASH_PROGRAM_SUCCESS, or a negative FLASH_PROGRAM_* error code.
+ */
+int flash_program_batch(uint32_t offset, const uint8_t *data, size_t len) {
+    if (data == NULL) {
+        return FLASH_PROGRAM_NULL_POINTER;
+    }
+    if (offset % FLASH_PAGE_SIZE != 0 || len % FLASH_PAGE_SIZE != 0
+        || offset < FLASH_TARGET_OFFSET || len > FLASH_SIZE || offset > FLASH_SIZE - len) {
+        printf("Error: Invalid range for batch program (offset %u, length %u).\n", offset, (unsigned)len);
+        return FLASH_PROGRAM_INVALID_RANGE;
+    }
+
+    flush_worker_barrier(offset, len);
+    flash_raw(offset, data, len);
+
+    OP_COUNT(pages_programmed, len / FLASH_PAGE_SIZE);
+    return FLASH_PROGRAM_SUCCESS;
+}
+
+
+
+/**
+ * Copies the running totals of erase and program operations into the caller's structure.
+ */
+void flash_get_op_stats(flash_op_stats *stats) {
+    if (stats != NULL) {
+        *stats = op_totals;
+    }
+}
+
+
+/**
+ * Resets the running totals of erase and program operations to zero.
+ */
+void flash_reset_op_stats(void) {
+    memset(&op_totals, 0, sizeof(op_totals));
 }
 
 
@@ -54,19 +54,19 @@ uint32_t get_flash_write_count(uint32_t offset) {
     }
 
     // Check to ensure that the read operation stays within the bounds of the flash memory to avoid overflow errors.
-    if (flash_offset + METADATA_SIZE > FLASH_TARGET_OFFSET + FLASH_SIZE) {
+    if (flash_offset + METADATA_SIZE > FLASH_SIZE) {
         printf("Error: Attempt to read for write count beyond flash memory limits.\n");
         return 0; // Return 0 as an error indicator due to attempting to read beyond the flash memory limits.
     }
 
-    // Define a temporary structure to store the data read from flash memory.
-    flash_data tempFlashData;
-
-    // Read the metadata from the specified offset within the flash memory.
-    memcpy(&tempFlashData, (const void *)(XIP_BASE + flash_offset), METADATA_SIZE);
+    // The header is stored in the packed layout written by serialize_flash_data(): valid,
+    // write_count, data_len. Read the write count from its place in that layout.
+    const uint8_t *header = (const uint8_t *)(XIP_BASE + flash_offset);
+    uint32_t write_count;
+    memcpy(&write_count, header + sizeof(bool), sizeof(write_count));
 
     // Return the retrieved write count. This count helps in understanding the wear level of the flash sector.
-    return tempFlashData.write_count;
+    return write_count;
 }
 
 
@@ -91,22 +91,21 @@ uint32_t get_flash_data_length(uint32_t offset) {
     }
 
     // Check that the memory address for reading is within the allowed flash memory bounds.
-    if (flash_offset + METADATA_SIZE > FLASH_TARGET_OFFSET + FLASH_SIZE) {
+    if (flash_offset + METADATA_SIZE > FLASH_SIZE) {
         printf("Error: Attempt to read for data length beyond flash memory limits.\n");
         return 0; // Return 0 to indicate an error due to reading beyond flash memory limits.
     }
 
-    // Define a temporary structure to hold the flash data read from memory.
-    flash_data tempFlashData;
-
-    // Read the data from the specified flash memory offset.
-    memcpy(&tempFlashData, (const void *)(XIP_BASE + flash_offset), METADATA_SIZE);
+    // Read the data length from the packed header written by serialize_flash_data().
+    const uint8_t *header = (const uint8_t *)(XIP_BASE + flash_offset);
+    size_t data_len;
+    memcpy(&data_len, header + sizeof(bool) + sizeof(uint32_t), sizeof(data_len));
 
     // Output the data length for debugging and verification purposes.
-    printf("FLASH DATA LENGTH: %zu\n", tempFlashData.data_len);
+    printf("FLASH DATA LENGTH: %zu\n", data_len);
 
     // Return the data length retrieved from the flash memory.
-    return tempFlashData.data_len;
+    return data_len;
 }
 
 
@@ -0,0 +1,379 @@
+/**
+ * @file flush_worker.c
+ *
+ * This module moves flash erases and programs off the core that writes files.
+ *
+ * - The sector cache hands each evicted or synced sector image to flush_worker_submit(),
+ *   which copies it into a ring of FLUSH_RING_SLOTS slots and returns. Retired blocks are
+ *   queued as erases by flush_worker_submit_erase().
+ * - The ring has a single consumer (the worker), which only moves the tail. As both cores
+ *   may use the filesystem, producers claim a slot with a compare-and-swap on the head and
+ *   publish it with a release store of the slot's sequence number, as the queue of
+ *   ring_log.c does. A producer that finds the ring full waits for the worker without
+ *   holding anything.
+ * - Readers take no lock either. They check a slot's sequence number before and after
+ *   copying from it; if the worker handed the slot back meanwhile, they look again.
+ * - The worker writes slots in order with flash_program_safe(), which erases only when it
+ *   has to. A slot whose sector is queued again further on is skipped, since the newer image
+ *   replaces it anyway. A slot is released only once it is on flash.
+ * - On the RP2040 the worker runs on core 1, and every flash command of either core goes
+ *   through flash_safe_execute() while the worker runs, because neither core may execute
+ *   from XIP during an erase or program. Host builds run the worker as a thread against the
+ *   simulated flash.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "pico/time.h"
+#include "../config/flash_config.h"
+#include "../flash/flash_ops.h"
+#include "../flash/flush_worker.h"
+
+#if PICO_ON_DEVICE
+#include "pico/multicore.h"
+#include "pico/flash.h"
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#if (FLUSH_RING_SLOTS & (FLUSH_RING_SLOTS - 1)) != 0
+#error "FLUSH_RING_SLOTS must be a power of two"
+#endif
+
+
+/**
+ * One queued sector image.
+ */
+typedef struct {
+    volatile uint32_t sequence;         // n while free for item n, n + 1 once item n is published.
+    uint32_t sector_offset;             // Flash offset of the sector, sector aligned.
+    uint8_t data[FLASH_SECTOR_SIZE];    // Contents it gets; all 0xFF for an erase.
+} flush_slot;
+
+static flush_slot ring[FLUSH_RING_SLOTS];
+// Free-running counts of slots queued and written; slot n lives at n % FLUSH_RING_SLOTS.
+static volatile uint32_t ring_head = 0;   // Claimed by producers with a compare-and-swap.
+static volatile uint32_t ring_tail = 0;   // Written by the worker only.
+static volatile bool worker_stop = false;
+static volatile bool worker_running = false;
+static flush_worker_stats worker_stats;
+
+#if PICO_ON_DEVICE
+static volatile bool worker_exited = false;
+
+// Each side sleeps until the other signals that it moved its end of the ring.
+static inline void ring_wait(void) { __wfe(); }
+static inline void ring_signal(void) { __sev(); }
+static inline bool on_worker(void) { return get_core_num() == 1; }
+#else
+static pthread_t worker_thread;
+static _Thread_local bool worker_self = false;
+
+static inline void ring_wait(void) {
+    struct timespec pause = { 0, 20000 };
+    nanosleep(&pause, NULL);
+}
+static inline void ring_signal(void) {}
+static inline bool on_worker(void) { return worker_self; }
+#endif
+
+
+/**
+ * Writes queued slots until asked to stop with the ring empty.
+ */
+static void worker_loop(void) {
+    for (;;) {
+        uint32_t tail = ring_tail;
+        flush_slot *slot = &ring[tail % FLUSH_RING_SLOTS];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != tail + 1) {
+            // Empty, or the producer that claimed the slot is still filling it.
+            if (__atomic_load_n(&worker_stop, __ATOMIC_ACQUIRE) && __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == tail) {
+                return;
+            }
+            ring_wait();
+            continue;
+        }
+
+        // Only published slots count; one still being filled is not superseding anything yet.
+        uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+        bool superseded = false;
+        for (uint32_t later = tail + 1; later != head && !superseded; later++) {
+            flush_slot *next = &ring[later % FLUSH_RING_SLOTS];
+            superseded = __atomic_load_n(&next->sequence, __ATOMIC_ACQUIRE) == later + 1
+                         && next->sector_offset == slot->sector_offset;
+        }
+        if (superseded) {
+            __atomic_fetch_add(&worker_stats.superseded, 1, __ATOMIC_RELAXED);
+        } else {
+            if (flash_program_safe(slot->sector_offset, slot->data, FLASH_SECTOR_SIZE, NULL) != FLASH_PROGRAM_SUCCESS) {
+                printf("Error: Flush worker failed to write sector at %u.\n", slot->sector_offset);
+            }
+            __atomic_fetch_add(&worker_stats.written, 1, __ATOMIC_RELAXED);
+        }
+        // Hand the slot back to the producer that claims it on the next lap.
+        __atomic_store_n(&slot->sequence, tail + FLUSH_RING_SLOTS, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+        ring_signal();
+    }
+}
+
+
+#if PICO_ON_DEVICE
+static void worker_core1_entry(void) {
+    // Lets core 0 pause this core while it erases or programs.
+    flash_safe_execute_core_init();
+    worker_loop();
+    flash_safe_execute_core_deinit();
+    worker_exited = true;
+    ring_signal();
+}
+#else
+static void *worker_thread_entry(void *unused) {
+    (void)unused;
+    worker_self = true;
+    worker_loop();
+    return NULL;
+}
+#endif
+
+
+/**
+ * Starts the worker with an empty ring. From here on the sector cache queues its
+ * write-backs instead of programming them. Call after fs_init() or fs_mount().
+ *
+ * @return 0 on success, or -1 if the worker could not be started.
+ */
+int flush_worker_start(void) {
+    if (worker_running) {
+        return 0;
+    }
+    ring_head = 0;
+    ring_tail = 0;
+    for (uint32_t i = 0; i < FLUSH_RING_SLOTS; i++) {
+        ring[i].sequence = i;
+    }
+    worker_stop = false;
+    memset(&worker_stats, 0, sizeof(worker_stats));
+    worker_running = true;
+
+#if PICO_ON_DEVICE
+    worker_exited = false;
+    // Lets core 1 pause this core while it erases or programs.
+    flash_safe_execute_core_init();
+    multicore_launch_core1(worker_core1_entry);
+#else
+    if (pthread_create(&worker_thread, NULL, worker_thread_entry, NULL) != 0) {
+        printf("Error: Failed to start the flush worker.\n");
+        worker_running = false;
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+
+/**
+ * Waits for everything queued to reach the flash, then stops the worker. The cache writes
+ * back synchronously again afterwards.
+ */
+void flush_worker_stop(void) {
+    if (!worker_running) {
+        return;
+    }
+    __atomic_store_n(&worker_stop, true, __ATOMIC_RELEASE);
+    ring_signal();
+#if PICO_ON_DEVICE
+    while (!worker_exited) {
+        ring_wait();
+    }
+    flash_safe_execute_core_deinit();
+    multicore_reset_core1();
+#else
+    pthread_join(worker_thread, NULL);
+#endif
+    worker_running = false;
+}
+
+
+/**
+ * Returns true while the worker is running.
+ */
+bool flush_worker_running(void) {
+    return worker_running;
+}
+
+
+/**
+ * Claims the next slot, waiting for the worker if all of them are queued, fills it and
+ * publishes it. Nothing is held while waiting, so readers and other producers go on.
+ */
+static void ring_push(uint32_t sector_offset, const uint8_t *data) {
+    uint64_t began = time_us_64();
+    bool waited = false;
+    uint32_t position = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    flush_slot *slot;
+    for (;;) {
+        slot = &ring[position % FLUSH_RING_SLOTS];
+        int32_t lag = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+        if (lag == 0) {
+            if (__atomic_compare_exchange_n(&ring_head, &position, position + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (lag < 0) {
+            // Full: the worker has not handed this slot back from the previous lap yet.
+            waited = true;
+            ring_wait();
+            position = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        } else {
+            position = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Readers may still look at the slot's previous image; they see the sequence change.
+    __atomic_store_n(&slot->sector_offset, sector_offset, __ATOMIC_RELAXED);
+    if (data != NULL) {
+        memcpy(slot->data, data, FLASH_SECTOR_SIZE);
+    } else {
+        memset(slot->data, 0xFF, FLASH_SECTOR_SIZE);
+    }
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    ring_signal();
+
+    uint32_t took = (uint32_t)(time_us_64() - began);
+    __atomic_fetch_add(&worker_stats.submitted, 1, __ATOMIC_RELAXED);
+    if (waited) {
+        __atomic_fetch_add(&worker_stats.full_waits, 1, __ATOMIC_RELAXED);
+    }
+    uint32_t most = __atomic_load_n(&worker_stats.max_submit_us, __ATOMIC_RELAXED);
+    while (took > most && !__atomic_compare_exchange_n(&worker_stats.max_submit_us, &most, took, true,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+
+/**
+ * Queues the full contents of a sector to be written by the worker.
+ *
+ * @param sector_offset Flash offset of the sector; must be sector aligned.
+ * @param data FLASH_SECTOR_SIZE bytes; copied before this returns.
+ */
+void flush_worker_submit(uint32_t sector_offset, const uint8_t *data) {
+    ring_push(sector_offset, data);
+}
+
+
+/**
+ * Queues an erase of a sector. Until the worker gets to it, reads through the cache
+ * already see the sector as erased.
+ */
+void flush_worker_submit_erase(uint32_t sector_offset) {
+    ring_push(sector_offset, NULL);
+}
+
+
+/**
+ * Reads bytes of a sector from the newest image of it still queued.
+ *
+ * @param offset Flash offset of the first byte; the range must lie within one sector.
+ * @param buffer Receives len bytes.
+ * @return true if the sector is queued and the bytes were copied, false if the flash itself
+ *         is up to date.
+ */
+bool flush_worker_read(uint32_t offset, uint8_t *buffer, size_t len) {
+    if (!worker_running) {
+        return false;
+    }
+    uint32_t sector_offset = offset & ~(FLASH_SECTOR_SIZE - 1);
+    for (;;) {
+        uint32_t tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+        uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+        bool reused = false;
+        for (uint32_t i = head; i != tail && !reused; i--) {
+            flush_slot *slot = &ring[(i - 1) % FLUSH_RING_SLOTS];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != i) {
+                // Still being filled, so not queued yet; or already written and handed back,
+                // and so is everything older.
+                reused = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) - i) > 0;
+                continue;
+            }
+            if (__atomic_load_n(&slot->sector_offset, __ATOMIC_RELAXED) != sector_offset) {
+                continue;
+            }
+            memcpy(buffer, slot->data + (offset - sector_offset), len);
+            // The copy only counts if the worker did not hand the slot back meanwhile.
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == i) {
+                return true;
+            }
+            reused = true;
+        }
+        if (!reused) {
+            return false;
+        }
+        // The worker moved on while we looked; the flash may hold the image by now, or a
+        // newer slot may. Look again from the current ends.
+    }
+}
+
+
+/**
+ * Waits until no queued image overlaps a range of flash, so that the range can be erased,
+ * programmed or read through XIP directly. Returns at once when called by the worker itself.
+ */
+void flush_worker_barrier(uint32_t offset, size_t len) {
+    if (!worker_running || on_worker()) {
+        return;
+    }
+    for (;;) {
+        uint32_t tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+        uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+        bool pending = false;
+        for (uint32_t i = tail; i != head && !pending; i++) {
+            flush_slot *slot = &ring[i % FLUSH_RING_SLOTS];
+            uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+            if (sequence == i) {
+                // Claimed but not filled yet; its sector is not known, so wait for it.
+                pending = true;
+            } else if (sequence == i + 1) {
+                uint32_t sector = __atomic_load_n(&slot->sector_offset, __ATOMIC_RELAXED);
+                pending = sector < offset + len && offset < sector + FLASH_SECTOR_SIZE;
+            }
+        }
+        if (!pending) {
+            return;
+        }
+        ring_wait();
+    }
+}
+
+
+/**
+ * Waits until every queued image is on flash.
+ */
+void flush_worker_drain(void) {
+    if (!worker_running || on_worker()) {
+        return;
+    }
+    while (__atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) != ring_head) {
+        ring_wait();
+    }
+}
+
+
+/**
+ * Copies out the worker's counters.
+ */
+void flush_worker_get_stats(flush_worker_stats *stats) {
+    if (stats != NULL) {
+        // The worker and the producers update them while this runs.
+        stats->submitted = __atomic_load_n(&worker_stats.submitted, __ATOMIC_RELAXED);
+        stats->written = __atomic_load_n(&worker_stats.written, __ATOMIC_RELAXED);
+        stats->superseded = __atomic_load_n(&worker_stats.superseded, __ATOMIC_RELAXED);
+        stats->full_waits = __atomic_load_n(&worker_stats.full_waits, __ATOMIC_RELAXED);
+        stats->max_submit_us = __atomic_load_n(&worker_stats.max_submit_us, __ATOMIC_RELAXED);
+    }
+}
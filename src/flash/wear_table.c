@@ -0,0 +1,238 @@
+/**
+ * @file wear_table.c
+ *
+ * This module keeps an erase count for every block and makes it available to the block
+ * allocator.
+ *
+ * - Every erase issued through flash_ops.c is counted here, including the block erases of
+ *   flash_erase_range(), which count once for each sector they cover.
+ * - The counts are saved with each metadata checkpoint, packed as 32-bit values, one
+ *   FILESYSTEM_BLOCK_SIZE sector per WEAR_SECTOR_ENTRIES blocks. Like the FAT, each sector
+ *   has two copies: only sectors with changed counts are rewritten, into the copy the
+ *   previous checkpoint does not use, so a torn checkpoint leaves the previous one valid.
+ * - A checkpoint whose wear sectors fail their CRC does not stop the mount; the counts then
+ *   start again from zero, which only weakens the leveling for a while.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "hardware/flash.h"
+#include "pico/mutex.h"
+#include "../config/flash_config.h"
+#include "../flash/flash_ops.h"
+#include "../flash/block_log.h"
+#include "../flash/wear_table.h"
+
+// Blocks counted by wear_table_get_stats(): those the FAT allocator hands out.
+#define WEAR_FIRST_DATA_BLOCK (NUMBER_OF_RESERVED_BLOCKS + METADATA_RESERVED_BLOCKS)
+
+static uint32_t erase_counts[TOTAL_BLOCKS];
+static uint32_t max_count = 0;                // Highest count of a data block.
+static uint8_t dirty_sectors[WEAR_SECTORS];   // Sectors whose counts changed since the last save.
+static wear_checkpoint saved_wear;            // Copies written by the last save.
+static bool wear_ready = false;
+static mutex_t wear_mutex;
+
+
+/**
+ * Returns the flash offset of one copy of a wear sector.
+ */
+static uint32_t wear_sector_offset(uint32_t sector, uint32_t copy) {
+    return (WEAR_CHECKPOINT_FIRST_BLOCK + copy * WEAR_SECTORS + sector) * FILESYSTEM_BLOCK_SIZE;
+}
+
+
+/**
+ * Sets every count to zero. Called when the filesystem is formatted, and at mount before
+ * the counts of the last checkpoint are loaded.
+ */
+void wear_table_init(void) {
+    if (!wear_ready) {
+        mutex_init(&wear_mutex);
+        wear_ready = true;
+    }
+    mutex_enter_blocking(&wear_mutex);
+    memset(erase_counts, 0, sizeof(erase_counts));
+    max_count = 0;
+    memset(dirty_sectors, 1, sizeof(dirty_sectors));
+    memset(&saved_wear, 0, sizeof(saved_wear));
+    mutex_exit(&wear_mutex);
+}
+
+
+/**
+ * Counts an erase of a sector-aligned flash range, once for each sector it covers.
+ * Erases before wear_table_init() are not counted.
+ */
+void wear_table_note_erase(uint32_t offset, size_t len) {
+    if (!wear_ready) {
+        return;
+    }
+    mutex_enter_blocking(&wear_mutex);
+    for (uint32_t block = offset / FILESYSTEM_BLOCK_SIZE;
+         block < (offset + len) / FILESYSTEM_BLOCK_SIZE && block < TOTAL_BLOCKS; block++) {
+        erase_counts[block]++;
+        if (block >= WEAR_FIRST_DATA_BLOCK && erase_counts[block] > max_count) {
+            max_count = erase_counts[block];
+        }
+        dirty_sectors[block / WEAR_SECTOR_ENTRIES] = 1;
+    }
+    mutex_exit(&wear_mutex);
+}
+
+
+/**
+ * Returns how often a block has been erased. Read without locking: a count that is one
+ * erase out of date makes no difference to the allocator.
+ */
+uint32_t wear_table_count(uint32_t block) {
+    return (block < TOTAL_BLOCKS) ? erase_counts[block] : 0;
+}
+
+
+/**
+ * Returns the erase count of the most worn block the allocator hands out, kept up to date
+ * as erases are counted.
+ */
+uint32_t wear_table_max(void) {
+    return max_count;
+}
+
+
+/**
+ * Writes one copy of a wear sector a page at a time. The erase is counted before the
+ * counts are copied, so the sector includes its own erase.
+ *
+ * @param crc Receives the CRC-32 of the sector as written.
+ */
+static int wear_write_sector(uint32_t sector, uint32_t copy, uint32_t *crc) {
+    uint32_t offset = wear_sector_offset(sector, copy);
+    if (flash_erase_range(offset, FILESYSTEM_BLOCK_SIZE) != FLASH_PROGRAM_SUCCESS) {
+        return WEAR_IO_ERROR;
+    }
+
+    uint32_t page[FLASH_PAGE_SIZE / sizeof(uint32_t)];
+    uint32_t block = sector * WEAR_SECTOR_ENTRIES;
+    *crc = 0;
+    for (uint32_t pageOffset = 0; pageOffset < FILESYSTEM_BLOCK_SIZE; pageOffset += FLASH_PAGE_SIZE) {
+        mutex_enter_blocking(&wear_mutex);
+        for (uint32_t i = 0; i < FLASH_PAGE_SIZE / sizeof(uint32_t); i++, block++) {
+            page[i] = (block < TOTAL_BLOCKS) ? erase_counts[block] : 0;
+        }
+        mutex_exit(&wear_mutex);
+        *crc = block_log_crc32(*crc, (const uint8_t *)page, FLASH_PAGE_SIZE);
+        if (flash_program_safe(offset + pageOffset, (const uint8_t *)page, FLASH_PAGE_SIZE, NULL) != FLASH_PROGRAM_SUCCESS) {
+            return WEAR_IO_ERROR;
+        }
+    }
+    return WEAR_SUCCESS;
+}
+
+
+/**
+ * Writes every wear sector whose counts changed since the last save into the copy the
+ * last save did not use.
+ *
+ * @param checkpoint Receives the copy and CRC of every sector, to be recorded with the
+ *                   checkpoint and handed to wear_table_load().
+ * @return WEAR_SUCCESS, or WEAR_IO_ERROR if a sector could not be written.
+ */
+int wear_table_save(wear_checkpoint *checkpoint) {
+    int result = WEAR_SUCCESS;
+    for (uint32_t sector = 0; sector < WEAR_SECTORS; sector++) {
+        if (!dirty_sectors[sector]) {
+            continue;
+        }
+        // Cleared first: erases counted while the sector is written mark it again.
+        dirty_sectors[sector] = 0;
+        uint32_t copy = saved_wear.copy[sector] ^ 1;
+        uint32_t crc;
+        if (wear_write_sector(sector, copy, &crc) != WEAR_SUCCESS) {
+            printf("Error: Failed to write wear sector %u.\n", sector);
+            dirty_sectors[sector] = 1;
+            result = WEAR_IO_ERROR;
+            break;
+        }
+        saved_wear.copy[sector] = copy;
+        saved_wear.crc[sector] = crc;
+    }
+    *checkpoint = saved_wear;
+    return result;
+}
+
+
+/**
+ * Replaces the counts with those saved by a checkpoint. Every sector is checked against its
+ * CRC before anything is changed.
+ *
+ * @return WEAR_SUCCESS, or WEAR_CORRUPTED if a sector does not match; the counts are then
+ *         left as they were.
+ */
+int wear_table_load(const wear_checkpoint *checkpoint) {
+    for (uint32_t sector = 0; sector < WEAR_SECTORS; sector++) {
+        const uint8_t *data = (const uint8_t *)(XIP_BASE + wear_sector_offset(sector, checkpoint->copy[sector] & 1));
+        if (checkpoint->copy[sector] > 1 || block_log_crc32(0, data, FILESYSTEM_BLOCK_SIZE) != checkpoint->crc[sector]) {
+            printf("Warning: Wear sector %u of the checkpoint is corrupted.\n", sector);
+            return WEAR_CORRUPTED;
+        }
+    }
+
+    mutex_enter_blocking(&wear_mutex);
+    for (uint32_t sector = 0; sector < WEAR_SECTORS; sector++) {
+        const uint32_t *counts = (const uint32_t *)(XIP_BASE + wear_sector_offset(sector, checkpoint->copy[sector]));
+        uint32_t first = sector * WEAR_SECTOR_ENTRIES;
+        uint32_t n = (TOTAL_BLOCKS - first < WEAR_SECTOR_ENTRIES) ? TOTAL_BLOCKS - first : WEAR_SECTOR_ENTRIES;
+        memcpy(erase_counts + first, counts, n * sizeof(uint32_t));
+    }
+    max_count = 0;
+    for (uint32_t block = WEAR_FIRST_DATA_BLOCK; block < TOTAL_BLOCKS; block++) {
+        max_count = (erase_counts[block] > max_count) ? erase_counts[block] : max_count;
+    }
+    memset(dirty_sectors, 0, sizeof(dirty_sectors));
+    saved_wear = *checkpoint;
+    mutex_exit(&wear_mutex);
+    return WEAR_SUCCESS;
+}
+
+
+/**
+ * Summarizes the erase counts of the blocks the allocator hands out.
+ */
+void wear_table_get_stats(wear_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->min = UINT32_MAX;
+    uint64_t total = 0;
+    for (uint32_t block = WEAR_FIRST_DATA_BLOCK; block < TOTAL_BLOCKS; block++) {
+        uint32_t count = erase_counts[block];
+        stats->min = (count < stats->min) ? count : stats->min;
+        stats->max = (count > stats->max) ? count : stats->max;
+        total += count;
+        stats->blocks++;
+    }
+    if (stats->blocks == 0) {
+        stats->min = 0;
+        return;
+    }
+    stats->total = (uint32_t)total;
+    stats->mean = (uint32_t)(total / stats->blocks);
+}
+
+
+/**
+ * Sorts the blocks the allocator hands out into buckets of equal width by erase count.
+ *
+ * @param buckets Receives bucket_count counts of blocks; bucket i holds the blocks erased
+ *                i * width to (i + 1) * width - 1 times.
+ * @param bucket_count Number of buckets, at least 1.
+ * @return The width of each bucket, chosen so that the most worn block falls in the last.
+ */
+uint32_t wear_table_histogram(uint32_t *buckets, uint32_t bucket_count) {
+    wear_stats stats;
+    wear_table_get_stats(&stats);
+    uint32_t width = stats.max / bucket_count + 1;
+    memset(buckets, 0, bucket_count * sizeof(uint32_t));
+    for (uint32_t block = WEAR_FIRST_DATA_BLOCK; block < TOTAL_BLOCKS; block++) {
+        buckets[erase_counts[block] / width]++;
+    }
+    return width;
+}
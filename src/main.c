@@ -3,8 +3,24 @@
 #include "pico/stdlib.h"
 #include "../filesystem/filesystem.h"  
  #include "../tests/filesystem_test.h" 
+#include "../tests/flash_ops_test.h"
 #include "../tests/fat_fs_test.h"
 #include "../tests/filesystem_helper_test.h"
+#include "../tests/flash_cache_test.h"
+#include "../tests/block_log_test.h"
+#include "../tests/meta_journal_test.h"
+#include "../tests/mount_test.h"
+#include "../tests/wear_table_test.h"
+#include "../tests/wear_level_test.h"
+#include "../tests/flush_worker_test.h"
+#include "../tests/fs_async_test.h"
+#include "../tests/concurrency_test.h"
+#include "../tests/ring_log_test.h"
+#include "../tests/dentry_cache_test.h"
+#include "../tests/readdir_test.h"
+#include "../tests/visual_test.h"
+#include "../tests/cow_test.h"
+#include "../tests/cp_deep_test.h"
 
 
 int main() {
@@ -30,9 +46,25 @@ int main() {
      printf("Testing write, read, and erase cycle...\n");
     
    
-    //run_all_tests_filesystem();
+    run_all_tests_flash_ops();
+    run_all_tests_filesystem();
     run_all_tests_FAT();
     run_all_tests_filesystem_Helper();
+    run_all_tests_flash_cache();
+    run_all_tests_block_log();
+    run_all_tests_meta_journal();
+    run_all_tests_mount();
+    run_all_tests_wear_table();
+    run_all_tests_wear_level();
+    run_all_tests_flush_worker();
+    run_all_tests_fs_async();
+    run_all_tests_concurrency();
+    run_all_tests_ring_log();
+    run_all_tests_dentry_cache();
+    run_all_tests_readdir();
+    run_all_tests_visual();
+    run_all_tests_cow();
+    run_all_tests_cp_deep();
 
 
     printf("File closed after reading.\n");
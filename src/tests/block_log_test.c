@@ -0,0 +1,291 @@
+
+
+#include "../flash/block_log.h"
+#include "../flash/flash_cache.h"
+#include "../flash/flash_ops.h"
+#include "../FAT/fat_fs.h"
+#include "../filesystem/filesystem.h"
+#include "../tests/block_log_test.h"
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "hardware/flash.h"
+#include "pico/time.h"
+
+
+void run_all_tests_block_log() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_block_log_append_fills_payload();
+    printf("%s", slashes);
+    test_block_log_overwrite_relocates();
+    printf("%s", slashes);
+    test_block_log_file_spans_blocks();
+    printf("%s", slashes);
+    test_block_log_bulk_write_benchmark();
+    printf("%s", slashes);
+    test_block_log_reserve_extent();
+    printf("%s", slashes);
+}
+
+
+
+
+/**
+ * Fills a whole payload with small appends and checks that no erase was needed, that the
+ * block was sealed and that its CRC matches.
+ */
+void test_block_log_append_fills_payload() {
+    printf("Testing block log appends up to a full payload...\n");
+    uint32_t block = block_log_allocate();
+
+    flash_cache_sync();
+    flash_reset_op_stats();
+    block_log_reset_stats();
+
+    uint8_t record[255];
+    uint32_t pos = 0;
+    for (int i = 0; pos < FS_BLOCK_PAYLOAD_SIZE; i++) {
+        memset(record, i, sizeof(record));
+        uint32_t original = block;
+        block_log_write(&block, pos, pos, record, sizeof(record), 42);
+        if (block != original) {
+            break;
+        }
+        pos += sizeof(record);
+    }
+    flash_cache_sync();
+
+    flash_op_stats ops;
+    block_log_stats stats;
+    block_trailer trailer;
+    flash_get_op_stats(&ops);
+    block_log_get_stats(&stats);
+    bool sealed = block_log_read_trailer(block, &trailer);
+    printf("Erases: %u, pages programmed: %u, in place: %u, relocations: %u\n",
+           ops.erases, ops.pages_programmed, stats.in_place_writes, stats.relocations);
+
+    if (pos == FS_BLOCK_PAYLOAD_SIZE && ops.erases == 0 && sealed && trailer.owner_id == 42
+        && trailer.length == FS_BLOCK_PAYLOAD_SIZE && block_log_verify(block)) {
+        printf("Block Log Append Test Passed - %u bytes appended without an erase.\n", pos);
+    } else {
+        printf("Block Log Append Test Failed - Payload not filled in place or trailer invalid.\n");
+    }
+
+    block_log_retire(block);
+    block_log_reclaim();
+}
+
+
+/**
+ * Overwrites bytes that are already on flash and checks that the data moves to a fresh
+ * block while the old block is left untouched until it is reclaimed.
+ */
+void test_block_log_overwrite_relocates() {
+    printf("Testing block log relocation on overwrite...\n");
+    uint32_t block = block_log_allocate();
+    uint32_t original = block;
+
+    const char *first = "first version of the data";
+    block_log_write(&block, 0, 0, (const uint8_t *)first, strlen(first), 7);
+    flash_cache_sync();
+
+    block_log_write(&block, strlen(first), 0, (const uint8_t *)"FIRST", 5, 7);
+    block_log_retire(original);
+    flash_cache_sync();
+
+    // Until it is reclaimed, the old block must still hold the old data untouched.
+    bool old_intact = memcmp((const void *)(XIP_BASE + original * FILESYSTEM_BLOCK_SIZE), first, strlen(first)) == 0;
+    int reclaimed = block_log_reclaim();
+
+    char buffer[32] = {0};
+    flash_cache_read(block * FILESYSTEM_BLOCK_SIZE, (uint8_t *)buffer, strlen(first));
+    printf("Old block: %u, new block: %u, read '%s'\n", original, block, buffer);
+
+    if (block != original && old_intact && reclaimed == 1
+        && strcmp(buffer, "FIRST version of the data") == 0) {
+        printf("Block Log Relocation Test Passed - Overwrite went to a fresh block.\n");
+    } else {
+        printf("Block Log Relocation Test Failed - Overwrite was not relocated as expected.\n");
+    }
+
+    block_log_retire(block);
+    block_log_reclaim();
+}
+
+
+/**
+ * Writes a file that spans several blocks through the filesystem API and reads it back,
+ * checking that every block carries exactly FS_BLOCK_PAYLOAD_SIZE bytes of file data.
+ */
+void test_block_log_file_spans_blocks() {
+    printf("Testing file data across block payloads...\n");
+    FS_FILE *file = fs_open("/blockLogTest.bin", "w");
+    if (file == NULL) {
+        printf("Block Log File Test Failed - Could not open file.\n");
+        return;
+    }
+
+    static uint8_t data[FS_BLOCK_PAYLOAD_SIZE * 2 + 500];
+    static uint8_t readBack[sizeof(data)];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 13);
+    }
+    int written = fs_write(file, data, sizeof(data));
+
+    // Overwrite a range that crosses the first block boundary.
+    fs_seek(file, FS_BLOCK_PAYLOAD_SIZE - 8, SEEK_SET);
+    memset(data + FS_BLOCK_PAYLOAD_SIZE - 8, 0x5A, 16);
+    fs_write(file, data + FS_BLOCK_PAYLOAD_SIZE - 8, 16);
+
+    // Read back through a handle in read mode on the same entry.
+    file->mode = 'r';
+    fs_seek(file, 0, SEEK_SET);
+    int read = fs_read(file, readBack, sizeof(readBack));
+    fs_sync();
+
+    uint32_t second;
+    fat_get_next_block(file->entry->start_block, &second);
+    if (written == (int)sizeof(data) && read == (int)sizeof(data) && memcmp(data, readBack, sizeof(data)) == 0
+        && block_log_verify(file->entry->start_block) && block_log_verify(second)) {
+        printf("Block Log File Test Passed - %d bytes over %u-byte payloads.\n", read, FS_BLOCK_PAYLOAD_SIZE);
+    } else {
+        printf("Block Log File Test Failed - Written %d, read %d.\n", written, read);
+    }
+    fs_close(file);
+}
+
+
+
+/**
+ * Writes 32 blocks (about 128 KB) twice over the same contiguous run: once block by block
+ * through flash_write_safe(), which erases and programs each sector separately, and once
+ * with block_log_write_run(). Reports the throughput of both paths in MB/s and checks that
+ * the batched path is not the slower one. Host builds count the flash model's erase and
+ * program times, as the comparison is meaningless without them.
+ */
+void test_block_log_bulk_write_benchmark() {
+    printf("Benchmarking per-block writes against batched run writes...\n");
+    const uint32_t count = 32;
+    uint32_t first = fat_allocate_extent(count, 0);
+    if (first == FAT_NO_FREE_BLOCKS) {
+        printf("Block Log Bulk Test Failed - No contiguous run of %u blocks.\n", count);
+        return;
+    }
+
+    // Like a firmware upload, the source data is read straight from flash (the program image).
+    const uint8_t *source = (const uint8_t *)XIP_BASE;
+
+#if !PICO_ON_DEVICE
+    bool timing = flash_model_set_timing(true);
+#endif
+
+    // Old path: one erase and one program per block, with a header in front of the data.
+    size_t chunk = FLASH_SECTOR_SIZE - sizeof(flash_data);
+    uint64_t start = time_us_64();
+    for (uint32_t i = 0; i < count; i++) {
+        flash_write_safe((first + i) * FILESYSTEM_BLOCK_SIZE, source + i * chunk, chunk);
+    }
+    uint64_t per_block_us = time_us_64() - start;
+
+    // Batched path over the same, now dirty, run.
+    flash_reset_op_stats();
+    start = time_us_64();
+    int result = block_log_write_run(first, count, source, 99);
+    uint64_t batched_us = time_us_64() - start;
+
+#if !PICO_ON_DEVICE
+    flash_model_set_timing(timing);
+#endif
+
+    flash_op_stats ops;
+    flash_get_op_stats(&ops);
+
+    bool matches = (result == BLOCK_LOG_SUCCESS);
+    for (uint32_t i = 0; i < count && matches; i++) {
+        matches = memcmp((const void *)(XIP_BASE + (first + i) * FILESYSTEM_BLOCK_SIZE),
+                         source + i * FS_BLOCK_PAYLOAD_SIZE, FS_BLOCK_PAYLOAD_SIZE) == 0
+                  && block_log_verify(first + i);
+    }
+
+    double per_block_mbps = per_block_us ? (double)(count * chunk) / per_block_us : 0;
+    double batched_mbps = batched_us ? (double)(count * FS_BLOCK_PAYLOAD_SIZE) / batched_us : 0;
+    printf("Per-block path: %u bytes in %" PRIu64 " us (%.3f MB/s)\n", (unsigned)(count * chunk), per_block_us, per_block_mbps);
+    printf("Batched path: %u bytes in %" PRIu64 " us (%.3f MB/s)\n", count * FS_BLOCK_PAYLOAD_SIZE, batched_us, batched_mbps);
+    printf("Batched path - sector erases: %u, 64 KB erases: %u, pages programmed: %u\n",
+           ops.erases, ops.block_erases, ops.pages_programmed);
+
+    if (matches && ops.block_erases >= 1 && batched_us <= per_block_us) {
+        printf("Block Log Bulk Test Passed - Run written with block erases and batched programs, %.1fx the per-block throughput.\n",
+               batched_mbps / per_block_mbps);
+    } else {
+        printf("Block Log Bulk Test Failed - Run data, erase pattern or throughput not as expected.\n");
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        fat_free_block(first + i);
+    }
+}
+
+
+
+/**
+ * Reserves room for a file with fs_reserve(), fills it, and checks that the data landed on
+ * one contiguous extent that reads and maps back correctly at any offset.
+ */
+void test_block_log_reserve_extent() {
+    printf("Testing reserved contiguous extents...\n");
+    FS_FILE *file = fs_open("/reserveTest.bin", "w");
+    if (file == NULL) {
+        printf("Block Log Reserve Test Failed - Could not open file.\n");
+        return;
+    }
+
+    static uint8_t data[FS_BLOCK_PAYLOAD_SIZE * 6 + 100];
+    static uint8_t readBack[64];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7 + 3);
+    }
+
+    int reserved = fs_reserve(file, sizeof(data));
+    // Small writes go into the reserved, already erased blocks without any relocation.
+    block_log_reset_stats();
+    int written = 0;
+    for (size_t offset = 0; offset < sizeof(data); offset += 1000) {
+        size_t chunk = (sizeof(data) - offset < 1000) ? sizeof(data) - offset : 1000;
+        written += fs_write(file, data + offset, chunk);
+    }
+    block_log_stats stats;
+    block_log_get_stats(&stats);
+
+    // Every block of the file should be start_block + i.
+    bool contiguous = (file->entry->extent_blocks == 7);
+    uint32_t block = file->entry->start_block;
+    for (uint32_t i = 1; i < 7 && contiguous; i++) {
+        uint32_t next;
+        contiguous = fat_get_next_block(block, &next) == FAT_SUCCESS && next == block + 1;
+        block = next;
+    }
+
+    // Read and map at offsets spread over the whole file.
+    file->mode = 'r';
+    bool matches = true;
+    for (uint32_t offset = 5; offset + sizeof(readBack) < sizeof(data) && matches; offset += 3001) {
+        const void *mapped;
+        fs_seek(file, offset, SEEK_SET);
+        matches = fs_read(file, readBack, sizeof(readBack)) == (int)sizeof(readBack)
+                  && memcmp(readBack, data + offset, sizeof(readBack)) == 0
+                  && fs_map(file, offset, 1, &mapped) == 1
+                  && *(const uint8_t *)mapped == data[offset];
+    }
+    fs_sync();
+
+    if (reserved == 0 && written == (int)sizeof(data) && stats.relocations == 0 && contiguous && matches) {
+        printf("Block Log Reserve Test Passed - %d bytes on a %u-block extent.\n", written, file->entry->extent_blocks);
+    } else {
+        printf("Block Log Reserve Test Failed - Reserve %d, written %d, relocations %u, extent %u blocks.\n",
+               reserved, written, stats.relocations, file->entry->extent_blocks);
+    }
+    fs_close(file);
+}
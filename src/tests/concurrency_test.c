@@ -0,0 +1,311 @@
+#include "../FAT/fat_fs.h"
+#include "../flash/flush_worker.h"
+#include "../filesystem/filesystem.h"
+#include "../directory/directories.h"
+#include "../tests/concurrency_test.h"
+#include <stdio.h>
+#include <string.h>
+#include "pico/time.h"
+
+#if PICO_ON_DEVICE
+#include "pico/multicore.h"
+#include "pico/flash.h"
+#else
+#include <pthread.h>
+#endif
+
+// Each writer of the stress benchmark appends this many records to a file of its own.
+#define CONCURRENCY_TEST_RECORDS 512
+#define CONCURRENCY_TEST_RECORD_SIZE 128
+// Directories created by the main core while the other one writes.
+#define CONCURRENCY_TEST_DIRECTORIES 8
+
+
+void run_all_tests_concurrency() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_concurrency_core_cursors();
+    printf("%s", slashes);
+    test_concurrency_metadata_while_writing();
+    printf("%s", slashes);
+    test_concurrency_two_writer_scaling();
+    printf("%s", slashes);
+}
+
+
+
+
+/**
+ * One writer of the stress benchmark.
+ */
+typedef struct {
+    FS_FILE *file;
+    uint32_t core;        // Core whose allocation cursor the writer uses.
+    uint32_t seed;        // Makes the records of each writer different.
+    bool ok;
+} writer_job;
+
+
+/**
+ * Fills a record with bytes that depend on the writer and the record number.
+ */
+static void make_record(uint8_t *record, uint32_t seed, int index) {
+    for (int i = 0; i < CONCURRENCY_TEST_RECORD_SIZE; i++) {
+        record[i] = (uint8_t)(seed * 31 + index * 7 + i);
+    }
+}
+
+
+static void writer_run(writer_job *job) {
+    uint8_t record[CONCURRENCY_TEST_RECORD_SIZE];
+    fat_bind_core(job->core);
+    job->ok = true;
+    for (int i = 0; i < CONCURRENCY_TEST_RECORDS && job->ok; i++) {
+        make_record(record, job->seed, i);
+        job->ok = fs_write(job->file, record, sizeof(record)) == (int)sizeof(record);
+    }
+}
+
+
+/**
+ * Runs a job on the other core (a thread on the host) while the caller runs another
+ * function, and waits for both. The flush worker has to be stopped, since it would hold
+ * core 1 otherwise.
+ */
+#if PICO_ON_DEVICE
+static writer_job *core1_job;
+static volatile bool core1_done;
+
+static void core1_entry(void) {
+    // Lets core 0 pause this core while it erases or programs, and the other way round.
+    flash_safe_execute_core_init();
+    writer_run(core1_job);
+    flash_safe_execute_core_deinit();
+    core1_done = true;
+    __sev();
+}
+
+static void run_beside(writer_job *job, void (*local)(void *), void *context) {
+    core1_job = job;
+    core1_done = false;
+    multicore_launch_core1(core1_entry);
+    local(context);
+    while (!core1_done) {
+        __wfe();
+    }
+    multicore_reset_core1();
+}
+#else
+static void *writer_thread_entry(void *job) {
+    writer_run((writer_job *)job);
+    return NULL;
+}
+
+static void run_beside(writer_job *job, void (*local)(void *), void *context) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writer_thread_entry, job) != 0) {
+        job->ok = false;
+        local(context);
+        return;
+    }
+    local(context);
+    pthread_join(thread, NULL);
+}
+#endif
+
+
+static void writer_local(void *job) {
+    writer_run((writer_job *)job);
+}
+
+
+/**
+ * Checks that a file holds exactly the records of a writer.
+ */
+static bool records_intact(const char *path, uint32_t seed) {
+    FS_FILE *file = fs_open(path, "r");
+    bool ok = (file != NULL && file->entry->size == CONCURRENCY_TEST_RECORDS * CONCURRENCY_TEST_RECORD_SIZE);
+    uint8_t expected[CONCURRENCY_TEST_RECORD_SIZE];
+    uint8_t actual[CONCURRENCY_TEST_RECORD_SIZE];
+    for (int i = 0; i < CONCURRENCY_TEST_RECORDS && ok; i++) {
+        make_record(expected, seed, i);
+        ok = fs_read(file, actual, sizeof(actual)) == (int)sizeof(actual)
+            && memcmp(expected, actual, sizeof(actual)) == 0;
+    }
+    if (file != NULL) {
+        fs_close(file);
+    }
+    return ok;
+}
+
+
+/**
+ * Sums the lock contention counters of every FAT region.
+ */
+static uint32_t region_contention(void) {
+    uint32_t contended = 0;
+    for (uint32_t r = 0; r < FAT_REGIONS; r++) {
+        fat_region_stats stats;
+        fat_get_region_stats(r, &stats);
+        contended += stats.contended;
+    }
+    return contended;
+}
+
+
+/**
+ * Each core allocates from a cursor of its own, and the cursors start in different FAT
+ * regions: core 1 takes blocks from the start of its region onwards, core 0 from below it.
+ */
+void test_concurrency_core_cursors() {
+    printf("Testing that each core allocates from its own FAT region...\n");
+    fs_init();
+
+    uint32_t first0 = fat_allocate_block();
+    fat_bind_core(1);
+    uint32_t first1 = fat_allocate_block();
+    uint32_t second1 = fat_allocate_block();
+    fat_bind_core(0);
+    uint32_t second0 = fat_allocate_block();
+
+    bool ok = first0 < fat_core_start_block(1) && second0 == first0 + 1
+        && first1 == fat_core_start_block(1) && second1 == first1 + 1;
+    fat_free_block(first0);
+    fat_free_block(second0);
+    fat_free_block(first1);
+    fat_free_block(second1);
+
+    if (ok) {
+        printf("Concurrency Test Passed - core 0 allocated %u, %u and core 1 %u, %u.\n",
+               first0, second0, first1, second1);
+    } else {
+        printf("Concurrency Test Failed - core 0 allocated %u, %u and core 1 %u, %u.\n",
+               first0, second0, first1, second1);
+    }
+}
+
+
+/**
+ * Creates a directory and a small file at a time, as the main core does in the next test.
+ */
+static void create_directories(void *result) {
+    bool *ok = (bool *)result;
+    char path[32];
+    for (int i = 0; i < CONCURRENCY_TEST_DIRECTORIES && *ok; i++) {
+        snprintf(path, sizeof(path), "/root/busyDir%d", i);
+        *ok = fs_create_directory(path);
+        snprintf(path, sizeof(path), "/root/busyNote%d", i);
+        FS_FILE *note = fs_open(path, "w");
+        *ok = *ok && note != NULL && fs_write(note, path, strlen(path)) == (int)strlen(path);
+        if (note != NULL) {
+            fs_close(note);
+        }
+    }
+}
+
+/**
+ * Creates directories and opens and closes files while the other core writes: the metadata
+ * changes wait for the writer only between its writes, and the data stays intact.
+ */
+void test_concurrency_metadata_while_writing() {
+    printf("Testing metadata changes while another core writes...\n");
+    fs_init();
+    flush_worker_stop();
+
+    writer_job job = { fs_open("/root/busyLog", "w"), 1, 3, false };
+    bool created = (job.file != NULL);
+    if (created) {
+        run_beside(&job, create_directories, &created);
+        fs_close(job.file);
+    }
+
+    bool intact = job.ok && records_intact("/root/busyLog", 3);
+    char path[32];
+    for (int i = 0; i < CONCURRENCY_TEST_DIRECTORIES && created; i++) {
+        snprintf(path, sizeof(path), "/root/busyNote%d", i);
+        FS_FILE *note = fs_open(path, "r");
+        char text[32] = { 0 };
+        created = note != NULL && fs_read(note, text, sizeof(text) - 1) == (int)strlen(path)
+            && strcmp(text, path) == 0;
+        if (note != NULL) {
+            fs_close(note);
+        }
+    }
+
+    if (intact && created) {
+        printf("Concurrency Test Passed - %d directories created during the write, data intact.\n",
+               CONCURRENCY_TEST_DIRECTORIES);
+    } else {
+        printf("Concurrency Test Failed - writer %s, directories %s.\n",
+               intact ? "intact" : "corrupted", created ? "created" : "missing");
+    }
+}
+
+
+/**
+ * Stress benchmark: two writers each append CONCURRENCY_TEST_RECORDS records to a file of
+ * their own, first one after the other on one core and then at the same time on both cores.
+ * Prints the throughput of both runs, the scaling between them and how often a FAT region
+ * lock was found taken. Passes if every record of both runs reads back intact; the scaling
+ * depends on how much of a write is spent in flash commands, which are serialised.
+ */
+void test_concurrency_two_writer_scaling() {
+    printf("Testing write throughput of one and two writers...\n");
+    const uint32_t bytes = 2 * CONCURRENCY_TEST_RECORDS * CONCURRENCY_TEST_RECORD_SIZE;
+
+    fs_init();
+    flush_worker_stop();
+    writer_job a = { fs_open("/root/soloA", "w"), 0, 1, false };
+    writer_job b = { fs_open("/root/soloB", "w"), 0, 2, false };
+    bool ok = (a.file != NULL && b.file != NULL);
+    uint64_t began = time_us_64();
+    if (ok) {
+        writer_run(&a);
+        writer_run(&b);
+    }
+    uint64_t solo_us = time_us_64() - began;
+    if (a.file != NULL) {
+        fs_close(a.file);
+    }
+    if (b.file != NULL) {
+        fs_close(b.file);
+    }
+    ok = ok && a.ok && b.ok && records_intact("/root/soloA", 1) && records_intact("/root/soloB", 2);
+
+    fs_init();
+    flush_worker_stop();
+    writer_job c = { fs_open("/root/pairA", "w"), 0, 1, false };
+    writer_job d = { fs_open("/root/pairB", "w"), 1, 2, false };
+    bool pair_ok = (c.file != NULL && d.file != NULL);
+    began = time_us_64();
+    if (pair_ok) {
+        run_beside(&d, writer_local, &c);
+    }
+    uint64_t pair_us = time_us_64() - began;
+    uint32_t contended = region_contention();
+    if (c.file != NULL) {
+        fs_close(c.file);
+    }
+    if (d.file != NULL) {
+        fs_close(d.file);
+    }
+    pair_ok = pair_ok && c.ok && d.ok && records_intact("/root/pairA", 1) && records_intact("/root/pairB", 2);
+
+    uint32_t solo_kbs = (uint32_t)((uint64_t)bytes * 1000000 / 1024 / (solo_us > 0 ? solo_us : 1));
+    uint32_t pair_kbs = (uint32_t)((uint64_t)bytes * 1000000 / 1024 / (pair_us > 0 ? pair_us : 1));
+    printf("One writer:  %u bytes in %u us, %u KB/s\n", bytes, (unsigned)solo_us, solo_kbs);
+    printf("Two writers: %u bytes in %u us, %u KB/s, FAT region lock contended %u times\n",
+           bytes, (unsigned)pair_us, pair_kbs, contended);
+    printf("Scaling from one to two writers: %u.%02ux\n",
+           pair_kbs / (solo_kbs > 0 ? solo_kbs : 1),
+           (pair_kbs * 100 / (solo_kbs > 0 ? solo_kbs : 1)) % 100);
+
+    if (ok && pair_ok) {
+        printf("Concurrency Test Passed - both runs intact, %u KB/s with one writer and %u KB/s with two.\n",
+               solo_kbs, pair_kbs);
+    } else {
+        printf("Concurrency Test Failed - one writer %s, two writers %s.\n",
+               ok ? "intact" : "corrupted", pair_ok ? "intact" : "corrupted");
+    }
+}
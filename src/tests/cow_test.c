@@ -0,0 +1,340 @@
+#include "../filesystem/filesystem.h"
+#include "../directory/directories.h"
+#include "../flash/block_log.h"
+#include "../flash/flush_worker.h"
+#include "../FAT/fat_fs.h"
+#include "../tests/cow_test.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hardware/flash.h"
+#include "pico/time.h"
+
+// Size of the large file copied by the benchmark, and the blocks of the copy rewritten.
+#define COW_TEST_LARGE_BYTES (1024 * 1024)
+#define COW_TEST_REWRITTEN_BLOCKS 4
+// Most flash commands a copy is expected to make; the power cut test gives up after these.
+#define COW_TEST_MAX_CUTS 64
+
+
+void run_all_tests_cow() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_cow_copies_are_independent();
+    printf("%s", slashes);
+    test_cow_blocks_freed_with_last_copy();
+    printf("%s", slashes);
+    test_cow_copy_large_file();
+    printf("%s", slashes);
+    test_cow_wipe_keeps_copy();
+    printf("%s", slashes);
+    test_cow_copy_is_atomic();
+    printf("%s", slashes);
+}
+
+
+
+
+/**
+ * The byte at an offset of a file written by write_pattern(); seed tells files apart.
+ */
+static uint8_t pattern_byte(uint32_t offset, uint8_t seed) {
+    return (uint8_t)((offset * 7u + (offset >> 8)) ^ seed);
+}
+
+/**
+ * Writes size bytes of a pattern to a new file, in pieces of 4 KB.
+ */
+static bool write_pattern(const char* path, uint32_t size, uint8_t seed) {
+    FS_FILE* file = fs_open(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    uint8_t buffer[4096];
+    bool ok = true;
+    for (uint32_t offset = 0; offset < size && ok; offset += sizeof(buffer)) {
+        uint32_t length = (size - offset < sizeof(buffer)) ? size - offset : sizeof(buffer);
+        for (uint32_t i = 0; i < length; i++) {
+            buffer[i] = pattern_byte(offset + i, seed);
+        }
+        ok = fs_write(file, buffer, length) == (int)length;
+    }
+    fs_close(file);
+    return ok;
+}
+
+/**
+ * Checks length bytes of a file from an offset against the pattern, except for the bytes
+ * in [patched, patched + patchedLength), which must hold patch instead.
+ */
+static bool holds_pattern(const char* path, uint32_t offset, uint32_t length, uint8_t seed,
+                          uint32_t patched, uint32_t patchedLength, uint8_t patch) {
+    FS_FILE* file = fs_open(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    uint8_t buffer[512];
+    bool ok = fs_seek(file, offset, SEEK_SET) == 0;
+    for (uint32_t done = 0; done < length && ok; ) {
+        uint32_t piece = (length - done < sizeof(buffer)) ? length - done : sizeof(buffer);
+        ok = fs_read(file, buffer, piece) == (int)piece;
+        for (uint32_t i = 0; i < piece && ok; i++) {
+            uint32_t at = offset + done + i;
+            bool inPatch = at >= patched && at < patched + patchedLength;
+            ok = buffer[i] == (inPatch ? patch : pattern_byte(at, seed));
+        }
+        done += piece;
+    }
+    fs_close(file);
+    return ok;
+}
+
+/**
+ * Overwrites length bytes of an existing file from an offset with one value.
+ */
+static bool patch_file(const char* path, uint32_t offset, uint32_t length, uint8_t value) {
+    FS_FILE* file = fs_open(path, "a");
+    if (file == NULL) {
+        return false;
+    }
+    uint8_t buffer[512];
+    memset(buffer, value, sizeof(buffer));
+    bool ok = fs_seek(file, offset, SEEK_SET) == 0;
+    for (uint32_t done = 0; done < length && ok; ) {
+        uint32_t piece = (length - done < sizeof(buffer)) ? length - done : sizeof(buffer);
+        ok = fs_write(file, buffer, piece) == (int)piece;
+        done += piece;
+    }
+    fs_close(file);
+    return ok;
+}
+
+/**
+ * Free blocks once the blocks retired so far have been erased and returned to the FAT.
+ */
+static uint32_t settled_free_blocks(void) {
+    fs_sync();
+    return fat_free_block_count();
+}
+
+
+/**
+ * A copy and its source share their blocks until one of them is written: a write to the
+ * copy leaves the source as it was and the other way round, also after a remount, which
+ * counts the shared blocks again.
+ */
+void test_cow_copies_are_independent() {
+    printf("Testing that writes to a copy and its source stay apart...\n");
+    fs_init();
+
+    const uint32_t size = 3 * FS_BLOCK_PAYLOAD_SIZE;
+    bool ok = fs_create_directory("/root/orig") && fs_create_directory("/root/snap")
+        && write_pattern("/root/orig/data", size, 0x11)
+        && fs_cp("/root/orig/data", "/root/snap/data") == 0;
+    bool shared = ok && fat_shared_block_count() > 0
+        && holds_pattern("/root/snap/data", 0, size, 0x11, 0, 0, 0);
+
+    // The copy's first block and then the source's second block are written.
+    ok = ok && patch_file("/root/snap/data", 10, 100, 0xC0) && patch_file("/root/orig/data", FS_BLOCK_PAYLOAD_SIZE + 10, 100, 0x0C);
+    bool apart = ok && holds_pattern("/root/snap/data", 0, size, 0x11, 10, 100, 0xC0)
+        && holds_pattern("/root/orig/data", 0, size, 0x11, FS_BLOCK_PAYLOAD_SIZE + 10, 100, 0x0C);
+
+    // The third block is still shared; the remount has to find that out again.
+    uint32_t sharedBefore = fat_shared_block_count();
+    bool remounted = ok && fs_unmount() == 0 && fs_mount() == 0
+        && fat_shared_block_count() == sharedBefore && sharedBefore > 0
+        && holds_pattern("/root/snap/data", 0, size, 0x11, 10, 100, 0xC0)
+        && holds_pattern("/root/orig/data", 0, size, 0x11, FS_BLOCK_PAYLOAD_SIZE + 10, 100, 0x0C);
+    bool lastBlock = remounted && patch_file("/root/orig/data", 2 * FS_BLOCK_PAYLOAD_SIZE, 10, 0x0D)
+        && holds_pattern("/root/snap/data", 2 * FS_BLOCK_PAYLOAD_SIZE, FS_BLOCK_PAYLOAD_SIZE, 0x11, 0, 0, 0)
+        && fat_shared_block_count() == 0;
+
+    if (shared && apart && remounted && lastBlock) {
+        printf("COW Test Passed - copy and source written apart, %u shared block counted again after remount.\n",
+               sharedBefore);
+    } else {
+        printf("COW Test Failed - shared %d, apart %d, after remount %d (%u shared blocks), last block %d.\n",
+               shared, apart, remounted, sharedBefore, lastBlock);
+    }
+}
+
+
+/**
+ * Removing the source keeps the copy readable, and removing the copy too gives every block
+ * of the file back to the FAT. Metadata written meanwhile may keep a block of its own, so
+ * the blocks are counted from after the source was written.
+ */
+void test_cow_blocks_freed_with_last_copy() {
+    printf("Testing that shared blocks are freed with the last copy...\n");
+    fs_init();
+
+    const uint32_t size = 5 * FS_BLOCK_PAYLOAD_SIZE + 123;
+    const uint32_t blocks = 6;
+    bool ok = fs_create_directory("/root/orig") && fs_create_directory("/root/snap")
+        && write_pattern("/root/orig/data", size, 0x22);
+    uint32_t written = settled_free_blocks();
+    ok = ok && fs_cp("/root/orig/data", "/root/snap/data") == 0;
+    uint32_t copied = settled_free_blocks();
+
+    ok = ok && fs_rm("/root/orig/data") == 0;
+    bool kept = ok && settled_free_blocks() == copied
+        && holds_pattern("/root/snap/data", 0, size, 0x22, 0, 0, 0);
+    ok = ok && fs_rm("/root/snap/data") == 0;
+    uint32_t freed = settled_free_blocks();
+
+    if (kept && freed == written + blocks && copied == written && fat_shared_block_count() == 0) {
+        printf("COW Test Passed - the copy took no blocks, and all %u blocks came back with the last copy.\n",
+               blocks);
+    } else {
+        printf("COW Test Failed - kept %d, free blocks %u written, %u copied, %u at end.\n",
+               kept, written, copied, freed);
+    }
+}
+
+
+/**
+ * Benchmark: copying a 1 MB file with fs_cp() against writing it, and rewriting the first
+ * blocks of the copy, which copies only those blocks. Prints both times; passes if the copy
+ * took no flash blocks, the rewrite cloned exactly the blocks it changed and the source kept
+ * its data.
+ */
+void test_cow_copy_large_file() {
+    printf("Testing a copy of a %d KB file...\n", COW_TEST_LARGE_BYTES / 1024);
+    fs_init();
+
+    bool ok = fs_create_directory("/root/orig") && fs_create_directory("/root/snap");
+    uint64_t began = time_us_64();
+    ok = ok && write_pattern("/root/orig/big", COW_TEST_LARGE_BYTES, 0x33);
+    uint32_t write_us = (uint32_t)(time_us_64() - began);
+    uint32_t written = settled_free_blocks();
+
+    began = time_us_64();
+    ok = ok && fs_cp("/root/orig/big", "/root/snap/big") == 0;
+    uint32_t copy_us = (uint32_t)(time_us_64() - began);
+    uint32_t copied = settled_free_blocks();
+    printf("Writing 1 MB: %u us, fs_cp(): %u us\n", write_us, copy_us);
+
+    block_log_stats before;
+    block_log_stats after;
+    block_log_get_stats(&before);
+    const uint32_t rewritten = COW_TEST_REWRITTEN_BLOCKS * FS_BLOCK_PAYLOAD_SIZE;
+    began = time_us_64();
+    ok = ok && patch_file("/root/snap/big", 0, rewritten, 0xEE);
+    uint32_t rewrite_us = (uint32_t)(time_us_64() - began);
+    block_log_get_stats(&after);
+    uint32_t clones = after.clones - before.clones;
+    printf("Rewriting %d blocks of the copy: %u us, %u blocks cloned\n", COW_TEST_REWRITTEN_BLOCKS, rewrite_us, clones);
+
+    bool apart = ok && holds_pattern("/root/orig/big", 0, 2 * rewritten, 0x33, 0, 0, 0)
+        && holds_pattern("/root/snap/big", 0, 2 * rewritten, 0x33, 0, rewritten, 0xEE)
+        && holds_pattern("/root/snap/big", COW_TEST_LARGE_BYTES - 1000, 1000, 0x33, 0, 0, 0);
+    ok = ok && fs_rm("/root/orig/big") == 0 && fs_rm("/root/snap/big") == 0;
+
+    if (ok && apart && copied == written && clones == COW_TEST_REWRITTEN_BLOCKS) {
+        printf("COW Test Passed - 1 MB copied in %u us without new blocks (written in %u us), %u blocks cloned on rewrite.\n",
+               copy_us, write_us, clones);
+    } else {
+        printf("COW Test Failed - steps %s, data apart %d, free blocks %u before and %u after the copy, %u clones.\n",
+               ok ? "succeeded" : "failed", apart, written, copied, clones);
+    }
+}
+
+
+/**
+ * fs_wipe() of a file whose blocks a copy shares leaves the copy readable, and wiping the
+ * copy too erases every block of the file and gives it back to the FAT.
+ */
+void test_cow_wipe_keeps_copy() {
+    printf("Testing fs_wipe() of a file and its copy...\n");
+    fs_init();
+
+    const uint32_t size = 3 * FS_BLOCK_PAYLOAD_SIZE + 200;
+    const uint32_t blocks = 4;
+    bool ok = fs_create_directory("/root/orig") && fs_create_directory("/root/snap")
+        && write_pattern("/root/orig/data", size, 0x44);
+    uint32_t written = settled_free_blocks();
+    // The blocks of the file, to look at once they are wiped.
+    uint32_t chain[4];
+    FS_FILE* file = ok ? fs_open("/root/orig/data", "r") : NULL;
+    ok = file != NULL;
+    uint32_t block = ok ? file->entry->start_block : FAT_ENTRY_END;
+    for (uint32_t i = 0; i < blocks && ok; i++) {
+        chain[i] = block;
+        ok = fat_get_next_block(block, &block) == FAT_SUCCESS;
+    }
+    ok = ok && block == FAT_ENTRY_END;
+    fs_close(file);
+    ok = ok && fs_cp("/root/orig/data", "/root/snap/data") == 0;
+
+    ok = ok && fs_wipe("/root/orig/data") == 0;
+    bool kept = ok && holds_pattern("/root/snap/data", 0, size, 0x44, 0, 0, 0)
+        && settled_free_blocks() == written;
+
+    ok = ok && fs_wipe("/root/snap/data") == 0;
+    bool erased = ok;
+    for (uint32_t i = 0; i < blocks && erased; i++) {
+        const uint8_t *flash = (const uint8_t *)(XIP_BASE + chain[i] * FILESYSTEM_BLOCK_SIZE);
+        for (uint32_t j = 0; j < FILESYSTEM_BLOCK_SIZE && erased; j++) {
+            erased = flash[j] == 0xFF;
+        }
+    }
+    bool freed = ok && fat_free_block_count() == written + blocks && fat_shared_block_count() == 0;
+
+    if (kept && erased && freed) {
+        printf("COW Test Passed - the copy outlived the wipe of its source, and all %u blocks were erased and freed with it.\n",
+               blocks);
+    } else {
+        printf("COW Test Failed - copy kept %d, blocks erased %d, blocks freed %d.\n", kept, erased, freed);
+    }
+}
+
+
+/**
+ * A copy is created and given its source's blocks in one journal commit. Host builds cut
+ * the power after each flash command fs_cp() makes in turn, then mount again: the copy is
+ * either missing or holds all of the source, and the source is untouched. The device cannot
+ * cut its own power, so there the test is skipped.
+ */
+void test_cow_copy_is_atomic() {
+    printf("Testing that a copy cut short by a power loss is all or nothing...\n");
+#if PICO_ON_DEVICE
+    printf("COW Atomic Copy Test Skipped - Needs the host flash model to cut the power.\n");
+#else
+    const uint32_t size = 2 * FS_BLOCK_PAYLOAD_SIZE + 100;
+    uint32_t commands = 0;
+    uint32_t missing = 0;
+    bool ok = true;
+    bool finished = false;
+    for (; ok && !finished && commands < COW_TEST_MAX_CUTS; commands++) {
+        fs_init();
+        flush_worker_stop();
+        ok = fs_create_directory("/root/cutFrom") && fs_create_directory("/root/cutTo")
+            && write_pattern("/root/cutFrom/data", size, 0x5A) && fs_sync() == 0;
+
+        flash_model_cut_power(commands);
+        int copied = fs_cp("/root/cutFrom/data", "/root/cutTo/data");
+        finished = !flash_model_cut_power(FLASH_MODEL_NO_POWER_CUT);
+
+        ok = ok && fs_mount() == 0 && holds_pattern("/root/cutFrom/data", 0, size, 0x5A, 0, 0, 0);
+        FS_FILE* copy = fs_open("/root/cutTo/data", "r");
+        if (copy == NULL) {
+            missing++;
+            ok = ok && !finished;
+        } else {
+            ok = ok && copy->entry->size == size;
+            fs_close(copy);
+            ok = ok && holds_pattern("/root/cutTo/data", 0, size, 0x5A, 0, 0, 0);
+        }
+        ok = ok && (!finished || copied == 0);
+    }
+
+    if (ok && finished && missing > 0) {
+        printf("COW Atomic Copy Test Passed - Power cut at each of %u flash commands: copy missing %u times, complete otherwise.\n",
+               commands - 1, missing);
+    } else {
+        printf("COW Atomic Copy Test Failed - A copy cut short after %u flash commands was left partly made.\n",
+               commands - 1);
+    }
+#endif
+}
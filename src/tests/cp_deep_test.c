@@ -0,0 +1,238 @@
+#include "../filesystem/filesystem.h"
+#include "../directory/directories.h"
+#include "../flash/block_log.h"
+#include "../FAT/fat_fs.h"
+#include "../tests/cp_deep_test.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico/time.h"
+
+// Size of the file copied by the benchmark; a source and two copies fit in 2 MB of flash.
+#define CP_DEEP_TEST_BYTES (512 * 1024)
+
+
+void run_all_tests_cp_deep() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_cp_deep_copies_data();
+    printf("%s", slashes);
+    test_cp_deep_source_changed();
+    printf("%s", slashes);
+    test_cp_deep_benchmark();
+    printf("%s", slashes);
+}
+
+
+
+
+/**
+ * The byte at an offset of a file written by write_pattern(); seed tells files apart.
+ */
+static uint8_t pattern_byte(uint32_t offset, uint8_t seed) {
+    return (uint8_t)((offset * 13u + (offset >> 9)) ^ seed);
+}
+
+/**
+ * Writes size bytes of a pattern to a file in pieces of 4 KB, from its start: a new file is
+ * created, an existing one is overwritten in place.
+ */
+static bool write_pattern(const char* path, bool existing, uint32_t size, uint8_t seed) {
+    FS_FILE* file = fs_open(path, existing ? "a" : "w");
+    if (file == NULL) {
+        return false;
+    }
+    uint8_t buffer[4096];
+    bool ok = fs_seek(file, 0, SEEK_SET) == 0;
+    for (uint32_t offset = 0; offset < size && ok; offset += sizeof(buffer)) {
+        uint32_t length = (size - offset < sizeof(buffer)) ? size - offset : sizeof(buffer);
+        for (uint32_t i = 0; i < length; i++) {
+            buffer[i] = pattern_byte(offset + i, seed);
+        }
+        ok = fs_write(file, buffer, length) == (int)length;
+    }
+    fs_close(file);
+    return ok;
+}
+
+/**
+ * Checks that a file holds exactly size bytes of the pattern.
+ */
+static bool holds_pattern(const char* path, uint32_t size, uint8_t seed) {
+    FS_FILE* file = fs_open(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    uint8_t buffer[512];
+    bool ok = file->entry->size == size;
+    for (uint32_t done = 0; done < size && ok; ) {
+        uint32_t piece = (size - done < sizeof(buffer)) ? size - done : sizeof(buffer);
+        ok = fs_read(file, buffer, piece) == (int)piece;
+        for (uint32_t i = 0; i < piece && ok; i++) {
+            ok = buffer[i] == pattern_byte(done + i, seed);
+        }
+        done += piece;
+    }
+    fs_close(file);
+    return ok;
+}
+
+/**
+ * Whether a file's blocks are one contiguous extent that no other file shares.
+ */
+static bool is_own_extent(const char* path, uint32_t blocks) {
+    FS_FILE* file = fs_open(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    bool own = file->entry->extent_blocks == blocks;
+    uint32_t block = file->entry->start_block;
+    for (uint32_t i = 0; i < blocks && own; i++) {
+        own = block == file->entry->start_block + i && !fat_block_shared(block)
+            && fat_get_next_block(block, &block) == FAT_SUCCESS;
+    }
+    fs_close(file);
+    return own && block == FAT_ENTRY_END;
+}
+
+
+/**
+ * fs_cp_deep() gives the copy the source's bytes on blocks of its own: writes to the source
+ * leave the copy alone, the copy's last block takes appends in place, and both survive a
+ * remount.
+ */
+void test_cp_deep_copies_data() {
+    printf("Testing fs_cp_deep()...\n");
+    fs_init();
+
+    const uint32_t size = 5 * FS_BLOCK_PAYLOAD_SIZE + 700;
+    bool ok = fs_create_directory("/root/orig") && fs_create_directory("/root/copy")
+        && write_pattern("/root/orig/data", false, size, 0x41)
+        && fs_cp_deep("/root/orig/data", "/root/copy/data") == 0;
+    bool copied = ok && holds_pattern("/root/copy/data", size, 0x41) && is_own_extent("/root/copy/data", 6);
+
+    // Rewrite the source; the copy keeps the old bytes.
+    ok = ok && write_pattern("/root/orig/data", true, size, 0x42);
+    bool apart = ok && holds_pattern("/root/copy/data", size, 0x41) && holds_pattern("/root/orig/data", size, 0x42);
+
+    // The copy's last block is open, so an append is written in place.
+    block_log_stats before;
+    block_log_stats after;
+    block_log_get_stats(&before);
+    FS_FILE* file = ok ? fs_open("/root/copy/data", "a") : NULL;
+    uint8_t tail[100];
+    for (uint32_t i = 0; i < sizeof(tail); i++) {
+        tail[i] = pattern_byte(size + i, 0x41);
+    }
+    ok = file != NULL && fs_write(file, tail, sizeof(tail)) == (int)sizeof(tail);
+    fs_close(file);
+    block_log_get_stats(&after);
+    bool inPlace = ok && after.relocations == before.relocations && after.in_place_writes > before.in_place_writes;
+
+    bool remounted = ok && fs_unmount() == 0 && fs_mount() == 0
+        && holds_pattern("/root/copy/data", size + sizeof(tail), 0x41) && holds_pattern("/root/orig/data", size, 0x42);
+
+    if (copied && apart && inPlace && remounted) {
+        printf("Deep Copy Test Passed - %u bytes copied onto 6 contiguous blocks of its own.\n", size);
+    } else {
+        printf("Deep Copy Test Failed - copied %d, apart from the source %d, append in place %d, after remount %d.\n",
+               copied, apart, inPlace, remounted);
+    }
+}
+
+
+/**
+ * A copy in progress stops with an error once its source is written, and keeps the blocks
+ * it had copied until then.
+ */
+void test_cp_deep_source_changed() {
+    printf("Testing a deep copy whose source changes...\n");
+    fs_init();
+
+    const uint32_t size = 4 * FS_BLOCK_PAYLOAD_SIZE;
+    bool ok = fs_create_directory("/root/orig") && fs_create_directory("/root/copy")
+        && write_pattern("/root/orig/data", false, size, 0x51);
+    FS_COPY* copy = ok ? fs_cp_deep_open("/root/orig/data", "/root/copy/data") : NULL;
+    int first = (copy != NULL) ? fs_cp_deep_step(copy, 1) : -1;
+    ok = copy != NULL && first == 3 && write_pattern("/root/orig/data", true, size, 0x52);
+    int second = (copy != NULL) ? fs_cp_deep_step(copy, 1) : 0;
+    fs_cp_deep_close(copy);
+    bool kept = ok && holds_pattern("/root/copy/data", FS_BLOCK_PAYLOAD_SIZE, 0x51);
+    bool missing = fs_cp_deep_open("/root/orig/none", "/root/copy/none") == NULL;
+
+    if (ok && second == -1 && kept && missing) {
+        printf("Deep Copy Test Passed - the copy stopped when its source was written, after 1 of 4 blocks.\n");
+    } else {
+        printf("Deep Copy Test Failed - steps returned %d and %d, first block kept %d, missing source refused %d.\n",
+               first, second, kept, missing);
+    }
+}
+
+
+/**
+ * Benchmark: a physical copy of a 512 KB file with fs_cp_deep_step() against copying it with
+ * fs_read() and fs_write() through a 4 KB buffer. Prints the throughput of both and the
+ * longest single step. Passes if both copies hold the source's data.
+ */
+void test_cp_deep_benchmark() {
+    printf("Benchmarking a deep copy of %d KB...\n", CP_DEEP_TEST_BYTES / 1024);
+    fs_init();
+
+    bool ok = fs_create_directory("/root/orig") && fs_create_directory("/root/rw") && fs_create_directory("/root/copy")
+        && write_pattern("/root/orig/big", false, CP_DEEP_TEST_BYTES, 0x61);
+
+    // The copy an application would make without fs_cp_deep().
+    uint64_t began = time_us_64();
+    FS_FILE* source = ok ? fs_open("/root/orig/big", "r") : NULL;
+    FS_FILE* target = ok ? fs_open("/root/rw/big", "w") : NULL;
+    uint8_t *buffer = malloc(4096);
+    ok = source != NULL && target != NULL && buffer != NULL;
+    int n;
+    while (ok && (n = fs_read(source, buffer, 4096)) > 0) {
+        ok = fs_write(target, buffer, n) == n;
+    }
+    fs_close(source);
+    fs_close(target);
+    free(buffer);
+    uint32_t rw_us = (uint32_t)(time_us_64() - began);
+    bool rwCopied = ok && holds_pattern("/root/rw/big", CP_DEEP_TEST_BYTES, 0x61);
+    ok = ok && fs_rm("/root/rw/big") == 0 && fs_sync() == 0;
+
+    block_log_stats before;
+    block_log_stats after;
+    block_log_get_stats(&before);
+    uint32_t max_step_us = 0;
+    uint32_t steps = 0;
+    began = time_us_64();
+    FS_COPY* copy = ok ? fs_cp_deep_open("/root/orig/big", "/root/copy/big") : NULL;
+    int left = (copy != NULL) ? 1 : -1;
+    while (left > 0) {
+        uint64_t stepBegan = time_us_64();
+        left = fs_cp_deep_step(copy, FS_CP_DEEP_STEP_BLOCKS);
+        uint32_t step_us = (uint32_t)(time_us_64() - stepBegan);
+        max_step_us = (step_us > max_step_us) ? step_us : max_step_us;
+        steps++;
+    }
+    fs_cp_deep_close(copy);
+    uint32_t deep_us = (uint32_t)(time_us_64() - began);
+    block_log_get_stats(&after);
+    uint32_t blocks = (CP_DEEP_TEST_BYTES + FS_BLOCK_PAYLOAD_SIZE - 1) / FS_BLOCK_PAYLOAD_SIZE;
+    bool deepCopied = left == 0 && holds_pattern("/root/copy/big", CP_DEEP_TEST_BYTES, 0x61)
+        && after.copied_blocks - before.copied_blocks == blocks;
+
+    // Bytes per microsecond are megabytes per second.
+    float rw_mbs = rw_us > 0 ? (float)CP_DEEP_TEST_BYTES / rw_us : 0;
+    float deep_mbs = deep_us > 0 ? (float)CP_DEEP_TEST_BYTES / deep_us : 0;
+    printf("fs_read()/fs_write(): %u us, %.2f MB/s\n", rw_us, rw_mbs);
+    printf("fs_cp_deep_step(): %u us, %.2f MB/s, %u steps of %d blocks, longest %u us\n",
+           deep_us, deep_mbs, steps, FS_CP_DEEP_STEP_BLOCKS, max_step_us);
+
+    if (rwCopied && deepCopied) {
+        printf("Deep Copy Test Passed - %.2f MB/s against %.2f MB/s through fs_read()/fs_write(), longest step %u us.\n",
+               deep_mbs, rw_mbs, max_step_us);
+    } else {
+        printf("Deep Copy Test Failed - copy by read and write %d, deep copy %d (%d blocks left).\n",
+               rwCopied, deepCopied, left);
+    }
+}
@@ -0,0 +1,197 @@
+#include "../filesystem/filesystem.h"
+#include "../directory/directories.h"
+#include "../directory/directory_helpers.h"
+#include "../directory/dentry_cache.h"
+#include "../tests/dentry_cache_test.h"
+#include <stdio.h>
+#include <string.h>
+#include "pico/time.h"
+
+// Depth of the deepest directory chain of the benchmark, and opens timed at each depth.
+#define DENTRY_TEST_MAX_DEPTH 32
+#define DENTRY_TEST_OPENS 200
+
+
+void run_all_tests_dentry_cache() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_dentry_same_name_in_two_directories();
+    printf("%s", slashes);
+    test_dentry_negative_entries();
+    printf("%s", slashes);
+    test_dentry_deep_path_latency();
+    printf("%s", slashes);
+}
+
+
+
+
+/**
+ * Writes a short text to a file, replacing what it held.
+ */
+static bool write_text(const char* path, const char* text) {
+    FS_FILE* file = fs_open(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    bool ok = fs_write(file, text, strlen(text)) == (int)strlen(text);
+    fs_close(file);
+    return ok;
+}
+
+/**
+ * Checks that a file holds a text.
+ */
+static bool holds_text(const char* path, const char* text) {
+    FS_FILE* file = fs_open(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    char buffer[32] = { 0 };
+    bool ok = fs_read(file, buffer, sizeof(buffer) - 1) == (int)strlen(text) && strcmp(buffer, text) == 0;
+    fs_close(file);
+    return ok;
+}
+
+
+/**
+ * "/root/a/x/f" and "/root/b/x/f" are different files, before and after a remount, and
+ * removing one leaves the other.
+ */
+void test_dentry_same_name_in_two_directories() {
+    printf("Testing that equal names in different directories do not collide...\n");
+    fs_init();
+
+    bool ok = fs_create_directory("/root/a") && fs_create_directory("/root/b")
+        && fs_create_directory("/root/a/x") && fs_create_directory("/root/b/x")
+        && write_text("/root/a/x/f", "first") && write_text("/root/b/x/f", "second");
+    bool distinct = ok && holds_text("/root/a/x/f", "first") && holds_text("/root/b/x/f", "second");
+
+    // The same directory is found with or without the "/root" prefix.
+    DirectoryEntry* prefixed = DIR_find_directory_entry("/root/a/x");
+    uint32_t prefixedId = (prefixed != NULL) ? prefixed->currentDirId : 0;
+    DirectoryEntry* bare = DIR_find_directory_entry("/a/x");
+    bool aliases = prefixed != NULL && bare != NULL && bare->currentDirId == prefixedId;
+
+    bool remounted = ok && fs_unmount() == 0 && fs_mount() == 0
+        && holds_text("/root/a/x/f", "first") && holds_text("/root/b/x/f", "second");
+    bool removed = remounted && fs_rm("/root/a/x/f") == 0
+        && fs_open("/root/a/x/f", "r") == NULL && holds_text("/root/b/x/f", "second");
+
+    if (distinct && aliases && remounted && removed) {
+        printf("Dentry Test Passed - /root/a/x/f and /root/b/x/f kept apart, also after a remount.\n");
+    } else {
+        printf("Dentry Test Failed - created %d, distinct %d, aliases %d, remounted %d, removed %d.\n",
+               ok, distinct, aliases, remounted, removed);
+    }
+}
+
+
+/**
+ * A missing directory is looked up in the directory table once and then answered from the
+ * cache, until a directory of that name is created.
+ */
+void test_dentry_negative_entries() {
+    printf("Testing that missing directories are cached...\n");
+    fs_init();
+
+    dentry_cache_stats before;
+    dentry_cache_stats after;
+    bool missing = DIR_find_directory_entry("/root/later") == NULL;
+    dentry_cache_get_stats(&before);
+    for (int i = 0; i < 10; i++) {
+        missing = missing && DIR_find_directory_entry("/root/later") == NULL;
+    }
+    dentry_cache_get_stats(&after);
+    bool cached = after.misses == before.misses && after.negative_hits == before.negative_hits + 10;
+
+    bool created = fs_create_directory("/root/later") && DIR_find_directory_entry("/root/later") != NULL
+        && write_text("/root/later/file", "found");
+    bool found = created && holds_text("/root/later/file", "found");
+
+    if (missing && cached && found) {
+        printf("Dentry Test Passed - 10 lookups of a missing directory answered from the cache.\n");
+    } else {
+        printf("Dentry Test Failed - missing %d, cached %d (%u misses), found after creation %d.\n",
+               missing, cached, after.misses - before.misses, found);
+    }
+}
+
+
+/**
+ * Opens and closes the file at a path DENTRY_TEST_OPENS times.
+ *
+ * @param cold Whether to empty the cache before every open, so that each directory of the
+ *             path is looked up in the directory table.
+ * @return Average microseconds per open, or UINT32_MAX if an open failed.
+ */
+static uint32_t time_opens(const char* path, bool cold) {
+    uint64_t began = time_us_64();
+    for (int i = 0; i < DENTRY_TEST_OPENS; i++) {
+        if (cold) {
+            dentry_cache_init();
+        }
+        FS_FILE* file = fs_open(path, "r");
+        if (file == NULL) {
+            return UINT32_MAX;
+        }
+        fs_close(file);
+    }
+    return (uint32_t)((time_us_64() - began) / DENTRY_TEST_OPENS);
+}
+
+/**
+ * Benchmark: opening a file at depth 1, 8 and 32. The directories of the path are found in
+ * the cache, so the latency only grows with the hashing of the longer path. Prints the
+ * latency at each depth, with and without the cache; passes if every open at depth 32 was
+ * answered from the cache.
+ */
+void test_dentry_deep_path_latency() {
+    printf("Testing open latency of deep paths...\n");
+    fs_init();
+
+    // /root/d0/d1/.../d31, with a file at depth 1, 8 and 32.
+    char path[256] = "/root";
+    char files[3][sizeof(path) + sizeof("/sample")]; // Room for any directory path plus the file.
+    const int depths[3] = { 1, 8, DENTRY_TEST_MAX_DEPTH };
+    bool ok = true;
+    for (int depth = 1, next = 0; depth <= DENTRY_TEST_MAX_DEPTH && ok; depth++) {
+        size_t length = strlen(path);
+        snprintf(path + length, sizeof(path) - length, "/d%d", depth - 1);
+        ok = fs_create_directory(path);
+        if (ok && depth == depths[next]) {
+            snprintf(files[next], sizeof(files[next]), "%s/sample", path);
+            ok = write_text(files[next], "sample");
+            next++;
+        }
+    }
+
+    uint32_t latency[3] = { 0 };
+    uint32_t uncached[3] = { 0 };
+    dentry_cache_stats before = { 0 };
+    dentry_cache_stats after = { 0 };
+    for (int i = 0; i < 3 && ok; i++) {
+        uncached[i] = time_opens(files[i], true);
+        // The first open fills the cache with the path's directories.
+        time_opens(files[i], false);
+        dentry_cache_get_stats(&before);
+        latency[i] = time_opens(files[i], false);
+        dentry_cache_get_stats(&after);
+        ok = latency[i] != UINT32_MAX && uncached[i] != UINT32_MAX;
+    }
+    for (int i = 0; i < 3; i++) {
+        printf("Depth %2d: %u us per open, %u us without the cache\n", depths[i], latency[i], uncached[i]);
+    }
+    printf("Cache: %u hits, %u misses, %u evictions\n", after.hits, after.misses, after.evictions);
+
+    bool cached = after.misses == before.misses
+        && after.hits - before.hits == DENTRY_TEST_OPENS * (DENTRY_TEST_MAX_DEPTH + 1);
+    if (ok && cached) {
+        printf("Dentry Test Passed - %u us per open at depth 1, %u us at depth 8, %u us at depth 32.\n",
+               latency[0], latency[1], latency[2]);
+    } else {
+        printf("Dentry Test Failed - opens %s, %u lookups missed the cache at depth 32.\n",
+               ok ? "succeeded" : "failed", after.misses - before.misses);
+    }
+}
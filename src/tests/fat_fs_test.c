@@ -2,7 +2,9 @@
 
 #include "../FAT/fat_fs.h"
 #include <stdio.h>
+#include <inttypes.h>
 #include "../tests/fat_fs_test.h"
+#include "pico/time.h"
 
 
 void run_all_tests_FAT() {
@@ -17,6 +19,12 @@ void run_all_tests_FAT() {
     printf("%s", slashes);
     test_fat_link_blocks();
     printf("%s", slashes);
+    test_fat_free_block_count();
+    printf("%s", slashes);
+    test_fat_allocate_until_full();
+    printf("%s", slashes);
+    test_fat_allocate_extent();
+    printf("%s", slashes);
    
 
 
@@ -31,7 +39,7 @@ void test_fat_init() {
     printf("Testing fat_init...\n");
     fat_init();
     int reserved_blocks_ok = 1;
-    for (uint32_t i = 0; i < NUMBER_OF_RESERVED_BLOCKS + 5; i++) {
+    for (uint32_t i = 0; i < NUMBER_OF_RESERVED_BLOCKS + METADATA_RESERVED_BLOCKS; i++) {
         if (FAT[i] != FAT_ENTRY_RESERVED) {
             reserved_blocks_ok = 0;
             break;
@@ -79,5 +87,91 @@ void test_fat_link_blocks() {
     }
 }
 
- 
 
+void test_fat_free_block_count() {
+    printf("Testing fat_free_block_count...\n");
+    uint32_t before = fat_free_block_count();
+    uint32_t block = fat_allocate_block();
+    uint32_t during = fat_free_block_count();
+    fat_free_block(block);
+    uint32_t after = fat_free_block_count();
+
+    if (during == before - 1 && after == before) {
+        printf("Free Count Test Passed - %u free, %u after allocating, %u after freeing.\n", before, during, after);
+    } else {
+        printf("Free Count Test Failed - %u free, %u after allocating, %u after freeing.\n", before, during, after);
+    }
+}
+
+
+void test_fat_allocate_until_full() {
+    printf("Testing allocation until the FAT is full...\n");
+    static uint32_t blocks[TOTAL_BLOCKS];
+    uint32_t available = fat_free_block_count();
+    uint32_t allocated = 0;
+
+    uint64_t start = time_us_64();
+    while (allocated < TOTAL_BLOCKS) {
+        uint32_t block = fat_allocate_block();
+        if (block == FAT_NO_FREE_BLOCKS) {
+            break;
+        }
+        blocks[allocated++] = block;
+    }
+    uint64_t elapsed = time_us_64() - start;
+
+    // Every allocation must have handed out a distinct block now marked in use.
+    bool distinct = true;
+    for (uint32_t i = 0; i < allocated; i++) {
+        if (FAT[blocks[i]] != FAT_ENTRY_END) {
+            distinct = false;
+        }
+    }
+    uint32_t remaining = fat_free_block_count();
+
+    for (uint32_t i = 0; i < allocated; i++) {
+        fat_free_block(blocks[i]);
+    }
+
+    printf("Allocated %u blocks in %" PRIu64 " us, free count when full: %u\n", allocated, elapsed, remaining);
+    if (allocated == available && remaining == 0 && distinct && fat_free_block_count() == available) {
+        printf("Full Allocation Test Passed - Every free block allocated exactly once.\n");
+    } else {
+        printf("Full Allocation Test Failed - Expected %u blocks, allocated %u.\n", available, allocated);
+    }
+}
+
+
+void test_fat_allocate_extent() {
+    printf("Testing fat_allocate_extent...\n");
+    uint32_t before = fat_free_block_count();
+    uint32_t first = fat_allocate_extent(6, 0);
+    if (first == FAT_NO_FREE_BLOCKS) {
+        printf("Extent Test Failed - No run of 6 free blocks.\n");
+        return;
+    }
+
+    // The run must be physically consecutive and linked in order.
+    bool linked = true;
+    for (uint32_t i = 0; i < 6; i++) {
+        uint32_t expected = (i == 5) ? FAT_ENTRY_END : first + i + 1;
+        if (FAT[first + i] != expected) {
+            linked = false;
+        }
+    }
+
+    // Free a 2-block hole in the middle; a request for 2 blocks should fill it exactly.
+    fat_free_block(first + 2);
+    fat_free_block(first + 3);
+    uint32_t hole = fat_allocate_extent(2, first);
+
+    for (uint32_t i = 0; i < 6; i++) {
+        fat_free_block(first + i);
+    }
+
+    if (linked && hole == first + 2 && fat_free_block_count() == before) {
+        printf("Extent Test Passed - Run of 6 at block %u, best fit hole reused.\n", first);
+    } else {
+        printf("Extent Test Failed - Run at %u, hole allocated at %u.\n", first, hole);
+    }
+}
@@ -2,12 +2,22 @@
 #include "../filesystem/filesystem_helper.h"
 #include "../tests/filesystem_helper_test.h"
 #include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
 #include "../directory/directories.h"
+#include "../directory/directory_helpers.h"
+#include "../filesystem/file_index.h"
+#include "../filesystem/meta_table.h"
+#include "../filesystem/name_pool.h"
+#include "../FAT/fat_fs.h"
+#include "pico/time.h"
 
 
 void run_all_tests_filesystem_Helper() {
     char slashes[] = "\n/////////////////////////////////////////////\n";
 
+    // The FAT tests reinitialize the FAT under the tables; start from a fresh filesystem.
+    fs_init();
     printf("%s", slashes);
     test_extract_last_two_parts();
     printf("%s", slashes);
@@ -19,6 +29,12 @@ void run_all_tests_filesystem_Helper() {
     printf("%s", slashes);
     test_save_and_load_FileEntries();
     printf("%s", slashes);
+    test_file_lookup_benchmark();
+    printf("%s", slashes);
+    test_file_table_growth();
+    printf("%s", slashes);
+    test_name_pool_footprint();
+    printf("%s", slashes);
 
 
 
@@ -58,7 +74,7 @@ void test_file_system_operations() {
     const char* filePath = "newfile.txt";
     FileEntry* fileEntry = createFileEntry(filePath, parentDirId);
     if (fileEntry != NULL) {
-        printf("File Creation Test Passed - File created: %s\n", fileEntry->filename);
+        printf("File Creation Test Passed - File created: %s\n", name_pool_str(&fileEntry->filename));
     } else {
         printf("File Creation Test Failed - File not created.\n");
     }
@@ -122,3 +138,238 @@ void test_save_and_load_FileEntries() {
     saveFileEntriesToFileSystem();  // Save entries
     loadFileEntriesFromFileSystem();  // Load entries to test recovery
 }
+
+
+
+/**
+ * Adds count dummy entries named "bench_<n>.txt" to the root directory, growing the file
+ * table as needed, and stores the slot of each in slots[]. No data blocks are allocated.
+ */
+static void add_bench_entries(uint32_t rootId, int *slots, int count) {
+    for (int n = 0; n < count; n++) {
+        int slot = file_index_unused_slot();
+        if (slot < 0) {
+            slot = file_entry_count();
+            if (file_table_grow() != 0) {
+                slots[n] = -1;
+                continue;
+            }
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "bench_%d.txt", n);
+        FileEntry *entry = file_entry_at(slot);
+        memset(entry, 0, sizeof(FileEntry));
+        meta_table_pin(entry);
+        name_pool_set(&entry->filename, name);
+        meta_table_unpin(entry);
+        entry->parentDirId = rootId;
+        entry->unique_file_id = 0x10000000u + n;
+        entry->start_block = FAT_ENTRY_END;
+        entry->in_use = true;
+        file_index_insert(slot);
+        slots[n] = slot;
+    }
+}
+
+
+/**
+ * Removes the entries added by add_bench_entries().
+ */
+static void remove_bench_entries(const int *slots, int count) {
+    for (int n = 0; n < count; n++) {
+        if (slots[n] >= 0) {
+            FileEntry *entry = file_entry_at(slots[n]);
+            file_index_remove(slots[n]);
+            name_pool_clear(&entry->filename);
+            memset(entry, 0, sizeof(FileEntry));
+        }
+    }
+}
+
+
+/**
+ * Times 1000 lookups by name over count files: a plain scan comparing every name in the
+ * file table, FILE_find_file_entry() through the hash index, and a full fs_open()/fs_close()
+ * in read mode.
+ */
+static bool benchmark_lookups(int count) {
+    printf("Benchmarking file lookups with %d entries...\n", count);
+    uint32_t rootId = get_root_directory_id();
+    int *slots = malloc(count * sizeof(int));
+    if (slots == NULL) {
+        return false;
+    }
+    add_bench_entries(rootId, slots, count);
+
+    const int lookups = 1000;
+    char name[32];
+    uint32_t seed = 777;
+    bool found = true;
+
+    // Baseline: compare the name of every slot until the file turns up.
+    uint32_t entries = file_entry_count();
+    uint64_t start = time_us_64();
+    for (int n = 0; n < lookups; n++) {
+        seed = seed * 1103515245 + 12345;
+        snprintf(name, sizeof(name), "bench_%d.txt", (int)(seed % count));
+        for (uint32_t i = 0; i < entries; i++) {
+            FileEntry *entry = file_entry_at(i);
+            if (entry->in_use && entry->parentDirId == rootId && strcmp(name_pool_str(&entry->filename), name) == 0) {
+                break;
+            }
+        }
+    }
+    uint64_t scan_us = time_us_64() - start;
+
+    seed = 777;
+    start = time_us_64();
+    for (int n = 0; n < lookups; n++) {
+        seed = seed * 1103515245 + 12345;
+        int i = seed % count;
+        snprintf(name, sizeof(name), "bench_%d.txt", i);
+        FileEntry *entry = FILE_find_file_entry(name, rootId);
+        if (slots[i] < 0 || entry == NULL || file_entry_slot(entry) != slots[i]) {
+            found = false;
+        }
+    }
+    uint64_t index_us = time_us_64() - start;
+
+    seed = 777;
+    start = time_us_64();
+    for (int n = 0; n < lookups; n++) {
+        seed = seed * 1103515245 + 12345;
+        int i = seed % count;
+        snprintf(name, sizeof(name), "/bench_%d.txt", i);
+        FS_FILE *file = fs_open(name, "r");
+        if (file == NULL || file_entry_slot(file->entry) != slots[i]) {
+            found = false;
+        }
+        fs_close(file);
+    }
+    uint64_t open_us = time_us_64() - start;
+
+    remove_bench_entries(slots, count);
+    free(slots);
+
+    printf("%d lookups over %d entries: linear scan %" PRIu64 " us, hash index %" PRIu64 " us, fs_open %" PRIu64 " us\n",
+           lookups, count, scan_us, index_us, open_us);
+    return found;
+}
+
+
+/**
+ * Runs the lookup benchmark with a small and a large file table to show how each kind of
+ * lookup scales with the number of files.
+ */
+void test_file_lookup_benchmark() {
+    bool found = benchmark_lookups(20);
+    found = benchmark_lookups(1000) && found;
+    if (found) {
+        printf("File Lookup Test Passed - Every name resolved to its own entry.\n");
+    } else {
+        printf("File Lookup Test Failed - A lookup returned the wrong entry.\n");
+    }
+}
+
+
+/**
+ * Creates more files than fit in one page of the file table and checks that the table
+ * grows to hold them all while no more than META_CACHE_PAGES pages are held in RAM.
+ */
+void test_file_table_growth() {
+    printf("Testing file table growth past one page...\n");
+    const int count = 200;
+    uint32_t rootId = get_root_directory_id();
+    int *slots = malloc(count * sizeof(int));
+    if (slots == NULL) {
+        printf("File Table Growth Test Failed - Out of memory.\n");
+        return;
+    }
+
+    meta_table_reset_stats();
+    add_bench_entries(rootId, slots, count);
+
+    // Every entry must still be found after its page has been evicted and reloaded.
+    bool found = true;
+    char name[32];
+    for (int n = 0; n < count; n++) {
+        snprintf(name, sizeof(name), "bench_%d.txt", n);
+        FileEntry *entry = FILE_find_file_entry(name, rootId);
+        if (slots[n] < 0 || entry == NULL || entry->unique_file_id != 0x10000000u + n) {
+            found = false;
+        }
+    }
+
+    meta_table_stats stats;
+    meta_table_get_stats(&stats);
+    uint32_t slotsPerPage = FILESYSTEM_BLOCK_SIZE / sizeof(FileEntry);
+    remove_bench_entries(slots, count);
+    free(slots);
+
+    printf("%u file table slots (%u per page), %u page loads, %u write-backs, at most %u pages in RAM\n",
+           file_entry_count(), slotsPerPage, stats.misses, stats.writebacks, stats.peak_resident);
+    if (found && file_entry_count() >= (uint32_t)count && file_entry_count() > slotsPerPage
+        && stats.peak_resident <= META_CACHE_PAGES) {
+        printf("File Table Growth Test Passed - %d files held with a bounded page cache.\n", count);
+    } else {
+        printf("File Table Growth Test Failed - Table did not grow or the cache exceeded its budget.\n");
+    }
+}
+
+
+/**
+ * Measures the metadata footprint of 20, 200 and 2000 files: the file table records plus
+ * the names in the pool, against the same records with a 256-byte name buffer each. Also
+ * checks that a name used by two entries is stored once.
+ */
+void test_name_pool_footprint() {
+    printf("Testing name pool footprint...\n");
+    const int counts[] = {20, 200, 2000};
+    uint32_t rootId = get_root_directory_id();
+    uint32_t legacySize = sizeof(FileEntry) - sizeof(name_ref) + 256;
+    bool compact = true;
+
+    for (int c = 0; c < 3; c++) {
+        int count = counts[c];
+        int *slots = malloc(count * sizeof(int));
+        if (slots == NULL) {
+            printf("Name Pool Test Failed - Out of memory.\n");
+            return;
+        }
+        name_pool_stats before, after;
+        name_pool_get_stats(&before);
+        add_bench_entries(rootId, slots, count);
+        name_pool_get_stats(&after);
+
+        uint32_t records = count * sizeof(FileEntry);
+        uint32_t names = after.bytes_live - before.bytes_live;
+        uint32_t legacy = count * legacySize;
+        printf("%d entries: %u bytes of records + %u bytes of names = %u bytes (%u bytes with 256-byte names)\n",
+               count, records, names, records + names, legacy);
+        if ((records + names) * 4 > legacy) {
+            compact = false;
+        }
+        remove_bench_entries(slots, count);
+        free(slots);
+    }
+
+    // The same name in two directories is stored once.
+    FileEntry *first = createFileEntry("shared_name.txt", rootId);
+    name_ref firstName = first->filename;
+    FileEntry *second = createFileEntry("shared_name.txt", rootId + 1);
+    bool shared = second != NULL && second->filename.offset == firstName.offset;
+    fs_rm("/shared_name.txt");
+    if (second != NULL) {
+        // Not reachable through a directory, so undo what createFileEntry() did by hand.
+        fat_free_block(second->start_block);
+        file_index_remove(file_entry_slot(second));
+        name_pool_clear(&second->filename);
+        memset(second, 0, sizeof(FileEntry));
+    }
+
+    if (compact && shared) {
+        printf("Name Pool Test Passed - Metadata shrank more than 4x and names are shared.\n");
+    } else {
+        printf("Name Pool Test Failed - Metadata not compact enough or a name was stored twice.\n");
+    }
+}
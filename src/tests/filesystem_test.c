@@ -4,7 +4,10 @@
 #include "../filesystem/filesystem.h"  
 #include "../tests/filesystem_test.h" 
 #include <string.h>
+#include <inttypes.h>
 #include "../directory/directories.h"
+#include "../FAT/fat_fs.h"
+#include "pico/time.h"
 
 
 void run_all_tests_filesystem() {
@@ -24,6 +27,10 @@ void run_all_tests_filesystem() {
     test_fs_cp_function();
     printf("%s", slashes);
     test_fs_rm();
+    printf("%s", slashes);
+    test_fs_map_zero_copy();
+    printf("%s", slashes);
+    test_fs_random_read_benchmark();
 }
 
 
@@ -236,3 +243,130 @@ void test_fs_rm(void) {
 }
 
 
+
+void test_fs_map_zero_copy(void) {
+    fs_init();
+    FS_FILE *file = fs_open("/mapTest.bin", "w");
+    if (file == NULL) {
+        printf("Map Test - Failed to open file for writing.\n");
+        return;
+    }
+
+    // Two and a half blocks of a repeating pattern.
+    static uint8_t data[FILESYSTEM_BLOCK_SIZE * 2 + 2048];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7);
+    }
+    fs_write(file, data, sizeof(data));
+
+    // Map the file piece by piece; each piece is a contiguous run read in place.
+    uint32_t offset = 100;
+    int pieces = 0;
+    bool matches = true;
+    while (offset < sizeof(data)) {
+        const void *ptr;
+        int mapped = fs_map(file, offset, sizeof(data) - offset, &ptr);
+        if (mapped <= 0) {
+            matches = false;
+            break;
+        }
+        if (memcmp(ptr, data + offset, mapped) != 0) {
+            matches = false;
+        }
+        offset += mapped;
+        pieces++;
+    }
+
+    const void *ptr;
+    int past_end = fs_map(file, sizeof(data), 16, &ptr);
+
+    if (matches && past_end == 0) {
+        printf("Map Test Passed - %u bytes mapped in %d contiguous piece(s).\n", (unsigned)(sizeof(data) - 100), pieces);
+    } else {
+        printf("Map Test Failed - Mapped data did not match what was written.\n");
+    }
+    fs_close(file);
+}
+
+
+
+// Expected content of the random read benchmark file at a given offset.
+static uint8_t random_read_pattern(uint32_t offset) {
+    return (uint8_t)(offset * 7 + (offset >> 12));
+}
+
+
+void test_fs_random_read_benchmark(void) {
+    fs_init();
+    FS_FILE *file = fs_open("/randomRead.bin", "w");
+    if (file == NULL) {
+        printf("Random Read Test - Failed to open file for writing.\n");
+        return;
+    }
+
+    // Build a 1 MB file one 4 KB chunk at a time.
+    const uint32_t fileSize = 1024 * 1024;
+    static uint8_t chunk[FILESYSTEM_BLOCK_SIZE];
+    for (uint32_t offset = 0; offset < fileSize; offset += sizeof(chunk)) {
+        for (uint32_t i = 0; i < sizeof(chunk); i++) {
+            chunk[i] = random_read_pattern(offset + i);
+        }
+        if (fs_write(file, chunk, sizeof(chunk)) != (int)sizeof(chunk)) {
+            printf("Random Read Test - Failed to write at offset %u.\n", offset);
+            fs_close(file);
+            return;
+        }
+    }
+    file->mode = 'r';
+
+    // Treat the file as fragmented so that lookups cannot use its contiguous extent.
+    uint32_t extent = file->entry->extent_blocks;
+    file->entry->extent_blocks = 0;
+
+    const int reads = 1000;
+    uint8_t buffer[64];
+    bool matches = true;
+    uint32_t seed = 12345;
+
+    // Baseline: find each block by walking the FAT chain from the start of the file.
+    uint64_t start = time_us_64();
+    for (int n = 0; n < reads; n++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t offset = seed % (fileSize - sizeof(buffer));
+        uint32_t block = file->entry->start_block;
+        for (uint32_t skip = offset / FS_BLOCK_PAYLOAD_SIZE; skip > 0; skip--) {
+            fat_get_next_block(block, &block);
+        }
+        (void)block;
+    }
+    uint64_t walk_us = time_us_64() - start;
+
+    // Through the handle: the first random read builds the block map, the rest use it.
+    seed = 12345;
+    start = time_us_64();
+    for (int n = 0; n < reads && matches; n++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t offset = seed % (fileSize - sizeof(buffer));
+        fs_seek(file, offset, SEEK_SET);
+        if (fs_read(file, buffer, sizeof(buffer)) != (int)sizeof(buffer)) {
+            matches = false;
+        }
+        for (uint32_t i = 0; i < sizeof(buffer) && matches; i++) {
+            matches = (buffer[i] == random_read_pattern(offset + i));
+        }
+    }
+    uint64_t mapped_us = time_us_64() - start;
+    file->entry->extent_blocks = extent;
+
+    printf("%d random 64-byte reads over %u blocks: chain walks %" PRIu64 " us, fs_read with block map %" PRIu64 " us\n",
+           reads, file->block_map_len, walk_us, mapped_us);
+    if (matches && file->block_map_len * FS_BLOCK_PAYLOAD_SIZE >= fileSize) {
+        printf("Random Read Test Passed - Every read returned the data at its offset.\n");
+    } else {
+        printf("Random Read Test Failed - Data read back did not match its offset.\n");
+    }
+
+    // Give the blocks back so later tests have room.
+    fs_close(file);
+    fs_rm("/randomRead.bin");
+}
@@ -0,0 +1,146 @@
+
+
+#include "../flash/flash_cache.h"
+#include "../FAT/fat_fs.h"
+#include "../tests/flash_cache_test.h"
+#include <stdio.h>
+#include <string.h>
+#include "hardware/flash.h"
+
+
+void run_all_tests_flash_cache() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_flash_cache_read_back();
+    printf("%s", slashes);
+    test_flash_cache_coalesces_small_writes();
+    printf("%s", slashes);
+    test_flash_cache_lru_eviction();
+    printf("%s", slashes);
+    test_flash_cache_sync();
+    printf("%s", slashes);
+}
+
+
+
+
+/**
+ * Writes a few bytes into the middle of a block and reads them back before the cache
+ * has written anything to flash.
+ */
+void test_flash_cache_read_back() {
+    printf("Testing flash cache read back...\n");
+    uint32_t block = fat_allocate_block();
+    uint32_t offset = block * FILESYSTEM_BLOCK_SIZE + 100;
+
+    const char *data = "cached bytes";
+    char buffer[16] = {0};
+    flash_cache_write(offset, (const uint8_t *)data, strlen(data));
+    flash_cache_read(offset, (uint8_t *)buffer, strlen(data));
+
+    if (memcmp(buffer, data, strlen(data)) == 0) {
+        printf("Cache Read Back Test Passed - Read '%s'.\n", buffer);
+    } else {
+        printf("Cache Read Back Test Failed - Read '%s'.\n", buffer);
+    }
+
+    flash_cache_sync();
+    fat_free_block(block);
+}
+
+
+/**
+ * Appends 100 small records to the same block and checks that they reach the flash with
+ * a single write back instead of one erase per record.
+ */
+void test_flash_cache_coalesces_small_writes() {
+    printf("Testing flash cache coalescing of small writes...\n");
+    uint32_t block = fat_allocate_block();
+    uint32_t offset = block * FILESYSTEM_BLOCK_SIZE;
+
+    flash_cache_sync();
+    flash_cache_reset_stats();
+
+    uint8_t record[10];
+    for (int i = 0; i < 100; i++) {
+        memset(record, i, sizeof(record));
+        flash_cache_write(offset + i * sizeof(record), record, sizeof(record));
+    }
+    flash_cache_sync();
+
+    flash_cache_stats stats;
+    flash_cache_get_stats(&stats);
+    printf("Writebacks: %u, erases avoided: %u\n", stats.writebacks, stats.erases_avoided);
+
+    const uint8_t *flash = (const uint8_t *)(XIP_BASE + offset);
+    bool persisted = flash[0] == 0 && flash[995] == 99;
+    if (stats.writebacks == 1 && stats.erases_avoided == 99 && persisted) {
+        printf("Cache Coalescing Test Passed - 100 writes cost one erase.\n");
+    } else {
+        printf("Cache Coalescing Test Failed.\n");
+    }
+
+    fat_free_block(block);
+}
+
+
+/**
+ * Dirties one more sector than the cache can hold and checks that the least recently
+ * used sector was written back to make room.
+ */
+void test_flash_cache_lru_eviction() {
+    printf("Testing flash cache LRU eviction...\n");
+    uint32_t blocks[FLASH_CACHE_SECTORS + 1];
+    for (int i = 0; i < FLASH_CACHE_SECTORS + 1; i++) {
+        blocks[i] = fat_allocate_block();
+    }
+
+    // Start from an empty cache so only the sectors used here compete for slots.
+    flash_cache_sync();
+    flash_cache_init();
+
+    uint8_t value = 0x5A;
+    for (int i = 0; i < FLASH_CACHE_SECTORS + 1; i++) {
+        flash_cache_write(blocks[i] * FILESYSTEM_BLOCK_SIZE, &value, 1);
+    }
+
+    flash_cache_stats stats;
+    flash_cache_get_stats(&stats);
+    const uint8_t *oldest = (const uint8_t *)(XIP_BASE + blocks[0] * FILESYSTEM_BLOCK_SIZE);
+    if (stats.evictions == 1 && stats.writebacks == 1 && oldest[0] == value) {
+        printf("Cache Eviction Test Passed - Oldest sector written back on eviction.\n");
+    } else {
+        printf("Cache Eviction Test Failed - Evictions: %u, writebacks: %u.\n", stats.evictions, stats.writebacks);
+    }
+
+    flash_cache_sync();
+    for (int i = 0; i < FLASH_CACHE_SECTORS + 1; i++) {
+        fat_free_block(blocks[i]);
+    }
+}
+
+
+/**
+ * Checks that data only reaches the flash once the cache is synced.
+ */
+void test_flash_cache_sync() {
+    printf("Testing flash cache sync...\n");
+    uint32_t block = fat_allocate_block();
+    uint32_t offset = block * FILESYSTEM_BLOCK_SIZE;
+    const uint8_t *flash = (const uint8_t *)(XIP_BASE + offset);
+
+    uint8_t before = flash[0];
+    uint8_t value = (uint8_t)~before;
+    flash_cache_write(offset, &value, 1);
+    bool deferred = flash[0] == before;
+
+    flash_cache_sync();
+    if (deferred && flash[0] == value) {
+        printf("Cache Sync Test Passed - Data reached flash on sync.\n");
+    } else {
+        printf("Cache Sync Test Failed.\n");
+    }
+
+    fat_free_block(block);
+}
@@ -0,0 +1,277 @@
+#include "../flash/flush_worker.h"
+#include "../flash/flash_cache.h"
+#include "../FAT/fat_fs.h"
+#include "../filesystem/filesystem.h"
+#include "../tests/flush_worker_test.h"
+#include <stdio.h>
+#include <string.h>
+#include "hardware/flash.h"
+#include "pico/time.h"
+
+#if !PICO_ON_DEVICE
+#include <pthread.h>
+#endif
+
+// Small records written by the tests; enough to fill several more blocks than the cache holds.
+#define FLUSH_TEST_RECORDS 1500
+// Images each producer of the two-producer test queues, several laps of the ring.
+#define FLUSH_TEST_IMAGES 64
+
+
+void run_all_tests_flush_worker() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_flush_worker_reads_queued_sectors();
+    printf("%s", slashes);
+    test_flush_worker_write_latency();
+    printf("%s", slashes);
+    test_flush_worker_background_reclaim();
+    printf("%s", slashes);
+    test_flush_worker_two_producers();
+    printf("%s", slashes);
+}
+
+
+
+
+/**
+ * Appends FLUSH_TEST_RECORDS numbered records to a file.
+ *
+ * @param slowest Receives the longest time one fs_write() took, in microseconds.
+ * @return true if every record was written.
+ */
+static bool append_records(const char *path, uint32_t *slowest) {
+    FS_FILE *file = fs_open(path, "w");
+    bool ok = (file != NULL);
+    char record[32];
+    *slowest = 0;
+    for (int i = 0; i < FLUSH_TEST_RECORDS && ok; i++) {
+        int length = snprintf(record, sizeof(record), "%08d flush record\n", i);
+        uint64_t began = time_us_64();
+        ok = fs_write(file, record, length) == length;
+        uint32_t took = (uint32_t)(time_us_64() - began);
+        *slowest = (took > *slowest) ? took : *slowest;
+    }
+    if (file != NULL) {
+        fs_close(file);
+    }
+    return ok;
+}
+
+
+/**
+ * Checks that a file holds the records written by append_records().
+ */
+static bool records_intact(const char *path) {
+    FS_FILE *file = fs_open(path, "r");
+    bool ok = (file != NULL);
+    char record[32];
+    char expected[32];
+    for (int i = 0; i < FLUSH_TEST_RECORDS && ok; i++) {
+        int length = snprintf(expected, sizeof(expected), "%08d flush record\n", i);
+        ok = fs_read(file, record, length) == length && memcmp(record, expected, length) == 0;
+    }
+    if (file != NULL) {
+        fs_close(file);
+    }
+    return ok;
+}
+
+
+/**
+ * With the worker running, sectors evicted from the cache sit in its queue for a while.
+ * Reading the file straight away must see them, and after fs_sync() the flash holds them.
+ */
+void test_flush_worker_reads_queued_sectors() {
+    printf("Testing reads of sectors queued for the flush worker...\n");
+    fs_init();
+    bool ok = flush_worker_start() == 0;
+    uint32_t slowest;
+    ok = ok && append_records("/root/flushFile", &slowest);
+    bool before = ok && records_intact("/root/flushFile");
+
+    ok = ok && fs_sync() == 0;
+    flush_worker_stats stats;
+    flush_worker_get_stats(&stats);
+    flush_worker_stop();
+    // With the worker stopped, reads only see what is on flash.
+    flash_cache_init();
+    bool after = ok && records_intact("/root/flushFile");
+
+    if (before && after && stats.submitted > 0 && stats.written + stats.superseded == stats.submitted) {
+        printf("Flush Worker Read Test Passed - %u sectors queued, %u written, %u superseded.\n",
+               stats.submitted, stats.written, stats.superseded);
+    } else {
+        printf("Flush Worker Read Test Failed - Before sync %d, after %d, %u queued, %u written.\n",
+               before, after, stats.submitted, stats.written);
+    }
+}
+
+
+/**
+ * Compares the slowest fs_write() of the same workload with write-backs done in place and
+ * handed to the worker. Every write-back of the second run has to go through the queue.
+ */
+void test_flush_worker_write_latency() {
+    printf("Testing fs_write latency with the flush worker...\n");
+    fs_init();
+    uint32_t inline_slowest;
+    bool ok = append_records("/root/flushInline", &inline_slowest) && fs_sync() == 0;
+
+    flash_cache_stats cache_before, cache_after;
+    flash_cache_get_stats(&cache_before);
+    ok = ok && flush_worker_start() == 0;
+    uint32_t worker_slowest;
+    ok = ok && append_records("/root/flushWorker", &worker_slowest);
+    flash_cache_get_stats(&cache_after);
+    flush_worker_stats stats;
+    flush_worker_get_stats(&stats);
+    ok = ok && fs_sync() == 0;
+    flush_worker_stop();
+    ok = ok && records_intact("/root/flushInline") && records_intact("/root/flushWorker");
+
+    uint32_t writebacks = cache_after.writebacks - cache_before.writebacks;
+    printf("Slowest fs_write: %u us in place, %u us with the worker (%u write-backs queued, longest %u us, %u waits for a slot)\n",
+           inline_slowest, worker_slowest, stats.submitted, stats.max_submit_us, stats.full_waits);
+
+    if (ok && writebacks > 0 && stats.submitted == writebacks) {
+        printf("Flush Worker Latency Test Passed - Every write-back was queued.\n");
+    } else {
+        printf("Flush Worker Latency Test Failed - %u write-backs, %u queued.\n", writebacks, stats.submitted);
+    }
+}
+
+
+/**
+ * Blocks retired by an overwrite are erased by the worker after fs_sync() frees them.
+ */
+void test_flush_worker_background_reclaim() {
+    printf("Testing background erase of retired blocks...\n");
+    fs_init();
+    char data[FS_BLOCK_PAYLOAD_SIZE];
+    memset(data, 'r', sizeof(data));
+    FS_FILE *file = fs_open("/root/flushReclaim", "w");
+    bool ok = (file != NULL) && fs_write(file, data, sizeof(data)) == (int)sizeof(data);
+    uint32_t retired = (file != NULL) ? file->entry->start_block : FAT_ENTRY_END;
+    ok = ok && fs_sync() == 0 && flush_worker_start() == 0;
+
+    // Overwriting the start of the file moves it to another block and retires this one.
+    memset(data, 'o', 16);
+    ok = ok && fs_seek(file, 0, SEEK_SET) == 0 && fs_write(file, data, 16) == 16;
+    ok = ok && file->entry->start_block != retired;
+    if (file != NULL) {
+        fs_close(file);
+    }
+    ok = ok && fs_sync() == 0;
+    flush_worker_stats stats;
+    flush_worker_get_stats(&stats);
+    flush_worker_stop();
+
+    const uint8_t *flash = (const uint8_t *)(XIP_BASE + retired * FILESYSTEM_BLOCK_SIZE);
+    bool erased = true;
+    for (uint32_t i = 0; ok && i < FILESYSTEM_BLOCK_SIZE && erased; i++) {
+        erased = flash[i] == 0xFF;
+    }
+    bool freed = ok && FAT[retired] == FAT_ENTRY_FREE;
+
+    if (ok && erased && freed && stats.written > 0) {
+        printf("Flush Worker Reclaim Test Passed - Block %u was erased by the worker and freed.\n", retired);
+    } else {
+        printf("Flush Worker Reclaim Test Failed - Block %u erased %d, freed %d, %u sectors written.\n",
+               retired, erased, freed, stats.written);
+    }
+}
+
+
+/**
+ * One producer of test_flush_worker_two_producers(): queues numbered images of a sector of
+ * its own, and reads each back at once, which must give the newest one.
+ */
+typedef struct {
+    uint32_t sector_offset;
+    uint8_t image[FLASH_SECTOR_SIZE];
+    bool ok;
+} producer_job;
+
+static void producer_run(producer_job *job) {
+    uint8_t seen[16];
+    job->ok = true;
+    for (uint32_t n = 1; n <= FLUSH_TEST_IMAGES && job->ok; n++) {
+        memset(job->image, (uint8_t)n, sizeof(job->image));
+        flush_worker_submit(job->sector_offset, job->image);
+        if (!flush_worker_read(job->sector_offset + FLASH_SECTOR_SIZE - sizeof(seen), seen, sizeof(seen))) {
+            // Written already, so the flash has it.
+            memcpy(seen, (const void *)(XIP_BASE + job->sector_offset + FLASH_SECTOR_SIZE - sizeof(seen)), sizeof(seen));
+        }
+        for (uint32_t i = 0; i < sizeof(seen) && job->ok; i++) {
+            job->ok = seen[i] == (uint8_t)n;
+        }
+    }
+}
+
+#if !PICO_ON_DEVICE
+static void *producer_thread_entry(void *job) {
+    producer_run((producer_job *)job);
+    return NULL;
+}
+#endif
+
+
+/**
+ * Two producers queue images into the ring at the same time, on host builds from two
+ * threads. Core 1 runs the worker on the device, so there they take turns on core 0. Each
+ * must read back its own newest image at every step, and the flash ends up with the last
+ * image of both sectors.
+ */
+void test_flush_worker_two_producers() {
+    printf("Testing two producers filling the flush worker's ring...\n");
+    fs_init();
+    static producer_job jobs[2];
+    uint32_t block = fat_allocate_extent(2, NUMBER_OF_RESERVED_BLOCKS + METADATA_RESERVED_BLOCKS);
+    bool ok = block != FAT_NO_FREE_BLOCKS && flush_worker_start() == 0;
+    jobs[0].sector_offset = block * FILESYSTEM_BLOCK_SIZE;
+    jobs[1].sector_offset = jobs[0].sector_offset + FLASH_SECTOR_SIZE;
+    jobs[0].ok = jobs[1].ok = false;
+
+    if (ok) {
+#if PICO_ON_DEVICE
+        producer_run(&jobs[0]);
+        producer_run(&jobs[1]);
+#else
+        pthread_t thread;
+        bool beside = pthread_create(&thread, NULL, producer_thread_entry, &jobs[1]) == 0;
+        producer_run(&jobs[0]);
+        if (beside) {
+            pthread_join(thread, NULL);
+        } else {
+            producer_run(&jobs[1]);
+        }
+#endif
+    }
+    flush_worker_drain();
+    flush_worker_stats stats;
+    flush_worker_get_stats(&stats);
+    flush_worker_stop();
+
+    bool landed = ok;
+    for (int j = 0; j < 2 && landed; j++) {
+        const uint8_t *flash = (const uint8_t *)(XIP_BASE + jobs[j].sector_offset);
+        for (uint32_t i = 0; i < FLASH_SECTOR_SIZE && landed; i++) {
+            landed = flash[i] == (uint8_t)FLUSH_TEST_IMAGES;
+        }
+    }
+    if (block != FAT_NO_FREE_BLOCKS) {
+        fat_free_block(block);
+        fat_free_block(block + 1);
+    }
+
+    if (jobs[0].ok && jobs[1].ok && landed && stats.submitted == 2 * FLUSH_TEST_IMAGES
+        && stats.written + stats.superseded == stats.submitted) {
+        printf("Flush Worker Producers Test Passed - %u images queued, %u written, %u superseded, %u waits for a slot.\n",
+               stats.submitted, stats.written, stats.superseded, stats.full_waits);
+    } else {
+        printf("Flush Worker Producers Test Failed - Reads %d and %d, last images on flash %d, %u queued, %u written.\n",
+               jobs[0].ok, jobs[1].ok, landed, stats.submitted, stats.written);
+    }
+}
@@ -0,0 +1,548 @@
+#include "../filesystem/filesystem.h"
+#include "../filesystem/fs_async.h"
+#include "../tests/fs_async_test.h"
+#include <stdio.h>
+#include <string.h>
+#include "pico/time.h"
+
+#if PICO_ON_DEVICE
+#include "pico/multicore.h"
+#include "pico/flash.h"
+#else
+#include <pthread.h>
+#endif
+
+// Mixed load of the latency benchmark: sensor records appended to one file, with a read
+// from another file after every FS_ASYNC_TEST_READ_EVERY records.
+#define FS_ASYNC_TEST_RECORDS 1200
+#define FS_ASYNC_TEST_RECORD_SIZE 24
+#define FS_ASYNC_TEST_READ_EVERY 4
+#define FS_ASYNC_TEST_READ_SIZE 32
+// The main loop of the benchmark polls for this long after every few records.
+#define FS_ASYNC_TEST_POLL_EVERY 8
+#define FS_ASYNC_TEST_POLL_US 1000
+// Histogram buckets: up to 16 us, up to 32 us, ..., and everything above the last.
+#define LATENCY_BUCKETS 14
+// Records each core queues in the two-core test.
+#define FS_ASYNC_TEST_CORE_RECORDS 300
+
+
+void run_all_tests_fs_async() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_fs_async_completion_order();
+    printf("%s", slashes);
+    test_fs_async_merges_requests();
+    printf("%s", slashes);
+    test_fs_async_latency_histogram();
+    printf("%s", slashes);
+    test_fs_async_two_cores();
+    printf("%s", slashes);
+}
+
+
+
+
+/**
+ * Callbacks of the first tests record the handle and result of each completion here.
+ */
+typedef struct {
+    fs_async_handle handles[FS_ASYNC_QUEUE_DEPTH];
+    int results[FS_ASYNC_QUEUE_DEPTH];
+    int count;
+} completion_log;
+
+static void log_completion(fs_async_handle handle, int result, void *context) {
+    completion_log *log = (completion_log *)context;
+    if (log->count < FS_ASYNC_QUEUE_DEPTH) {
+        log->handles[log->count] = handle;
+        log->results[log->count] = result;
+    }
+    log->count++;
+}
+
+
+/**
+ * Requests run only when polled, complete in the order they were queued, and each callback
+ * gets what the blocking call would have returned, including 0 at the end of the file.
+ */
+void test_fs_async_completion_order() {
+    printf("Testing completion order of asynchronous requests...\n");
+    fs_init();
+    const char *parts[] = { "first ", "second ", "third ", "fourth" };
+    completion_log log = { .count = 0 };
+    fs_async_handle handles[6];
+
+    FS_FILE *file = fs_open("/root/asyncOrder", "w");
+    bool ok = (file != NULL);
+    for (int i = 0; i < 4 && ok; i++) {
+        handles[i] = fs_write_async(file, parts[i], strlen(parts[i]), log_completion, &log);
+        ok = handles[i] != FS_ASYNC_INVALID;
+    }
+    // Nothing runs until the queue is polled.
+    ok = ok && log.count == 0 && file->entry->size == 0 && fs_async_pending(handles[3]);
+    fs_async_drain();
+    ok = ok && log.count == 4 && !fs_async_pending(handles[3]);
+    for (int i = 0; i < 4 && ok; i++) {
+        ok = log.handles[i] == handles[i] && log.results[i] == (int)strlen(parts[i]);
+    }
+    if (file != NULL) {
+        fs_close(file);
+    }
+
+    // Read it back in two requests, then a third finds the end of the file.
+    char first[10] = { 0 };
+    char rest[32] = { 0 };
+    char past[4];
+    log.count = 0;
+    file = ok ? fs_open("/root/asyncOrder", "r") : NULL;
+    ok = (file != NULL);
+    if (ok) {
+        handles[0] = fs_read_async(file, first, 9, log_completion, &log);
+        handles[1] = fs_read_async(file, rest, sizeof(rest) - 1, log_completion, &log);
+        handles[2] = fs_read_async(file, past, sizeof(past), log_completion, &log);
+        fs_async_drain();
+        fs_close(file);
+    }
+    ok = ok && log.count == 3 && log.results[0] == 9 && log.results[1] == 16 && log.results[2] == 0;
+    ok = ok && strcmp(first, "first sec") == 0 && strcmp(rest, "ond third fourth") == 0;
+
+    if (ok) {
+        printf("Async Completion Order Test Passed - Requests completed in order with the expected results.\n");
+    } else {
+        printf("Async Completion Order Test Failed - %d completions, first read \"%s\", second \"%s\".\n",
+               log.count, first, rest);
+    }
+}
+
+
+/**
+ * A full queue of small writes to one block costs a single fs_write(), and the reads that
+ * follow a single fs_read(). Requests beyond the queue's depth are refused.
+ */
+void test_fs_async_merges_requests() {
+    printf("Testing merging of adjacent asynchronous requests...\n");
+    fs_init();
+    char records[FS_ASYNC_QUEUE_DEPTH][20];
+    char readback[FS_ASYNC_QUEUE_DEPTH][20];
+    completion_log log = { .count = 0 };
+    memset(records, 0, sizeof(records));
+
+    FS_FILE *file = fs_open("/root/asyncMerge", "w");
+    bool ok = (file != NULL);
+    for (int i = 0; i < FS_ASYNC_QUEUE_DEPTH && ok; i++) {
+        snprintf(records[i], sizeof(records[i]), "record %011d", i);
+        ok = fs_write_async(file, records[i], sizeof(records[i]), log_completion, &log) != FS_ASYNC_INVALID;
+    }
+    bool refused = ok && fs_write_async(file, records[0], sizeof(records[0]), NULL, NULL) == FS_ASYNC_INVALID;
+    fs_async_drain();
+    fs_async_stats writes;
+    fs_async_get_stats(&writes);
+    if (file != NULL) {
+        fs_close(file);
+    }
+
+    file = ok ? fs_open("/root/asyncMerge", "r") : NULL;
+    ok = (file != NULL) && log.count == FS_ASYNC_QUEUE_DEPTH;
+    for (int i = 0; i < FS_ASYNC_QUEUE_DEPTH && ok; i++) {
+        ok = fs_read_async(file, readback[i], sizeof(readback[i]), log_completion, &log) != FS_ASYNC_INVALID;
+    }
+    fs_async_drain();
+    fs_async_stats reads;
+    fs_async_get_stats(&reads);
+    if (file != NULL) {
+        fs_close(file);
+    }
+    ok = ok && memcmp(records, readback, sizeof(records)) == 0;
+    for (int i = 0; i < FS_ASYNC_QUEUE_DEPTH && ok; i++) {
+        ok = log.results[i] == (int)sizeof(records[i]);
+    }
+
+    uint32_t write_calls = writes.calls;
+    uint32_t read_calls = reads.calls - writes.calls;
+    if (ok && refused && write_calls == 1 && read_calls == 1) {
+        printf("Async Merge Test Passed - %d writes and %d reads took one call each, %u requests merged.\n",
+               FS_ASYNC_QUEUE_DEPTH, FS_ASYNC_QUEUE_DEPTH, reads.merged);
+    } else {
+        printf("Async Merge Test Failed - Data %d, refused %d, %u write calls, %u read calls.\n",
+               ok, refused, write_calls, read_calls);
+    }
+}
+
+
+
+
+/**
+ * Counts latencies in power-of-two buckets.
+ */
+typedef struct {
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t total_us;
+} latency_histogram;
+
+static void histogram_add(latency_histogram *histogram, uint32_t us) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && us > (16u << bucket)) {
+        bucket++;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->total_us += us;
+    if (us > histogram->max_us) {
+        histogram->max_us = us;
+    }
+}
+
+static void histogram_print(const char *title, const latency_histogram *histogram) {
+    printf("%s: %u samples, mean %u us, max %u us\n", title, histogram->count,
+           histogram->count ? (uint32_t)(histogram->total_us / histogram->count) : 0, histogram->max_us);
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        if (histogram->buckets[bucket] == 0) {
+            continue;
+        }
+        if (bucket < LATENCY_BUCKETS - 1) {
+            printf("    <= %6u us  %5u\n", 16u << bucket, histogram->buckets[bucket]);
+        } else {
+            printf("     > %6u us  %5u\n", 16u << (bucket - 1), histogram->buckets[bucket]);
+        }
+    }
+}
+
+
+/**
+ * One request of the benchmark in flight: its buffer, when it was queued and its outcome.
+ */
+typedef struct {
+    uint8_t data[FS_ASYNC_TEST_READ_SIZE];
+    uint64_t queued_at;
+    int expected;
+    bool failed;
+} benchmark_slot;
+
+static latency_histogram completion_latency;
+
+static void benchmark_completion(fs_async_handle handle, int result, void *context) {
+    (void)handle;
+    benchmark_slot *slot = (benchmark_slot *)context;
+    histogram_add(&completion_latency, (uint32_t)(time_us_64() - slot->queued_at));
+    slot->failed = result != slot->expected;
+}
+
+
+/**
+ * Fills a buffer with the sensor record of the given index.
+ */
+static void make_record(uint8_t *record, int index) {
+    memset(record, 0, FS_ASYNC_TEST_RECORD_SIZE);
+    snprintf((char *)record, FS_ASYNC_TEST_RECORD_SIZE, "%06d,%05d,%08d", index, (index * 37) % 100000, index * 3);
+}
+
+
+/**
+ * Writes the file the benchmark reads from, and opens it.
+ */
+static FS_FILE *open_readings(const char *path) {
+    uint8_t data[FS_ASYNC_TEST_READ_SIZE];
+    FS_FILE *file = fs_open(path, "w");
+    bool ok = (file != NULL);
+    for (int i = 0; ok && i < FS_ASYNC_TEST_RECORDS / FS_ASYNC_TEST_READ_EVERY; i++) {
+        memset(data, 'a' + i % 26, sizeof(data));
+        ok = fs_write(file, data, sizeof(data)) == (int)sizeof(data);
+    }
+    if (file != NULL) {
+        fs_close(file);
+    }
+    return ok ? fs_open(path, "r") : NULL;
+}
+
+
+/**
+ * Runs the mixed load with blocking calls, recording how long each call took.
+ */
+static bool benchmark_sync(latency_histogram *histogram) {
+    FS_FILE *readings = open_readings("/root/syncReadings");
+    FS_FILE *log = fs_open("/root/syncLog", "w");
+    bool ok = (readings != NULL && log != NULL);
+    uint8_t record[FS_ASYNC_TEST_RECORD_SIZE];
+    uint8_t data[FS_ASYNC_TEST_READ_SIZE];
+
+    for (int i = 0; ok && i < FS_ASYNC_TEST_RECORDS; i++) {
+        make_record(record, i);
+        uint64_t began = time_us_64();
+        ok = fs_write(log, record, sizeof(record)) == (int)sizeof(record);
+        histogram_add(histogram, (uint32_t)(time_us_64() - began));
+
+        if (ok && i % FS_ASYNC_TEST_READ_EVERY == 0) {
+            began = time_us_64();
+            ok = fs_read(readings, data, sizeof(data)) == (int)sizeof(data);
+            histogram_add(histogram, (uint32_t)(time_us_64() - began));
+        }
+    }
+    if (readings != NULL) {
+        fs_close(readings);
+    }
+    if (log != NULL) {
+        fs_close(log);
+    }
+    return ok;
+}
+
+
+/**
+ * Queues a request of the benchmark, polling until there is room for it. The time until it
+ * is accepted is what the sensor loop sees.
+ */
+static void benchmark_submit(FS_FILE *file, bool write, benchmark_slot *slot, int size,
+                             latency_histogram *histogram) {
+    slot->queued_at = time_us_64();
+    slot->expected = size;
+    slot->failed = false;
+    fs_async_handle handle;
+    for (;;) {
+        handle = write ? fs_write_async(file, slot->data, size, benchmark_completion, slot)
+                       : fs_read_async(file, slot->data, size, benchmark_completion, slot);
+        if (handle != FS_ASYNC_INVALID) {
+            break;
+        }
+        fs_poll(0);
+    }
+    histogram_add(histogram, (uint32_t)(time_us_64() - slot->queued_at));
+}
+
+
+/**
+ * Runs the mixed load with queued requests, polling for a while after every few records as a
+ * main loop would with its spare time.
+ */
+static bool benchmark_async(latency_histogram *submit, latency_histogram *poll) {
+    // Each slot is reused only after more requests than the queue holds have been queued.
+    static benchmark_slot slots[2 * FS_ASYNC_QUEUE_DEPTH];
+    FS_FILE *readings = open_readings("/root/asyncReadings");
+    FS_FILE *log = fs_open("/root/asyncLog", "w");
+    bool ok = (readings != NULL && log != NULL);
+    uint32_t next_slot = 0;
+
+    for (int i = 0; ok && i < FS_ASYNC_TEST_RECORDS; i++) {
+        benchmark_slot *slot = &slots[next_slot++ % (2 * FS_ASYNC_QUEUE_DEPTH)];
+        ok = !slot->failed;
+        make_record(slot->data, i);
+        benchmark_submit(log, true, slot, FS_ASYNC_TEST_RECORD_SIZE, submit);
+
+        if (i % FS_ASYNC_TEST_READ_EVERY == 0) {
+            slot = &slots[next_slot++ % (2 * FS_ASYNC_QUEUE_DEPTH)];
+            ok = ok && !slot->failed;
+            benchmark_submit(readings, false, slot, FS_ASYNC_TEST_READ_SIZE, submit);
+        }
+        if (i % FS_ASYNC_TEST_POLL_EVERY == FS_ASYNC_TEST_POLL_EVERY - 1) {
+            uint64_t began = time_us_64();
+            fs_poll(FS_ASYNC_TEST_POLL_US);
+            histogram_add(poll, (uint32_t)(time_us_64() - began));
+        }
+    }
+    fs_async_drain();
+    for (uint32_t i = 0; i < 2 * FS_ASYNC_QUEUE_DEPTH; i++) {
+        ok = ok && !slots[i].failed;
+    }
+    if (readings != NULL) {
+        fs_close(readings);
+    }
+    if (log != NULL) {
+        fs_close(log);
+    }
+    return ok;
+}
+
+
+/**
+ * Checks that two files have the same contents.
+ */
+static bool same_contents(const char *path_a, const char *path_b) {
+    FS_FILE *a = fs_open(path_a, "r");
+    FS_FILE *b = fs_open(path_b, "r");
+    bool ok = (a != NULL && b != NULL && a->entry->size == b->entry->size && a->entry->size > 0);
+    uint8_t chunk_a[256], chunk_b[256];
+    while (ok) {
+        int got_a = fs_read(a, chunk_a, sizeof(chunk_a));
+        int got_b = fs_read(b, chunk_b, sizeof(chunk_b));
+        ok = got_a == got_b && got_a >= 0 && memcmp(chunk_a, chunk_b, got_a > 0 ? got_a : 0) == 0;
+        if (got_a <= 0) {
+            break;
+        }
+    }
+    if (a != NULL) {
+        fs_close(a);
+    }
+    if (b != NULL) {
+        fs_close(b);
+    }
+    return ok;
+}
+
+
+/**
+ * Runs the same mixed load of record appends and reads with blocking calls and with queued
+ * requests, and prints latency histograms of both: for the blocking run how long each call
+ * took, for the queued run how long each submission took (the time the sensor loop is held
+ * up), how long each request waited for its completion and how long each poll ran.
+ */
+void test_fs_async_latency_histogram() {
+    printf("Testing latency of blocking and asynchronous I/O under mixed load...\n");
+    latency_histogram sync_calls = { 0 };
+    latency_histogram async_submits = { 0 };
+    latency_histogram async_polls = { 0 };
+    memset(&completion_latency, 0, sizeof(completion_latency));
+
+    fs_init();
+    bool ok = benchmark_sync(&sync_calls);
+    ok = ok && benchmark_async(&async_submits, &async_polls);
+    fs_async_stats stats;
+    fs_async_get_stats(&stats);
+    ok = ok && same_contents("/root/syncLog", "/root/asyncLog");
+
+    histogram_print("Blocking fs_write/fs_read", &sync_calls);
+    histogram_print("fs_write_async/fs_read_async submission", &async_submits);
+    histogram_print("Asynchronous completion (queued to callback)", &completion_latency);
+    histogram_print("fs_poll", &async_polls);
+    printf("%u requests took %u calls (%u merged), at most %u queued\n",
+           stats.completed, stats.calls, stats.merged, stats.max_queued);
+
+    if (ok && stats.completed == stats.submitted && stats.calls < stats.completed) {
+        printf("Async Latency Test Passed - Both runs wrote the same log.\n");
+    } else {
+        printf("Async Latency Test Failed - Data %d, %u of %u requests completed in %u calls.\n",
+               ok, stats.completed, stats.submitted, stats.calls);
+    }
+}
+
+
+
+/**
+ * One core's side of the two-core test: its file, its records and what their callbacks saw.
+ * The callbacks may run on either core, but only ever one poller at a time.
+ */
+typedef struct {
+    FS_FILE *file;
+    uint8_t records[FS_ASYNC_TEST_CORE_RECORDS][FS_ASYNC_TEST_RECORD_SIZE];
+    uint32_t completed;
+    bool results_ok;
+} core_job;
+
+static core_job core_jobs[2];
+
+static void core_completion(fs_async_handle handle, int result, void *context) {
+    (void)handle;
+    core_job *job = (core_job *)context;
+    job->completed++;
+    job->results_ok = job->results_ok && result == FS_ASYNC_TEST_RECORD_SIZE;
+}
+
+/**
+ * Queues every record of a job, polling whenever the queue is full.
+ */
+static void core_submit(core_job *job) {
+    for (int i = 0; i < FS_ASYNC_TEST_CORE_RECORDS; i++) {
+        make_record(job->records[i], i);
+        while (fs_write_async(job->file, job->records[i], FS_ASYNC_TEST_RECORD_SIZE, core_completion, job)
+               == FS_ASYNC_INVALID) {
+            fs_poll(FS_ASYNC_TEST_POLL_US);
+        }
+        if (i % FS_ASYNC_TEST_POLL_EVERY == 0) {
+            fs_poll(FS_ASYNC_TEST_POLL_US);
+        }
+    }
+}
+
+#if PICO_ON_DEVICE
+static volatile bool core1_done;
+
+static void core1_entry(void) {
+    // Lets core 0 pause this core while it erases or programs, and the other way round.
+    flash_safe_execute_core_init();
+    core_submit(&core_jobs[1]);
+    flash_safe_execute_core_deinit();
+    core1_done = true;
+    __sev();
+}
+
+static void run_cores(void) {
+    core1_done = false;
+    multicore_launch_core1(core1_entry);
+    core_submit(&core_jobs[0]);
+    while (!core1_done) {
+        __wfe();
+    }
+    multicore_reset_core1();
+}
+#else
+static void *core_thread_entry(void *job) {
+    core_submit((core_job *)job);
+    return NULL;
+}
+
+static void run_cores(void) {
+    pthread_t thread;
+    bool started = pthread_create(&thread, NULL, core_thread_entry, &core_jobs[1]) == 0;
+    core_submit(&core_jobs[0]);
+    if (started) {
+        pthread_join(thread, NULL);
+    } else {
+        core_submit(&core_jobs[1]);
+    }
+}
+#endif
+
+
+/**
+ * Both cores queue writes to a file of their own and poll at the same time. Every request
+ * completes once, with its full size, and each file holds its core's records in order.
+ */
+void test_fs_async_two_cores() {
+    printf("Testing asynchronous requests queued and polled from two cores...\n");
+    fs_init();
+    fs_async_init();
+    const char *paths[2] = { "/root/asyncCore0", "/root/asyncCore1" };
+    bool ok = true;
+    for (int c = 0; c < 2; c++) {
+        memset(&core_jobs[c], 0, sizeof(core_jobs[c]));
+        core_jobs[c].results_ok = true;
+        core_jobs[c].file = fs_open(paths[c], "w");
+        ok = ok && core_jobs[c].file != NULL;
+    }
+
+    if (ok) {
+        run_cores();
+        fs_async_drain();
+    }
+    fs_async_stats stats;
+    fs_async_get_stats(&stats);
+
+    uint8_t expected[FS_ASYNC_TEST_RECORD_SIZE];
+    uint8_t record[FS_ASYNC_TEST_RECORD_SIZE];
+    for (int c = 0; c < 2; c++) {
+        if (core_jobs[c].file != NULL) {
+            fs_close(core_jobs[c].file);
+        }
+        ok = ok && core_jobs[c].completed == FS_ASYNC_TEST_CORE_RECORDS && core_jobs[c].results_ok;
+        FS_FILE *file = ok ? fs_open(paths[c], "r") : NULL;
+        ok = ok && file != NULL;
+        for (int i = 0; ok && i < FS_ASYNC_TEST_CORE_RECORDS; i++) {
+            make_record(expected, i);
+            ok = fs_read(file, record, sizeof(record)) == (int)sizeof(record)
+                && memcmp(record, expected, sizeof(record)) == 0;
+        }
+        if (file != NULL) {
+            fs_close(file);
+        }
+    }
+
+    if (ok && stats.submitted == 2 * FS_ASYNC_TEST_CORE_RECORDS && stats.completed == stats.submitted) {
+        printf("Async Two Core Test Passed - %u requests from two cores in %u calls, each file in order.\n",
+               stats.completed, stats.calls);
+    } else {
+        printf("Async Two Core Test Failed - %u and %u of %u requests completed, %u submitted in all.\n",
+               core_jobs[0].completed, core_jobs[1].completed, FS_ASYNC_TEST_CORE_RECORDS, stats.submitted);
+    }
+}
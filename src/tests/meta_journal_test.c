@@ -0,0 +1,279 @@
+#include "../filesystem/meta_journal.h"
+#include "../filesystem/meta_table.h"
+#include "../filesystem/name_pool.h"
+#include "../filesystem/filesystem.h"
+#include "../filesystem/filesystem_helper.h"
+#include "../directory/directories.h"
+#include "../directory/directory_helpers.h"
+#include "../FAT/fat_fs.h"
+#include "../tests/meta_journal_test.h"
+#include <stdio.h>
+#include <string.h>
+#include "pico/time.h"
+
+
+void run_all_tests_meta_journal() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_meta_journal_commit_cost();
+    printf("%s", slashes);
+    test_meta_journal_recovery();
+    printf("%s", slashes);
+    test_meta_journal_ring_wrap();
+    printf("%s", slashes);
+    test_meta_journal_fat_persistence();
+    printf("%s", slashes);
+}
+
+
+
+
+/**
+ * Creates a file holding a short text and commits it.
+ */
+static bool write_text_file(const char *path, const char *text) {
+    FS_FILE *file = fs_open(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    int written = fs_write(file, text, strlen(text));
+    fs_close(file);
+    fs_sync();
+    return written == (int)strlen(text);
+}
+
+
+/**
+ * Checks that a file exists and holds exactly the given text.
+ */
+static bool file_holds(const char *path, const char *text) {
+    FS_FILE *file = fs_open(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    char buffer[64] = {0};
+    int read = fs_read(file, buffer, sizeof(buffer) - 1);
+    fs_close(file);
+    return read == (int)strlen(text) && strcmp(buffer, text) == 0;
+}
+
+
+/**
+ * Creates a file in filesystems holding 20, 100 and 300 files and compares the bytes the
+ * commit programs with what rewriting the tables and the FAT as a whole would take. The
+ * commit should stay the same size however many files exist.
+ */
+void test_meta_journal_commit_cost() {
+    printf("Testing metadata commit cost against table size...\n");
+    const int counts[] = {20, 100, 300};
+    uint32_t commitBytes[3];
+    char path[48];
+    int created = 0;
+    bool ok = true;
+
+    for (int c = 0; c < 3 && ok; c++) {
+        for (; created < counts[c] && ok; created++) {
+            snprintf(path, sizeof(path), "/root/journalCost%d", created);
+            FS_FILE *file = fs_open(path, "w");
+            ok = (file != NULL);
+            if (file != NULL) {
+                fs_close(file);
+            }
+        }
+
+        meta_journal_reset_stats();
+        snprintf(path, sizeof(path), "/root/journalProbe%d", c);
+        FS_FILE *probe = fs_open(path, "w");
+        ok = ok && (probe != NULL);
+        if (probe != NULL) {
+            fs_close(probe);
+        }
+
+        meta_journal_stats stats;
+        name_pool_stats names;
+        meta_journal_get_stats(&stats);
+        name_pool_get_stats(&names);
+        uint32_t rewriteBytes = file_entry_count() * sizeof(FileEntry) + dir_entry_count() * sizeof(DirectoryEntry)
+                                + names.bytes_used + TOTAL_BLOCKS * sizeof(uint32_t);
+        commitBytes[c] = stats.last_commit_bytes;
+        printf("%4d files: commit %u bytes in %u us, %u records; whole-table rewrite %u bytes\n",
+               counts[c], stats.last_commit_bytes, stats.last_commit_us, stats.records, rewriteBytes);
+    }
+
+    for (int i = 0; i < created; i++) {
+        snprintf(path, sizeof(path), "/root/journalCost%d", i);
+        fs_rm(path);
+    }
+    for (int c = 0; c < 3; c++) {
+        snprintf(path, sizeof(path), "/root/journalProbe%d", c);
+        fs_rm(path);
+    }
+
+    if (ok && commitBytes[2] > 0 && commitBytes[2] < FILESYSTEM_BLOCK_SIZE && commitBytes[2] <= 2 * commitBytes[0]) {
+        printf("Meta Journal Commit Cost Test Passed - Commit size does not grow with the tables.\n");
+    } else {
+        printf("Meta Journal Commit Cost Test Failed - Commit size grew with the tables.\n");
+    }
+}
+
+
+/**
+ * Creates, writes, removes and moves files, then recovers the filesystem from flash as a
+ * boot after power loss would, and checks that every committed change is there.
+ */
+void test_meta_journal_recovery() {
+    printf("Testing metadata recovery from the journal...\n");
+    bool ok = write_text_file("/root/journalA.txt", "alpha contents")
+              && write_text_file("/root/journalB.txt", "beta contents")
+              && fs_create_directory("/journalDir")
+              && write_text_file("/root/journalC.txt", "gamma contents");
+    ok = ok && fs_rm("/root/journalB.txt") == 0;
+    ok = ok && fs_mv("journalC.txt", "/journalDir/journalC.txt") == 0;
+    uint32_t freeBefore = fat_free_block_count();
+
+    int recovered = fs_mount();
+    meta_journal_stats stats;
+    meta_journal_get_stats(&stats);
+    uint32_t freeAfter = fat_free_block_count();
+    printf("Recovered: %d, records replayed: %u, free blocks before %u, after %u\n",
+           recovered, stats.replayed_records, freeBefore, freeAfter);
+
+    bool contents = file_holds("/root/journalA.txt", "alpha contents")
+                    && file_holds("/journalDir/journalC.txt", "gamma contents");
+    FS_FILE *removed = fs_open("/root/journalB.txt", "r");
+    if (removed != NULL) {
+        fs_close(removed);
+    }
+
+    fs_rm("/root/journalA.txt");
+    fs_rm("/journalDir/journalC.txt");
+
+    if (ok && recovered == 0 && contents && removed == NULL && freeBefore == freeAfter
+        && DIR_find_directory_entry("/journalDir") != NULL) {
+        printf("Meta Journal Recovery Test Passed - Committed changes survived recovery.\n");
+    } else {
+        printf("Meta Journal Recovery Test Failed - Recovered metadata does not match.\n");
+    }
+}
+
+
+/**
+ * Commits enough changes to wrap the journal ring several times, so that checkpoints are
+ * taken along the way, and checks that recovery still finds the latest state.
+ */
+void test_meta_journal_ring_wrap() {
+    printf("Testing recovery after the journal ring wraps...\n");
+    meta_journal_reset_stats();
+    char path[48];
+    bool ok = true;
+    for (int i = 0; i < 300 && ok; i++) {
+        snprintf(path, sizeof(path), "/root/journalWrap%d", i % 7);
+        FS_FILE *file = fs_open(path, "w");
+        ok = (file != NULL);
+        if (file != NULL) {
+            fs_close(file);
+        }
+        if (i % 2 == 1) {
+            fs_rm(path);
+        }
+    }
+    ok = ok && write_text_file("/root/journalWrap.txt", "after the wrap");
+
+    meta_journal_stats stats;
+    meta_journal_get_stats(&stats);
+    printf("Commits: %u, checkpoints: %u, sectors erased: %u, bytes written: %u\n",
+           stats.commits, stats.checkpoints, stats.sectors_erased, stats.bytes_written);
+    uint32_t freeBefore = fat_free_block_count();
+
+    int recovered = fs_mount();
+    bool contents = file_holds("/root/journalWrap.txt", "after the wrap");
+    uint32_t freeAfter = fat_free_block_count();
+
+    fs_rm("/root/journalWrap.txt");
+    for (int i = 0; i < 7; i++) {
+        snprintf(path, sizeof(path), "/root/journalWrap%d", i);
+        if (find_file_existance(path + 6, get_root_directory_id()) == 0) {
+            fs_rm(path);
+        }
+    }
+
+    if (ok && stats.checkpoints > 0 && recovered == 0 && contents && freeBefore == freeAfter) {
+        printf("Meta Journal Ring Test Passed - Recovery found the state after %u checkpoints.\n", stats.checkpoints);
+    } else {
+        printf("Meta Journal Ring Test Failed - State after the ring wrapped was not recovered.\n");
+    }
+}
+
+
+/**
+ * Changes 1, 8 and 32 file chains and reports what committing them and checkpointing the
+ * FAT costs. A checkpoint should only rewrite the FAT sectors holding changed entries, and
+ * nothing at all when the FAT has not changed.
+ */
+void test_meta_journal_fat_persistence() {
+    printf("Testing FAT persistence cost against dirty chains...\n");
+    const int chains[] = {1, 8, 32};
+    char path[48];
+    char data[FILESYSTEM_BLOCK_SIZE + 100];
+    memset(data, 'f', sizeof(data));
+    // The first checkpoint moves the changed table pages to fresh blocks; the second frees
+    // the blocks they left.
+    bool ok = meta_journal_checkpoint(NULL) == JOURNAL_SUCCESS && meta_journal_checkpoint(NULL) == JOURNAL_SUCCESS;
+
+    // With nothing changed, a checkpoint writes no FAT sector.
+    fat_persist_stats fat;
+    fat_reset_persist_stats();
+    ok = ok && meta_journal_checkpoint(NULL) == JOURNAL_SUCCESS;
+    fat_get_persist_stats(&fat);
+    bool idleClean = (fat.last_save_sectors == 0);
+
+    uint32_t fullSectors = 0;
+    for (int c = 0; c < 3 && ok; c++) {
+        meta_journal_reset_stats();
+        for (int i = 0; i < chains[c] && ok; i++) {
+            snprintf(path, sizeof(path), "/root/fatChain%d", i);
+            FS_FILE *file = fs_open(path, "w");
+            ok = (file != NULL) && fs_write(file, data, sizeof(data)) == (int)sizeof(data);
+            if (file != NULL) {
+                fs_close(file);
+            }
+        }
+        ok = ok && fs_sync() == 0;
+        meta_journal_stats journal;
+        meta_journal_get_stats(&journal);
+
+        fat_reset_persist_stats();
+        ok = ok && meta_journal_checkpoint(NULL) == JOURNAL_SUCCESS;
+        fat_get_persist_stats(&fat);
+        if (fat.last_save_sectors > fullSectors) {
+            fullSectors = fat.last_save_sectors;
+        }
+        printf("%3d chains: journal %u bytes in %u commits (%u us last); FAT checkpoint %u of %u sectors, "
+               "%u bytes in %u us; unpacked FAT %u bytes\n",
+               chains[c], journal.bytes_written, journal.commits, journal.last_commit_us,
+               fat.last_save_sectors, FAT_SECTORS, fat.bytes_written, fat.last_save_us,
+               (unsigned)(TOTAL_BLOCKS * sizeof(uint32_t)));
+
+        for (int i = 0; i < chains[c]; i++) {
+            snprintf(path, sizeof(path), "/root/fatChain%d", i);
+            fs_rm(path);
+        }
+    }
+
+    // The packed FAT comes back intact from its sectors. Unmounting frees the blocks of the
+    // pages its checkpoint moved before the last checkpoint is taken.
+    ok = ok && write_text_file("/root/fatKept.txt", "fat survives");
+    ok = ok && fs_unmount() == 0;
+    uint32_t freeBefore = fat_free_block_count();
+    ok = ok && fs_mount() == 0;
+    bool contents = file_holds("/root/fatKept.txt", "fat survives");
+    ok = ok && fat_free_block_count() == freeBefore;
+    fs_rm("/root/fatKept.txt");
+
+    if (ok && idleClean && contents && fullSectors <= FAT_SECTORS) {
+        printf("Meta Journal FAT Persistence Test Passed - Only changed FAT sectors were written.\n");
+    } else {
+        printf("Meta Journal FAT Persistence Test Failed - FAT checkpoint cost or contents were wrong.\n");
+    }
+}
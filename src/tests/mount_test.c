@@ -0,0 +1,215 @@
+#include "../filesystem/filesystem.h"
+#include "../filesystem/filesystem_helper.h"
+#include "../filesystem/meta_journal.h"
+#include "../directory/directories.h"
+#include "../directory/directory_helpers.h"
+#include "../flash/flash_ops.h"
+#include "../FAT/fat_fs.h"
+#include "../tests/mount_test.h"
+#include "hardware/flash.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "pico/time.h"
+
+
+void run_all_tests_mount() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_mount_clean_snapshot();
+    printf("%s", slashes);
+    test_mount_after_unclean_shutdown();
+    printf("%s", slashes);
+    test_mount_time();
+    printf("%s", slashes);
+    test_mount_rejects_bad_superblock();
+    printf("%s", slashes);
+}
+
+
+
+
+/**
+ * Creates a file holding a short text.
+ */
+static bool write_text_file(const char *path, const char *text) {
+    FS_FILE *file = fs_open(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    int written = fs_write(file, text, strlen(text));
+    fs_close(file);
+    fs_sync();
+    return written == (int)strlen(text);
+}
+
+
+/**
+ * Checks that a file exists and holds exactly the given text.
+ */
+static bool file_holds(const char *path, const char *text) {
+    FS_FILE *file = fs_open(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    char buffer[64] = {0};
+    int read = fs_read(file, buffer, sizeof(buffer) - 1);
+    fs_close(file);
+    return read == (int)strlen(text) && strcmp(buffer, text) == 0;
+}
+
+
+/**
+ * Unmounts cleanly and mounts again. The indexes should come from the snapshot, with
+ * nothing replayed, and files should be found through them as before.
+ */
+void test_mount_clean_snapshot() {
+    printf("Testing mount after a clean unmount...\n");
+    bool ok = write_text_file("/root/mountA.txt", "clean mount")
+              && fs_create_directory("/mountDir")
+              && write_text_file("/mountDir/mountB.txt", "in a directory");
+
+    int unmounted = fs_unmount();
+    uint32_t freeBefore = fat_free_block_count();
+    int mounted = fs_mount();
+    fs_mount_stats stats;
+    fs_get_mount_stats(&stats);
+    printf("Mounted: %d in %u us (journal %u us, indexes %u us), snapshot used: %d, records replayed: %u\n",
+           mounted, stats.total_us, stats.journal_us, stats.index_us, stats.used_snapshot, stats.replayed_records);
+
+    bool contents = file_holds("/root/mountA.txt", "clean mount")
+                    && file_holds("/mountDir/mountB.txt", "in a directory");
+    uint32_t freeAfter = fat_free_block_count();
+
+    // A file created after the mount must not collide with the loaded indexes.
+    ok = ok && write_text_file("/root/mountC.txt", "after mount") && file_holds("/root/mountC.txt", "after mount");
+
+    fs_rm("/root/mountA.txt");
+    fs_rm("/root/mountC.txt");
+    fs_rm("/mountDir/mountB.txt");
+
+    if (ok && unmounted == 0 && mounted == 0 && stats.used_snapshot && stats.replayed_records == 0
+        && contents && freeBefore == freeAfter) {
+        printf("Mount Clean Snapshot Test Passed - Indexes were loaded from the snapshot.\n");
+    } else {
+        printf("Mount Clean Snapshot Test Failed - Mount after a clean unmount did not match.\n");
+    }
+}
+
+
+/**
+ * Unmounts cleanly, then changes the filesystem without unmounting again, as a power loss
+ * would leave it. The mount has to replay the journal and rebuild the indexes instead of
+ * trusting the older snapshot.
+ */
+void test_mount_after_unclean_shutdown() {
+    printf("Testing mount after an unclean shutdown...\n");
+    bool ok = write_text_file("/root/mountOld.txt", "before unmount");
+    ok = ok && fs_unmount() == 0;
+    ok = ok && write_text_file("/root/mountNew.txt", "after unmount");
+    ok = ok && fs_rm("/root/mountOld.txt") == 0;
+
+    int mounted = fs_mount();
+    fs_mount_stats stats;
+    fs_get_mount_stats(&stats);
+    printf("Mounted: %d, snapshot used: %d, records replayed: %u\n",
+           mounted, stats.used_snapshot, stats.replayed_records);
+
+    bool contents = file_holds("/root/mountNew.txt", "after unmount");
+    FS_FILE *removed = fs_open("/root/mountOld.txt", "r");
+    if (removed != NULL) {
+        fs_close(removed);
+    }
+    fs_rm("/root/mountNew.txt");
+
+    if (ok && mounted == 0 && !stats.used_snapshot && stats.replayed_records > 0 && contents && removed == NULL) {
+        printf("Mount Unclean Shutdown Test Passed - Changes after the snapshot were replayed.\n");
+    } else {
+        printf("Mount Unclean Shutdown Test Failed - Stale snapshot or lost changes.\n");
+    }
+}
+
+
+/**
+ * Reports mount time with 20, 100 and 200 files, after a clean unmount and after an
+ * unclean shutdown, where the indexes are rebuilt from every table entry.
+ */
+void test_mount_time() {
+    printf("Testing mount time against the number of files...\n");
+    // 200 files fill most of a 2 MB flash, so blocks left behind by earlier tests must not
+    // take the room the mount snapshot needs.
+    fs_init();
+    const int counts[] = {20, 100, 200};
+    char path[48];
+    int created = 0;
+    bool ok = true;
+
+    for (int c = 0; c < 3 && ok; c++) {
+        for (; created < counts[c] && ok; created++) {
+            snprintf(path, sizeof(path), "/root/mountTime%d", created);
+            FS_FILE *file = fs_open(path, "w");
+            ok = (file != NULL);
+            if (file != NULL) {
+                fs_close(file);
+            }
+        }
+
+        fs_mount_stats clean;
+        fs_mount_stats rebuilt;
+        ok = ok && fs_unmount() == 0 && fs_mount() == 0;
+        fs_get_mount_stats(&clean);
+        ok = ok && clean.used_snapshot;
+
+        // One more change leaves the snapshot stale, as a power loss would.
+        snprintf(path, sizeof(path), "/root/mountTime%d", created - 1);
+        ok = ok && fs_rm(path) == 0 && write_text_file(path, "x");
+        ok = ok && fs_mount() == 0;
+        fs_get_mount_stats(&rebuilt);
+        ok = ok && !rebuilt.used_snapshot;
+
+        printf("%4d files: clean mount %u us (indexes %u us), unclean mount %u us (indexes %u us, %u records), "
+               "block log scan %u us\n",
+               counts[c], clean.total_us, clean.index_us, rebuilt.total_us, rebuilt.index_us,
+               rebuilt.replayed_records, clean.block_log_us);
+    }
+
+    for (int i = 0; i < created; i++) {
+        snprintf(path, sizeof(path), "/root/mountTime%d", i);
+        fs_rm(path);
+    }
+
+    if (ok) {
+        printf("Mount Time Test Passed - Mounted cleanly and uncleanly at every size.\n");
+    } else {
+        printf("Mount Time Test Failed - A mount did not succeed.\n");
+    }
+}
+
+
+/**
+ * Erases the superblock and checks that fs_mount() refuses the flash without touching the
+ * running filesystem, then puts the superblock back.
+ */
+void test_mount_rejects_bad_superblock() {
+    printf("Testing mount with a missing superblock...\n");
+    uint32_t offset = SUPERBLOCK_BLOCK * FILESYSTEM_BLOCK_SIZE;
+    uint8_t saved[FLASH_PAGE_SIZE];
+    memcpy(saved, (const void *)(XIP_BASE + offset), sizeof(saved));
+
+    bool ok = write_text_file("/root/mountKept.txt", "still here");
+    flash_erase_range(offset, FILESYSTEM_BLOCK_SIZE);
+    int rejected = fs_mount();
+    bool untouched = fs_initialized && file_holds("/root/mountKept.txt", "still here");
+
+    flash_program_safe(offset, saved, sizeof(saved), NULL);
+    int restored = fs_mount();
+    bool contents = file_holds("/root/mountKept.txt", "still here");
+    fs_rm("/root/mountKept.txt");
+
+    if (ok && rejected == -1 && untouched && restored == 0 && contents) {
+        printf("Mount Superblock Test Passed - Flash without a superblock was refused.\n");
+    } else {
+        printf("Mount Superblock Test Failed - Expected -1 without a superblock, got %d.\n", rejected);
+    }
+}
@@ -0,0 +1,319 @@
+#include "../filesystem/filesystem.h"
+#include "../filesystem/filesystem_helper.h"
+#include "../filesystem/file_index.h"
+#include "../filesystem/meta_table.h"
+#include "../filesystem/name_pool.h"
+#include "../directory/directories.h"
+#include "../directory/directory_helpers.h"
+#include "../FAT/fat_fs.h"
+#include "../tests/readdir_test.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico/time.h"
+
+// Files of the large directory in the benchmark, and listings timed per measurement.
+#define READDIR_TEST_MANY 1000
+#define READDIR_TEST_FEW 10
+#define READDIR_TEST_LISTINGS 20
+
+
+void run_all_tests_readdir() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_readdir_lists_children();
+    printf("%s", slashes);
+    test_readdir_remove_while_listing();
+    printf("%s", slashes);
+    test_readdir_benchmark();
+    printf("%s", slashes);
+}
+
+
+
+
+/**
+ * What a listing found: how many children, how many of them directories, the sum of the
+ * file sizes, and a bit for each child named "f<n>" or "d<n>" with n below 32.
+ */
+typedef struct {
+    int count;
+    int directories;
+    uint32_t bytes;
+    uint32_t files_seen;
+    uint32_t dirs_seen;
+} listing;
+
+static listing list_directory(const char* path) {
+    listing result = { 0 };
+    FS_DIR* dir = fs_opendir(path);
+    if (dir == NULL) {
+        result.count = -1;
+        return result;
+    }
+    fs_dirent* child;
+    while ((child = fs_readdir(dir)) != NULL) {
+        int n = atoi(child->name + 1);
+        result.count++;
+        if (child->is_directory) {
+            result.directories++;
+            result.dirs_seen |= (child->name[0] == 'd' && n < 32) ? 1u << n : 0;
+        } else {
+            result.bytes += child->size;
+            result.files_seen |= (child->name[0] == 'f' && n < 32) ? 1u << n : 0;
+        }
+    }
+    fs_closedir(dir);
+    return result;
+}
+
+static bool write_file(const char* path, const char* text) {
+    FS_FILE* file = fs_open(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    bool ok = fs_write(file, text, strlen(text)) == (int)strlen(text);
+    fs_close(file);
+    return ok;
+}
+
+
+/**
+ * A listing holds exactly the directory's subdirectories and files, follows removals and
+ * moves, and survives a remount.
+ */
+void test_readdir_lists_children() {
+    printf("Testing fs_opendir() and fs_readdir()...\n");
+    fs_init();
+
+    char path[48];
+    bool ok = fs_create_directory("/root/ls") && fs_create_directory("/root/ls/d0")
+        && fs_create_directory("/root/ls/d1") && fs_create_directory("/root/elsewhere")
+        && write_file("/root/elsewhere/f0", "not listed");
+    for (int i = 0; i < 4 && ok; i++) {
+        snprintf(path, sizeof(path), "/root/ls/f%d", i);
+        ok = write_file(path, "abc");
+    }
+    listing before = list_directory("/root/ls");
+    bool complete = ok && before.count == 6 && before.directories == 2 && before.bytes == 12
+        && before.files_seen == 0xF && before.dirs_seen == 0x3;
+
+    // Remove f1 and move f2 away; the listing no longer has them, and "elsewhere" has f2.
+    ok = ok && fs_rm("/root/ls/f1") == 0 && fs_mv("/root/ls/f2", "/root/elsewhere/f2") == 0;
+    listing after = list_directory("/root/ls");
+    listing other = list_directory("/root/elsewhere");
+    bool follows = ok && after.count == 4 && after.files_seen == 0x9
+        && other.count == 2 && other.files_seen == 0x5;
+
+    ok = ok && fs_unmount() == 0 && fs_mount() == 0;
+    listing remounted = list_directory("/root/ls");
+    bool persisted = ok && remounted.count == after.count && remounted.files_seen == after.files_seen
+        && remounted.dirs_seen == after.dirs_seen;
+    bool missing = fs_opendir("/root/nothing") == NULL;
+
+    if (complete && follows && persisted && missing) {
+        printf("Readdir Test Passed - listed 2 directories and 4 files, then 2 files after rm and mv.\n");
+    } else {
+        printf("Readdir Test Failed - complete %d, follows rm and mv %d, after remount %d, missing %d.\n",
+               complete, follows, persisted, missing);
+    }
+}
+
+
+/**
+ * Removing each file as soon as fs_readdir() returns it lists every file once and leaves
+ * the directory empty.
+ */
+void test_readdir_remove_while_listing() {
+    printf("Testing removal of files while listing them...\n");
+    fs_init();
+
+    char path[sizeof("/root/drain/") + NAME_POOL_MAX_LENGTH]; // Room for any listed name.
+    bool ok = fs_create_directory("/root/drain");
+    for (int i = 0; i < 8 && ok; i++) {
+        snprintf(path, sizeof(path), "/root/drain/f%d", i);
+        ok = write_file(path, "x");
+    }
+    uint32_t removed = 0;
+    FS_DIR* dir = ok ? fs_opendir("/root/drain") : NULL;
+    fs_dirent* child;
+    while (dir != NULL && (child = fs_readdir(dir)) != NULL) {
+        snprintf(path, sizeof(path), "/root/drain/%s", child->name);
+        if (fs_rm(path) == 0) {
+            removed |= 1u << atoi(child->name + 1);
+        }
+    }
+    fs_closedir(dir);
+    listing left = list_directory("/root/drain");
+
+    if (ok && dir != NULL && removed == 0xFF && left.count == 0) {
+        printf("Readdir Test Passed - all 8 files listed and removed during the listing.\n");
+    } else {
+        printf("Readdir Test Failed - removed mask 0x%X, %d children left.\n", removed, left.count);
+    }
+}
+
+
+/**
+ * Adds count entries named "bench_<n>" to a directory without data blocks, as the lookup
+ * benchmark of filesystem_helper_test.c does, listing each one in the directory.
+ */
+static int add_entries(uint32_t dirId, int *slots, int count) {
+    int added = 0;
+    for (int n = 0; n < count; n++) {
+        int slot = file_index_unused_slot();
+        if (slot < 0) {
+            slot = file_entry_count();
+            if (file_table_grow() != 0) {
+                slots[n] = -1;
+                continue;
+            }
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "bench_%d", n);
+        FileEntry *entry = file_entry_at(slot);
+        memset(entry, 0, sizeof(FileEntry));
+        meta_table_pin(entry);
+        name_pool_set(&entry->filename, name);
+        meta_table_unpin(entry);
+        entry->parentDirId = dirId;
+        entry->unique_file_id = 0x20000000u + n;
+        entry->start_block = FAT_ENTRY_END;
+        entry->in_use = true;
+        file_index_insert(slot);
+        dir_link_file(slot);
+        slots[n] = slot;
+        added++;
+    }
+    return added;
+}
+
+static void remove_entries(const int *slots, int count) {
+    for (int n = 0; n < count; n++) {
+        if (slots[n] >= 0) {
+            dir_unlink_file(slots[n]);
+            FileEntry *entry = file_entry_at(slots[n]);
+            file_index_remove(slots[n]);
+            name_pool_clear(&entry->filename);
+            memset(entry, 0, sizeof(FileEntry));
+        }
+    }
+}
+
+
+/**
+ * Lists a directory the way print_directory() in visual.c does: every slot of the directory
+ * table is checked for subdirectories, and every slot of the file table for files.
+ */
+static int scan_directory(uint32_t dirId) {
+    int count = 0;
+    char name[NAME_POOL_MAX_LENGTH + 1];
+    uint32_t dirCount = dir_entry_count();
+    for (uint32_t i = 0; i < dirCount; i++) {
+        DirectoryEntry* entry = dir_entry_at(i);
+        if (entry != NULL && entry->in_use && entry->is_directory && entry->parentDirId == dirId) {
+            snprintf(name, sizeof(name), "%s", name_pool_str(&entry->name));
+            count++;
+        }
+    }
+    uint32_t fileCount = file_entry_count();
+    for (uint32_t i = 0; i < fileCount; i++) {
+        FileEntry* file = file_entry_at(i);
+        if (file != NULL && file->in_use && !file->is_directory && file->parentDirId == dirId) {
+            snprintf(name, sizeof(name), "%s", name_pool_str(&file->filename));
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Times READDIR_TEST_LISTINGS listings of a directory with fs_readdir() and with a table
+ * scan, and prints both.
+ *
+ * @return true if both found the expected number of children every time.
+ */
+static bool time_listing(const char* label, const char* path, int expected) {
+    DirectoryEntry* directory = DIR_find_directory_entry(path);
+    if (directory == NULL) {
+        return false;
+    }
+    uint32_t dirId = directory->currentDirId;
+    bool ok = true;
+
+    uint64_t began = time_us_64();
+    for (int i = 0; i < READDIR_TEST_LISTINGS; i++) {
+        ok = ok && list_directory(path).count == expected;
+    }
+    uint32_t listed_us = (uint32_t)((time_us_64() - began) / READDIR_TEST_LISTINGS);
+
+    began = time_us_64();
+    for (int i = 0; i < READDIR_TEST_LISTINGS; i++) {
+        meta_table_lock();
+        ok = ok && scan_directory(dirId) == expected;
+        meta_table_unlock();
+    }
+    uint32_t scanned_us = (uint32_t)((time_us_64() - began) / READDIR_TEST_LISTINGS);
+
+    printf("%s: fs_readdir() %u us, table scan %u us per listing\n", label, listed_us, scanned_us);
+    return ok;
+}
+
+
+/**
+ * Benchmark: listing the root with 10 and with 1000 files, and listing a directory of 10
+ * files while the root holds 1000, with fs_readdir() and with the table scan of visual.c.
+ * fs_readdir() costs the same for the small directory whatever else the filesystem holds.
+ * Passes if both ways list the same children.
+ */
+void test_readdir_benchmark() {
+    printf("Benchmarking directory listings...\n");
+    fs_init();
+    uint32_t rootId = get_root_directory_id();
+    bool ok = fs_create_directory("/root/small");
+    DirectoryEntry* small = DIR_find_directory_entry("/root/small");
+    uint32_t smallId = (small != NULL) ? small->currentDirId : 0;
+    ok = ok && small != NULL;
+
+    int few[READDIR_TEST_FEW];
+    int *many = malloc(READDIR_TEST_MANY * sizeof(int));
+    ok = ok && many != NULL;
+    if (ok) {
+        meta_table_lock();
+        ok = add_entries(rootId, few, READDIR_TEST_FEW) == READDIR_TEST_FEW;
+        meta_table_unlock();
+    }
+    // The root also holds the "small" directory.
+    ok = ok && time_listing("Root, 10 files", "/root", READDIR_TEST_FEW + 1);
+
+    if (ok) {
+        meta_table_lock();
+        ok = add_entries(rootId, many, READDIR_TEST_MANY - READDIR_TEST_FEW) == READDIR_TEST_MANY - READDIR_TEST_FEW;
+        meta_table_unlock();
+    }
+    ok = ok && time_listing("Root, 1000 files", "/root", READDIR_TEST_MANY + 1);
+
+    int inside[READDIR_TEST_FEW];
+    if (ok) {
+        meta_table_lock();
+        ok = add_entries(smallId, inside, READDIR_TEST_FEW) == READDIR_TEST_FEW;
+        meta_table_unlock();
+    }
+    ok = ok && time_listing("10 files, 1000 elsewhere", "/root/small", READDIR_TEST_FEW);
+
+    meta_table_lock();
+    remove_entries(few, READDIR_TEST_FEW);
+    if (many != NULL) {
+        remove_entries(many, READDIR_TEST_MANY - READDIR_TEST_FEW);
+    }
+    remove_entries(inside, READDIR_TEST_FEW);
+    meta_table_unlock();
+    free(many);
+
+    if (ok) {
+        printf("Readdir Test Passed - fs_readdir() and the table scan listed the same children.\n");
+    } else {
+        printf("Readdir Test Failed - the listings differ or the entries could not be added.\n");
+    }
+}
@@ -0,0 +1,338 @@
+#include "../filesystem/filesystem.h"
+#include "../filesystem/ring_log.h"
+#include "../flash/flush_worker.h"
+#include "../tests/ring_log_test.h"
+#include <stdio.h>
+#include <string.h>
+#include "pico/time.h"
+
+#if PICO_ON_DEVICE
+#include "pico/multicore.h"
+#include "pico/flash.h"
+#else
+#include <pthread.h>
+#endif
+
+// Telemetry records of the tests: a producer number, a record number and padding.
+#define RING_LOG_TEST_RECORD_SIZE 32
+#define RING_LOG_TEST_BASELINE_RECORDS 2000
+#define RING_LOG_TEST_BENCH_RECORDS 1000
+#define RING_LOG_TEST_BENCH_BLOCKS 32
+
+
+void run_all_tests_ring_log() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_ring_log_append_and_iterate();
+    printf("%s", slashes);
+    test_ring_log_overwrites_oldest();
+    printf("%s", slashes);
+    test_ring_log_throughput();
+    printf("%s", slashes);
+}
+
+
+
+
+typedef struct {
+    uint32_t producer;
+    uint32_t number;
+    uint8_t padding[RING_LOG_TEST_RECORD_SIZE - 8];
+} telemetry_record;
+
+static void make_record(telemetry_record *record, uint32_t producer, uint32_t number) {
+    record->producer = producer;
+    record->number = number;
+    memset(record->padding, (uint8_t)(producer * 16 + number), sizeof(record->padding));
+}
+
+
+/**
+ * What a visitor found: the first and last record numbers of each producer, and whether
+ * every producer's records came in order, one after the other, with intact padding.
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t first[2];
+    uint32_t last[2];
+    uint32_t seen[2];
+    bool in_order;
+} visit_summary;
+
+static bool summarize(const void *data, uint16_t length, void *context) {
+    visit_summary *summary = (visit_summary *)context;
+    telemetry_record record;
+    telemetry_record expected;
+    if (length != sizeof(record)) {
+        summary->in_order = false;
+        return false;
+    }
+    memcpy(&record, data, sizeof(record));
+    if (record.producer > 1) {
+        summary->in_order = false;
+        return false;
+    }
+    make_record(&expected, record.producer, record.number);
+    uint32_t p = record.producer;
+    if (summary->seen[p] > 0 && record.number != summary->last[p] + 1) {
+        summary->in_order = false;
+    }
+    if (summary->seen[p]++ == 0) {
+        summary->first[p] = record.number;
+    }
+    summary->last[p] = record.number;
+    summary->in_order = summary->in_order && memcmp(&record, &expected, sizeof(record)) == 0;
+    summary->count++;
+    return true;
+}
+
+static visit_summary summarize_log(fs_log *log) {
+    visit_summary summary = { 0 };
+    summary.in_order = true;
+    fs_log_iterate(log, summarize, &summary);
+    return summary;
+}
+
+
+/**
+ * Records come back in order, whether still in RAM or on flash, and records of different
+ * lengths are kept apart.
+ */
+static bool check_lengths(const void *data, uint16_t length, void *context) {
+    uint32_t *next = (uint32_t *)context;
+    const uint8_t *bytes = (const uint8_t *)data;
+    bool ok = length == *next % FS_LOG_MAX_RECORD + 1;
+    for (uint16_t i = 0; i < length && ok; i++) {
+        ok = bytes[i] == (uint8_t)(*next + i);
+    }
+    if (ok) {
+        (*next)++;
+    }
+    return ok;
+}
+
+void test_ring_log_append_and_iterate() {
+    printf("Testing ring log appends of varying length...\n");
+    fs_init();
+
+    fs_log *log = fs_log_open("/root/telemetry", 4);
+    uint8_t record[FS_LOG_MAX_RECORD];
+    bool ok = (log != NULL);
+    for (uint32_t i = 0; i < 300 && ok; i++) {
+        uint16_t length = i % FS_LOG_MAX_RECORD + 1;
+        for (uint16_t b = 0; b < length; b++) {
+            record[b] = (uint8_t)(i + b);
+        }
+        ok = fs_log_append(log, record, length) == FS_LOG_SUCCESS;
+    }
+
+    uint32_t before_flush = 0;
+    uint32_t after_flush = 0;
+    if (ok) {
+        fs_log_iterate(log, check_lengths, &before_flush);
+        fs_log_flush(log);
+        fs_log_iterate(log, check_lengths, &after_flush);
+    }
+    fs_log_stats stats = { 0 };
+    fs_log_get_stats(log, &stats);
+    fs_log_close(log);
+
+    if (ok && before_flush == 300 && after_flush == 300 && stats.dropped == 0) {
+        printf("Ring Log Test Passed - 300 records read back before and after the flush in %u pages.\n",
+               stats.pages_programmed);
+    } else {
+        printf("Ring Log Test Failed - read back %u records before the flush and %u after.\n",
+               before_flush, after_flush);
+    }
+}
+
+
+/**
+ * Appending more than the ring holds drops the oldest blocks, keeps the newest records in
+ * order, and the log continues where it left off after an unmount and mount.
+ */
+void test_ring_log_overwrites_oldest() {
+    printf("Testing that a full ring log overwrites its oldest records...\n");
+    fs_init();
+
+    fs_log *log = fs_log_open("/root/wrapping", 2);
+    telemetry_record record;
+    bool ok = (log != NULL);
+    for (uint32_t i = 0; i < 1000 && ok; i++) {
+        make_record(&record, 0, i);
+        ok = fs_log_append(log, &record, sizeof(record)) == FS_LOG_SUCCESS;
+    }
+    ok = ok && fs_log_flush(log) == FS_LOG_SUCCESS;
+    visit_summary wrapped = summarize_log(log);
+    fs_log_stats stats = { 0 };
+    fs_log_get_stats(log, &stats);
+    fs_log_close(log);
+
+    ok = ok && fs_unmount() == 0 && fs_mount() == 0;
+    log = ok ? fs_log_open("/root/wrapping", 2) : NULL;
+    visit_summary remounted = { 0 };
+    visit_summary continued = { 0 };
+    if (log != NULL) {
+        remounted = summarize_log(log);
+        for (uint32_t i = 1000; i < 1010; i++) {
+            make_record(&record, 0, i);
+            fs_log_append(log, &record, sizeof(record));
+        }
+        continued = summarize_log(log);
+        fs_log_close(log);
+    }
+
+    ok = ok && log != NULL && wrapped.in_order && wrapped.last[0] == 999 && wrapped.first[0] > 0
+        && stats.blocks_overwritten > 0
+        && remounted.in_order && remounted.first[0] == wrapped.first[0] && remounted.last[0] == 999
+        && continued.in_order && continued.last[0] == 1009;
+    if (ok) {
+        printf("Ring Log Test Passed - kept records %u to %u after %u block overwrites, and after a remount.\n",
+               wrapped.first[0], wrapped.last[0], stats.blocks_overwritten);
+    } else {
+        printf("Ring Log Test Failed - kept records %u to %u, after remount %u to %u.\n",
+               wrapped.first[0], wrapped.last[0], remounted.first[0], remounted.last[0]);
+    }
+}
+
+
+/**
+ * One producer of the throughput benchmark. A full queue is retried, which stands for the
+ * producer dropping samples.
+ */
+typedef struct {
+    fs_log *log;
+    uint32_t producer;
+    uint32_t retries;
+    bool ok;
+} producer_job;
+
+static void producer_run(producer_job *job) {
+    telemetry_record record;
+    job->ok = true;
+    job->retries = 0;
+    for (uint32_t i = 0; i < RING_LOG_TEST_BENCH_RECORDS && job->ok; i++) {
+        make_record(&record, job->producer, i);
+        int result;
+        while ((result = fs_log_append(job->log, &record, sizeof(record))) == FS_LOG_FULL) {
+            job->retries++;
+        }
+        job->ok = (result == FS_LOG_SUCCESS);
+    }
+}
+
+#if PICO_ON_DEVICE
+static producer_job *core1_job;
+static volatile bool core1_done;
+
+static void core1_entry(void) {
+    // Lets core 0 pause this core while it erases or programs, and the other way round.
+    flash_safe_execute_core_init();
+    producer_run(core1_job);
+    flash_safe_execute_core_deinit();
+    core1_done = true;
+    __sev();
+}
+
+static void run_producers(producer_job *local, producer_job *other) {
+    core1_job = other;
+    core1_done = false;
+    multicore_launch_core1(core1_entry);
+    producer_run(local);
+    while (!core1_done) {
+        __wfe();
+    }
+    multicore_reset_core1();
+}
+#else
+static void *producer_thread_entry(void *job) {
+    producer_run((producer_job *)job);
+    return NULL;
+}
+
+static void run_producers(producer_job *local, producer_job *other) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, producer_thread_entry, other) != 0) {
+        other->ok = false;
+        producer_run(local);
+        return;
+    }
+    producer_run(local);
+    pthread_join(thread, NULL);
+}
+#endif
+
+
+/**
+ * Benchmark: telemetry records written one fs_write() each to a regular file, against the
+ * same number of records from two producers appending to a ring log at the same time. The
+ * ring holds them all, so neither path wraps around and erases what it wrote before. Prints
+ * records per second of both; host builds count the flash model's erase and program times.
+ * Passes if the ring log is faster and every producer's records come back in order.
+ */
+void test_ring_log_throughput() {
+    printf("Testing ring log throughput against fs_write()...\n");
+    telemetry_record record;
+
+    fs_init();
+    flush_worker_stop();
+#if !PICO_ON_DEVICE
+    bool timing = flash_model_set_timing(true);
+#endif
+    FS_FILE *file = fs_open("/root/plainTelemetry", "w");
+    bool ok = (file != NULL);
+    uint64_t began = time_us_64();
+    for (uint32_t i = 0; i < RING_LOG_TEST_BASELINE_RECORDS && ok; i++) {
+        make_record(&record, 0, i);
+        ok = fs_write(file, &record, sizeof(record)) == (int)sizeof(record);
+    }
+    ok = ok && fs_sync() == 0;
+    uint64_t plain_us = time_us_64() - began;
+    if (file != NULL) {
+        fs_close(file);
+    }
+
+    fs_log *log = fs_log_open("/root/ringTelemetry", RING_LOG_TEST_BENCH_BLOCKS);
+    producer_job a = { log, 0, 0, true };
+    producer_job b = { log, 1, 0, true };
+    visit_summary summary = { 0 };
+    fs_log_stats stats = { 0 };
+    uint64_t ring_us = 0;
+    if (log != NULL) {
+        began = time_us_64();
+        run_producers(&a, &b);
+        fs_log_flush(log);
+        ring_us = time_us_64() - began;
+        summary = summarize_log(log);
+        fs_log_get_stats(log, &stats);
+        fs_log_close(log);
+    }
+#if !PICO_ON_DEVICE
+    flash_model_set_timing(timing);
+#endif
+
+    uint32_t plain_rate = (uint32_t)((uint64_t)RING_LOG_TEST_BASELINE_RECORDS * 1000000 / (plain_us > 0 ? plain_us : 1));
+    uint32_t ring_rate = (uint32_t)((uint64_t)2 * RING_LOG_TEST_BENCH_RECORDS * 1000000 / (ring_us > 0 ? ring_us : 1));
+    printf("fs_write():      %u records in %u us, %u records/s\n",
+           RING_LOG_TEST_BASELINE_RECORDS, (unsigned)plain_us, plain_rate);
+    printf("fs_log_append(): %u records from 2 producers in %u us, %u records/s\n",
+           2 * RING_LOG_TEST_BENCH_RECORDS, (unsigned)ring_us, ring_rate);
+    printf("Pages programmed: %u, blocks overwritten: %u, most queued: %u, full-queue retries: %u\n",
+           stats.pages_programmed, stats.blocks_overwritten, stats.max_queued, a.retries + b.retries);
+
+    ok = ok && log != NULL && a.ok && b.ok && summary.in_order
+        && summary.count == 2 * RING_LOG_TEST_BENCH_RECORDS
+        && summary.last[0] == RING_LOG_TEST_BENCH_RECORDS - 1
+        && summary.last[1] == RING_LOG_TEST_BENCH_RECORDS - 1
+        && stats.appended == 2 * RING_LOG_TEST_BENCH_RECORDS
+        && ring_rate > plain_rate;
+    if (ok) {
+        printf("Ring Log Test Passed - %u records/s against %u with fs_write(), %u records kept in order.\n",
+               ring_rate, plain_rate, summary.count);
+    } else {
+        printf("Ring Log Test Failed - producers %s, records %s, newest %u and %u, %u records/s.\n",
+               (a.ok && b.ok) ? "finished" : "failed", summary.in_order ? "in order" : "out of order",
+               summary.last[0], summary.last[1], ring_rate);
+    }
+}
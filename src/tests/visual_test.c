@@ -0,0 +1,229 @@
+#include "../filesystem/filesystem.h"
+#include "../filesystem/file_index.h"
+#include "../filesystem/meta_table.h"
+#include "../filesystem/name_pool.h"
+#include "../directory/directories.h"
+#include "../directory/directory_helpers.h"
+#include "../FAT/fat_fs.h"
+#include "../HighLevelAPI/visual.h"
+#include "../tests/visual_test.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico/time.h"
+
+// Files spread over the directories of the large tree, and walks timed per measurement.
+#define VISUAL_TEST_FILES 1000
+#define VISUAL_TEST_DIRECTORIES 20
+#define VISUAL_TEST_WALKS 20
+
+
+void run_all_tests_visual() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_du_totals();
+    printf("%s", slashes);
+    test_tree_walk_depth_limit();
+    printf("%s", slashes);
+    test_tree_walk_large();
+    printf("%s", slashes);
+}
+
+
+
+
+static bool write_bytes(const char* path, int length) {
+    FS_FILE* file = fs_open(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    char buffer[64];
+    memset(buffer, 'v', sizeof(buffer));
+    bool ok = length <= (int)sizeof(buffer) && fs_write(file, buffer, length) == length;
+    fs_close(file);
+    return ok;
+}
+
+
+/**
+ * fs_du() counts the files and bytes of a directory and everything below it, and follows
+ * removals. print_filesystem_structure() runs over the same tree.
+ */
+void test_du_totals() {
+    printf("Testing fs_du() totals...\n");
+    fs_init();
+
+    bool ok = fs_create_directory("/root/du") && fs_create_directory("/root/du/a")
+        && fs_create_directory("/root/du/a/b") && fs_create_directory("/root/du/c")
+        && write_bytes("/root/du/top", 10) && write_bytes("/root/du/a/one", 20)
+        && write_bytes("/root/du/a/b/two", 30) && write_bytes("/root/du/a/b/three", 40)
+        && write_bytes("/root/outside", 50);
+    fs_usage all = { 0 };
+    fs_usage a = { 0 };
+    fs_usage removed = { 0 };
+    fs_usage root = { 0 };
+    ok = ok && fs_du("/root/du", &all) == 0 && fs_du("/root/du/a", &a) == 0;
+    bool counted = ok && all.directories == 3 && all.files == 4 && all.bytes == 100
+        && a.directories == 1 && a.files == 3 && a.bytes == 90;
+
+    ok = ok && fs_rm("/root/du/a/b/two") == 0 && fs_du("/root/du", &removed) == 0;
+    bool follows = ok && removed.files == 3 && removed.bytes == 70;
+
+    print_filesystem_structure();
+    bool whole = fs_du("/root", &root) == 0 && root.directories == 4 && root.files == 4 && root.bytes == 120;
+    bool missing = fs_du("/root/nothing", &root) == -1;
+
+    if (counted && follows && whole && missing) {
+        printf("Visual Test Passed - 3 directories, 4 files and 100 bytes below /root/du, 70 bytes after rm.\n");
+    } else {
+        printf("Visual Test Failed - counted %d (%u dirs, %u files, %u bytes), after rm %d, whole %d, missing %d.\n",
+               counted, all.directories, all.files, all.bytes, follows, whole, missing);
+    }
+}
+
+
+/**
+ * A chain of directories deeper than FS_TREE_MAX_DEPTH is walked down to that depth, and
+ * fs_du() reports that the rest was skipped instead of overflowing its stack.
+ */
+void test_tree_walk_depth_limit() {
+    printf("Testing the depth limit of the tree walk...\n");
+    fs_init();
+
+    bool ok = fs_create_directory("/root/deep");
+    DirectoryEntry* top = DIR_find_directory_entry("/root/deep");
+    uint32_t parentId = (top != NULL) ? top->currentDirId : 0;
+    ok = ok && top != NULL;
+    meta_table_lock();
+    for (int level = 0; level < FS_TREE_MAX_DEPTH + 5 && ok; level++) {
+        char name[16];
+        snprintf(name, sizeof(name), "d%d", level);
+        DirectoryEntry* child = createDirectoryEntry(name, parentId);
+        ok = child != NULL;
+        parentId = ok ? child->currentDirId : 0;
+    }
+    meta_table_unlock();
+
+    fs_usage usage = { 0 };
+    int result = ok ? fs_du("/root/deep", &usage) : 0;
+
+    if (ok && result == -1 && usage.directories == FS_TREE_MAX_DEPTH) {
+        printf("Visual Test Passed - walked %u levels of %d and reported the rest as skipped.\n",
+               usage.directories, FS_TREE_MAX_DEPTH + 5);
+    } else {
+        printf("Visual Test Failed - created %d, result %d, %u directories walked.\n",
+               ok, result, usage.directories);
+    }
+}
+
+
+/**
+ * Adds a file entry without data blocks to a directory, as the lookup benchmark of
+ * filesystem_helper_test.c does.
+ *
+ * @return The entry's slot, or -1 if the file table could not grow.
+ */
+static int add_entry(uint32_t dirId, int n, uint32_t size) {
+    int slot = file_index_unused_slot();
+    if (slot < 0) {
+        slot = file_entry_count();
+        if (file_table_grow() != 0) {
+            return -1;
+        }
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "walk_%d", n);
+    FileEntry *entry = file_entry_at(slot);
+    memset(entry, 0, sizeof(FileEntry));
+    meta_table_pin(entry);
+    name_pool_set(&entry->filename, name);
+    meta_table_unpin(entry);
+    entry->parentDirId = dirId;
+    entry->unique_file_id = 0x30000000u + n;
+    entry->size = size;
+    entry->start_block = FAT_ENTRY_END;
+    entry->in_use = true;
+    file_index_insert(slot);
+    dir_link_file(slot);
+    return slot;
+}
+
+static void remove_entry(int slot) {
+    dir_unlink_file(slot);
+    FileEntry *entry = file_entry_at(slot);
+    file_index_remove(slot);
+    name_pool_clear(&entry->filename);
+    memset(entry, 0, sizeof(FileEntry));
+}
+
+
+/**
+ * Benchmark: fs_du() over 1000 files in 20 directories. Prints the time per walk. Passes if
+ * the totals are right and the walks loaded no metadata page into the cache.
+ */
+void test_tree_walk_large() {
+    printf("Testing the tree walk over %d files...\n", VISUAL_TEST_FILES);
+    fs_init();
+
+    uint32_t dirIds[VISUAL_TEST_DIRECTORIES];
+    bool ok = fs_create_directory("/root/big");
+    for (int d = 0; d < VISUAL_TEST_DIRECTORIES && ok; d++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/root/big/d%d", d);
+        ok = fs_create_directory(path);
+        DirectoryEntry* entry = ok ? DIR_find_directory_entry(path) : NULL;
+        ok = entry != NULL;
+        dirIds[d] = ok ? entry->currentDirId : 0;
+    }
+    int *slots = malloc(VISUAL_TEST_FILES * sizeof(int));
+    ok = ok && slots != NULL;
+    uint32_t bytes = 0;
+    int added = 0;
+    if (ok) {
+        meta_table_lock();
+        for (; added < VISUAL_TEST_FILES; added++) {
+            slots[added] = add_entry(dirIds[added % VISUAL_TEST_DIRECTORIES], added, (uint32_t)added);
+            if (slots[added] < 0) {
+                break;
+            }
+            bytes += (uint32_t)added;
+        }
+        meta_table_unlock();
+        ok = added == VISUAL_TEST_FILES;
+    }
+    // Write the tables back, so that the walk finds most pages only on flash.
+    ok = ok && fs_sync() == 0;
+
+    fs_usage usage = { 0 };
+    meta_table_stats before;
+    meta_table_stats after;
+    meta_table_get_stats(&before);
+    uint64_t began = time_us_64();
+    for (int i = 0; i < VISUAL_TEST_WALKS && ok; i++) {
+        ok = fs_du("/root/big", &usage) == 0;
+    }
+    uint32_t walk_us = (uint32_t)((time_us_64() - began) / VISUAL_TEST_WALKS);
+    meta_table_get_stats(&after);
+    printf("fs_du(): %u us per walk of %u directories and %u files\n", walk_us, usage.directories, usage.files);
+
+    if (slots != NULL) {
+        meta_table_lock();
+        for (int n = 0; n < added; n++) {
+            remove_entry(slots[n]);
+        }
+        meta_table_unlock();
+        free(slots);
+    }
+
+    bool right = usage.directories == VISUAL_TEST_DIRECTORIES && usage.files == VISUAL_TEST_FILES
+        && usage.bytes == bytes;
+    bool uncached = after.misses == before.misses;
+    if (ok && right && uncached) {
+        printf("Visual Test Passed - %u us per walk of %d files, no metadata pages loaded.\n",
+               walk_us, VISUAL_TEST_FILES);
+    } else {
+        printf("Visual Test Failed - walks %s, totals %u files and %u bytes, %u pages loaded.\n",
+               ok ? "succeeded" : "failed", usage.files, usage.bytes, after.misses - before.misses);
+    }
+}
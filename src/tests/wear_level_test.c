@@ -0,0 +1,196 @@
+#include "../flash/wear_table.h"
+#include "../flash/flash_ops.h"
+#include "../flash/block_log.h"
+#include "../FAT/fat_fs.h"
+#include "../filesystem/filesystem.h"
+#include "../tests/wear_level_test.h"
+#include <stdio.h>
+#include <string.h>
+#include "pico/time.h"
+
+#define WEAR_LEVEL_TEST_FILES 8
+// Fewer than WEAR_CANDIDATES, so the allocator always has a fresher block than these to hand out.
+#define WEAR_LEVEL_TEST_WORN 4
+
+
+void run_all_tests_wear_level() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_wear_level_moves_cold_block();
+    printf("%s", slashes);
+    test_wear_level_abandons_changed_block();
+    printf("%s", slashes);
+    test_wear_level_write_latency();
+    printf("%s", slashes);
+}
+
+
+
+
+/**
+ * Writes a file of two full blocks that is never changed again.
+ */
+static bool write_cold_file(const char *path, char fill) {
+    char data[2 * FS_BLOCK_PAYLOAD_SIZE];
+    memset(data, fill, sizeof(data));
+    FS_FILE *file = fs_open(path, "w");
+    bool ok = (file != NULL) && fs_write(file, data, sizeof(data)) == (int)sizeof(data);
+    if (file != NULL) {
+        fs_close(file);
+    }
+    return ok && fs_sync() == 0;
+}
+
+
+/**
+ * Checks that a file still holds what write_cold_file() wrote, and returns its first block.
+ */
+static bool cold_file_intact(const char *path, char fill, uint32_t *start_block) {
+    char data[2 * FS_BLOCK_PAYLOAD_SIZE];
+    FS_FILE *file = fs_open(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    bool ok = fs_read(file, data, sizeof(data)) == (int)sizeof(data);
+    for (size_t i = 0; ok && i < sizeof(data); i++) {
+        ok = data[i] == fill;
+    }
+    *start_block = file->entry->start_block;
+    fs_close(file);
+    return ok;
+}
+
+
+/**
+ * Erases a free block until it is worn past the static wear levelling threshold.
+ */
+static uint32_t wear_free_block(void) {
+    uint32_t block = fat_allocate_block();
+    for (uint32_t i = 0; i < WEAR_LEVEL_THRESHOLD + 10; i++) {
+        flash_erase_sector(block * FILESYSTEM_BLOCK_SIZE);
+    }
+    fat_free_block(block);
+    return block;
+}
+
+
+/**
+ * With one free block worn far beyond the rest, the first block of a file that never changes
+ * moves onto it, and the move survives a remount.
+ */
+void test_wear_level_moves_cold_block() {
+    printf("Testing static wear levelling of a cold block...\n");
+    fs_init();
+    bool ok = write_cold_file("/root/coldFile", 'c');
+    uint32_t before = FAT_ENTRY_END;
+    ok = ok && cold_file_intact("/root/coldFile", 'c', &before);
+    uint32_t worn = wear_free_block();
+
+    int moved = fs_wear_level(UINT32_MAX);
+    uint32_t after = FAT_ENTRY_END;
+    ok = ok && cold_file_intact("/root/coldFile", 'c', &after);
+    uint32_t mounted = FAT_ENTRY_END;
+    ok = ok && fs_unmount() == 0 && fs_mount() == 0 && cold_file_intact("/root/coldFile", 'c', &mounted);
+
+    if (ok && moved == 1 && after == worn && mounted == worn) {
+        printf("Wear Level Move Test Passed - Block %u moved to worn block %u (%u erases).\n",
+               before, worn, wear_table_count(worn));
+    } else {
+        printf("Wear Level Move Test Failed - Moved %d, start block %u -> %u (%u after mount), worn block %u.\n",
+               moved, before, after, mounted, worn);
+    }
+}
+
+
+/**
+ * A move is spread over several calls. If the file is rewritten in between, the move is
+ * dropped at the end and the file keeps its new data.
+ */
+void test_wear_level_abandons_changed_block() {
+    printf("Testing static wear levelling of a block changed mid-move...\n");
+    fs_init();
+    bool ok = write_cold_file("/root/coldFile", 'c');
+    wear_free_block();
+
+    // A zero budget runs one step per call: find the block, erase the target, copy a page.
+    for (int i = 0; i < 3; i++) {
+        fs_wear_level(0);
+    }
+    FS_FILE *file = fs_open("/root/coldFile", "a");
+    char data[FS_BLOCK_PAYLOAD_SIZE];
+    memset(data, 'n', sizeof(data));
+    ok = ok && (file != NULL) && fs_seek(file, 0, SEEK_SET) == 0 && fs_write(file, data, sizeof(data)) == (int)sizeof(data);
+    if (file != NULL) {
+        fs_close(file);
+    }
+    fs_wear_level(UINT32_MAX);
+
+    fs_wear_level_stats stats;
+    fs_get_wear_level_stats(&stats);
+    file = fs_open("/root/coldFile", "r");
+    char check[FS_BLOCK_PAYLOAD_SIZE];
+    ok = ok && (file != NULL) && fs_read(file, check, sizeof(check)) == (int)sizeof(check) && memcmp(check, data, sizeof(data)) == 0;
+    if (file != NULL) {
+        fs_close(file);
+    }
+
+    if (ok && stats.abandoned == 1 && stats.migrations == 0) {
+        printf("Wear Level Abandon Test Passed - The move was dropped and the new data kept.\n");
+    } else {
+        printf("Wear Level Abandon Test Failed - %u moves, %u dropped.\n", stats.migrations, stats.abandoned);
+    }
+}
+
+
+/**
+ * Appends small records while cold blocks wait to be moved onto a few worn blocks. The moves happen in the
+ * slices fs_write() gives them, and no slice runs longer than WEAR_LEVEL_SLICE_US plus one
+ * step.
+ */
+void test_wear_level_write_latency() {
+    printf("Testing static wear levelling within fs_write()...\n");
+    fs_init();
+    char path[32];
+    bool ok = true;
+    for (int i = 0; i < WEAR_LEVEL_TEST_FILES && ok; i++) {
+        snprintf(path, sizeof(path), "/root/cold%d", i);
+        ok = write_cold_file(path, (char)('a' + i));
+    }
+    for (int i = 0; i < WEAR_LEVEL_TEST_WORN; i++) {
+        wear_free_block();
+    }
+
+    FS_FILE *log = fs_open("/root/hotLog", "w");
+    ok = ok && (log != NULL);
+    uint32_t slowest = 0;
+    char record[32];
+    for (int i = 0; i < 2000 && ok; i++) {
+        int length = snprintf(record, sizeof(record), "%06d reading\n", i);
+        uint64_t began = time_us_64();
+        ok = fs_write(log, record, length) == length;
+        uint32_t took = (uint32_t)(time_us_64() - began);
+        slowest = (took > slowest) ? took : slowest;
+    }
+    if (log != NULL) {
+        fs_close(log);
+    }
+
+    for (int i = 0; i < WEAR_LEVEL_TEST_FILES && ok; i++) {
+        uint32_t block;
+        snprintf(path, sizeof(path), "/root/cold%d", i);
+        ok = cold_file_intact(path, (char)('a' + i), &block);
+    }
+
+    fs_wear_level_stats stats;
+    fs_get_wear_level_stats(&stats);
+    printf("%u blocks moved in %u slices; longest slice %u us, longest step %u us, slowest fs_write %u us\n",
+           stats.migrations, stats.slices, stats.max_slice_us, stats.max_step_us, slowest);
+
+    if (ok && stats.migrations == WEAR_LEVEL_TEST_WORN && stats.max_slice_us <= WEAR_LEVEL_SLICE_US + stats.max_step_us) {
+        printf("Wear Level Latency Test Passed - Every worn block took cold data within the slice.\n");
+    } else {
+        printf("Wear Level Latency Test Failed - %u of %u blocks moved, longest slice %u us.\n",
+               stats.migrations, WEAR_LEVEL_TEST_WORN, stats.max_slice_us);
+    }
+}
@@ -0,0 +1,165 @@
+#include "../flash/wear_table.h"
+#include "../flash/flash_ops.h"
+#include "../flash/block_log.h"
+#include "../FAT/fat_fs.h"
+#include "../filesystem/filesystem.h"
+#include "../filesystem/meta_journal.h"
+#include "../tests/wear_table_test.h"
+#include <stdio.h>
+#include <string.h>
+#include "pico/time.h"
+
+// Small writes made by the logging simulation. A run on the device wears real flash, so
+// the default is modest; host builds raise it to a million with -DWEAR_SIM_WRITES=1000000.
+#ifndef WEAR_SIM_WRITES
+#define WEAR_SIM_WRITES 20000
+#endif
+
+#define WEAR_HISTOGRAM_BUCKETS 8
+
+
+void run_all_tests_wear_table() {
+    char slashes[] = "\n/////////////////////////////////////////////\n";
+
+    printf("%s", slashes);
+    test_wear_table_counts_erases();
+    printf("%s", slashes);
+    test_wear_table_survives_mount();
+    printf("%s", slashes);
+    test_wear_table_logging_simulation();
+    printf("%s", slashes);
+}
+
+
+
+
+/**
+ * Erases a free block by sector and as part of a range and checks that each erase is
+ * counted once.
+ */
+void test_wear_table_counts_erases() {
+    printf("Testing wear table erase counting...\n");
+    uint32_t block = fat_allocate_block();
+    uint32_t before = wear_table_count(block);
+
+    flash_erase_sector(block * FILESYSTEM_BLOCK_SIZE);
+    uint32_t afterSector = wear_table_count(block);
+    flash_erase_range(block * FILESYSTEM_BLOCK_SIZE, FILESYSTEM_BLOCK_SIZE);
+    uint32_t afterRange = wear_table_count(block);
+    fat_free_block(block);
+
+    if (block != FAT_NO_FREE_BLOCKS && afterSector == before + 1 && afterRange == before + 2) {
+        printf("Wear Table Count Test Passed - Each erase was counted once.\n");
+    } else {
+        printf("Wear Table Count Test Failed - Counts went from %u to %u and %u.\n", before, afterSector, afterRange);
+    }
+}
+
+
+/**
+ * Wears a block, takes a checkpoint and mounts again; the count has to come back from the
+ * checkpoint rather than starting over.
+ */
+void test_wear_table_survives_mount() {
+    printf("Testing wear table persistence across mount...\n");
+    uint32_t block = fat_allocate_block();
+    for (int i = 0; i < 5; i++) {
+        flash_erase_sector(block * FILESYSTEM_BLOCK_SIZE);
+    }
+    fat_free_block(block);
+    uint32_t before = wear_table_count(block);
+
+    bool ok = fs_unmount() == 0 && fs_mount() == 0;
+    uint32_t after = wear_table_count(block);
+
+    if (ok && before >= 5 && after == before) {
+        printf("Wear Table Mount Test Passed - Block %u kept its %u erases.\n", block, after);
+    } else {
+        printf("Wear Table Mount Test Failed - Count %u before mount, %u after.\n", before, after);
+    }
+}
+
+
+/**
+ * Simulates a logging load: small records appended to a log file that is rotated when it
+ * reaches 64 KB, a small status file rewritten every hundred records, and some files that
+ * never change. Reports how the erases spread over the blocks the allocator manages.
+ */
+void test_wear_table_logging_simulation() {
+    printf("Testing wear spread under a logging load (%d writes)...\n", WEAR_SIM_WRITES);
+    char record[48];
+    char path[32];
+    bool ok = true;
+
+    // Long-lived files, written once.
+    char block[FS_BLOCK_PAYLOAD_SIZE];
+    memset(block, 's', sizeof(block));
+    for (int i = 0; i < 8 && ok; i++) {
+        snprintf(path, sizeof(path), "/root/wearStatic%d", i);
+        FS_FILE *file = fs_open(path, "w");
+        ok = (file != NULL) && fs_write(file, block, sizeof(block)) == (int)sizeof(block);
+        if (file != NULL) {
+            fs_close(file);
+        }
+    }
+    ok = ok && meta_journal_checkpoint(NULL) == JOURNAL_SUCCESS;
+
+    wear_stats start;
+    wear_table_get_stats(&start);
+    uint64_t began = time_us_64();
+
+    FS_FILE *log = fs_open("/root/wearLog", "w");
+    ok = ok && (log != NULL);
+    for (int i = 0; i < WEAR_SIM_WRITES && ok; i++) {
+        int length = snprintf(record, sizeof(record), "%08d sensor=%d\n", i, (i % 1000) * 7919 % 1000);
+        ok = fs_write(log, record, length) == length;
+
+        if (log->entry->size >= 64 * 1024) {
+            fs_close(log);
+            fs_rm("/root/wearLog");
+            log = fs_open("/root/wearLog", "w");
+            ok = ok && (log != NULL);
+        }
+        if (i % 100 == 99) {
+            // Opening with "w" creates a new entry, so the previous status file goes first.
+            if (i > 99) {
+                fs_rm("/root/wearStatus");
+            }
+            FS_FILE *status = fs_open("/root/wearStatus", "w");
+            ok = ok && (status != NULL) && fs_write(status, record, length) == length;
+            if (status != NULL) {
+                fs_close(status);
+            }
+            fs_sync();
+        }
+    }
+    if (log != NULL) {
+        fs_close(log);
+    }
+    fs_sync();
+    uint32_t elapsed = (uint32_t)((time_us_64() - began) / 1000);
+
+    wear_stats end;
+    wear_table_get_stats(&end);
+    uint32_t buckets[WEAR_HISTOGRAM_BUCKETS];
+    uint32_t width = wear_table_histogram(buckets, WEAR_HISTOGRAM_BUCKETS);
+    printf("%u erases over %u blocks in %u ms: min %u, mean %u, max %u\n",
+           end.total - start.total, end.blocks, elapsed, end.min, end.mean, end.max);
+    for (uint32_t i = 0; i < WEAR_HISTOGRAM_BUCKETS; i++) {
+        printf("  %6u - %6u erases: %u blocks\n", i * width, (i + 1) * width - 1, buckets[i]);
+    }
+
+    fs_rm("/root/wearLog");
+    fs_rm("/root/wearStatus");
+    for (int i = 0; i < 8; i++) {
+        snprintf(path, sizeof(path), "/root/wearStatic%d", i);
+        fs_rm(path);
+    }
+
+    // With the erases spread, no block should be worn far beyond the average.
+    if (ok && end.total > start.total && end.max <= 2 * end.mean + WEAR_CANDIDATES) {
+        printf("Wear Table Simulation Test Passed - Most worn block at %u erases, mean %u.\n", end.max, end.mean);
+    } else {
+        printf("Wear Table Simulation Test Failed - Erases were concentrated (max %u, mean %u).\n", end.max, end.mean);
+    }
+}